@@ -1090,6 +1090,7 @@ bool tcg_exec_realizefn(CPUState *cpu, Error **errp)
     tlb_init(cpu);
 #ifndef CONFIG_USER_ONLY
     tcg_iommu_init_notifier_list(cpu);
+    tcg_dirty_ring_init_cpu(cpu);
 #endif /* !CONFIG_USER_ONLY */
     /* qemu_plugin_vcpu_init_hook delayed until cpu_index assigned. */
 
@@ -1100,6 +1101,7 @@ bool tcg_exec_realizefn(CPUState *cpu, Error **errp)
 void tcg_exec_unrealizefn(CPUState *cpu)
 {
 #ifndef CONFIG_USER_ONLY
+    tcg_dirty_ring_destroy_cpu(cpu);
     tcg_iommu_free_notifier_list(cpu);
 #endif /* !CONFIG_USER_ONLY */
 
@@ -1322,6 +1322,23 @@ static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
         tb_invalidate_phys_range_fast(ram_addr, size, retaddr);
     }
 
+    if (tcg_dirty_ring_push(cpu, ram_addr)) {
+        /*
+         * The migration bit is deferred to the ring harvest; only touch
+         * the shared VGA bitmap if the page is still clean there.
+         */
+        cpu_physical_memory_set_dirty_range(ram_addr, size,
+            cpu_physical_memory_range_includes_clean(ram_addr, size,
+                                                     1 << DIRTY_MEMORY_VGA));
+
+        if (cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_VGA) &&
+            cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+            trace_memory_notdirty_set_dirty(mem_vaddr);
+            tlb_set_dirty(cpu, mem_vaddr);
+        }
+        return;
+    }
+
     /*
      * Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
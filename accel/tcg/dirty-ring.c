@@ -0,0 +1,224 @@
+/*
+ * TCG per-vCPU dirty page ring
+ *
+ * While global dirty tracking is active, vCPUs push the RAM pages they
+ * dirty onto a private ring instead of setting bits in the shared
+ * ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION] bitmap, which avoids
+ * bouncing the bitmap cache lines between vCPU threads.  The rings are
+ * harvested into the bitmap by the log_sync_global() memory listener hook,
+ * i.e. from migration_bitmap_sync() and from the dirty-ring mode of
+ * calc-dirty-rate.  The design mirrors the KVM dirty ring.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "exec/exec-all.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "hw/core/cpu.h"
+#include "sysemu/tcg.h"
+#include "internal-common.h"
+#include "trace.h"
+
+struct TCGDirtyRing {
+    /* Serializes reapers: the sync path and the vCPU itself when full */
+    QemuMutex lock;
+    /* Number of entries, a power of two */
+    uint32_t size;
+    /* Next entry to fill; only written by the vCPU thread */
+    uint32_t head;
+    /* Next entry to harvest; only written under @lock */
+    uint32_t tail;
+    uint64_t reaped;
+    uint64_t full_exits;
+    ram_addr_t pages[];
+};
+
+static MemoryListener tcg_dirty_ring_listener;
+
+void tcg_dirty_ring_init_cpu(CPUState *cpu)
+{
+    TCGDirtyRing *ring;
+
+    if (!tcg_dirty_ring_size) {
+        return;
+    }
+
+    ring = g_malloc0(sizeof(*ring) +
+                     tcg_dirty_ring_size * sizeof(ring->pages[0]));
+    qemu_mutex_init(&ring->lock);
+    ring->size = tcg_dirty_ring_size;
+    cpu->tcg_dirty_ring = ring;
+}
+
+void tcg_dirty_ring_destroy_cpu(CPUState *cpu)
+{
+    TCGDirtyRing *ring = cpu->tcg_dirty_ring;
+
+    if (!ring) {
+        return;
+    }
+
+    cpu->tcg_dirty_ring = NULL;
+    qemu_mutex_destroy(&ring->lock);
+    g_free(ring);
+}
+
+static uint32_t tcg_dirty_ring_reap_locked(CPUState *cpu, TCGDirtyRing *ring)
+{
+    uint32_t head = qatomic_load_acquire(&ring->head);
+    uint32_t tail = ring->tail;
+    uint32_t count = head - tail;
+    bool migration = global_dirty_tracking & GLOBAL_DIRTY_MIGRATION;
+
+    for (; tail != head; tail++) {
+        ram_addr_t page = ring->pages[tail & (ring->size - 1)];
+
+        if (migration) {
+            cpu_physical_memory_set_dirty_range(page, TARGET_PAGE_SIZE,
+                                                1 << DIRTY_MEMORY_MIGRATION);
+        } else {
+            /*
+             * Only the dirty rate is being measured: nobody consumes the
+             * migration bitmap, so re-arm the notdirty trap right away.
+             */
+            tlb_reset_dirty_range_all(page, TARGET_PAGE_SIZE);
+        }
+    }
+    qatomic_store_release(&ring->tail, tail);
+
+    if (count) {
+        qatomic_set(&ring->reaped, ring->reaped + count);
+        cpu->dirty_pages += count;
+        trace_tcg_dirty_ring_reap(cpu->cpu_index, count);
+    }
+    return count;
+}
+
+static uint32_t tcg_dirty_ring_reap_one(CPUState *cpu)
+{
+    TCGDirtyRing *ring = cpu->tcg_dirty_ring;
+    uint32_t count;
+
+    if (!ring) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&ring->lock);
+    count = tcg_dirty_ring_reap_locked(cpu, ring);
+    qemu_mutex_unlock(&ring->lock);
+    return count;
+}
+
+static uint64_t tcg_dirty_ring_reap(void)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+
+    CPU_FOREACH(cpu) {
+        total += tcg_dirty_ring_reap_one(cpu);
+    }
+    return total;
+}
+
+bool tcg_dirty_ring_push(CPUState *cpu, ram_addr_t ram_addr)
+{
+    TCGDirtyRing *ring = cpu->tcg_dirty_ring;
+    uint32_t head;
+
+    if (!ring || !qatomic_read(&global_dirty_tracking)) {
+        return false;
+    }
+
+    head = ring->head;
+    if (head - qatomic_load_acquire(&ring->tail) == ring->size) {
+        /*
+         * Where KVM would exit to userspace, harvest our own ring so the
+         * vCPU does not have to wait for the next sync.
+         */
+        qatomic_set(&ring->full_exits, ring->full_exits + 1);
+        trace_tcg_dirty_ring_full(cpu->cpu_index);
+        tcg_dirty_ring_reap_one(cpu);
+    }
+
+    ring->pages[head & (ring->size - 1)] = ram_addr & TARGET_PAGE_MASK;
+    qatomic_store_release(&ring->head, head + 1);
+    return true;
+}
+
+void tcg_dirty_ring_stats(uint64_t *reaped, uint64_t *full_exits)
+{
+    CPUState *cpu;
+
+    *reaped = 0;
+    *full_exits = 0;
+    CPU_FOREACH(cpu) {
+        TCGDirtyRing *ring = cpu->tcg_dirty_ring;
+
+        if (ring) {
+            *reaped += qatomic_read(&ring->reaped);
+            *full_exits += qatomic_read(&ring->full_exits);
+        }
+    }
+}
+
+static bool tcg_dirty_ring_log_global_start(MemoryListener *listener,
+                                            Error **errp)
+{
+    RAMBlock *block;
+
+    /*
+     * Leave the migration bitmap alone when only the dirty rate or the
+     * dirty limit is tracked: its users did not ask for it to be reset.
+     */
+    if (!(global_dirty_tracking & GLOBAL_DIRTY_MIGRATION)) {
+        return true;
+    }
+
+    /*
+     * Start from a clean migration bitmap so that the next write to every
+     * page goes through notdirty_write() and lands in a ring.  Migration
+     * itself starts with all pages marked dirty in its own bitmap, so no
+     * information is lost.
+     */
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH(block) {
+            cpu_physical_memory_test_and_clear_dirty(block->offset,
+                                                     block->used_length,
+                                                     DIRTY_MEMORY_MIGRATION);
+        }
+    }
+    return true;
+}
+
+static void tcg_dirty_ring_log_global_stop(MemoryListener *listener)
+{
+    tcg_dirty_ring_reap();
+}
+
+static void tcg_dirty_ring_log_sync_global(MemoryListener *listener,
+                                           bool last_stage)
+{
+    tcg_dirty_ring_reap();
+}
+
+void tcg_dirty_ring_init(void)
+{
+    if (!tcg_dirty_ring_size) {
+        return;
+    }
+
+    tcg_dirty_ring_listener = (MemoryListener) {
+        .name = "tcg-dirty-ring",
+        .log_global_start = tcg_dirty_ring_log_global_start,
+        .log_global_stop = tcg_dirty_ring_log_global_stop,
+        .log_sync_global = tcg_dirty_ring_log_sync_global,
+        .priority = MEMORY_LISTENER_PRIORITY_ACCEL,
+    };
+    memory_listener_register(&tcg_dirty_ring_listener, &address_space_memory);
+}
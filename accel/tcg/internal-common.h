@@ -56,4 +56,18 @@ void cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool tcg_exec_realizefn(CPUState *cpu, Error **errp);
 void tcg_exec_unrealizefn(CPUState *cpu);
 
+/* dirty-ring.c */
+/* Same limit as KVM_DIRTY_RING_MAX_ENTRIES */
+#define TCG_DIRTY_RING_MAX_SIZE 65536
+
+void tcg_dirty_ring_init(void);
+void tcg_dirty_ring_init_cpu(CPUState *cpu);
+void tcg_dirty_ring_destroy_cpu(CPUState *cpu);
+/*
+ * Record a write to @ram_addr in the ring of @cpu.  Returns false if the
+ * ring is not in use and the dirty bitmaps must be updated directly.
+ */
+bool tcg_dirty_ring_push(CPUState *cpu, ram_addr_t ram_addr);
+void tcg_dirty_ring_stats(uint64_t *reaped, uint64_t *full_exits);
+
 #endif
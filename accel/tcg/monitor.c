@@ -52,6 +52,23 @@ static void dump_accel_info(GString *buf)
                            one_insn_per_tb ? "on" : "off");
 }
 
+static void dump_dirty_ring_info(GString *buf)
+{
+    uint64_t reaped, full_exits;
+
+    if (!tcg_dirty_ring_enabled()) {
+        return;
+    }
+
+    tcg_dirty_ring_stats(&reaped, &full_exits);
+    g_string_append_printf(buf, "\nDirty ring\n");
+    g_string_append_printf(buf, "ring size           %" PRIu32 "\n",
+                           tcg_dirty_ring_size);
+    g_string_append_printf(buf, "reaped pages        %" PRIu64 "\n", reaped);
+    g_string_append_printf(buf, "ring full exits     %" PRIu64 "\n",
+                           full_exits);
+}
+
 static void print_qht_statistics(struct qht_stats hst, GString *buf)
 {
     uint32_t hgram_opts;
@@ -211,6 +228,7 @@ HumanReadableText *qmp_x_query_jit(Error **errp)
     dump_accel_info(buf);
     dump_exec_info(buf);
     dump_drift_info(buf);
+    dump_dirty_ring_info(buf);
 
     return human_readable_text_from_str(buf);
 }
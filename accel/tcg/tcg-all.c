@@ -47,6 +47,7 @@ struct TCGState {
     bool one_insn_per_tb;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t dirty_ring_size;
 };
 typedef struct TCGState TCGState;
 
@@ -99,6 +100,7 @@ static void tcg_accel_instance_init(Object *obj)
 
 bool mttcg_enabled;
 bool one_insn_per_tb;
+uint32_t tcg_dirty_ring_size;
 
 static int tcg_init_machine(MachineState *ms)
 {
@@ -111,6 +113,9 @@ static int tcg_init_machine(MachineState *ms)
 
     tcg_allowed = true;
     mttcg_enabled = s->mttcg_enabled;
+#ifndef CONFIG_USER_ONLY
+    tcg_dirty_ring_size = s->dirty_ring_size;
+#endif
 
     page_init();
     tb_htable_init();
@@ -122,6 +127,7 @@ static int tcg_init_machine(MachineState *ms)
      * initialize the prologue now.
      */
     tcg_prologue_init();
+    tcg_dirty_ring_init();
 #endif
 
     return 0;
@@ -181,6 +187,44 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+static void tcg_get_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (tcg_allowed) {
+        error_setg(errp, "Cannot set properties after the accelerator has been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value & (value - 1)) {
+        error_setg(errp, "dirty-ring-size must be a power of two.");
+        return;
+    }
+    if (value > TCG_DIRTY_RING_MAX_SIZE) {
+        error_setg(errp, "dirty-ring-size must be at most %u.",
+                   TCG_DIRTY_RING_MAX_SIZE);
+        return;
+    }
+
+    s->dirty_ring_size = value;
+}
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -242,6 +286,12 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+    object_class_property_add(oc, "dirty-ring-size", "uint32",
+        tcg_get_dirty_ring_size, tcg_set_dirty_ring_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-size",
+        "Size of the per-vCPU dirty page ring (0 to disable, at most 65536)");
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
@@ -22,6 +22,8 @@
 
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -32,6 +34,7 @@
 #include "qemu/option.h"
 #include "qemu/cutils.h"
 #include "qemu/memalign.h"
+#include "qemu/units.h"
 #include "crypto.h"
 
 typedef struct BlockCrypto BlockCrypto;
@@ -466,6 +469,82 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/*
+ * Encryption and decryption run in the thread pool, so that they don't
+ * occupy the AioContext of the disk.  Larger requests are split in
+ * slices that are processed in parallel, so that a single disk is not
+ * limited to the cipher speed of one core.
+ */
+#define BLOCK_CRYPTO_SLICE_SIZE (64 * KiB)
+#define BLOCK_CRYPTO_MAX_WORKERS 4
+
+typedef int BlockCryptoEncDecFunc(QCryptoBlock *block, uint64_t offset,
+                                  uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoTask {
+    AioTask task;
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+    BlockCryptoEncDecFunc *func;
+} BlockCryptoTask;
+
+static int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoTask *t = opaque;
+
+    return t->func(t->block, t->offset, t->buf, t->len, NULL) < 0 ? -EIO : 0;
+}
+
+static int coroutine_fn block_crypto_encdec_task_entry(AioTask *task)
+{
+    return thread_pool_submit_co(block_crypto_encdec_pool_func, task);
+}
+
+static int coroutine_fn
+block_crypto_co_encdec(BlockCrypto *crypto, uint64_t offset, uint8_t *buf,
+                       size_t len, BlockCryptoEncDecFunc *func)
+{
+    AioTaskPool *pool;
+    size_t done;
+    int ret;
+
+    if (len <= BLOCK_CRYPTO_SLICE_SIZE) {
+        BlockCryptoTask t = {
+            .block = crypto->block,
+            .offset = offset,
+            .buf = buf,
+            .len = len,
+            .func = func,
+        };
+
+        return thread_pool_submit_co(block_crypto_encdec_pool_func, &t);
+    }
+
+    pool = aio_task_pool_new(BLOCK_CRYPTO_MAX_WORKERS);
+    for (done = 0; done < len && !aio_task_pool_status(pool);
+         done += BLOCK_CRYPTO_SLICE_SIZE) {
+        BlockCryptoTask *t = g_new(BlockCryptoTask, 1);
+
+        *t = (BlockCryptoTask) {
+            .task.func = block_crypto_encdec_task_entry,
+            .block = crypto->block,
+            .offset = offset + done,
+            .buf = buf + done,
+            .len = MIN(len - done, BLOCK_CRYPTO_SLICE_SIZE),
+            .func = func,
+        };
+        aio_task_pool_start_task(pool, &t->task);
+    }
+
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+
+    return ret;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
                        QEMUIOVector *qiov, BdrvRequestFlags flags)
@@ -508,9 +587,10 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(crypto, offset + bytes_done,
+                                     cipher_data, cur_bytes,
+                                     qcrypto_block_decrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -565,9 +645,10 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(crypto, offset + bytes_done,
+                                     cipher_data, cur_bytes,
+                                     qcrypto_block_encrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
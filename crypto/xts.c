@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "qemu/bswap.h"
 #include "crypto/xts.h"
+#include "host/cpuinfo.h"
 
 typedef union {
     uint8_t b[XTS_BLOCK_SIZE];
@@ -134,6 +135,8 @@ void xts_decrypt(const void *datactx,
         for (i = 0; i < lim; i++, S++, D++) {
             xts_tweak_encdec(datactx, decfunc, S, D, &T);
         }
+        src = (const uint8_t *)S;
+        dst = (uint8_t *)D;
     } else {
         xts_uint128 D;
 
@@ -210,6 +213,8 @@ void xts_encrypt(const void *datactx,
         for (i = 0; i < lim; i++, S++, D++) {
             xts_tweak_encdec(datactx, encfunc, S, D, &T);
         }
+        src = (const uint8_t *)S;
+        dst = (uint8_t *)D;
     } else {
         xts_uint128 D;
 
@@ -248,3 +253,157 @@ void xts_encrypt(const void *datactx,
     /* Decrypt the iv back */
     decfunc(tweakctx, XTS_BLOCK_SIZE, iv, T.b);
 }
+
+
+/*
+ * The AES versions run the whole blocks of a request through one call
+ * of an accelerated function.  @tweak holds the tweak of the first block
+ * on entry and the tweak that follows the last block on return.
+ */
+typedef void (*xts_aes_accel_fn)(const AES_KEY *key, bool decrypt,
+                                 xts_uint128 *tweak, uint8_t *dst,
+                                 const uint8_t *src, size_t nblocks);
+
+static void xts_aes_blocks_int(const AES_KEY *key, bool decrypt,
+                               xts_uint128 *tweak, uint8_t *dst,
+                               const uint8_t *src, size_t nblocks)
+{
+    xts_uint128 D;
+
+    for (; nblocks; nblocks--) {
+        memcpy(&D, src, XTS_BLOCK_SIZE);
+        xts_uint128_xor(&D, &D, tweak);
+        if (decrypt) {
+            AES_decrypt(D.b, D.b, key);
+        } else {
+            AES_encrypt(D.b, D.b, key);
+        }
+        xts_uint128_xor(&D, &D, tweak);
+        memcpy(dst, &D, XTS_BLOCK_SIZE);
+        xts_mult_x(tweak);
+
+        src += XTS_BLOCK_SIZE;
+        dst += XTS_BLOCK_SIZE;
+    }
+}
+
+#include "host/xts-aes.c.inc"
+
+static xts_aes_accel_fn xts_aes_accel;
+static unsigned accel_index;
+
+void xts_aes_decrypt(const AES_KEY *datakey,
+                     const AES_KEY *tweakenc,
+                     const AES_KEY *tweakdec,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src)
+{
+    xts_uint128 PP, CC, T;
+    size_t i, m, mo, lim;
+
+    /* get number of blocks */
+    m = length >> 4;
+    mo = length & 15;
+
+    /* must have at least one full block */
+    g_assert(m != 0);
+
+    lim = mo ? m - 1 : m;
+
+    /* encrypt the iv */
+    AES_encrypt(iv, T.b, tweakenc);
+
+    xts_aes_accel(datakey, true, &T, dst, src, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
+
+    /* if length is not a multiple of XTS_BLOCK_SIZE then */
+    if (mo > 0) {
+        memcpy(&CC, &T, XTS_BLOCK_SIZE);
+        xts_mult_x(&CC);
+
+        /* PP = tweak decrypt block m-1 */
+        xts_aes_blocks_int(datakey, true, &CC, PP.b, src, 1);
+
+        /* Pm = first length % XTS_BLOCK_SIZE bytes of PP */
+        for (i = 0; i < mo; i++) {
+            CC.b[i] = src[XTS_BLOCK_SIZE + i];
+            dst[XTS_BLOCK_SIZE + i] = PP.b[i];
+        }
+        for (; i < XTS_BLOCK_SIZE; i++) {
+            CC.b[i] = PP.b[i];
+        }
+
+        /* Pm-1 = Tweak uncrypt CC */
+        xts_aes_blocks_int(datakey, true, &T, dst, CC.b, 1);
+    }
+
+    /* Decrypt the iv back */
+    AES_decrypt(T.b, iv, tweakdec);
+}
+
+void xts_aes_encrypt(const AES_KEY *datakey,
+                     const AES_KEY *tweakenc,
+                     const AES_KEY *tweakdec,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src)
+{
+    xts_uint128 PP, CC, T;
+    size_t i, m, mo, lim;
+
+    /* get number of blocks */
+    m = length >> 4;
+    mo = length & 15;
+
+    /* must have at least one full block */
+    g_assert(m != 0);
+
+    lim = mo ? m - 1 : m;
+
+    /* encrypt the iv */
+    AES_encrypt(iv, T.b, tweakenc);
+
+    xts_aes_accel(datakey, false, &T, dst, src, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
+
+    /* if length is not a multiple of XTS_BLOCK_SIZE then */
+    if (mo > 0) {
+        /* CC = tweak encrypt block m-1 */
+        xts_aes_blocks_int(datakey, false, &T, CC.b, src, 1);
+
+        /* Cm = first length % XTS_BLOCK_SIZE bytes of CC */
+        for (i = 0; i < mo; i++) {
+            PP.b[i] = src[XTS_BLOCK_SIZE + i];
+            dst[XTS_BLOCK_SIZE + i] = CC.b[i];
+        }
+        for (; i < XTS_BLOCK_SIZE; i++) {
+            PP.b[i] = CC.b[i];
+        }
+
+        /* Cm-1 = Tweak encrypt PP */
+        xts_aes_blocks_int(datakey, false, &T, dst, PP.b, 1);
+    }
+
+    /* Decrypt the iv back */
+    AES_decrypt(T.b, iv, tweakdec);
+}
+
+bool test_xts_aes_next_accel(void)
+{
+    if (accel_index != 0) {
+        xts_aes_accel = accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    xts_aes_accel = accel_table[accel_index];
+}
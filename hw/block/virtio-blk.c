@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qemu/defer-call.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qemu/error-report.h"
@@ -55,6 +56,180 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+
+    if (qemu_in_iothread()) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+/*
+ * Completion coalescing
+ *
+ * Instead of notifying the guest for every completed request, completions
+ * are pushed to the used ring and the notification is deferred:
+ *
+ * - until the end of the current AioContext iteration (a BH), so that all
+ *   completions reaped in one iteration share one interrupt;
+ * - and, when the completion rate is high enough that more completions are
+ *   expected soon, until either @batch completions are pending or
+ *   coalesce-max-usecs have passed since the first pending completion.
+ *
+ * @batch is retuned periodically from the observed completion rate as the
+ * number of completions expected within coalesce-max-usecs, so that low
+ * queue depth workloads are never delayed by more than one iteration.
+ */
+
+/* Interval over which the completion rate is measured */
+#define VIRTIO_BLK_COALESCE_WINDOW_NS (10 * SCALE_MS)
+
+static void virtio_blk_coalesce_flush(VirtIOBlkCoalesce *c)
+{
+    VirtIOBlock *s = c->s;
+
+    if (!c->pending) {
+        return;
+    }
+
+    trace_virtio_blk_coalesce_flush(VIRTIO_DEVICE(s), c->vq, c->pending);
+    c->pending = 0;
+    timer_del(c->timer);
+    stat64_inc(&s->coalesce_stats.notifications);
+    virtio_blk_notify(s, c->vq);
+}
+
+static void virtio_blk_coalesce_update_batch(VirtIOBlkCoalesce *c,
+                                             int64_t now)
+{
+    VirtIOBlock *s = c->s;
+    int64_t elapsed = now - c->window_start_ns;
+    uint64_t expected;
+
+    if (elapsed < VIRTIO_BLK_COALESCE_WINDOW_NS) {
+        return;
+    }
+
+    expected = c->window_completions * s->conf.coalesce_max_usecs *
+               SCALE_US / elapsed;
+    c->batch = MAX(1, MIN(expected, s->conf.coalesce_max_batch));
+    trace_virtio_blk_coalesce_batch(VIRTIO_DEVICE(s), c->vq,
+                                    c->window_completions *
+                                    NANOSECONDS_PER_SECOND / elapsed,
+                                    c->batch);
+
+    c->window_start_ns = now;
+    c->window_completions = 0;
+}
+
+/* Context: the virtqueue's AioContext */
+static void virtio_blk_coalesce_complete(VirtIOBlkCoalesce *c)
+{
+    VirtIOBlock *s = c->s;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    stat64_inc(&s->coalesce_stats.completions);
+    c->window_completions++;
+    virtio_blk_coalesce_update_batch(c, now);
+
+    if (c->pending++ == 0) {
+        c->first_pending_ns = now;
+    }
+
+    if (c->batch > 1 && c->pending >= c->batch) {
+        stat64_inc(&s->coalesce_stats.batch_flushes);
+        virtio_blk_coalesce_flush(c);
+        return;
+    }
+
+    qemu_bh_schedule(c->bh);
+}
+
+/* Runs once the current AioContext iteration has reaped its completions */
+static void virtio_blk_coalesce_bh(void *opaque)
+{
+    VirtIOBlkCoalesce *c = opaque;
+    VirtIOBlock *s = c->s;
+    int64_t deadline;
+
+    if (!c->pending) {
+        return;
+    }
+
+    deadline = c->first_pending_ns +
+               (int64_t)s->conf.coalesce_max_usecs * SCALE_US;
+    if (c->batch <= 1 ||
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= deadline) {
+        stat64_inc(&s->coalesce_stats.iteration_flushes);
+        virtio_blk_coalesce_flush(c);
+        return;
+    }
+
+    if (!timer_pending(c->timer)) {
+        timer_mod(c->timer, deadline);
+    }
+}
+
+static void virtio_blk_coalesce_timer_cb(void *opaque)
+{
+    VirtIOBlkCoalesce *c = opaque;
+
+    if (c->pending) {
+        stat64_inc(&c->s->coalesce_stats.timer_flushes);
+        virtio_blk_coalesce_flush(c);
+    }
+}
+
+/* Context: BH in the virtqueue's AioContext */
+static void virtio_blk_coalesce_flush_bh(void *opaque)
+{
+    virtio_blk_coalesce_flush(opaque);
+}
+
+static void virtio_blk_coalesce_init(VirtIOBlock *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned i;
+
+    if (!s->conf.coalesce) {
+        return;
+    }
+
+    s->coalesce = g_new0(VirtIOBlkCoalesce, s->conf.num_queues);
+    for (i = 0; i < s->conf.num_queues; i++) {
+        VirtIOBlkCoalesce *c = &s->coalesce[i];
+
+        c->s = s;
+        c->vq = virtio_get_queue(vdev, i);
+        c->ctx = s->vq_aio_context[i];
+        c->bh = aio_bh_new_guarded(c->ctx, virtio_blk_coalesce_bh, c,
+                                   &DEVICE(s)->mem_reentrancy_guard);
+        c->timer = aio_timer_new(c->ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                 virtio_blk_coalesce_timer_cb, c);
+        c->batch = 1;
+        c->window_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+}
+
+static void virtio_blk_coalesce_cleanup(VirtIOBlock *s)
+{
+    unsigned i;
+
+    if (!s->coalesce) {
+        return;
+    }
+
+    for (i = 0; i < s->conf.num_queues; i++) {
+        qemu_bh_delete(s->coalesce[i].bh);
+        timer_free(s->coalesce[i].timer);
+    }
+    g_free(s->coalesce);
+    s->coalesce = NULL;
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -66,11 +241,21 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     iov_discard_undo(&req->inhdr_undo);
     iov_discard_undo(&req->outhdr_undo);
     virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (qemu_in_iothread()) {
-        virtio_notify_irqfd(vdev, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+
+    /*
+     * Only coalesce completions that run in the virtqueue's own AioContext,
+     * which owns the coalescing state; anything else (e.g. requests
+     * completing while ioeventfd is stopped) is notified right away.
+     */
+    if (s->coalesce && s->ioeventfd_started) {
+        VirtIOBlkCoalesce *c = &s->coalesce[virtio_get_queue_index(req->vq)];
+
+        if (c->ctx == qemu_get_current_aio_context()) {
+            virtio_blk_coalesce_complete(c);
+            return;
+        }
     }
+    virtio_blk_notify(s, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -1418,128 +1603,6 @@ static const BlockDevOps virtio_block_ops = {
     .drained_end   = virtio_blk_drained_end,
 };
 
-static bool
-validate_iothread_vq_mapping_list(IOThreadVirtQueueMappingList *list,
-        uint16_t num_queues, Error **errp)
-{
-    g_autofree unsigned long *vqs = bitmap_new(num_queues);
-    g_autoptr(GHashTable) iothreads =
-        g_hash_table_new(g_str_hash, g_str_equal);
-
-    for (IOThreadVirtQueueMappingList *node = list; node; node = node->next) {
-        const char *name = node->value->iothread;
-        uint16List *vq;
-
-        if (!iothread_by_id(name)) {
-            error_setg(errp, "IOThread \"%s\" object does not exist", name);
-            return false;
-        }
-
-        if (!g_hash_table_add(iothreads, (gpointer)name)) {
-            error_setg(errp,
-                    "duplicate IOThread name \"%s\" in iothread-vq-mapping",
-                    name);
-            return false;
-        }
-
-        if (node != list) {
-            if (!!node->value->vqs != !!list->value->vqs) {
-                error_setg(errp, "either all items in iothread-vq-mapping "
-                                 "must have vqs or none of them must have it");
-                return false;
-            }
-        }
-
-        for (vq = node->value->vqs; vq; vq = vq->next) {
-            if (vq->value >= num_queues) {
-                error_setg(errp, "vq index %u for IOThread \"%s\" must be "
-                        "less than num_queues %u in iothread-vq-mapping",
-                        vq->value, name, num_queues);
-                return false;
-            }
-
-            if (test_and_set_bit(vq->value, vqs)) {
-                error_setg(errp, "cannot assign vq %u to IOThread \"%s\" "
-                        "because it is already assigned", vq->value, name);
-                return false;
-            }
-        }
-    }
-
-    if (list->value->vqs) {
-        for (uint16_t i = 0; i < num_queues; i++) {
-            if (!test_bit(i, vqs)) {
-                error_setg(errp,
-                        "missing vq %u IOThread assignment in iothread-vq-mapping",
-                        i);
-                return false;
-            }
-        }
-    }
-
-    return true;
-}
-
-/**
- * apply_iothread_vq_mapping:
- * @iothread_vq_mapping_list: The mapping of virtqueues to IOThreads.
- * @vq_aio_context: The array of AioContext pointers to fill in.
- * @num_queues: The length of @vq_aio_context.
- * @errp: If an error occurs, a pointer to the area to store the error.
- *
- * Fill in the AioContext for each virtqueue in the @vq_aio_context array given
- * the iothread-vq-mapping parameter in @iothread_vq_mapping_list.
- *
- * Returns: %true on success, %false on failure.
- **/
-static bool apply_iothread_vq_mapping(
-        IOThreadVirtQueueMappingList *iothread_vq_mapping_list,
-        AioContext **vq_aio_context,
-        uint16_t num_queues,
-        Error **errp)
-{
-    IOThreadVirtQueueMappingList *node;
-    size_t num_iothreads = 0;
-    size_t cur_iothread = 0;
-
-    if (!validate_iothread_vq_mapping_list(iothread_vq_mapping_list,
-                                           num_queues, errp)) {
-        return false;
-    }
-
-    for (node = iothread_vq_mapping_list; node; node = node->next) {
-        num_iothreads++;
-    }
-
-    for (node = iothread_vq_mapping_list; node; node = node->next) {
-        IOThread *iothread = iothread_by_id(node->value->iothread);
-        AioContext *ctx = iothread_get_aio_context(iothread);
-
-        /* Released in virtio_blk_vq_aio_context_cleanup() */
-        object_ref(OBJECT(iothread));
-
-        if (node->value->vqs) {
-            uint16List *vq;
-
-            /* Explicit vq:IOThread assignment */
-            for (vq = node->value->vqs; vq; vq = vq->next) {
-                assert(vq->value < num_queues);
-                vq_aio_context[vq->value] = ctx;
-            }
-        } else {
-            /* Round-robin vq:IOThread assignment */
-            for (unsigned i = cur_iothread; i < num_queues;
-                 i += num_iothreads) {
-                vq_aio_context[i] = ctx;
-            }
-        }
-
-        cur_iothread++;
-    }
-
-    return true;
-}
-
 /* Context: BQL held */
 static bool virtio_blk_vq_aio_context_init(VirtIOBlock *s, Error **errp)
 {
@@ -1581,7 +1644,7 @@ static bool virtio_blk_vq_aio_context_init(VirtIOBlock *s, Error **errp)
     s->vq_aio_context = g_new(AioContext *, conf->num_queues);
 
     if (conf->iothread_vq_mapping_list) {
-        if (!apply_iothread_vq_mapping(conf->iothread_vq_mapping_list,
+        if (!iothread_vq_mapping_apply(conf->iothread_vq_mapping_list,
                                        s->vq_aio_context,
                                        conf->num_queues,
                                        errp)) {
@@ -1615,12 +1678,7 @@ static void virtio_blk_vq_aio_context_cleanup(VirtIOBlock *s)
     assert(!s->ioeventfd_started);
 
     if (conf->iothread_vq_mapping_list) {
-        IOThreadVirtQueueMappingList *node;
-
-        for (node = conf->iothread_vq_mapping_list; node; node = node->next) {
-            IOThread *iothread = iothread_by_id(node->value->iothread);
-            object_unref(OBJECT(iothread));
-        }
+        iothread_vq_mapping_cleanup(conf->iothread_vq_mapping_list);
     }
 
     if (conf->iothread) {
@@ -1807,6 +1865,15 @@ static void virtio_blk_stop_ioeventfd(VirtIODevice *vdev)
     /* Wait for virtio_blk_dma_restart_bh() and in flight I/O to complete */
     blk_drain(s->conf.conf.blk);
 
+    /* Deliver coalesced notifications before the guest notifiers go away */
+    if (s->coalesce) {
+        for (i = 0; i < nvqs; i++) {
+            aio_wait_bh_oneshot(s->vq_aio_context[i],
+                                virtio_blk_coalesce_flush_bh,
+                                &s->coalesce[i]);
+        }
+    }
+
     /*
      * Try to switch bs back to the QEMU main loop. If other users keep the
      * BlockBackend in the iothread, that's ok
@@ -1848,6 +1915,10 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
                    "must be > 2", conf->queue_size);
         return;
     }
+    if (conf->coalesce && !conf->coalesce_max_batch) {
+        error_setg(errp, "coalesce-max-batch property must be larger than 0");
+        return;
+    }
     if (!is_power_of_2(conf->queue_size) ||
         conf->queue_size > VIRTQUEUE_MAX_SIZE) {
         error_setg(errp, "invalid queue-size property (%" PRIu16 "), "
@@ -1926,6 +1997,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+    virtio_blk_coalesce_init(s);
 
     /*
      * This must be after virtio_init() so virtio_blk_dma_restart_cb() gets
@@ -1954,6 +2026,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
 
     blk_drain(s->blk);
     del_boot_device_lchs(dev, "/disk@0,0");
+    virtio_blk_coalesce_cleanup(s);
     virtio_blk_vq_aio_context_cleanup(s);
     for (i = 0; i < conf->num_queues; i++) {
         virtio_del_queue(vdev, i);
@@ -1966,6 +2039,34 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     virtio_cleanup(vdev);
 }
 
+static void virtio_blk_get_coalesce_stats(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    VirtIOBlkCoalesceStats *stats = &s->coalesce_stats;
+    uint64_t completions = stat64_get(&stats->completions);
+    uint64_t notifications = stat64_get(&stats->notifications);
+    uint64_t batch_flushes = stat64_get(&stats->batch_flushes);
+    uint64_t iteration_flushes = stat64_get(&stats->iteration_flushes);
+    uint64_t timer_flushes = stat64_get(&stats->timer_flushes);
+
+    if (!visit_start_struct(v, name, NULL, 0, errp)) {
+        return;
+    }
+    if (!visit_type_uint64(v, "completions", &completions, errp) ||
+        !visit_type_uint64(v, "notifications", &notifications, errp) ||
+        !visit_type_uint64(v, "batch-flushes", &batch_flushes, errp) ||
+        !visit_type_uint64(v, "iteration-flushes", &iteration_flushes,
+                           errp) ||
+        !visit_type_uint64(v, "timer-flushes", &timer_flushes, errp)) {
+        goto out;
+    }
+    visit_check_struct(v, errp);
+out:
+    visit_end_struct(v, NULL);
+}
+
 static void virtio_blk_instance_init(Object *obj)
 {
     VirtIOBlock *s = VIRTIO_BLK(obj);
@@ -1973,6 +2074,9 @@ static void virtio_blk_instance_init(Object *obj)
     device_add_bootindex_property(obj, &s->conf.conf.bootindex,
                                   "bootindex", "/disk@0,0",
                                   DEVICE(obj));
+
+    object_property_add(obj, "coalesce-stats", "completion coalescing stats",
+                        virtio_blk_get_coalesce_stats, NULL, NULL, NULL);
 }
 
 static const VMStateDescription vmstate_virtio_blk = {
@@ -2014,6 +2118,11 @@ static Property virtio_blk_properties[] = {
                        conf.max_write_zeroes_sectors, BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_BOOL("x-enable-wce-if-config-wce", VirtIOBlock,
                      conf.x_enable_wce_if_config_wce, true),
+    DEFINE_PROP_BOOL("coalesce", VirtIOBlock, conf.coalesce, false),
+    DEFINE_PROP_UINT32("coalesce-max-batch", VirtIOBlock,
+                       conf.coalesce_max_batch, 32),
+    DEFINE_PROP_UINT32("coalesce-max-usecs", VirtIOBlock,
+                       conf.coalesce_max_usecs, 50),
     DEFINE_PROP_END_OF_LIST(),
 };
 
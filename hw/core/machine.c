@@ -456,6 +456,17 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static bool machine_get_incremental_flatview(Object *obj, Error **errp)
+{
+    return memory_region_get_incremental_update();
+}
+
+static void machine_set_incremental_flatview(Object *obj, bool value,
+                                             Error **errp)
+{
+    memory_region_set_incremental_update(value);
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -1068,6 +1079,11 @@ static void machine_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "mem-merge",
         "Enable/disable memory merge support");
 
+    object_class_property_add_bool(oc, "x-incremental-flatview",
+        machine_get_incremental_flatview, machine_set_incremental_flatview);
+    object_class_property_set_description(oc, "x-incremental-flatview",
+        "Only re-render the memory ranges touched by a topology change");
+
     object_class_property_add_bool(oc, "usb",
         machine_get_usb, machine_set_usb);
     object_class_property_set_description(oc, "usb",
@@ -538,9 +538,14 @@ static void net_tx_pkt_do_sw_csum(struct NetTxPkt *pkt,
 
 #define NET_MAX_FRAG_SG_LIST (64)
 
+/*
+ * Gather up to @src_len payload bytes into @dst.  If @csum is not NULL,
+ * the checksum of the gathered bytes is added to it on the way, so that
+ * a segment is checksummed while it is carved out of the payload.
+ */
 static size_t net_tx_pkt_fetch_fragment(struct NetTxPkt *pkt,
     int *src_idx, size_t *src_offset, size_t src_len,
-    struct iovec *dst, int *dst_idx)
+    struct iovec *dst, int *dst_idx, uint32_t *csum)
 {
     size_t fetched = 0;
     struct iovec *src = pkt->vec;
@@ -562,6 +567,11 @@ static size_t net_tx_pkt_fetch_fragment(struct NetTxPkt *pkt,
         dst[*dst_idx].iov_len = MIN(src[*src_idx].iov_len - *src_offset,
             src_len - fetched);
 
+        if (csum) {
+            *csum += net_checksum_add_cont(dst[*dst_idx].iov_len,
+                                           dst[*dst_idx].iov_base, fetched);
+        }
+
         *src_offset += dst[*dst_idx].iov_len;
         fetched += dst[*dst_idx].iov_len;
 
@@ -665,6 +675,38 @@ static void net_tx_pkt_tcp_fragment_fix(struct NetTxPkt *pkt,
     }
 }
 
+/*
+ * Complete the TCP checksum of a segment: the payload was summed by
+ * net_tx_pkt_fetch_fragment(), only the pseudo header and the TCP header
+ * are left.
+ */
+static void net_tx_pkt_tcp_fragment_csum(struct NetTxPkt *pkt,
+                                         struct iovec *fragment,
+                                         size_t fragment_len,
+                                         uint32_t payload_csum,
+                                         uint8_t gso_type)
+{
+    struct iovec *l3hdr = fragment + NET_TX_PKT_L3HDR_FRAG;
+    struct iovec *l4hdr = fragment + NET_TX_PKT_PL_START_FRAG;
+    struct tcp_hdr *th = l4hdr->iov_base;
+    uint16_t csl = l4hdr->iov_len + fragment_len;
+    uint32_t csum_cntr;
+    uint32_t cso;
+
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+        csum_cntr = eth_calc_ip4_pseudo_hdr_csum(l3hdr->iov_base, csl, &cso);
+    } else {
+        csum_cntr = eth_calc_ip6_pseudo_hdr_csum(l3hdr->iov_base, csl,
+                                                 pkt->l4proto, &cso);
+    }
+
+    /* hdr_len comes from th_off, so the payload starts at an even offset */
+    stw_he_p(&th->th_sum, 0);
+    csum_cntr += net_checksum_add(l4hdr->iov_len, l4hdr->iov_base);
+    csum_cntr += payload_csum;
+    stw_be_p(&th->th_sum, net_checksum_finish_nozero(csum_cntr));
+}
+
 static void net_tx_pkt_tcp_fragment_advance(struct NetTxPkt *pkt,
                                             struct iovec *fragment,
                                             size_t fragment_len,
@@ -727,6 +769,9 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
 
     struct iovec fragment[NET_MAX_FRAG_SG_LIST];
     size_t fragment_len;
+    uint32_t payload_csum;
+    bool tcp = gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+               gso_type == VIRTIO_NET_HDR_GSO_TCPV6;
     size_t l4hdr_len;
     size_t src_len;
 
@@ -768,8 +813,10 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     /* Put as much data as possible and send */
     while (true) {
         dst_idx = pl_idx;
+        payload_csum = 0;
         fragment_len = net_tx_pkt_fetch_fragment(pkt,
-            &src_idx, &src_offset, src_len, fragment, &dst_idx);
+            &src_idx, &src_offset, src_len, fragment, &dst_idx,
+            tcp ? &payload_csum : NULL);
         if (!fragment_len) {
             break;
         }
@@ -778,9 +825,8 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
         case VIRTIO_NET_HDR_GSO_TCPV4:
         case VIRTIO_NET_HDR_GSO_TCPV6:
             net_tx_pkt_tcp_fragment_fix(pkt, fragment, fragment_len, gso_type);
-            net_tx_pkt_do_sw_csum(pkt, fragment + NET_TX_PKT_L2HDR_FRAG,
-                                  dst_idx - NET_TX_PKT_L2HDR_FRAG,
-                                  l4hdr_len + fragment_len);
+            net_tx_pkt_tcp_fragment_csum(pkt, fragment, fragment_len,
+                                         payload_csum, gso_type);
             break;
 
         case VIRTIO_NET_HDR_GSO_UDP:
@@ -793,8 +839,7 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
                  fragment + NET_TX_PKT_L2HDR_FRAG, dst_idx - NET_TX_PKT_L2HDR_FRAG,
                  fragment + NET_TX_PKT_VHDR_FRAG, dst_idx - NET_TX_PKT_VHDR_FRAG);
 
-        if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
-            gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+        if (tcp) {
             net_tx_pkt_tcp_fragment_advance(pkt, fragment, fragment_len,
                                             gso_type);
         }
@@ -802,8 +847,7 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
         fragment_offset += fragment_len;
     }
 
-    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
-        gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+    if (tcp) {
         net_tx_pkt_tcp_fragment_deinit(fragment);
     }
 
@@ -2754,8 +2754,22 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             }
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        /*
+         * Unless the header was swapped into vhdr above, out_sg only points
+         * to guest memory that stays mapped until virtio_net_tx_complete()
+         * pushes the element, so a queued packet can refer to it.
+         */
+        if (n->needs_vnet_hdr_swap) {
+            ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic,
+                                                            queue_index),
+                                          out_sg, out_num,
+                                          virtio_net_tx_complete);
+        } else {
+            ret = qemu_sendv_packet_async_nocopy(qemu_get_subqueue(n->nic,
+                                                                   queue_index),
+                                                 out_sg, out_num,
+                                                 virtio_net_tx_complete);
+        }
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
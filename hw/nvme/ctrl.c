@@ -40,6 +40,8 @@
  *              sriov_vi_flexible=<N[optional]> \
  *              sriov_max_vi_per_vf=<N[optional]> \
  *              sriov_max_vq_per_vf=<N[optional]> \
+ *              iothread=<iothread_id[optional]> \
+ *              dbbuf-poll=<on|off[optional]> \
  *              subsys=<subsys_id>
  *      -device nvme-ns,drive=<drive_id>,bus=<bus_name>,nsid=<nsid>,\
  *              zoned=<true|false[optional]>, \
@@ -147,6 +149,34 @@
  *   a secondary controller. The default 0 resolves to
  *   `(sriov_vq_flexible / sriov_max_vfs)`.
  *
+ * - `iothread`
+ *   Process all I/O queue pairs in the given IOThread instead of the main
+ *   loop. The Admin Queue is always processed in the main loop.
+ *
+ * - `iothread-vq-mapping`
+ *   Like `iothread`, but distributes the I/O queue pairs over several
+ *   IOThreads. Entry N of the `vqs` lists is the queue pair with identifier
+ *   N + 1; without `vqs` the queue pairs are assigned round-robin. Cannot be
+ *   combined with `iothread`. A submission queue is processed in the
+ *   IOThread of the completion queue it is created on.
+ *
+ *   Controllers that use IOThreads do not support zoned namespaces or
+ *   Flexible Data Placement.
+ *
+ * - `dbbuf-poll`
+ *   Let the IOThreads poll the Shadow Doorbell buffer of their queues
+ *   instead of waiting for doorbell writes. While an IOThread polls, the
+ *   event indices tell the host that it does not need to ring the doorbell.
+ *   The poll window is the adaptive one of the IOThread, configured with its
+ *   `poll-max-ns`, `poll-grow` and `poll-shrink` properties. Requires
+ *   `ioeventfd` and `iothread` or `iothread-vq-mapping`, and a host that
+ *   sets up the Shadow Doorbell buffer (Doorbell Buffer Config command).
+ *
+ *   The read-only `stats.*` properties count the MMIO and ioeventfd doorbell
+ *   writes and the polled doorbell updates, and the number, total and
+ *   maximum latency (from fetch to completion, in nanoseconds) of the I/O
+ *   commands.
+ *
  * nvme namespace device parameters
  * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  * - `shared`
@@ -204,6 +234,7 @@
 #include "hw/pci/msix.h"
 #include "hw/pci/pcie_sriov.h"
 #include "migration/vmstate.h"
+#include "block/aio-wait.h"
 
 #include "nvme.h"
 #include "dif.h"
@@ -311,6 +342,7 @@ static const uint32_t nvme_cse_iocs_zoned[256] = {
 };
 
 static void nvme_process_sq(void *opaque);
+static void nvme_update_sq_eventidx(const NvmeSQueue *sq);
 static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst);
 static inline uint64_t nvme_get_timestamp(const NvmeCtrl *n);
 
@@ -634,14 +666,66 @@ static void nvme_inc_sq_head(NvmeSQueue *sq)
     sq->head = (sq->head + 1) % sq->size;
 }
 
+/*
+ * The head of a CQ and the tail of an SQ are written by the doorbell, which
+ * runs in the main loop, while queues may be processed in an IOThread.
+ */
 static uint8_t nvme_cq_full(NvmeCQueue *cq)
 {
-    return (cq->tail + 1) % cq->size == cq->head;
+    return (cq->tail + 1) % cq->size == qatomic_read(&cq->head);
 }
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == qatomic_read(&sq->tail);
+}
+
+static bool nvme_cq_in_iothread(NvmeCQueue *cq)
+{
+    return cq->ctx != qemu_get_aio_context();
+}
+
+/*
+ * Run @fn in @ctx and wait for it.  Used by the main loop to change the
+ * state of queues that are processed in an IOThread.
+ */
+static void nvme_run_in_ctx(AioContext *ctx, QEMUBHFunc *fn, void *opaque)
+{
+    if (ctx == qemu_get_aio_context()) {
+        fn(opaque);
+    } else {
+        aio_wait_bh_oneshot(ctx, fn, opaque);
+    }
+}
+
+/*
+ * Doorbell notifiers of the main loop go to the iohandler context, so that
+ * they do not run in nested event loops, like the other device handlers.
+ */
+static void nvme_set_notifier_handler(AioContext *ctx, EventNotifier *e,
+                                      EventNotifierHandler *handler)
+{
+    if (ctx == qemu_get_aio_context()) {
+        event_notifier_set_handler(e, handler);
+    } else {
+        aio_set_event_notifier(ctx, e, handler, NULL, NULL);
+    }
+}
+
+/*
+ * Only queues of the main loop use the reentrancy guard of the device: it
+ * is not thread safe, and an IOThread that holds it would make the device
+ * drop the doorbell writes of the vCPUs.
+ */
+static QEMUBH *nvme_queue_bh_new(NvmeCtrl *n, AioContext *ctx,
+                                 QEMUBHFunc *cb, void *opaque)
+{
+    if (ctx == qemu_get_aio_context()) {
+        return qemu_bh_new_guarded(cb, opaque,
+                                   &DEVICE(n)->mem_reentrancy_guard);
+    }
+
+    return aio_bh_new(ctx, cb, opaque);
 }
 
 static void nvme_irq_check(NvmeCtrl *n)
@@ -693,6 +777,30 @@ static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/*
+ * Interrupt update of a CQ that is processed in an IOThread.  Runs in the
+ * main loop, either from irq_bh or from the doorbell write.
+ */
+static void nvme_cq_update_irq(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+    /* Pairs with qatomic_store_release() in nvme_post_cqes() */
+    bool notify = qatomic_xchg(&cq->irq_notify, false);
+    bool pending = qatomic_read(&cq->tail) != qatomic_read(&cq->head);
+
+    if (cq->irq_enabled && pending != cq->irq_pending) {
+        n->cq_pending += pending ? 1 : -1;
+    }
+    cq->irq_pending = pending;
+
+    if (!pending) {
+        nvme_irq_deassert(n, cq);
+    } else if (notify) {
+        nvme_irq_assert(n, cq);
+    }
+}
+
 static void nvme_req_clear(NvmeRequest *req)
 {
     req->ns = NULL;
@@ -1466,11 +1574,23 @@ static inline void nvme_blk_write(BlockBackend *blk, int64_t offset,
     }
 }
 
+/*
+ * The host rings the doorbell when it moves the shadow doorbell past the
+ * event index.  While the AioContext polls the shadow doorbell, keep the
+ * event index one entry behind so that the host never needs to.
+ */
+static uint32_t nvme_eventidx(uint32_t idx, uint32_t size, bool poll_started)
+{
+    return poll_started ? (idx + size - 1) % size : idx;
+}
+
 static void nvme_update_cq_eventidx(const NvmeCQueue *cq)
 {
-    trace_pci_nvme_update_cq_eventidx(cq->cqid, cq->head);
+    uint32_t v = nvme_eventidx(cq->head, cq->size, cq->poll_started);
 
-    stl_le_pci_dma(PCI_DEVICE(cq->ctrl), cq->ei_addr, cq->head,
+    trace_pci_nvme_update_cq_eventidx(cq->cqid, v);
+
+    stl_le_pci_dma(PCI_DEVICE(cq->ctrl), cq->ei_addr, v,
                    MEMTXATTRS_UNSPECIFIED);
 }
 
@@ -1488,6 +1608,7 @@ static void nvme_post_cqes(void *opaque)
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
     bool pending = cq->head != cq->tail;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
@@ -1519,9 +1640,25 @@ static void nvme_post_cqes(void *opaque)
         QTAILQ_REMOVE(&cq->req_list, req, entry);
         nvme_inc_cq_tail(cq);
         nvme_sg_unmap(&req->sg);
+        if (sq->sqid) {
+            /* AERs stay outstanding until an event, leave them out */
+            stat64_add(&n->stats.completions, 1);
+            stat64_add(&n->stats.latency_ns, now - req->fetch_ns);
+            stat64_max(&n->stats.max_latency_ns, now - req->fetch_ns);
+        }
+        if (QTAILQ_EMPTY(&sq->req_list) && sq->bh) {
+            /* The SQ stopped fetching commands, let it resume */
+            qemu_bh_schedule(sq->bh);
+        }
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     if (cq->tail != cq->head) {
+        if (nvme_cq_in_iothread(cq)) {
+            qatomic_store_release(&cq->irq_notify, true);
+            qemu_bh_schedule(cq->irq_bh);
+            return;
+        }
+
         if (cq->irq_enabled && !pending) {
             n->cq_pending++;
         }
@@ -4495,9 +4632,12 @@ static void nvme_cq_notifier(EventNotifier *e)
         return;
     }
 
+    stat64_add(&n->stats.ioeventfd_doorbells, 1);
     nvme_update_cq_head(cq);
 
-    if (cq->tail == cq->head) {
+    if (nvme_cq_in_iothread(cq)) {
+        qemu_bh_schedule(cq->irq_bh);
+    } else if (cq->tail == cq->head) {
         if (cq->irq_enabled) {
             n->cq_pending--;
         }
@@ -4508,6 +4648,48 @@ static void nvme_cq_notifier(EventNotifier *e)
     qemu_bh_schedule(cq->bh);
 }
 
+/*
+ * Polling handlers of the shadow doorbells.  They are only installed for
+ * queues that run in an IOThread, which polls for up to its poll-max-ns
+ * before it waits for the doorbell notifiers.
+ */
+static bool nvme_cq_poll(void *opaque)
+{
+    NvmeCQueue *cq = container_of(opaque, NvmeCQueue, notifier);
+    uint32_t head;
+
+    ldl_le_pci_dma(PCI_DEVICE(cq->ctrl), cq->db_addr, &head,
+                   MEMTXATTRS_UNSPECIFIED);
+
+    return head != qatomic_read(&cq->head);
+}
+
+static void nvme_cq_poll_ready(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+
+    stat64_add(&cq->ctrl->stats.polled_doorbells, 1);
+    nvme_update_cq_head(cq);
+    qemu_bh_schedule(cq->irq_bh);
+    nvme_post_cqes(cq);
+}
+
+static void nvme_cq_poll_begin(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+
+    cq->poll_started = true;
+    nvme_update_cq_eventidx(cq);
+}
+
+static void nvme_cq_poll_end(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+
+    cq->poll_started = false;
+    nvme_update_cq_eventidx(cq);
+}
+
 static int nvme_init_cq_ioeventfd(NvmeCQueue *cq)
 {
     NvmeCtrl *n = cq->ctrl;
@@ -4519,7 +4701,14 @@ static int nvme_init_cq_ioeventfd(NvmeCQueue *cq)
         return ret;
     }
 
-    event_notifier_set_handler(&cq->notifier, nvme_cq_notifier);
+    if (n->params.dbbuf_poll && nvme_cq_in_iothread(cq)) {
+        aio_set_event_notifier(cq->ctx, &cq->notifier, nvme_cq_notifier,
+                               nvme_cq_poll, nvme_cq_poll_ready);
+        aio_set_event_notifier_poll(cq->ctx, &cq->notifier,
+                                    nvme_cq_poll_begin, nvme_cq_poll_end);
+    } else {
+        nvme_set_notifier_handler(cq->ctx, &cq->notifier, nvme_cq_notifier);
+    }
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &cq->notifier);
 
@@ -4534,9 +4723,50 @@ static void nvme_sq_notifier(EventNotifier *e)
         return;
     }
 
+    stat64_add(&sq->ctrl->stats.ioeventfd_doorbells, 1);
     nvme_process_sq(sq);
 }
 
+static bool nvme_sq_poll(void *opaque)
+{
+    NvmeSQueue *sq = container_of(opaque, NvmeSQueue, notifier);
+    uint32_t tail;
+
+    /* Without a free request the SQ is resumed by the CQ anyway */
+    if (QTAILQ_EMPTY(&sq->req_list)) {
+        return false;
+    }
+
+    ldl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->db_addr, &tail,
+                   MEMTXATTRS_UNSPECIFIED);
+
+    return tail != sq->head;
+}
+
+static void nvme_sq_poll_ready(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    stat64_add(&sq->ctrl->stats.polled_doorbells, 1);
+    nvme_process_sq(sq);
+}
+
+static void nvme_sq_poll_begin(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    sq->poll_started = true;
+    nvme_update_sq_eventidx(sq);
+}
+
+static void nvme_sq_poll_end(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    sq->poll_started = false;
+    nvme_update_sq_eventidx(sq);
+}
+
 static int nvme_init_sq_ioeventfd(NvmeSQueue *sq)
 {
     NvmeCtrl *n = sq->ctrl;
@@ -4548,23 +4778,49 @@ static int nvme_init_sq_ioeventfd(NvmeSQueue *sq)
         return ret;
     }
 
-    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    if (n->params.dbbuf_poll && sq->ctx != qemu_get_aio_context()) {
+        aio_set_event_notifier(sq->ctx, &sq->notifier, nvme_sq_notifier,
+                               nvme_sq_poll, nvme_sq_poll_ready);
+        aio_set_event_notifier_poll(sq->ctx, &sq->notifier,
+                                    nvme_sq_poll_begin, nvme_sq_poll_end);
+    } else {
+        nvme_set_notifier_handler(sq->ctx, &sq->notifier, nvme_sq_notifier);
+    }
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &sq->notifier);
 
     return 0;
 }
 
+/* Runs in the AioContext of the SQ, so that nothing of it is running */
+static void nvme_stop_sq_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    if (sq->ioeventfd_enabled) {
+        nvme_set_notifier_handler(sq->ctx, &sq->notifier, NULL);
+    }
+    qemu_bh_delete(sq->bh);
+    sq->bh = NULL;
+}
+
+/* Stop fetching commands from the SQ */
+static void nvme_stop_sq(NvmeSQueue *sq)
+{
+    if (sq->bh) {
+        nvme_run_in_ctx(sq->ctx, nvme_stop_sq_bh, sq);
+    }
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     uint16_t offset = sq->sqid << 3;
 
     n->sq[sq->sqid] = NULL;
-    qemu_bh_delete(sq->bh);
+    nvme_stop_sq(sq);
     if (sq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &sq->notifier);
-        event_notifier_set_handler(&sq->notifier, NULL);
         event_notifier_cleanup(&sq->notifier);
     }
     g_free(sq->io_req);
@@ -4573,29 +4829,28 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
     }
 }
 
-static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
+/*
+ * blk_aio_cancel() waits in the main loop, so requests of an SQ that runs
+ * in an IOThread are cancelled asynchronously from there and waited for by
+ * nvme_del_sq().
+ */
+static void nvme_cancel_sq_bh(void *opaque)
 {
-    NvmeDeleteQ *c = (NvmeDeleteQ *)&req->cmd;
+    NvmeSQueue *sq = opaque;
     NvmeRequest *r, *next;
-    NvmeSQueue *sq;
-    NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
 
-    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
-        trace_pci_nvme_err_invalid_del_sq(qid);
-        return NVME_INVALID_QID | NVME_DNR;
-    }
-
-    trace_pci_nvme_del_sq(qid);
-
-    sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        r = QTAILQ_FIRST(&sq->out_req_list);
+    QTAILQ_FOREACH_SAFE(r, &sq->out_req_list, entry, next) {
         assert(r->aiocb);
-        blk_aio_cancel(r->aiocb);
+        blk_aio_cancel_async(r->aiocb);
     }
+}
 
-    assert(QTAILQ_EMPTY(&sq->out_req_list));
+static void nvme_unlink_sq_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeRequest *r, *next;
+    NvmeCQueue *cq;
 
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
@@ -4609,7 +4864,40 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
             }
         }
     }
+}
+
+static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)&req->cmd;
+    NvmeRequest *r;
+    NvmeSQueue *sq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
+        trace_pci_nvme_err_invalid_del_sq(qid);
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+
+    trace_pci_nvme_del_sq(qid);
+
+    sq = n->sq[qid];
+    nvme_stop_sq(sq);
+
+    if (sq->ctx == qemu_get_aio_context()) {
+        while (!QTAILQ_EMPTY(&sq->out_req_list)) {
+            r = QTAILQ_FIRST(&sq->out_req_list);
+            assert(r->aiocb);
+            blk_aio_cancel(r->aiocb);
+        }
+    } else {
+        aio_wait_bh_oneshot(sq->ctx, nvme_cancel_sq_bh, sq);
+        /* Completions in the IOThread kick the wait through the block layer */
+        AIO_WAIT_WHILE(NULL, !QTAILQ_EMPTY(&sq->out_req_list));
+    }
 
+    assert(QTAILQ_EMPTY(&sq->out_req_list));
+
+    nvme_run_in_ctx(sq->ctx, nvme_unlink_sq_bh, sq);
     nvme_free_sq(sq, n);
     return NVME_SUCCESS;
 }
@@ -4620,11 +4908,15 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     int i;
     NvmeCQueue *cq;
 
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+
     sq->ctrl = n;
     sq->dma_addr = dma_addr;
     sq->sqid = sqid;
     sq->size = size;
     sq->cqid = cqid;
+    sq->ctx = cq->ctx;
     sq->head = sq->tail = 0;
     sq->io_req = g_new0(NvmeRequest, sq->size);
 
@@ -4635,8 +4927,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
 
-    sq->bh = qemu_bh_new_guarded(nvme_process_sq, sq,
-                                 &DEVICE(sq->ctrl)->mem_reentrancy_guard);
+    sq->bh = nvme_queue_bh_new(n, sq->ctx, nvme_process_sq, sq);
 
     if (n->dbbuf_enabled) {
         sq->db_addr = n->dbbuf_dbs + (sqid << 3);
@@ -4649,8 +4940,6 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
 
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
 }
@@ -5209,17 +5498,39 @@ static uint16_t nvme_get_log(NvmeCtrl *n, NvmeRequest *req)
     }
 }
 
+static void nvme_stop_cq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    if (cq->ioeventfd_enabled) {
+        nvme_set_notifier_handler(cq->ctx, &cq->notifier, NULL);
+    }
+    qemu_bh_delete(cq->bh);
+    cq->bh = NULL;
+}
+
+/* Stop posting completions to the CQ and updating its interrupt */
+static void nvme_stop_cq(NvmeCQueue *cq)
+{
+    if (cq->bh) {
+        nvme_run_in_ctx(cq->ctx, nvme_stop_cq_bh, cq);
+    }
+    if (cq->irq_bh) {
+        qemu_bh_delete(cq->irq_bh);
+        cq->irq_bh = NULL;
+    }
+}
+
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     PCIDevice *pci = PCI_DEVICE(n);
     uint16_t offset = (cq->cqid << 3) + (1 << 2);
 
     n->cq[cq->cqid] = NULL;
-    qemu_bh_delete(cq->bh);
+    nvme_stop_cq(cq);
     if (cq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &cq->notifier);
-        event_notifier_set_handler(&cq->notifier, NULL);
         event_notifier_cleanup(&cq->notifier);
     }
     if (msix_enabled(pci)) {
@@ -5247,7 +5558,12 @@ static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeRequest *req)
         return NVME_INVALID_QUEUE_DEL;
     }
 
-    if (cq->irq_enabled && cq->tail != cq->head) {
+    if (nvme_cq_in_iothread(cq)) {
+        nvme_stop_cq(cq);
+        if (cq->irq_enabled && cq->irq_pending) {
+            n->cq_pending--;
+        }
+    } else if (cq->irq_enabled && cq->tail != cq->head) {
         n->cq_pending--;
     }
 
@@ -5274,8 +5590,17 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->ctx = n->ioq_aio_context[cqid];
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
+
+    /* The doorbell notifier of an IOThread can fire as soon as it is set */
+    cq->bh = nvme_queue_bh_new(n, cq->ctx, nvme_post_cqes, cq);
+    if (nvme_cq_in_iothread(cq)) {
+        cq->irq_bh = qemu_bh_new_guarded(nvme_cq_update_irq, cq,
+                                         &DEVICE(n)->mem_reentrancy_guard);
+    }
+
     if (n->dbbuf_enabled) {
         cq->db_addr = n->dbbuf_dbs + (cqid << 3) + (1 << 2);
         cq->ei_addr = n->dbbuf_eis + (cqid << 3) + (1 << 2);
@@ -5287,8 +5612,6 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
     n->cq[cqid] = cq;
-    cq->bh = qemu_bh_new_guarded(nvme_post_cqes, cq,
-                                 &DEVICE(cq->ctrl)->mem_reentrancy_guard);
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -6417,6 +6740,10 @@ static uint16_t nvme_ns_attachment(NvmeCtrl *n, NvmeRequest *req)
                 return NVME_NS_PRIVATE | NVME_DNR;
             }
 
+            if (ns->params.zoned && nvme_ctrl_uses_iothreads(ctrl)) {
+                return NVME_NS_CTRL_LIST_INVALID | NVME_DNR;
+            }
+
             nvme_attach_ns(ctrl, ns);
             nvme_select_iocs_ns(ctrl, ns);
 
@@ -6816,9 +7143,40 @@ static uint16_t nvme_virt_mngmt(NvmeCtrl *n, NvmeRequest *req)
     }
 }
 
+/*
+ * The shadow doorbell addresses are set in the AioContext of the queue,
+ * before dbbuf_enabled tells the queue to use them.
+ */
+static void nvme_dbbuf_config_sq_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    /*
+     * CAP.DSTRD is 0, so offset of ith sq db_addr is (i<<3)
+     * nvme_process_db() uses this hard-coded way to calculate
+     * doorbell offsets. Be consistent with that here.
+     */
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    stl_le_pci_dma(PCI_DEVICE(n), sq->db_addr, sq->tail,
+                   MEMTXATTRS_UNSPECIFIED);
+}
+
+static void nvme_dbbuf_config_cq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    /* CAP.DSTRD is 0, so offset of ith cq db_addr is (i<<3)+(1<<2) */
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    stl_le_pci_dma(PCI_DEVICE(n), cq->db_addr, cq->head,
+                   MEMTXATTRS_UNSPECIFIED);
+}
+
 static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
 {
-    PCIDevice *pci = PCI_DEVICE(n);
     uint64_t dbs_addr = le64_to_cpu(req->cmd.dptr.prp1);
     uint64_t eis_addr = le64_to_cpu(req->cmd.dptr.prp2);
     int i;
@@ -6831,21 +7189,13 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
     /* Save shadow buffer base addr for use during queue creation */
     n->dbbuf_dbs = dbs_addr;
     n->dbbuf_eis = eis_addr;
-    n->dbbuf_enabled = true;
 
     for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
         NvmeSQueue *sq = n->sq[i];
         NvmeCQueue *cq = n->cq[i];
 
         if (sq) {
-            /*
-             * CAP.DSTRD is 0, so offset of ith sq db_addr is (i<<3)
-             * nvme_process_db() uses this hard-coded way to calculate
-             * doorbell offsets. Be consistent with that here.
-             */
-            sq->db_addr = dbs_addr + (i << 3);
-            sq->ei_addr = eis_addr + (i << 3);
-            stl_le_pci_dma(pci, sq->db_addr, sq->tail, MEMTXATTRS_UNSPECIFIED);
+            nvme_run_in_ctx(sq->ctx, nvme_dbbuf_config_sq_bh, sq);
 
             if (n->params.ioeventfd && sq->sqid != 0) {
                 if (!nvme_init_sq_ioeventfd(sq)) {
@@ -6855,10 +7205,7 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
         }
 
         if (cq) {
-            /* CAP.DSTRD is 0, so offset of ith cq db_addr is (i<<3)+(1<<2) */
-            cq->db_addr = dbs_addr + (i << 3) + (1 << 2);
-            cq->ei_addr = eis_addr + (i << 3) + (1 << 2);
-            stl_le_pci_dma(pci, cq->db_addr, cq->head, MEMTXATTRS_UNSPECIFIED);
+            nvme_run_in_ctx(cq->ctx, nvme_dbbuf_config_cq_bh, cq);
 
             if (n->params.ioeventfd && cq->cqid != 0) {
                 if (!nvme_init_cq_ioeventfd(cq)) {
@@ -6868,6 +7215,8 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
         }
     }
 
+    n->dbbuf_enabled = true;
+
     trace_pci_nvme_dbbuf_config(dbs_addr, eis_addr);
 
     return NVME_SUCCESS;
@@ -6989,9 +7338,11 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
 
 static void nvme_update_sq_eventidx(const NvmeSQueue *sq)
 {
-    trace_pci_nvme_update_sq_eventidx(sq->sqid, sq->tail);
+    uint32_t v = nvme_eventidx(sq->tail, sq->size, sq->poll_started);
+
+    trace_pci_nvme_update_sq_eventidx(sq->sqid, v);
 
-    stl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->ei_addr, sq->tail,
+    stl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->ei_addr, v,
                    MEMTXATTRS_UNSPECIFIED);
 }
 
@@ -7032,6 +7383,7 @@ static void nvme_process_sq(void *opaque)
         QTAILQ_REMOVE(&sq->req_list, req, entry);
         QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
         nvme_req_clear(req);
+        req->fetch_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         req->cqe.cid = cmd.cid;
         memcpy(&req->cmd, &cmd, sizeof(NvmeCmd));
 
@@ -7094,6 +7446,13 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
     NvmeNamespace *ns;
     int i;
 
+    /* IOThreads would keep submitting requests while the drain runs */
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_stop_sq(n->sq[i]);
+        }
+    }
+
     for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
         ns = nvme_ns(n, i);
         if (!ns) {
@@ -7103,6 +7462,13 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
         nvme_ns_drain(ns);
     }
 
+    /* Completions queued by the drain refer to the requests of the SQs */
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_stop_cq(n->cq[i]);
+        }
+    }
+
     for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -7578,6 +7944,8 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         return;
     }
 
+    stat64_add(&n->stats.mmio_doorbells, 1);
+
     if (((addr - 0x1000) >> 2) & 1) {
         /* Completion queue doorbell write */
 
@@ -7633,6 +8001,17 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_cq(cq->cqid, new_head);
 
+        if (nvme_cq_in_iothread(cq)) {
+            /*
+             * The tail belongs to the IOThread: let it post what is waiting
+             * and resume the SQs that ran out of requests.
+             */
+            qatomic_set(&cq->head, new_head);
+            qemu_bh_schedule(cq->bh);
+            nvme_cq_update_irq(cq);
+            return;
+        }
+
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
         if (!qid && n->dbbuf_enabled) {
@@ -7694,7 +8073,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
 
-        sq->tail = new_tail;
+        qatomic_set(&sq->tail, new_tail);
         if (!qid && n->dbbuf_enabled) {
             /*
              * The spec states "the host shall also update the controller's
@@ -7786,6 +8165,40 @@ static bool nvme_check_params(NvmeCtrl *n, Error **errp)
         return false;
     }
 
+    if (n->iothread && n->iothread_vq_mapping_list) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties cannot "
+                   "be set at the same time");
+        return false;
+    }
+
+    if (params->dbbuf_poll &&
+        !(params->ioeventfd && nvme_ctrl_uses_iothreads(n))) {
+        error_setg(errp, "dbbuf-poll requires ioeventfd and iothread or "
+                   "iothread-vq-mapping");
+        return false;
+    }
+
+    if (nvme_ctrl_uses_iothreads(n) && n->subsys) {
+        int i;
+
+        if (n->subsys->endgrp.fdp.enabled) {
+            error_setg(errp, "flexible data placement is not supported with "
+                       "iothread");
+            return false;
+        }
+
+        for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
+            NvmeNamespace *ns = nvme_subsys_ns(n->subsys, i);
+
+            if (ns && ns->params.shared && !ns->params.detached &&
+                ns->params.zoned) {
+                error_setg(errp, "zoned namespaces are not supported with "
+                           "iothread");
+                return false;
+            }
+        }
+    }
+
     if (params->max_ioqpairs < 1 ||
         params->max_ioqpairs > NVME_MAX_IOQPAIRS) {
         error_setg(errp, "max_ioqpairs must be between 1 and %d",
@@ -7909,6 +8322,56 @@ static bool nvme_check_params(NvmeCtrl *n, Error **errp)
     return true;
 }
 
+/* The Admin Queue always runs in the main loop */
+static bool nvme_ioq_aio_context_init(NvmeCtrl *n, Error **errp)
+{
+    uint32_t num_queues = n->params.max_ioqpairs;
+    AioContext *ctx = qemu_get_aio_context();
+    int i;
+
+    n->ioq_aio_context = g_new(AioContext *, num_queues + 1);
+    n->ioq_aio_context[0] = qemu_get_aio_context();
+
+    if (n->iothread_vq_mapping_list) {
+        if (!iothread_vq_mapping_apply(n->iothread_vq_mapping_list,
+                                       &n->ioq_aio_context[1], num_queues,
+                                       errp)) {
+            g_free(n->ioq_aio_context);
+            n->ioq_aio_context = NULL;
+            return false;
+        }
+
+        return true;
+    }
+
+    if (n->iothread) {
+        ctx = iothread_get_aio_context(n->iothread);
+
+        /* Released in nvme_ioq_aio_context_cleanup() */
+        object_ref(OBJECT(n->iothread));
+    }
+
+    for (i = 1; i <= num_queues; i++) {
+        n->ioq_aio_context[i] = ctx;
+    }
+
+    return true;
+}
+
+static void nvme_ioq_aio_context_cleanup(NvmeCtrl *n)
+{
+    if (n->iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(n->iothread_vq_mapping_list);
+    }
+
+    if (n->iothread) {
+        object_unref(OBJECT(n->iothread));
+    }
+
+    g_free(n->ioq_aio_context);
+    n->ioq_aio_context = NULL;
+}
+
 static void nvme_init_state(NvmeCtrl *n)
 {
     NvmePriCtrlCap *cap = &n->pri_ctrl_cap;
@@ -8364,14 +8827,18 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         return;
     }
 
+    if (!nvme_ioq_aio_context_init(n, errp)) {
+        return;
+    }
+
     qbus_init(&n->bus, sizeof(NvmeBus), TYPE_NVME_BUS, dev, dev->id);
 
     if (nvme_init_subsys(n, errp)) {
-        return;
+        goto err_aio_context;
     }
     nvme_init_state(n);
     if (!nvme_init_pci(n, pci_dev, errp)) {
-        return;
+        goto err_aio_context;
     }
     nvme_init_ctrl(n, pci_dev);
 
@@ -8381,11 +8848,16 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         ns->params.nsid = 1;
 
         if (nvme_ns_setup(ns, errp)) {
-            return;
+            goto err_aio_context;
         }
 
         nvme_attach_ns(n, ns);
     }
+    return;
+
+err_aio_context:
+    /* Drops the IOThread references taken above */
+    nvme_ioq_aio_context_cleanup(n);
 }
 
 static void nvme_exit(PCIDevice *pci_dev)
@@ -8410,6 +8882,7 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->cq);
     g_free(n->sq);
     g_free(n->aer_reqs);
+    nvme_ioq_aio_context_cleanup(n);
 
     if (n->params.cmb_size_mb) {
         g_free(n->cmb.buf);
@@ -8445,6 +8918,7 @@ static Property nvme_props[] = {
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
     DEFINE_PROP_BOOL("legacy-cmb", NvmeCtrl, params.legacy_cmb, false),
     DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
+    DEFINE_PROP_BOOL("dbbuf-poll", NvmeCtrl, params.dbbuf_poll, false),
     DEFINE_PROP_UINT8("zoned.zasl", NvmeCtrl, params.zasl, 0),
     DEFINE_PROP_BOOL("zoned.auto_transition", NvmeCtrl,
                      params.auto_transition_zones, true),
@@ -8459,6 +8933,10 @@ static Property nvme_props[] = {
                       params.sriov_max_vq_per_vf, 0),
     DEFINE_PROP_BOOL("msix-exclusive-bar", NvmeCtrl, params.msix_exclusive_bar,
                      false),
+    DEFINE_PROP_LINK("iothread", NvmeCtrl, iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", NvmeCtrl,
+                                         iothread_vq_mapping_list),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -8471,6 +8949,14 @@ static void nvme_get_smart_warning(Object *obj, Visitor *v, const char *name,
     visit_type_uint8(v, name, &value, errp);
 }
 
+static void nvme_get_stat(Object *obj, Visitor *v, const char *name,
+                          void *opaque, Error **errp)
+{
+    uint64_t value = stat64_get(opaque);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void nvme_set_smart_warning(Object *obj, Visitor *v, const char *name,
                                    void *opaque, Error **errp)
 {
@@ -8569,6 +9055,21 @@ static void nvme_instance_init(Object *obj)
     object_property_add(obj, "smart_critical_warning", "uint8",
                         nvme_get_smart_warning,
                         nvme_set_smart_warning, NULL, NULL);
+
+    object_property_add(obj, "stats.mmio-doorbells", "uint64",
+                        nvme_get_stat, NULL, NULL, &n->stats.mmio_doorbells);
+    object_property_add(obj, "stats.ioeventfd-doorbells", "uint64",
+                        nvme_get_stat, NULL, NULL,
+                        &n->stats.ioeventfd_doorbells);
+    object_property_add(obj, "stats.polled-doorbells", "uint64",
+                        nvme_get_stat, NULL, NULL,
+                        &n->stats.polled_doorbells);
+    object_property_add(obj, "stats.completions", "uint64",
+                        nvme_get_stat, NULL, NULL, &n->stats.completions);
+    object_property_add(obj, "stats.latency-ns", "uint64",
+                        nvme_get_stat, NULL, NULL, &n->stats.latency_ns);
+    object_property_add(obj, "stats.max-latency-ns", "uint64",
+                        nvme_get_stat, NULL, NULL, &n->stats.max_latency_ns);
 }
 
 static const TypeInfo nvme_info = {
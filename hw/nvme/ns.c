@@ -712,6 +712,40 @@ static void nvme_ns_unrealize(DeviceState *dev)
     nvme_ns_cleanup(ns);
 }
 
+/*
+ * Zone state is not thread safe, so zoned namespaces cannot be attached to
+ * controllers that process I/O queues in IOThreads.
+ */
+static bool nvme_ns_check_iothreads(NvmeNamespace *ns, NvmeCtrl *n,
+                                    Error **errp)
+{
+    NvmeSubsystem *subsys = ns->subsys;
+    bool iothreads = nvme_ctrl_uses_iothreads(n);
+    int i;
+
+    if (!ns->params.zoned || ns->params.detached) {
+        return true;
+    }
+
+    if (subsys && ns->params.shared) {
+        for (i = 0; i < ARRAY_SIZE(subsys->ctrls); i++) {
+            NvmeCtrl *ctrl = subsys->ctrls[i];
+
+            if (ctrl && ctrl != SUBSYS_SLOT_RSVD) {
+                iothreads |= nvme_ctrl_uses_iothreads(ctrl);
+            }
+        }
+    }
+
+    if (iothreads) {
+        error_setg(errp, "zoned namespaces are not supported by controllers "
+                   "with iothread");
+        return false;
+    }
+
+    return true;
+}
+
 static void nvme_ns_realize(DeviceState *dev, Error **errp)
 {
     NvmeNamespace *ns = NVME_NS(dev);
@@ -745,6 +779,10 @@ static void nvme_ns_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (!nvme_ns_check_iothreads(ns, n, errp)) {
+        return;
+    }
+
     if (!nsid) {
         for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
             if (nvme_ns(n, i) || nvme_subsys_ns(subsys, i)) {
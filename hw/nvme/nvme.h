@@ -19,8 +19,10 @@
 #define HW_NVME_NVME_H
 
 #include "qemu/uuid.h"
+#include "qemu/stats64.h"
 #include "hw/pci/pci_device.h"
 #include "hw/block/block.h"
+#include "sysemu/iothread.h"
 
 #include "block/nvme.h"
 
@@ -421,6 +423,7 @@ typedef struct NvmeRequest {
     NvmeCmd                 cmd;
     BlockAcctCookie         acct;
     NvmeSg                  sg;
+    int64_t                 fetch_ns;
     QTAILQ_ENTRY(NvmeRequest)entry;
 } NvmeRequest;
 
@@ -484,9 +487,11 @@ typedef struct NvmeSQueue {
     uint64_t    dma_addr;
     uint64_t    db_addr;
     uint64_t    ei_addr;
+    AioContext  *ctx;
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    bool        poll_started;
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
@@ -505,9 +510,20 @@ typedef struct NvmeCQueue {
     uint64_t    dma_addr;
     uint64_t    db_addr;
     uint64_t    ei_addr;
+    AioContext  *ctx;
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    bool        poll_started;
+
+    /*
+     * The interrupt of a CQ that runs in an IOThread is raised and lowered
+     * by irq_bh in the main loop.  irq_notify is set when entries have been
+     * posted, irq_pending is only accessed in the main loop.
+     */
+    QEMUBH      *irq_bh;
+    bool        irq_notify;
+    bool        irq_pending;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -531,6 +547,7 @@ typedef struct NvmeParams {
     bool     auto_transition_zones;
     bool     legacy_cmb;
     bool     ioeventfd;
+    bool     dbbuf_poll;
     uint8_t  sriov_max_vfs;
     uint16_t sriov_vq_flexible;
     uint16_t sriov_vi_flexible;
@@ -547,6 +564,9 @@ typedef struct NvmeCtrl {
     NvmeParams   params;
     NvmeBus      bus;
 
+    IOThread                    *iothread;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
+
     uint16_t    cntlid;
     bool        qs_created;
     uint32_t    page_size;
@@ -567,6 +587,16 @@ typedef struct NvmeCtrl {
     uint64_t    dbbuf_eis;
     bool        dbbuf_enabled;
 
+    /* Doorbell and completion counters, exposed as "stats.*" properties */
+    struct {
+        Stat64  mmio_doorbells;
+        Stat64  ioeventfd_doorbells;
+        Stat64  polled_doorbells;
+        Stat64  completions;
+        Stat64  latency_ns;
+        Stat64  max_latency_ns;
+    } stats;
+
     struct {
         MemoryRegion mem;
         uint8_t      *buf;
@@ -597,6 +627,7 @@ typedef struct NvmeCtrl {
     NvmeNamespace   *namespaces[NVME_MAX_NAMESPACES + 1];
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
+    AioContext      **ioq_aio_context;  /* indexed by CQ identifier */
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
     NvmeIdCtrl      id_ctrl;
@@ -633,6 +664,11 @@ static inline NvmeNamespace *nvme_ns(NvmeCtrl *n, uint32_t nsid)
     return n->namespaces[nsid];
 }
 
+static inline bool nvme_ctrl_uses_iothreads(NvmeCtrl *n)
+{
+    return n->iothread || n->iothread_vq_mapping_list;
+}
+
 static inline NvmeCQueue *nvme_cq(NvmeRequest *req)
 {
     NvmeSQueue *sq = req->sq;
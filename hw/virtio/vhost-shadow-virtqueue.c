@@ -15,7 +15,16 @@
 #include "qemu/main-loop.h"
 #include "qemu/log.h"
 #include "qemu/memalign.h"
+#include "qemu/timer.h"
+#include "block/aio-wait.h"
 #include "linux-headers/linux/vhost.h"
+#include "trace.h"
+
+/*
+ * Maximum number of guest buffers made available to the device before it is
+ * notified while draining the guest's avail ring.
+ */
+#define SVQ_KICK_BATCH 32
 
 /**
  * Validate the transport device features that both guests can use with the SVQ
@@ -217,10 +226,21 @@ static bool vhost_svq_add_split(VhostShadowVirtqueue *svq,
     return true;
 }
 
+/**
+ * Notify the device about the buffers made available since the last call.
+ *
+ * @svq: The svq
+ */
 static void vhost_svq_kick(VhostShadowVirtqueue *svq)
 {
+    uint16_t old_avail_idx = svq->kicked_avail_idx;
     bool needs_kick;
 
+    if (old_avail_idx == svq->shadow_avail_idx) {
+        return;
+    }
+    svq->kicked_avail_idx = svq->shadow_avail_idx;
+
     /*
      * We need to expose the available array entries before checking the used
      * flags
@@ -229,7 +249,8 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
 
     if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t avail_event = *(uint16_t *)(&svq->vring.used->ring[svq->vring.num]);
-        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, svq->shadow_avail_idx - 1);
+        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx,
+                                      old_avail_idx);
     } else {
         needs_kick = !(svq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
     }
@@ -238,17 +259,19 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
         return;
     }
 
+    stat64_add(&svq->stats.device_kicks, 1);
     event_notifier_set(&svq->hdev_kick);
 }
 
-/**
- * Add an element to a SVQ.
+/*
+ * Add an element to a SVQ without notifying the device.
  *
  * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
  */
-int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
-                  size_t out_num, const struct iovec *in_sg, size_t in_num,
-                  VirtQueueElement *elem)
+static int vhost_svq_add_no_kick(VhostShadowVirtqueue *svq,
+                                 const struct iovec *out_sg, size_t out_num,
+                                 const struct iovec *in_sg, size_t in_num,
+                                 VirtQueueElement *elem)
 {
     unsigned qemu_head;
     unsigned ndescs = in_num + out_num;
@@ -266,16 +289,36 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
     svq->num_free -= ndescs;
     svq->desc_state[qemu_head].elem = elem;
     svq->desc_state[qemu_head].ndescs = ndescs;
-    vhost_svq_kick(svq);
+    stat64_add(&svq->stats.avail_elems, 1);
     return 0;
 }
 
-/* Convenience wrapper to add a guest's element to SVQ */
+/**
+ * Add an element to a SVQ.
+ *
+ * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+ */
+int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
+                  size_t out_num, const struct iovec *in_sg, size_t in_num,
+                  VirtQueueElement *elem)
+{
+    int r = vhost_svq_add_no_kick(svq, out_sg, out_num, in_sg, in_num, elem);
+
+    if (r == 0) {
+        vhost_svq_kick(svq);
+    }
+    return r;
+}
+
+/*
+ * Convenience wrapper to add a guest's element to SVQ.  The device is
+ * notified by the caller once per batch.
+ */
 static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
                                  VirtQueueElement *elem)
 {
-    return vhost_svq_add(svq, elem->out_sg, elem->out_num, elem->in_sg,
-                         elem->in_num, elem);
+    return vhost_svq_add_no_kick(svq, elem->out_sg, elem->out_num,
+                                 elem->in_sg, elem->in_num, elem);
 }
 
 /**
@@ -290,6 +333,9 @@ static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
  *
  * If that happens, guest's kick notifications will be disabled until the
  * device uses some buffers.
+ *
+ * Buffers forwarded without the help of the owner's avail_handler are exposed
+ * to the device in batches of up to SVQ_KICK_BATCH before it is notified.
  */
 static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
 {
@@ -336,16 +382,37 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
                 }
 
                 /* VQ is full or broken, just return and ignore kicks */
+                vhost_svq_kick(svq);
                 return;
             }
             /* elem belongs to SVQ or external caller now */
             elem = NULL;
+
+            if ((uint16_t)(svq->shadow_avail_idx - svq->kicked_avail_idx) >=
+                SVQ_KICK_BATCH) {
+                vhost_svq_kick(svq);
+            }
         }
 
+        vhost_svq_kick(svq);
         virtio_queue_set_notification(svq->vq, true);
     } while (!virtio_queue_empty(svq->vq));
 }
 
+/*
+ * Account for a handler invocation that started at @start_ns.  The relay
+ * latency is the time spent moving buffers between the guest and the device.
+ */
+static void vhost_svq_account_relay(VhostShadowVirtqueue *svq,
+                                    int64_t start_ns)
+{
+    int64_t ns = get_clock() - start_ns;
+
+    stat64_add(&svq->stats.relay_runs, 1);
+    stat64_add(&svq->stats.relay_ns, ns);
+    stat64_max(&svq->stats.relay_ns_max, ns);
+}
+
 /**
  * Handle guest's kick.
  *
@@ -354,8 +421,11 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
 static void vhost_handle_guest_kick_notifier(EventNotifier *n)
 {
     VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue, svq_kick);
+    int64_t start_ns = get_clock();
+
     event_notifier_test_and_clear(n);
     vhost_handle_guest_kick(svq);
+    vhost_svq_account_relay(svq, start_ns);
 }
 
 static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
@@ -477,6 +547,9 @@ static void vhost_svq_flush(VhostShadowVirtqueue *svq,
 {
     VirtQueue *vq = svq->vq;
 
+    /* virtqueue_flush() needs it when not called from the main loop */
+    RCU_READ_LOCK_GUARD();
+
     /* Forward as many used buffers as possible. */
     do {
         unsigned i = 0;
@@ -501,6 +574,7 @@ static void vhost_svq_flush(VhostShadowVirtqueue *svq,
         }
 
         virtqueue_flush(vq, i);
+        stat64_add(&svq->stats.used_elems, i);
         event_notifier_set(&svq->svq_call);
 
         if (check_for_avail_queue && svq->next_guest_avail_elem) {
@@ -560,8 +634,102 @@ static void vhost_svq_handle_call(EventNotifier *n)
 {
     VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
                                              hdev_call);
+    int64_t start_ns = get_clock();
+
     event_notifier_test_and_clear(n);
     vhost_svq_flush(svq, true);
+    vhost_svq_account_relay(svq, start_ns);
+}
+
+/*
+ * Busy-poll callbacks for the device used ring, only used when the SVQ runs
+ * in an IOThread with polling enabled.  Device calls are suppressed while the
+ * IOThread polls.
+ */
+static void vhost_svq_call_poll_begin(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+
+    vhost_svq_disable_notification(svq);
+}
+
+static bool vhost_svq_call_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+
+    return vhost_svq_more_used(svq);
+}
+
+static void vhost_svq_call_poll_ready(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+    int64_t start_ns = get_clock();
+
+    vhost_svq_flush(svq, true);
+    vhost_svq_account_relay(svq, start_ns);
+}
+
+static void vhost_svq_call_poll_end(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+
+    /* Caller polls once more after this to catch buffers that race with us */
+    vhost_svq_enable_notification(svq);
+}
+
+/*
+ * Attach the guest kick and device call notifiers to the SVQ AioContext.
+ *
+ * Called on BQL context with the SVQ started.
+ */
+static void vhost_svq_attach_ctx(VhostShadowVirtqueue *svq)
+{
+    if (event_notifier_get_fd(&svq->svq_kick) != VHOST_FILE_UNBIND) {
+        aio_set_event_notifier(svq->ctx, &svq->svq_kick,
+                               vhost_handle_guest_kick_notifier, NULL, NULL);
+        event_notifier_set(&svq->svq_kick);
+    }
+
+    if (svq->poll) {
+        aio_set_event_notifier(svq->ctx, &svq->hdev_call,
+                               vhost_svq_handle_call, vhost_svq_call_poll,
+                               vhost_svq_call_poll_ready);
+        aio_set_event_notifier_poll(svq->ctx, &svq->hdev_call,
+                                    vhost_svq_call_poll_begin,
+                                    vhost_svq_call_poll_end);
+    } else {
+        aio_set_event_notifier(svq->ctx, &svq->hdev_call,
+                               vhost_svq_handle_call, NULL, NULL);
+    }
+    /* Forward whatever the device used while we were detached */
+    event_notifier_set(&svq->hdev_call);
+    svq->ctx_attached = true;
+}
+
+static void vhost_svq_detach_ctx_bh(void *opaque)
+{
+    VhostShadowVirtqueue *svq = opaque;
+
+    if (event_notifier_get_fd(&svq->svq_kick) != VHOST_FILE_UNBIND) {
+        aio_set_event_notifier(svq->ctx, &svq->svq_kick, NULL, NULL, NULL);
+    }
+    aio_set_event_notifier(svq->ctx, &svq->hdev_call, NULL, NULL, NULL);
+}
+
+/*
+ * Detach the notifiers from the SVQ AioContext.  This runs in the AioContext
+ * so no relay handler is in flight when it returns, and the caller can access
+ * the SVQ from the BQL context.
+ */
+static void vhost_svq_detach_ctx(VhostShadowVirtqueue *svq)
+{
+    aio_wait_bh_oneshot(svq->ctx, vhost_svq_detach_ctx_bh, svq);
+    svq->ctx_attached = false;
 }
 
 /**
@@ -574,6 +742,12 @@ static void vhost_svq_handle_call(EventNotifier *n)
  */
 void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd)
 {
+    bool attached = svq->ctx_attached;
+
+    if (attached) {
+        vhost_svq_detach_ctx(svq);
+    }
+
     if (call_fd == VHOST_FILE_UNBIND) {
         /*
          * Fail event_notifier_set if called handling device call.
@@ -585,6 +759,10 @@ void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd)
     } else {
         event_notifier_init_fd(&svq->svq_call, call_fd);
     }
+
+    if (attached) {
+        vhost_svq_attach_ctx(svq);
+    }
 }
 
 /**
@@ -630,6 +808,23 @@ void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd)
     bool poll_stop = VHOST_FILE_UNBIND != event_notifier_get_fd(svq_kick);
     bool poll_start = svq_kick_fd != VHOST_FILE_UNBIND;
 
+    if (svq->ctx) {
+        /*
+         * The handler is attached by vhost_svq_start(), since the IOThread
+         * could otherwise run it before the shadow vring exists.
+         */
+        bool attached = svq->ctx_attached;
+
+        if (attached) {
+            vhost_svq_detach_ctx(svq);
+        }
+        event_notifier_init_fd(svq_kick, svq_kick_fd);
+        if (attached) {
+            vhost_svq_attach_ctx(svq);
+        }
+        return;
+    }
+
     if (poll_stop) {
         event_notifier_set_handler(svq_kick, NULL);
     }
@@ -646,6 +841,23 @@ void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd)
     }
 }
 
+/**
+ * Set the AioContext that relays the SVQ notifications.
+ *
+ * @svq: Shadow Virtqueue
+ * @ctx: IOThread AioContext, or NULL for the main loop
+ * @poll: Busy-poll the device used ring from @ctx
+ *
+ * Must be called while the SVQ is stopped.
+ */
+void vhost_svq_set_aio_context(VhostShadowVirtqueue *svq, AioContext *ctx,
+                               bool poll)
+{
+    assert(!svq->vq);
+    svq->ctx = ctx;
+    svq->poll = ctx && poll;
+}
+
 /**
  * Start the shadow virtqueue operation.
  *
@@ -659,9 +871,12 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
 {
     size_t desc_size;
 
-    event_notifier_set_handler(&svq->hdev_call, vhost_svq_handle_call);
+    if (!svq->ctx) {
+        event_notifier_set_handler(&svq->hdev_call, vhost_svq_handle_call);
+    }
     svq->next_guest_avail_elem = NULL;
     svq->shadow_avail_idx = 0;
+    svq->kicked_avail_idx = 0;
     svq->shadow_used_idx = 0;
     svq->last_used_idx = 0;
     svq->vdev = vdev;
@@ -683,6 +898,10 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
     for (unsigned i = 0; i < svq->vring.num - 1; i++) {
         svq->desc_next[i] = cpu_to_le16(i + 1);
     }
+
+    if (svq->ctx) {
+        vhost_svq_attach_ctx(svq);
+    }
 }
 
 /**
@@ -691,9 +910,13 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
  */
 void vhost_svq_stop(VhostShadowVirtqueue *svq)
 {
-    vhost_svq_set_svq_kick_fd(svq, VHOST_FILE_UNBIND);
     g_autofree VirtQueueElement *next_avail_elem = NULL;
 
+    if (svq->ctx_attached) {
+        vhost_svq_detach_ctx(svq);
+    }
+    vhost_svq_set_svq_kick_fd(svq, VHOST_FILE_UNBIND);
+
     if (!svq->vq) {
         return;
     }
@@ -722,7 +945,16 @@ void vhost_svq_stop(VhostShadowVirtqueue *svq)
     g_free(svq->desc_state);
     munmap(svq->vring.desc, vhost_svq_driver_area_size(svq));
     munmap(svq->vring.used, vhost_svq_device_area_size(svq));
-    event_notifier_set_handler(&svq->hdev_call, NULL);
+    if (!svq->ctx) {
+        event_notifier_set_handler(&svq->hdev_call, NULL);
+    }
+
+    trace_vhost_svq_stats(svq, stat64_get(&svq->stats.avail_elems),
+                          stat64_get(&svq->stats.used_elems),
+                          stat64_get(&svq->stats.device_kicks),
+                          stat64_get(&svq->stats.relay_runs),
+                          stat64_get(&svq->stats.relay_ns),
+                          stat64_get(&svq->stats.relay_ns_max));
 }
 
 /**
@@ -11,6 +11,8 @@
 #define VHOST_SHADOW_VIRTQUEUE_H
 
 #include "qemu/event_notifier.h"
+#include "qemu/stats64.h"
+#include "block/aio.h"
 #include "hw/virtio/virtio.h"
 #include "standard-headers/linux/vhost_types.h"
 #include "hw/virtio/vhost-iova-tree.h"
@@ -46,6 +48,20 @@ typedef struct VhostShadowVirtqueueOps {
     VirtQueueAvailCallback avail_handler;
 } VhostShadowVirtqueueOps;
 
+/* Relay counters, updated from the context the SVQ runs in */
+typedef struct VhostShadowVirtqueueStats {
+    /* Guest buffers made available to the device */
+    Stat64 avail_elems;
+    /* Device buffers returned to the guest */
+    Stat64 used_elems;
+    /* Notifications sent to the device */
+    Stat64 device_kicks;
+    /* Handler invocations and the time they spent relaying buffers */
+    Stat64 relay_runs;
+    Stat64 relay_ns;
+    Stat64 relay_ns_max;
+} VhostShadowVirtqueueStats;
+
 /* Shadow virtqueue to relay notifications */
 typedef struct VhostShadowVirtqueue {
     /* Shadow vring */
@@ -110,6 +126,24 @@ typedef struct VhostShadowVirtqueue {
 
     /* Size of SVQ vring free descriptors */
     uint16_t num_free;
+
+    /* Avail index the device was last notified about */
+    uint16_t kicked_avail_idx;
+
+    /*
+     * AioContext (IOThread) that relays the notifications, or NULL to use the
+     * main loop.  The control virtqueue must stay in the main loop, since it
+     * is polled synchronously with the BQL held.
+     */
+    AioContext *ctx;
+
+    /* Busy-poll the device used ring from @ctx before sleeping */
+    bool poll;
+
+    /* The notifiers are attached to @ctx */
+    bool ctx_attached;
+
+    VhostShadowVirtqueueStats stats;
 } VhostShadowVirtqueue;
 
 bool vhost_svq_valid_features(uint64_t features, Error **errp);
@@ -129,6 +163,8 @@ void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
 size_t vhost_svq_driver_area_size(const VhostShadowVirtqueue *svq);
 size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq);
 
+void vhost_svq_set_aio_context(VhostShadowVirtqueue *svq, AioContext *ctx,
+                               bool poll);
 void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
                      VirtQueue *vq, VhostIOVATree *iova_tree);
 void vhost_svq_stop(VhostShadowVirtqueue *svq);
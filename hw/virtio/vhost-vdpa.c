@@ -587,6 +587,7 @@ static void vhost_vdpa_init_svq(struct vhost_dev *hdev, struct vhost_vdpa *v)
         VhostShadowVirtqueue *svq;
 
         svq = vhost_svq_new(v->shadow_vq_ops, v->shadow_vq_ops_opaque);
+        vhost_svq_set_aio_context(svq, v->svq_ctx, v->svq_poll);
         g_ptr_array_add(shadow_vqs, svq);
     }
 
@@ -751,7 +752,7 @@ static void vhost_vdpa_svq_cleanup(struct vhost_dev *dev)
     for (idx = 0; idx < v->shadow_vqs->len; ++idx) {
         vhost_svq_stop(g_ptr_array_index(v->shadow_vqs, idx));
     }
-    g_ptr_array_free(v->shadow_vqs, true);
+    g_clear_pointer(&v->shadow_vqs, g_ptr_array_unref);
 }
 
 static int vhost_vdpa_cleanup(struct vhost_dev *dev)
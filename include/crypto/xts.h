@@ -26,6 +26,7 @@
 #ifndef QCRYPTO_XTS_H
 #define QCRYPTO_XTS_H
 
+#include "crypto/aes.h"
 
 #define XTS_BLOCK_SIZE 16
 
@@ -78,5 +79,48 @@ void xts_encrypt(const void *datactx,
                  uint8_t *dst,
                  const uint8_t *src);
 
+/**
+ * xts_aes_decrypt:
+ * @datakey: the AES key for data decryption
+ * @tweakenc: the AES key for tweak encryption
+ * @tweakdec: the AES key for tweak decryption
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @length: the length of @dst and @src
+ * @dst: buffer to hold the decrypted plaintext
+ * @src: buffer providing the ciphertext
+ *
+ * Decrypts @src into @dst, like xts_decrypt() with the AES
+ * cipher, using the AES instructions of the host if it has them.
+ */
+void xts_aes_decrypt(const AES_KEY *datakey,
+                     const AES_KEY *tweakenc,
+                     const AES_KEY *tweakdec,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src);
+
+/**
+ * xts_aes_encrypt:
+ * @datakey: the AES key for data encryption
+ * @tweakenc: the AES key for tweak encryption
+ * @tweakdec: the AES key for tweak decryption
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @length: the length of @dst and @src
+ * @dst: buffer to hold the encrypted ciphertext
+ * @src: buffer providing the plaintext
+ *
+ * Encrypts @src into @dst, like xts_encrypt() with the AES
+ * cipher, using the AES instructions of the host if it has them.
+ */
+void xts_aes_encrypt(const AES_KEY *datakey,
+                     const AES_KEY *tweakenc,
+                     const AES_KEY *tweakdec,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src);
+
+bool test_xts_aes_next_accel(void);
 
 #endif /* QCRYPTO_XTS_H */
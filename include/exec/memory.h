@@ -788,6 +788,9 @@ struct MemoryRegion {
     uint8_t vga_logging_count;
     MemoryRegion *alias;
     hwaddr alias_offset;
+    /* Aliases pointing at this region, for incremental FlatView updates */
+    QLIST_HEAD(, MemoryRegion) aliased_by;
+    QLIST_ENTRY(MemoryRegion) aliased_by_link;
     int32_t priority;
     QTAILQ_HEAD(, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
@@ -2531,6 +2534,23 @@ void memory_region_transaction_begin(void);
  */
 void memory_region_transaction_commit(void);
 
+/**
+ * memory_region_set_incremental_update: Enable or disable incremental
+ *                                       FlatView updates
+ *
+ * When disabled, every transaction commit regenerates all FlatViews from
+ * scratch.  This is meant for debugging and testing the incremental path.
+ *
+ * @enable: whether to only re-render the ranges touched by a transaction
+ */
+void memory_region_set_incremental_update(bool enable);
+
+/**
+ * memory_region_get_incremental_update: Return whether incremental
+ *                                       FlatView updates are enabled
+ */
+bool memory_region_get_incremental_update(void);
+
 /**
  * memory_listener_register: register callbacks to be called when memory
  *                           sections are mapped or unmapped into an address
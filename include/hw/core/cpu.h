@@ -443,6 +443,8 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @tcg_dirty_ring: Per-vCPU dirty page ring when the TCG dirty ring is
+ *    enabled.
  *
  * @neg_align: The CPUState is the common part of a concrete ArchCPU
  * which is allocated when an individual CPU instance is created. As
@@ -530,6 +532,9 @@ struct CPUState {
     int kvm_vcpu_stats_fd;
     bool vcpu_dirty;
 
+    /* Only used in TCG */
+    struct TCGDirtyRing *tcg_dirty_ring;
+
     /* Use by accel-block: CPU is executing an ioctl() */
     QemuLockCnt in_ioctl_lock;
 
@@ -34,6 +34,9 @@ struct SCSIRequest {
     SCSICommand       cmd;
     NotifierList      cancel_notifiers;
 
+    /* The AioContext that submits and completes the request */
+    AioContext        *ctx;
+
     /* Note:
      * - fields before sense are initialized by scsi_req_alloc;
      * - sense[] is uninitialized;
@@ -77,9 +80,11 @@ struct SCSIDevice
     uint32_t sense_len;
 
     /*
-     * The requests list is only accessed from the AioContext that executes
-     * requests or from the main loop when IOThread processing is stopped.
+     * The HBA can submit requests from several AioContexts at once.  Each
+     * request is only touched by its own AioContext, but the list that links
+     * them is shared and protected by requests_lock.
      */
+    QemuMutex requests_lock;
     QTAILQ_HEAD(, SCSIRequest) requests;
 
     uint32_t channel;
@@ -69,6 +69,10 @@ typedef struct vhost_vdpa {
     GPtrArray *shadow_vqs;
     const VhostShadowVirtqueueOps *shadow_vq_ops;
     void *shadow_vq_ops_opaque;
+    /* AioContext relaying the shadow virtqueues, NULL for the main loop */
+    AioContext *svq_ctx;
+    /* Busy-poll the shadow virtqueues' used rings from svq_ctx */
+    bool svq_poll;
     struct vhost_dev *dev;
     Error *migration_blocker;
     VhostVDPAHostNotifier notifier[VIRTIO_QUEUE_MAX];
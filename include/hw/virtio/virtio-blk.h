@@ -21,6 +21,7 @@
 #include "sysemu/block-backend.h"
 #include "sysemu/block-ram-registrar.h"
 #include "qom/object.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-types-virtio.h"
 
 #define TYPE_VIRTIO_BLK "virtio-blk-device"
@@ -48,9 +49,44 @@ struct VirtIOBlkConf
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
     bool x_enable_wce_if_config_wce;
+    bool coalesce;
+    uint32_t coalesce_max_batch;
+    uint32_t coalesce_max_usecs;
 };
 
 struct VirtIOBlockReq;
+
+/*
+ * Per-virtqueue completion coalescing state.  Only accessed from the
+ * virtqueue's AioContext.
+ */
+typedef struct VirtIOBlkCoalesce {
+    struct VirtIOBlock *s;
+    VirtQueue *vq;
+    AioContext *ctx;
+    QEMUBH *bh;
+    QEMUTimer *timer;
+
+    /* Completions pushed to the used ring but not notified yet */
+    unsigned pending;
+    int64_t first_pending_ns;
+
+    /* Notify as soon as this many completions are pending */
+    unsigned batch;
+
+    /* Completion rate measurement used to tune @batch */
+    int64_t window_start_ns;
+    uint64_t window_completions;
+} VirtIOBlkCoalesce;
+
+typedef struct VirtIOBlkCoalesceStats {
+    Stat64 completions;
+    Stat64 notifications;
+    Stat64 batch_flushes;
+    Stat64 iteration_flushes;
+    Stat64 timer_flushes;
+} VirtIOBlkCoalesceStats;
+
 struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
@@ -71,6 +107,10 @@ struct VirtIOBlock {
      */
     AioContext **vq_aio_context;
 
+    /* One per virtqueue, NULL unless the coalesce property is set */
+    VirtIOBlkCoalesce *coalesce;
+    VirtIOBlkCoalesceStats coalesce_stats;
+
     uint64_t host_features;
     size_t config_size;
     BlockRAMRegistrar blk_ram_registrar;
@@ -32,6 +32,8 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* Queue a reference to the sender's buffers, see net/queue.c */
+#define QEMU_NET_PACKET_FLAG_NOCOPY  (1<<1)
 
 /* Returns:
  *   >0 - success
@@ -220,6 +220,16 @@ static inline bool buffer_is_zero(const void *buf, size_t len)
 #define buffer_is_zero  buffer_is_zero_ool
 #endif
 
+/*
+ * Compare @len bytes of @dst and @src in blocks of @block bytes, the last of
+ * which may be shorter; multiples of 16 are faster.  Blocks that differ are
+ * copied from @src to @dst and their bit is set in @changed, the bits of the
+ * others are left alone.  Returns the number of blocks copied.
+ */
+size_t buffer_diff_copy(void *dst, const void *src, size_t len,
+                        size_t block, unsigned long *changed);
+bool test_buffer_diff_copy_next_accel(void);
+
 /*
  * Implementation of ULEB128 (http://en.wikipedia.org/wiki/LEB128)
  * Input is limited to 14-bit numbers
@@ -17,6 +17,7 @@
 #include "block/aio.h"
 #include "qemu/thread.h"
 #include "qom/object.h"
+#include "qapi/qapi-types-virtio.h"
 #include "sysemu/event-loop-base.h"
 
 #define TYPE_IOTHREAD "iothread"
@@ -64,4 +65,30 @@ void iothread_destroy(IOThread *iothread);
  */
 bool qemu_in_iothread(void);
 
+/**
+ * iothread_vq_mapping_apply:
+ * @list: The mapping of queues to IOThreads.
+ * @vq_aio_context: The array of AioContext pointers to fill in.
+ * @num_queues: The length of @vq_aio_context.
+ * @errp: If an error occurs, a pointer to the area to store the error.
+ *
+ * Fill in the AioContext for each queue in the @vq_aio_context array given
+ * the iothread-vq-mapping parameter in @list.  The IOThreads are referenced
+ * until iothread_vq_mapping_cleanup() is called.
+ *
+ * Returns: %true on success, %false on failure.
+ **/
+bool iothread_vq_mapping_apply(IOThreadVirtQueueMappingList *list,
+                               AioContext **vq_aio_context,
+                               uint16_t num_queues,
+                               Error **errp);
+
+/**
+ * iothread_vq_mapping_cleanup:
+ * @list: The mapping of queues to IOThreads.
+ *
+ * Drop the IOThread references taken by iothread_vq_mapping_apply().
+ **/
+void iothread_vq_mapping_cleanup(IOThreadVirtQueueMappingList *list);
+
 #endif /* IOTHREAD_H */
@@ -12,9 +12,12 @@
 
 #ifdef CONFIG_TCG
 extern bool tcg_allowed;
+extern uint32_t tcg_dirty_ring_size;
 #define tcg_enabled() (tcg_allowed)
+#define tcg_dirty_ring_enabled() (tcg_enabled() && tcg_dirty_ring_size)
 #else
 #define tcg_enabled() 0
+#define tcg_dirty_ring_enabled() 0
 #endif
 
 #endif
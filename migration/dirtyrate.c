@@ -26,6 +26,7 @@
 #include "monitor/monitor.h"
 #include "qapi/qmp/qdict.h"
 #include "sysemu/kvm.h"
+#include "sysemu/tcg.h"
 #include "sysemu/runstate.h"
 #include "exec/memory.h"
 #include "qemu/xxhash.h"
@@ -804,11 +805,12 @@ void qmp_calc_dirty_rate(int64_t calc_time,
     }
 
     /*
-     * dirty ring mode only works when kvm dirty ring is enabled.
-     * on the contrary, dirty bitmap mode is not.
+     * dirty ring mode only works when kvm or tcg dirty ring is enabled.
+     * on the contrary, dirty bitmap mode is not available with kvm dirty
+     * ring.
      */
     if (((mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) &&
-        !kvm_dirty_ring_enabled()) ||
+        !kvm_dirty_ring_enabled() && !tcg_dirty_ring_enabled()) ||
         ((mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) &&
          kvm_dirty_ring_enabled())) {
         error_setg(errp, "mode %s is not enabled, use other method instead.",
@@ -16,27 +16,77 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "net/checksum.h"
 #include "net/eth.h"
+#include "host/cpuinfo.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The accelerated kernels return the one's complement sum of the
+ * big-endian 16-bit words of a buffer that starts at an even offset,
+ * folded to 16 bits.  Folding keeps the value congruent modulo 0xffff and
+ * only yields zero for a buffer of zeroes, so callers can keep adding the
+ * partial sums and pass them to net_checksum_finish().
+ */
+typedef uint32_t (*csum_accel_fn)(const uint8_t *, size_t);
+
+static inline uint32_t net_checksum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static uint32_t net_checksum_int(const uint8_t *buf, size_t len)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    uint64_t sum = 0;
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+    /* 32-bit words are congruent to the sum of their two 16-bit halves */
+    for (; len >= 8; buf += 8, len -= 8) {
+        sum += ldl_be_p(buf);
+        sum += ldl_be_p(buf + 4);
+    }
+    for (; len >= 2; buf += 2, len -= 2) {
+        sum += lduw_be_p(buf);
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+    if (len) {
+        sum += (uint32_t)buf[0] << 8;
     }
+    return net_checksum_fold(sum);
+}
+
+#include "host/checksum.c.inc"
+
+static csum_accel_fn net_checksum_accel;
+static unsigned accel_index;
 
-    if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint32_t sum;
+
+    if (len <= 0) {
+        return 0;
     }
+
+    sum = net_checksum_accel(buf, len);
+    /* A buffer at an odd offset has its bytes in the other lanes */
+    return seq & 1 ? bswap16(sum) : sum;
+}
+
+bool test_net_checksum_next_accel(void)
+{
+    if (accel_index != 0) {
+        net_checksum_accel = accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    net_checksum_accel = accel_table[accel_index];
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -32,6 +32,7 @@
 
 #include "block/aio-wait.h"
 #include "qemu/coroutine.h"
+#include "qemu/thread.h"
 
 #define TYPE_COLO_COMPARE "colo-compare"
 typedef struct CompareState CompareState;
@@ -53,6 +54,8 @@ static NotifierList colo_compare_notifiers =
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
 
+#define COLO_COMPARE_MAX_SHARDS 64
+
 /* #define DEBUG_COLO_PACKETS */
 
 static QemuMutex colo_compare_mutex;
@@ -101,6 +104,53 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/*
+ * The connections are split in shards by the hash of their key.  With a
+ * single shard, packets are compared in the compare iothread as soon as
+ * they are read.  With more, each shard has a worker thread: the iothread
+ * only parses the packets and hands them over, the worker compares them
+ * and gives the primary packets it releases back to the iothread, which
+ * owns the chardevs.  A connection always lives in the same shard, so its
+ * packets still leave in order.
+ */
+typedef struct CompareShard {
+    struct CompareState *s;
+    unsigned index;
+    bool threaded;
+    QemuThread thread;
+
+    /* Protects the connections, out, inconsistent and the statistics */
+    QemuMutex lock;
+
+    /*
+     * Packets read by the iothread and not yet compared, element type:
+     * Packet.  Each holds at most max_queue_size packets.  Protected by
+     * in_lock, taken after lock when both are needed.
+     */
+    QemuMutex in_lock;
+    QemuCond in_cond;
+    GQueue pri_in;
+    GQueue sec_in;
+    bool stopping;
+    /* Packets dropped because an input queue was full */
+    uint64_t in_dropped;
+
+    /* Primary packets released by the worker, element type: Packet */
+    GQueue out;
+    /* The worker found a difference, the iothread asks for a checkpoint */
+    bool inconsistent;
+
+    /* Element type: Connection */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    uint64_t packets;
+    uint64_t released;
+    uint64_t miscompares;
+    uint64_t dropped;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -121,13 +171,11 @@ struct CompareState {
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    /* Record the connection that through the NIC */
+    uint32_t nr_shards;
+    CompareShard *shards;
+    /* Sends what the shard workers released */
+    QEMUBH *shard_bh;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -192,10 +240,15 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
-/* Use restricted to colo_insert_packet() */
-static gint seq_sorter(Packet *a, Packet *b, gpointer data)
+/* Called with the shard lock held */
+static void colo_shard_inconsistent(CompareShard *sh)
 {
-    return b->tcp_seq - a->tcp_seq;
+    sh->miscompares++;
+    if (sh->threaded) {
+        sh->inconsistent = true;
+    } else {
+        colo_compare_inconsistency_notify(sh->s);
+    }
 }
 
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
@@ -220,33 +273,67 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
  * Return 1 on success, if return 0 means the
  * packet will be dropped
  */
-static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
+static int colo_insert_packet(PacketRing *ring, Packet *pkt, uint32_t *max_ack)
 {
-    if (g_queue_get_length(queue) <= max_queue_size) {
+    if (ring->len <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            packet_ring_insert_sorted(ring, pkt);
         } else {
-            g_queue_push_tail(queue, pkt);
+            packet_ring_push_back(ring, pkt);
         }
         return 1;
     }
     return 0;
 }
 
+static void colo_compare_connection(void *opaque, void *user_data);
+
+/* Called with the shard lock held */
+static void colo_shard_compare(CompareShard *sh, int mode, Packet *pkt)
+{
+    ConnectionKey key;
+    Connection *conn;
+    int ret;
+
+    fill_connection_key(pkt, &key, false);
+
+    conn = connection_get(sh->connection_track_table,
+                          &key,
+                          &sh->conn_list);
+
+    if (!conn->processing) {
+        g_queue_push_tail(&sh->conn_list, conn);
+        conn->processing = true;
+    }
+
+    if (mode == PRIMARY_IN) {
+        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
+    } else {
+        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
+    }
+
+    sh->packets++;
+    if (!ret) {
+        trace_colo_compare_drop_packet(colo_mode[mode],
+            "queue size too big, drop packet");
+        packet_destroy(pkt, NULL);
+        sh->dropped++;
+    }
+
+    /* compare packet in the specified connection */
+    colo_compare_connection(conn, sh);
+}
+
 /*
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static int packet_enqueue(CompareState *s, int mode)
 {
     ConnectionKey key;
+    CompareShard *sh;
     Packet *pkt = NULL;
-    Connection *conn;
-    int ret;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf,
@@ -263,32 +350,35 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
         pkt = NULL;
         return -1;
     }
+
     fill_connection_key(pkt, &key, false);
+    sh = &s->shards[connection_key_hash(&key) % s->nr_shards];
 
-    conn = connection_get(s->connection_track_table,
-                          &key,
-                          &s->conn_list);
+    if (sh->threaded) {
+        GQueue *in = mode == PRIMARY_IN ? &sh->pri_in : &sh->sec_in;
 
-    if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
-        conn->processing = true;
-    }
+        qemu_mutex_lock(&sh->in_lock);
+        if (g_queue_get_length(in) < max_queue_size) {
+            g_queue_push_tail(in, pkt);
+            qemu_cond_signal(&sh->in_cond);
+            pkt = NULL;
+        } else {
+            sh->in_dropped++;
+        }
+        qemu_mutex_unlock(&sh->in_lock);
 
-    if (mode == PRIMARY_IN) {
-        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
+        if (pkt) {
+            /* The worker is not keeping up, like a full connection queue */
+            trace_colo_compare_drop_packet(colo_mode[mode],
+                "shard input queue too big, drop packet");
+            packet_destroy(pkt, NULL);
+        }
     } else {
-        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
+        qemu_mutex_lock(&sh->lock);
+        colo_shard_compare(sh, mode, pkt);
+        qemu_mutex_unlock(&sh->lock);
     }
 
-    if (!ret) {
-        trace_colo_compare_drop_packet(colo_mode[mode],
-            "queue size too big, drop packet");
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-    }
-
-    *con = conn;
-
     return 0;
 }
 
@@ -297,7 +387,7 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
     ret = compare_chr_send(s,
@@ -309,10 +399,31 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+/* Called from the compare iothread */
+static void colo_send_primary_queue(CompareState *s, GQueue *queue)
+{
+    Packet *pkt;
+
+    while ((pkt = g_queue_pop_head(queue))) {
+        colo_send_primary_pkt(s, pkt);
+    }
+}
+
+/* Called with the shard lock held */
+static void colo_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    trace_colo_compare_main("packet same and release packet");
+    sh->released++;
+    if (sh->threaded) {
+        g_queue_push_tail(&sh->out, pkt);
+    } else {
+        colo_send_primary_pkt(sh->s, pkt);
+    }
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -396,7 +507,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *sh, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -416,25 +527,25 @@ static void colo_compare_tcp(CompareState *s, Connection *conn)
                        conn->sack : conn->pack;
 
 pri:
-    if (g_queue_is_empty(&conn->primary_list)) {
+    if (packet_ring_empty(&conn->primary_list)) {
         return;
     }
-    ppkt = g_queue_pop_tail(&conn->primary_list);
+    ppkt = packet_ring_pop_front(&conn->primary_list);
 sec:
-    if (g_queue_is_empty(&conn->secondary_list)) {
-        g_queue_push_tail(&conn->primary_list, ppkt);
+    if (packet_ring_empty(&conn->secondary_list)) {
+        packet_ring_push_front(&conn->primary_list, ppkt);
         return;
     }
-    spkt = g_queue_pop_tail(&conn->secondary_list);
+    spkt = packet_ring_pop_front(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
@@ -456,7 +567,7 @@ sec:
             }
         }
         if (!ppkt) {
-            g_queue_push_tail(&conn->secondary_list, spkt);
+            packet_ring_push_front(&conn->secondary_list, spkt);
             goto pri;
         }
     }
@@ -474,8 +585,8 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
-            g_queue_push_tail(&conn->secondary_list, spkt);
+            colo_release_primary_pkt(sh, ppkt);
+            packet_ring_push_front(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
             conn->compare_seq = spkt->seq_end;
@@ -483,20 +594,20 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
     } else {
-        g_queue_push_tail(&conn->primary_list, ppkt);
-        g_queue_push_tail(&conn->secondary_list, spkt);
+        packet_ring_push_front(&conn->primary_list, ppkt);
+        packet_ring_push_front(&conn->secondary_list, spkt);
 
 #ifdef DEBUG_COLO_PACKETS
         qemu_hexdump(stderr, "colo-compare ppkt", ppkt->data, ppkt->size);
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_shard_inconsistent(sh);
     }
 }
 
@@ -598,16 +709,20 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
                                        ppkt->size - offset);
 }
 
-static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
+static bool colo_old_packet_check_one(PacketRing *ring, int64_t check_time)
 {
     int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    uint32_t i;
 
-    if ((now - pkt->creation_ms) > (*check_time)) {
-        trace_colo_old_packet_check_found(pkt->creation_ms);
-        return 0;
-    } else {
-        return 1;
+    for (i = 0; i < ring->len; i++) {
+        Packet *pkt = packet_ring_peek(ring, i);
+
+        if ((now - pkt->creation_ms) > check_time) {
+            trace_colo_old_packet_check_found(pkt->creation_ms);
+            return true;
+        }
     }
+    return false;
 }
 
 void colo_compare_register_notifier(Notifier *notify)
@@ -623,26 +738,12 @@ void colo_compare_unregister_notifier(Notifier *notify)
 static int colo_old_packet_check_one_conn(Connection *conn,
                                           CompareState *s)
 {
-    if (!g_queue_is_empty(&conn->primary_list)) {
-        if (g_queue_find_custom(&conn->primary_list,
-                                &s->compare_timeout,
-                                (GCompareFunc)colo_old_packet_check_one))
-            goto out;
-    }
-
-    if (!g_queue_is_empty(&conn->secondary_list)) {
-        if (g_queue_find_custom(&conn->secondary_list,
-                                &s->compare_timeout,
-                                (GCompareFunc)colo_old_packet_check_one))
-            goto out;
+    if (colo_old_packet_check_one(&conn->primary_list, s->compare_timeout) ||
+        colo_old_packet_check_one(&conn->secondary_list, s->compare_timeout)) {
+        return 0;
     }
 
     return 1;
-
-out:
-    /* Do checkpoint will flush old packet */
-    colo_compare_inconsistency_notify(s);
-    return 0;
 }
 
 /*
@@ -653,32 +754,49 @@ out:
 static void colo_old_packet_check(void *opaque)
 {
     CompareState *s = opaque;
+    bool found = false;
+    unsigned i;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
-                        (GCompareFunc)colo_old_packet_check_one_conn);
+    for (i = 0; i < s->nr_shards && !found; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        found = g_queue_find_custom(&sh->conn_list, s,
+                        (GCompareFunc)colo_old_packet_check_one_conn) != NULL;
+        qemu_mutex_unlock(&sh->lock);
+    }
+
+    if (found) {
+        /* Do checkpoint will flush old packet */
+        colo_compare_inconsistency_notify(s);
+    }
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *sh, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
     Packet *pkt = NULL;
-    GList *result = NULL;
-
-    while (!g_queue_is_empty(&conn->primary_list) &&
-           !g_queue_is_empty(&conn->secondary_list)) {
-        pkt = g_queue_pop_tail(&conn->primary_list);
-        result = g_queue_find_custom(&conn->secondary_list,
-                 pkt, (GCompareFunc)HandlePacket);
-
-        if (result) {
-            colo_release_primary_pkt(s, pkt);
-            packet_destroy(result->data, NULL);
-            g_queue_delete_link(&conn->secondary_list, result);
+    uint32_t i;
+
+    while (!packet_ring_empty(&conn->primary_list) &&
+           !packet_ring_empty(&conn->secondary_list)) {
+        pkt = packet_ring_pop_front(&conn->primary_list);
+        for (i = 0; i < conn->secondary_list.len; i++) {
+            if (!HandlePacket(packet_ring_peek(&conn->secondary_list, i),
+                              pkt)) {
+                break;
+            }
+        }
+
+        if (i < conn->secondary_list.len) {
+            colo_release_primary_pkt(sh, pkt);
+            packet_destroy(packet_ring_peek(&conn->secondary_list, i), NULL);
+            packet_ring_remove(&conn->secondary_list, i);
         } else {
             /*
              * If one packet arrive late, the secondary_list or
@@ -687,9 +805,9 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
              * timeout, it will trigger a checkpoint request.
              */
             trace_colo_compare_main("packet different");
-            g_queue_push_tail(&conn->primary_list, pkt);
+            packet_ring_push_front(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_shard_inconsistent(sh);
             break;
         }
     }
@@ -703,21 +821,21 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(sh, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(sh, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(sh, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(sh, conn, colo_packet_compare_other);
         break;
     }
 }
@@ -944,7 +1062,7 @@ static void colo_compare_timer_del(CompareState *s)
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
+static void colo_compare_flush(CompareState *s);
 
 static void colo_compare_handle_event(void *opaque)
 {
@@ -952,7 +1070,7 @@ static void colo_compare_handle_event(void *opaque)
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -989,6 +1107,150 @@ static void colo_compare_iothread(CompareState *s)
     s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
 }
 
+/*
+ * Called from the compare iothread to send the packets released by the
+ * shard workers, and to ask for the checkpoints they found necessary.
+ */
+static void colo_compare_shard_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    bool inconsistent = false;
+    unsigned i;
+
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+        GQueue out;
+
+        qemu_mutex_lock(&sh->lock);
+        out = sh->out;
+        g_queue_init(&sh->out);
+        inconsistent |= sh->inconsistent;
+        sh->inconsistent = false;
+        qemu_mutex_unlock(&sh->lock);
+
+        colo_send_primary_queue(s, &out);
+    }
+
+    if (inconsistent) {
+        colo_compare_inconsistency_notify(s);
+    }
+}
+
+static void *colo_compare_shard_thread(void *opaque)
+{
+    CompareShard *sh = opaque;
+    Packet *pkt;
+    bool kick;
+
+    for (;;) {
+        qemu_mutex_lock(&sh->in_lock);
+        while (!sh->stopping &&
+               g_queue_is_empty(&sh->pri_in) && g_queue_is_empty(&sh->sec_in)) {
+            qemu_cond_wait(&sh->in_cond, &sh->in_lock);
+        }
+        if (sh->stopping) {
+            qemu_mutex_unlock(&sh->in_lock);
+            break;
+        }
+        qemu_mutex_unlock(&sh->in_lock);
+
+        /*
+         * Take the packets with the shard lock held, so that a checkpoint
+         * either flushes them from the input queues or finds them compared.
+         */
+        qemu_mutex_lock(&sh->lock);
+        qemu_mutex_lock(&sh->in_lock);
+        while ((pkt = g_queue_pop_head(&sh->pri_in))) {
+            qemu_mutex_unlock(&sh->in_lock);
+            colo_shard_compare(sh, PRIMARY_IN, pkt);
+            qemu_mutex_lock(&sh->in_lock);
+        }
+        while ((pkt = g_queue_pop_head(&sh->sec_in))) {
+            qemu_mutex_unlock(&sh->in_lock);
+            colo_shard_compare(sh, SECONDARY_IN, pkt);
+            qemu_mutex_lock(&sh->in_lock);
+        }
+        qemu_mutex_unlock(&sh->in_lock);
+        kick = !g_queue_is_empty(&sh->out) || sh->inconsistent;
+        qemu_mutex_unlock(&sh->lock);
+
+        if (kick) {
+            qemu_bh_schedule(sh->s->shard_bh);
+        }
+    }
+
+    return NULL;
+}
+
+static void colo_compare_shards_init(CompareState *s)
+{
+    AioContext *ctx = iothread_get_aio_context(s->iothread);
+    unsigned i;
+
+    s->shards = g_new0(CompareShard, s->nr_shards);
+    s->shard_bh = aio_bh_new(ctx, colo_compare_shard_bh, s);
+
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        sh->s = s;
+        sh->index = i;
+        sh->threaded = s->nr_shards > 1;
+        qemu_mutex_init(&sh->lock);
+        qemu_mutex_init(&sh->in_lock);
+        qemu_cond_init(&sh->in_cond);
+        g_queue_init(&sh->pri_in);
+        g_queue_init(&sh->sec_in);
+        g_queue_init(&sh->out);
+        g_queue_init(&sh->conn_list);
+        sh->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                           connection_key_equal,
+                                                           g_free,
+                                                           NULL);
+        if (sh->threaded) {
+            qemu_thread_create(&sh->thread, "colo-compare",
+                               colo_compare_shard_thread, sh,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+}
+
+static void colo_compare_shards_stop(CompareState *s)
+{
+    unsigned i;
+
+    for (i = 0; s->shards && i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        if (!sh->threaded) {
+            continue;
+        }
+        qemu_mutex_lock(&sh->in_lock);
+        sh->stopping = true;
+        qemu_cond_signal(&sh->in_cond);
+        qemu_mutex_unlock(&sh->in_lock);
+        qemu_thread_join(&sh->thread);
+        sh->threaded = false;
+    }
+}
+
+static void colo_compare_shards_destroy(CompareState *s)
+{
+    unsigned i;
+
+    for (i = 0; s->shards && i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        g_queue_clear(&sh->conn_list);
+        g_hash_table_destroy(sh->connection_track_table);
+        qemu_cond_destroy(&sh->in_cond);
+        qemu_mutex_destroy(&sh->in_lock);
+        qemu_mutex_destroy(&sh->lock);
+    }
+    g_free(s->shards);
+    s->shards = NULL;
+}
+
 static char *compare_get_pri_indev(Object *obj, Error **errp)
 {
     CompareState *s = COLO_COMPARE(obj);
@@ -1147,12 +1409,70 @@ static void set_max_queue_size(Object *obj, Visitor *v,
     max_queue_size = value;
 }
 
+static void compare_get_shards(Object *obj, Visitor *v,
+                               const char *name, void *opaque,
+                               Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->nr_shards;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_shards(Object *obj, Visitor *v,
+                               const char *name, void *opaque,
+                               Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (s->shards) {
+        error_setg(errp, "Property '%s.%s' can't be changed once created",
+                   object_get_typename(obj), name);
+        return;
+    }
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value || value > COLO_COMPARE_MAX_SHARDS) {
+        error_setg(errp, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, COLO_COMPARE_MAX_SHARDS);
+        return;
+    }
+    s->nr_shards = value;
+}
+
+static char *compare_get_stats(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    GString *str = g_string_new(NULL);
+    unsigned i;
+
+    for (i = 0; s->shards && i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        qemu_mutex_lock(&sh->in_lock);
+        g_string_append_printf(str, "%sshard%u: connections=%u queued=%u"
+                               " packets=%" PRIu64 " released=%" PRIu64
+                               " miscompares=%" PRIu64 " dropped=%" PRIu64,
+                               i ? " " : "", sh->index,
+                               g_hash_table_size(sh->connection_track_table),
+                               g_queue_get_length(&sh->pri_in) +
+                               g_queue_get_length(&sh->sec_in),
+                               sh->packets, sh->released, sh->miscompares,
+                               sh->dropped + sh->in_dropped);
+        qemu_mutex_unlock(&sh->in_lock);
+        qemu_mutex_unlock(&sh->lock);
+    }
+    return g_string_free(str, false);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (packet_enqueue(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1160,22 +1480,15 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len,
                          false,
                          false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (packet_enqueue(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
@@ -1197,7 +1510,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1269,6 +1582,11 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         max_queue_size = MAX_QUEUE_SIZE;
     }
 
+    if (!s->nr_shards) {
+        /* Compare in the iothread by default */
+        s->nr_shards = 1;
+    }
+
     if (find_and_check_chardev(&chr, s->pri_indev, errp) ||
         !qemu_chr_fe_init(&s->chr_pri_in, chr, errp)) {
         return;
@@ -1312,13 +1630,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      NULL);
-
+    colo_compare_shards_init(s);
     colo_compare_iothread(s);
 
     qemu_mutex_lock(&colo_compare_mutex);
@@ -1339,8 +1651,8 @@ static void colo_flush_packets(void *opaque, void *user_data)
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
-    while (!g_queue_is_empty(&conn->primary_list)) {
-        pkt = g_queue_pop_tail(&conn->primary_list);
+    while (!packet_ring_empty(&conn->primary_list)) {
+        pkt = packet_ring_pop_front(&conn->primary_list);
         compare_chr_send(s,
                          pkt->data,
                          pkt->size,
@@ -1349,12 +1661,38 @@ static void colo_flush_packets(void *opaque, void *user_data)
                          true);
         packet_destroy_partial(pkt, NULL);
     }
-    while (!g_queue_is_empty(&conn->secondary_list)) {
-        pkt = g_queue_pop_tail(&conn->secondary_list);
+    while (!packet_ring_empty(&conn->secondary_list)) {
+        pkt = packet_ring_pop_front(&conn->secondary_list);
         packet_destroy(pkt, NULL);
     }
 }
 
+/*
+ * Called from the compare iothread: send the primary packets of every
+ * shard, released or not, in the order they were received, and drop the
+ * secondary ones.
+ */
+static void colo_compare_flush(CompareState *s)
+{
+    unsigned i;
+
+    for (i = 0; s->shards && i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        colo_send_primary_queue(s, &sh->out);
+        sh->inconsistent = false;
+        g_queue_foreach(&sh->conn_list, colo_flush_packets, s);
+
+        qemu_mutex_lock(&sh->in_lock);
+        colo_send_primary_queue(s, &sh->pri_in);
+        g_queue_foreach(&sh->sec_in, packet_destroy, NULL);
+        g_queue_clear(&sh->sec_in);
+        qemu_mutex_unlock(&sh->in_lock);
+        qemu_mutex_unlock(&sh->lock);
+    }
+}
+
 static void colo_compare_class_init(ObjectClass *oc, void *data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
@@ -1392,6 +1730,12 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "shards", "uint32",
+                        compare_get_shards,
+                        compare_set_shards, NULL, NULL);
+
+    object_property_add_str(obj, "stats", compare_get_stats, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1434,8 +1778,12 @@ static void colo_compare_finalize(Object *obj)
     }
 
     colo_compare_timer_del(s);
+    colo_compare_shards_stop(s);
 
     qemu_bh_delete(s->event_bh);
+    if (s->shard_bh) {
+        qemu_bh_delete(s->shard_bh);
+    }
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     AIO_WAIT_WHILE(ctx, !s->out_sendco.done);
@@ -1444,18 +1792,15 @@ static void colo_compare_finalize(Object *obj)
     }
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    colo_compare_flush(s);
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
-    }
+    colo_compare_shards_destroy(s);
 
     object_unref(OBJECT(s->iothread));
 
@@ -145,8 +145,8 @@ Connection *connection_new(ConnectionKey *key)
     conn->ip_proto = key->ip_proto;
     conn->processing = false;
     conn->tcp_state = TCPS_CLOSED;
-    g_queue_init(&conn->primary_list);
-    g_queue_init(&conn->secondary_list);
+    packet_ring_init(&conn->primary_list);
+    packet_ring_init(&conn->secondary_list);
 
     return conn;
 }
@@ -155,13 +155,112 @@ void connection_destroy(void *opaque)
 {
     Connection *conn = opaque;
 
-    g_queue_foreach(&conn->primary_list, packet_destroy, NULL);
-    g_queue_clear(&conn->primary_list);
-    g_queue_foreach(&conn->secondary_list, packet_destroy, NULL);
-    g_queue_clear(&conn->secondary_list);
+    packet_ring_destroy(&conn->primary_list);
+    packet_ring_destroy(&conn->secondary_list);
     g_slice_free(Connection, conn);
 }
 
+#define PACKET_RING_INIT_SIZE 16
+
+void packet_ring_init(PacketRing *ring)
+{
+    ring->pkts = NULL;
+    ring->size = 0;
+    ring->head = 0;
+    ring->len = 0;
+}
+
+void packet_ring_destroy(PacketRing *ring)
+{
+    while (!packet_ring_empty(ring)) {
+        packet_destroy(packet_ring_pop_front(ring), NULL);
+    }
+    g_free(ring->pkts);
+    packet_ring_init(ring);
+}
+
+static void packet_ring_grow(PacketRing *ring)
+{
+    uint32_t size = ring->size ? ring->size * 2 : PACKET_RING_INIT_SIZE;
+    Packet **pkts = g_new(Packet *, size);
+    uint32_t i;
+
+    for (i = 0; i < ring->len; i++) {
+        pkts[i] = packet_ring_peek(ring, i);
+    }
+    g_free(ring->pkts);
+    ring->pkts = pkts;
+    ring->size = size;
+    ring->head = 0;
+}
+
+static inline Packet **packet_ring_slot(PacketRing *ring, uint32_t i)
+{
+    return &ring->pkts[(ring->head + i) & (ring->size - 1)];
+}
+
+void packet_ring_push_front(PacketRing *ring, Packet *pkt)
+{
+    if (ring->len == ring->size) {
+        packet_ring_grow(ring);
+    }
+    ring->head = (ring->head - 1) & (ring->size - 1);
+    ring->len++;
+    *packet_ring_slot(ring, 0) = pkt;
+}
+
+void packet_ring_push_back(PacketRing *ring, Packet *pkt)
+{
+    if (ring->len == ring->size) {
+        packet_ring_grow(ring);
+    }
+    *packet_ring_slot(ring, ring->len++) = pkt;
+}
+
+/*
+ * Insert after the last packet whose sequence number is not after the
+ * one of @pkt, so that packets with the same sequence number keep their
+ * arrival order.
+ */
+void packet_ring_insert_sorted(PacketRing *ring, Packet *pkt)
+{
+    uint32_t i;
+
+    if (ring->len == ring->size) {
+        packet_ring_grow(ring);
+    }
+    for (i = ring->len; i > 0; i--) {
+        Packet *prev = *packet_ring_slot(ring, i - 1);
+
+        if ((int32_t)(pkt->tcp_seq - prev->tcp_seq) >= 0) {
+            break;
+        }
+        *packet_ring_slot(ring, i) = prev;
+    }
+    *packet_ring_slot(ring, i) = pkt;
+    ring->len++;
+}
+
+Packet *packet_ring_pop_front(PacketRing *ring)
+{
+    Packet *pkt;
+
+    assert(ring->len);
+    pkt = *packet_ring_slot(ring, 0);
+    ring->head = (ring->head + 1) & (ring->size - 1);
+    ring->len--;
+    return pkt;
+}
+
+void packet_ring_remove(PacketRing *ring, uint32_t i)
+{
+    assert(i < ring->len);
+    for (; i + 1 < ring->len; i++) {
+        *packet_ring_slot(ring, i) = *packet_ring_slot(ring, i + 1);
+    }
+    ring->len--;
+}
+
 Packet *packet_new(const void *data, int size, int vnet_hdr_len)
 {
     Packet *pkt = g_slice_new0(Packet);
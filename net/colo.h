@@ -57,6 +57,36 @@ typedef struct Packet {
     uint8_t flags; /* Flags(aka Control bits) */
 } Packet;
 
+/*
+ * Packets of one direction of a connection, oldest first.  TCP packets
+ * are kept ordered by sequence number; as they nearly always arrive in
+ * order, inserting one is a store at the back of the ring.
+ */
+typedef struct PacketRing {
+    Packet **pkts;
+    uint32_t size;      /* a power of two */
+    uint32_t head;
+    uint32_t len;
+} PacketRing;
+
+static inline bool packet_ring_empty(PacketRing *ring)
+{
+    return ring->len == 0;
+}
+
+static inline Packet *packet_ring_peek(PacketRing *ring, uint32_t i)
+{
+    return ring->pkts[(ring->head + i) & (ring->size - 1)];
+}
+
+void packet_ring_init(PacketRing *ring);
+void packet_ring_destroy(PacketRing *ring);
+void packet_ring_push_front(PacketRing *ring, Packet *pkt);
+void packet_ring_push_back(PacketRing *ring, Packet *pkt);
+void packet_ring_insert_sorted(PacketRing *ring, Packet *pkt);
+Packet *packet_ring_pop_front(PacketRing *ring);
+void packet_ring_remove(PacketRing *ring, uint32_t i);
+
 typedef struct ConnectionKey {
     /* (src, dst) must be grouped, in the same way than in IP header */
     struct in_addr src;
@@ -67,10 +97,10 @@ typedef struct ConnectionKey {
 } QEMU_PACKED ConnectionKey;
 
 typedef struct Connection {
-    /* connection primary send queue: element type: Packet */
-    GQueue primary_list;
-    /* connection secondary send queue: element type: Packet */
-    GQueue secondary_list;
+    /* connection primary send queue */
+    PacketRing primary_list;
+    /* connection secondary send queue */
+    PacketRing secondary_list;
     /* flag to enqueue unprocessed_connections */
     bool processing;
     uint8_t ip_proto;
@@ -36,6 +36,33 @@
 #include "qemu/main-loop.h"
 #include "qemu/cutils.h"
 
+#ifdef CONFIG_LINUX
+#include <netinet/udp.h>
+#endif
+
+#ifdef CONFIG_SENDMMSG
+/*
+ * Datagrams are read NET_DGRAM_BATCH at a time with recvmmsg(), and the
+ * packets that the peer sends during one main loop iteration are copied
+ * and sent together by a bottom half with sendmmsg().  With gso=on, runs
+ * of packets of the same size go out as a single UDP GSO message, and the
+ * receive side gets coalesced datagrams back through UDP GRO, so the host
+ * stack also handles fewer datagrams.
+ */
+#define NET_DGRAM_BATCH         32
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define NET_DGRAM_HAVE_GSO
+/* UDP_MAX_SEGMENTS in Linux, and the message must fit in a datagram */
+#define NET_DGRAM_GSO_SEGS      64
+#define NET_DGRAM_GSO_BYTES     65000
+#endif
+
+typedef union NetDgramCmsg {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} NetDgramCmsg;
+#endif
+
 typedef struct NetDgramState {
     NetClientState nc;
     int fd;
@@ -45,6 +72,26 @@ typedef struct NetDgramState {
     /* contains destination iff connectionless */
     struct sockaddr *dest_addr;
     socklen_t dest_len;
+#ifdef CONFIG_SENDMMSG
+    bool gso;
+    /* Datagrams read by the last recvmmsg(), delivered up to rx_next */
+    struct mmsghdr rx_msgs[NET_DGRAM_BATCH];
+    struct iovec rx_iov[NET_DGRAM_BATCH];
+    NetDgramCmsg rx_ctrl[NET_DGRAM_BATCH];
+    int rx_count;
+    int rx_next;
+    int rx_off;                   /* offset of the next GRO segment */
+    /* Packets from the peer, sent up to tx_next */
+    QEMUBH *tx_bh;
+    struct iovec tx_iov[NET_DGRAM_BATCH];
+    size_t tx_size[NET_DGRAM_BATCH];
+    int tx_count;
+    int tx_next;
+    bool tx_full;
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t syscalls;
+#endif
 } NetDgramState;
 
 static void net_dgram_send(void *opaque);
@@ -70,15 +117,149 @@ static void net_dgram_write_poll(NetDgramState *s, bool enable)
     net_dgram_update_fd_handler(s);
 }
 
+#ifdef CONFIG_SENDMMSG
+/* Group the pending packets into messages, returns the number of messages */
+static int net_dgram_build_tx(NetDgramState *s, struct mmsghdr *msgs,
+                              NetDgramCmsg *ctrl, int *npkts)
+{
+    int n = 0, i = s->tx_next;
+
+    while (i < s->tx_count) {
+        struct msghdr *m = &msgs[n].msg_hdr;
+        size_t seg = s->tx_iov[i].iov_len;
+        int j = i + 1;
+
+#ifdef NET_DGRAM_HAVE_GSO
+        if (s->gso) {
+            size_t total = seg;
+
+            /* All segments but the last one have the GSO size */
+            while (j < s->tx_count && j - i < NET_DGRAM_GSO_SEGS &&
+                   s->tx_iov[j].iov_len <= seg &&
+                   total + s->tx_iov[j].iov_len <= NET_DGRAM_GSO_BYTES) {
+                total += s->tx_iov[j].iov_len;
+                if (s->tx_iov[j++].iov_len < seg) {
+                    break;
+                }
+            }
+        }
+#endif
+
+        *m = (struct msghdr) {
+            .msg_name = s->dest_addr,
+            .msg_namelen = s->dest_len,
+            .msg_iov = &s->tx_iov[i],
+            .msg_iovlen = j - i,
+        };
+#ifdef NET_DGRAM_HAVE_GSO
+        if (j - i > 1) {
+            uint16_t gso_size = seg;
+            struct cmsghdr *cmsg;
+
+            m->msg_control = ctrl[n].buf;
+            m->msg_controllen = CMSG_SPACE(sizeof(gso_size));
+            cmsg = CMSG_FIRSTHDR(m);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+#endif
+        npkts[n++] = j - i;
+        i = j;
+    }
+    return n;
+}
+
+static void net_dgram_flush_tx(NetDgramState *s)
+{
+    struct mmsghdr msgs[NET_DGRAM_BATCH];
+    NetDgramCmsg ctrl[NET_DGRAM_BATCH];
+    int npkts[NET_DGRAM_BATCH];
+    int i, n, ret;
+
+    while (s->tx_next < s->tx_count) {
+        n = net_dgram_build_tx(s, msgs, ctrl, npkts);
+        ret = RETRY_ON_EINTR(sendmmsg(s->fd, msgs, n, 0));
+        s->syscalls++;
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                net_dgram_write_poll(s, true);
+                return;
+            }
+            if (s->gso && npkts[0] > 1 &&
+                (errno == EINVAL || errno == EIO || errno == EMSGSIZE)) {
+                /* The route cannot segment these packets, stop trying */
+                warn_report("%s: UDP GSO failed, disabling it", s->nc.name);
+                s->gso = false;
+                continue;
+            }
+            /* Drop the first message, like a failed send() drops a packet */
+            ret = 1;
+        }
+        for (i = 0; i < ret; i++) {
+            s->tx_next += npkts[i];
+        }
+    }
+
+    s->tx_count = 0;
+    s->tx_next = 0;
+    if (s->tx_full) {
+        s->tx_full = false;
+        qemu_flush_queued_packets(&s->nc);
+    }
+}
+
+static void net_dgram_tx_bh(void *opaque)
+{
+    NetDgramState *s = opaque;
+
+    if (!s->write_poll) {
+        net_dgram_flush_tx(s);
+    }
+}
+
+static ssize_t net_dgram_receive(NetClientState *nc,
+                                 const uint8_t *buf, size_t size)
+{
+    NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
+    int i;
+
+    if (s->tx_count == NET_DGRAM_BATCH) {
+        /* Retried by qemu_flush_queued_packets() after the next flush */
+        s->tx_full = true;
+        return 0;
+    }
+
+    i = s->tx_count++;
+    if (s->tx_size[i] < size) {
+        g_free(s->tx_iov[i].iov_base);
+        s->tx_iov[i].iov_base = g_malloc(size);
+        s->tx_size[i] = size;
+    }
+    memcpy(s->tx_iov[i].iov_base, buf, size);
+    s->tx_iov[i].iov_len = size;
+    s->tx_packets++;
+
+    qemu_bh_schedule(s->tx_bh);
+    return size;
+}
+#endif
+
 static void net_dgram_writable(void *opaque)
 {
     NetDgramState *s = opaque;
 
     net_dgram_write_poll(s, false);
 
+#ifdef CONFIG_SENDMMSG
+    net_dgram_flush_tx(s);
+#else
     qemu_flush_queued_packets(&s->nc);
+#endif
 }
 
+#ifndef CONFIG_SENDMMSG
 static ssize_t net_dgram_receive(NetClientState *nc,
                                  const uint8_t *buf, size_t size)
 {
@@ -99,24 +280,100 @@ static ssize_t net_dgram_receive(NetClientState *nc,
     }
     return ret;
 }
+#endif
+
+#ifdef CONFIG_SENDMMSG
+static void net_dgram_send_completed(NetClientState *nc, ssize_t len);
+
+static int net_dgram_gro_size(struct mmsghdr *msg)
+{
+#ifdef NET_DGRAM_HAVE_GSO
+    struct cmsghdr *cmsg;
+    int gso_size;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg->msg_hdr); cmsg;
+         cmsg = CMSG_NXTHDR(&msg->msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            return gso_size;
+        }
+    }
+#endif
+    return msg->msg_len;
+}
+
+/* Hand the received packets to the peer, false if it stopped taking them */
+static bool net_dgram_deliver(NetDgramState *s)
+{
+    while (s->rx_next < s->rx_count) {
+        struct mmsghdr *msg = &s->rx_msgs[s->rx_next];
+        uint8_t *buf = s->rx_iov[s->rx_next].iov_base;
+        int len = MIN((int)msg->msg_len - s->rx_off, net_dgram_gro_size(msg));
+        ssize_t ret = -1;
+
+        if (len > 0) {
+            ret = qemu_send_packet_async(&s->nc, buf + s->rx_off, len,
+                                         net_dgram_send_completed);
+            s->rx_packets++;
+            s->rx_off += len;
+        }
+        if (len <= 0 || s->rx_off >= msg->msg_len) {
+            s->rx_next++;
+            s->rx_off = 0;
+        }
+        if (ret == 0) {
+            net_dgram_read_poll(s, false);
+            return false;
+        }
+    }
+    return true;
+}
 
 static void net_dgram_send_completed(NetClientState *nc, ssize_t len)
 {
     NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
 
-    if (!s->read_poll) {
+    if (net_dgram_deliver(s) && !s->read_poll) {
         net_dgram_read_poll(s, true);
     }
 }
 
-static void net_dgram_rs_finalize(SocketReadState *rs)
+static void net_dgram_send(void *opaque)
 {
-    NetDgramState *s = container_of(rs, NetDgramState, rs);
+    NetDgramState *s = opaque;
+    int i, n;
 
-    if (qemu_send_packet_async(&s->nc, rs->buf,
-                               rs->packet_len,
-                               net_dgram_send_completed) == 0) {
-        net_dgram_read_poll(s, false);
+    if (!net_dgram_deliver(s)) {
+        return;
+    }
+
+    for (i = 0; i < NET_DGRAM_BATCH; i++) {
+        s->rx_msgs[i].msg_hdr = (struct msghdr) {
+            .msg_iov = &s->rx_iov[i],
+            .msg_iovlen = 1,
+            .msg_control = s->gso ? s->rx_ctrl[i].buf : NULL,
+            .msg_controllen = s->gso ? sizeof(s->rx_ctrl[i].buf) : 0,
+        };
+    }
+
+    n = RETRY_ON_EINTR(recvmmsg(s->fd, s->rx_msgs, NET_DGRAM_BATCH,
+                                MSG_DONTWAIT, NULL));
+    s->syscalls++;
+    if (n <= 0) {
+        return;
+    }
+    s->rx_count = n;
+    s->rx_next = 0;
+    s->rx_off = 0;
+    net_dgram_deliver(s);
+}
+#else
+static void net_dgram_send_completed(NetClientState *nc, ssize_t len)
+{
+    NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
+
+    if (!s->read_poll) {
+        net_dgram_read_poll(s, true);
     }
 }
 
@@ -140,6 +397,18 @@ static void net_dgram_send(void *opaque)
         net_dgram_read_poll(s, false);
     }
 }
+#endif
+
+static void net_dgram_rs_finalize(SocketReadState *rs)
+{
+    NetDgramState *s = container_of(rs, NetDgramState, rs);
+
+    if (qemu_send_packet_async(&s->nc, rs->buf,
+                               rs->packet_len,
+                               net_dgram_send_completed) == 0) {
+        net_dgram_read_poll(s, false);
+    }
+}
 
 static int net_dgram_mcast_create(struct sockaddr_in *mcastaddr,
                                   struct in_addr *localaddr,
@@ -238,6 +507,10 @@ fail:
 static void net_dgram_cleanup(NetClientState *nc)
 {
     NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
+#ifdef CONFIG_SENDMMSG
+    int i;
+#endif
+
     if (s->fd != -1) {
         net_dgram_read_poll(s, false);
         net_dgram_write_poll(s, false);
@@ -247,23 +520,71 @@ static void net_dgram_cleanup(NetClientState *nc)
     g_free(s->dest_addr);
     s->dest_addr = NULL;
     s->dest_len = 0;
+
+#ifdef CONFIG_SENDMMSG
+    qemu_bh_delete(s->tx_bh);
+    s->tx_bh = NULL;
+    for (i = 0; i < NET_DGRAM_BATCH; i++) {
+        g_free(s->rx_iov[i].iov_base);
+        g_free(s->tx_iov[i].iov_base);
+        s->rx_iov[i].iov_base = NULL;
+        s->tx_iov[i].iov_base = NULL;
+    }
+#endif
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_dgram_print_stats(NetClientState *nc, Monitor *mon)
+{
+    NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
+    uint64_t packets = s->rx_packets + s->tx_packets;
+
+    monitor_printf(mon, "  rx_packets=%" PRIu64 " tx_packets=%" PRIu64
+                   " syscalls=%" PRIu64 " packets/syscall=%.1f%s\n",
+                   s->rx_packets, s->tx_packets, s->syscalls,
+                   s->syscalls ? (double)packets / s->syscalls : 0.0,
+                   s->gso ? " gso" : "");
+}
+#endif
+
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_DGRAM,
     .size = sizeof(NetDgramState),
     .receive = net_dgram_receive,
     .cleanup = net_dgram_cleanup,
+#ifdef CONFIG_SENDMMSG
+    .print_stats = net_dgram_print_stats,
+#endif
 };
 
+static int net_dgram_set_gso(NetDgramState *s, Error **errp)
+{
+#ifdef NET_DGRAM_HAVE_GSO
+    int on = 1;
+
+    if (setsockopt(s->fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        error_setg_errno(errp, errno, "can't enable UDP GRO");
+        return -1;
+    }
+    s->gso = true;
+    return 0;
+#else
+    error_setg(errp, "gso=on is not supported on this host");
+    return -1;
+#endif
+}
+
 static NetDgramState *net_dgram_fd_init(NetClientState *peer,
                                         const char *model,
                                         const char *name,
-                                        int fd,
+                                        int fd, bool gso,
                                         Error **errp)
 {
     NetClientState *nc;
     NetDgramState *s;
+#ifdef CONFIG_SENDMMSG
+    int i;
+#endif
 
     nc = qemu_new_net_client(&net_dgram_socket_info, peer, model, name);
 
@@ -271,6 +592,19 @@ static NetDgramState *net_dgram_fd_init(NetClientState *peer,
 
     s->fd = fd;
     net_socket_rs_init(&s->rs, net_dgram_rs_finalize, false);
+
+#ifdef CONFIG_SENDMMSG
+    s->tx_bh = qemu_bh_new(net_dgram_tx_bh, s);
+    for (i = 0; i < NET_DGRAM_BATCH; i++) {
+        s->rx_iov[i].iov_base = g_malloc(NET_BUFSIZE);
+        s->rx_iov[i].iov_len = NET_BUFSIZE;
+    }
+#endif
+    if (gso && net_dgram_set_gso(s, errp) < 0) {
+        qemu_del_net_client(nc);
+        return NULL;
+    }
+
     net_dgram_read_poll(s, true);
 
     return s;
@@ -281,6 +615,7 @@ static int net_dgram_mcast_init(NetClientState *peer,
                                 const char *name,
                                 SocketAddress *remote,
                                 SocketAddress *local,
+                                bool gso,
                                 Error **errp)
 {
     NetDgramState *s;
@@ -382,7 +717,7 @@ static int net_dgram_mcast_init(NetClientState *peer,
         }
     }
 
-    s = net_dgram_fd_init(peer, model, name, fd, errp);
+    s = net_dgram_fd_init(peer, model, name, fd, gso, errp);
     if (!s) {
         g_free(saddr);
         return -1;
@@ -424,15 +759,17 @@ int net_init_dgram(const Netdev *netdev, const char *name,
     NetDgramState *s;
     int fd, ret;
     SocketAddress *remote, *local;
-    struct sockaddr *dest_addr;
+    g_autofree struct sockaddr *dest_addr = NULL;
     struct sockaddr_in laddr_in, raddr_in;
     struct sockaddr_un laddr_un, raddr_un;
     socklen_t dest_len;
+    bool gso;
 
     assert(netdev->type == NET_CLIENT_DRIVER_DGRAM);
 
     remote = netdev->u.dgram.remote;
     local = netdev->u.dgram.local;
+    gso = netdev->u.dgram.has_gso && netdev->u.dgram.gso;
 
     /* detect multicast address */
     if (remote && remote->type == SOCKET_ADDRESS_TYPE_INET) {
@@ -445,7 +782,7 @@ int net_init_dgram(const Netdev *netdev, const char *name,
 
         if (IN_MULTICAST(ntohl(mcastaddr.sin_addr.s_addr))) {
             return net_dgram_mcast_init(peer, "dram", name, remote, local,
-                                           errp);
+                                        gso, errp);
         }
     }
 
@@ -576,14 +913,14 @@ int net_init_dgram(const Netdev *netdev, const char *name,
         return -1;
     }
 
-    s = net_dgram_fd_init(peer, "dgram", name, fd, errp);
+    s = net_dgram_fd_init(peer, "dgram", name, fd, gso, errp);
     if (!s) {
         return -1;
     }
 
     if (remote) {
         g_assert(s->dest_addr == NULL);
-        s->dest_addr = dest_addr;
+        s->dest_addr = g_steal_pointer(&dest_addr);
         s->dest_len = dest_len;
     }
 
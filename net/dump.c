@@ -33,11 +33,56 @@
 #include "net/filter.h"
 #include "qom/object.h"
 #include "sysemu/rtc.h"
+#include "qemu/thread.h"
+#include "qemu/host-utils.h"
+#include "qemu/memalign.h"
+#include "qemu/units.h"
+
+/*
+ * Packets are not written from the packet path: they are copied, with
+ * their pcap record header, to a ring that a writer thread empties in
+ * batches of DUMP_BATCH bytes, so that the file offset of each write is
+ * aligned on the batch size.  Whatever is left is written after
+ * DUMP_FLUSH_MS without new batch.  When the ring is full, packets are
+ * dropped and counted rather than waiting for the disk.
+ *
+ * The file can be rotated when it reaches a size or an age.  The packet
+ * path decides where rotations happen, as it knows the record boundaries,
+ * and queues their ring positions for the writer.
+ */
+#define DUMP_BATCH          (64 * KiB)
+#define DUMP_FLUSH_MS       100
+#define DUMP_MAX_ROTATIONS  16
 
 typedef struct DumpState {
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+
+    char *filename;
+    unsigned file_index;
+    uint64_t file_off;          /* writer side */
+    uint64_t rotate_size;
+    int64_t rotate_interval_ms;
+
+    QemuThread thread;
+    bool running;
+
+    /* Protects the fields below */
+    QemuMutex lock;
+    QemuCond cond;
+    uint8_t *ring;
+    size_t ring_size;           /* a power of two */
+    uint64_t head;              /* bytes queued since the start */
+    uint64_t tail;              /* bytes written since the start */
+    uint64_t rotations[DUMP_MAX_ROTATIONS];
+    unsigned n_rotations;
+    uint64_t file_bytes;        /* packet path side */
+    int64_t file_start_ms;
+    bool stopping;
+    bool failed;
+    uint64_t dropped;
+    uint64_t rotations_delayed;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -61,6 +106,38 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
+/* Called with the lock held */
+static void dump_queue_rotation(DumpState *s, size_t len)
+{
+    int64_t now = 0;
+
+    if (s->rotate_interval_ms) {
+        now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    }
+    if (s->file_bytes == sizeof(struct pcap_file_hdr)) {
+        return;
+    }
+    if ((s->rotate_size && s->file_bytes + len > s->rotate_size) ||
+        (s->rotate_interval_ms &&
+         now - s->file_start_ms >= s->rotate_interval_ms)) {
+        /*
+         * The writer is too far behind: keep appending to the current
+         * file, which is rotated with the next packet after a slot frees.
+         */
+        if (s->n_rotations == DUMP_MAX_ROTATIONS) {
+            s->rotations_delayed++;
+            warn_report_once("net dump: the writer is %u rotations behind, "
+                             "files will exceed the rotation limits",
+                             DUMP_MAX_ROTATIONS);
+            return;
+        }
+        s->rotations[s->n_rotations++] = s->head;
+        s->file_bytes = sizeof(struct pcap_file_hdr);
+        s->file_start_ms = now;
+        qemu_cond_signal(&s->cond);
+    }
+}
+
 static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt,
                                 int offset)
 {
@@ -68,10 +145,11 @@ static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt,
     int64_t ts;
     int caplen;
     size_t size = iov_size(iov, cnt) - offset;
+    size_t len, pos, first;
     g_autofree struct iovec *dumpiov = g_new(struct iovec, cnt + 1);
 
-    /* Early return in case of previous error. */
-    if (s->fd < 0) {
+    /* Early return in case the dump could not be set up. */
+    if (!s->running) {
         return size;
     }
 
@@ -86,29 +164,47 @@ static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt,
     dumpiov[0].iov_base = &hdr;
     dumpiov[0].iov_len = sizeof(hdr);
     cnt = iov_copy(&dumpiov[1], cnt, iov, cnt, offset, caplen);
+    len = sizeof(hdr) + caplen;
 
-    if (writev(s->fd, dumpiov, cnt + 1) != sizeof(hdr) + caplen) {
-        error_report("network dump write error - stopping dump");
-        close(s->fd);
-        s->fd = -1;
+    qemu_mutex_lock(&s->lock);
+    if (s->failed) {
+        goto out;
+    }
+    dump_queue_rotation(s, len);
+    if (s->ring_size - (s->head - s->tail) < len) {
+        s->dropped++;
+        goto out;
     }
 
+    pos = s->head & (s->ring_size - 1);
+    first = MIN(len, s->ring_size - pos);
+    iov_to_buf(dumpiov, cnt + 1, 0, s->ring + pos, first);
+    iov_to_buf(dumpiov, cnt + 1, first, s->ring, len - first);
+    s->head += len;
+    s->file_bytes += len;
+
+    /* Wake the writer up when a batch is complete */
+    if (s->head - s->tail >= DUMP_BATCH &&
+        s->head - s->tail - len < DUMP_BATCH) {
+        qemu_cond_signal(&s->cond);
+    }
+out:
+    qemu_mutex_unlock(&s->lock);
     return size;
 }
 
-static void dump_cleanup(DumpState *s)
-{
-    close(s->fd);
-    s->fd = -1;
-}
-
-static int net_dump_state_init(DumpState *s, const char *filename,
-                               int len, Error **errp)
+static int dump_open(DumpState *s, Error **errp)
 {
+    g_autofree char *filename = NULL;
     struct pcap_file_hdr hdr;
-    struct tm tm;
     int fd;
 
+    if (s->file_index) {
+        filename = g_strdup_printf("%s.%u", s->filename, s->file_index);
+    } else {
+        filename = g_strdup(s->filename);
+    }
+
     fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
     if (fd < 0) {
         error_setg_errno(errp, errno, "net dump: can't open %s", filename);
@@ -120,7 +216,7 @@ static int net_dump_state_init(DumpState *s, const char *filename,
     hdr.version_minor = 4;
     hdr.thiszone = 0;
     hdr.sigfigs = 0;
-    hdr.snaplen = len;
+    hdr.snaplen = s->pcap_caplen;
     hdr.linktype = 1;
 
     if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
@@ -130,11 +226,159 @@ static int net_dump_state_init(DumpState *s, const char *filename,
     }
 
     s->fd = fd;
+    s->file_off = sizeof(hdr);
+    return 0;
+}
+
+/* Write the ring from @tail to @end, which may wrap around */
+static int dump_write(DumpState *s, uint64_t tail, uint64_t end)
+{
+    size_t pos = tail & (s->ring_size - 1);
+    size_t len = end - tail;
+    size_t first = MIN(len, s->ring_size - pos);
+
+    if (qemu_write_full(s->fd, s->ring + pos, first) != first ||
+        qemu_write_full(s->fd, s->ring, len - first) != len - first) {
+        return -1;
+    }
+    s->file_off += len;
+    return 0;
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    bool timed_out = false;
+
+    qemu_mutex_lock(&s->lock);
+    while (!s->failed) {
+        uint64_t tail = s->tail;
+        uint64_t end = s->head;
+        bool rotate = s->n_rotations;
+        bool flush = s->stopping || timed_out || rotate;
+        Error *local_err = NULL;
+
+        if (rotate) {
+            end = s->rotations[0];
+        }
+        if (tail == end && !rotate) {
+            if (s->stopping) {
+                break;
+            }
+            timed_out = !qemu_cond_timedwait(&s->cond, &s->lock,
+                                             DUMP_FLUSH_MS);
+            continue;
+        }
+        if (!flush) {
+            if (end - tail < DUMP_BATCH) {
+                timed_out = !qemu_cond_timedwait(&s->cond, &s->lock,
+                                                 DUMP_FLUSH_MS);
+                continue;
+            }
+            /* Leave the partial batch for later, to keep writes aligned */
+            end = tail + QEMU_ALIGN_DOWN(s->file_off + end - tail, DUMP_BATCH)
+                  - s->file_off;
+        }
+        qemu_mutex_unlock(&s->lock);
+
+        if (dump_write(s, tail, end) < 0) {
+            error_report("network dump write error - stopping dump");
+            qemu_mutex_lock(&s->lock);
+            s->failed = true;
+            break;
+        }
+        if (rotate) {
+            close(s->fd);
+            s->fd = -1;
+            s->file_index++;
+            if (dump_open(s, &local_err) < 0) {
+                error_report_err(local_err);
+                qemu_mutex_lock(&s->lock);
+                s->failed = true;
+                break;
+            }
+        }
+
+        qemu_mutex_lock(&s->lock);
+        s->tail = end;
+        if (rotate) {
+            s->n_rotations--;
+            memmove(s->rotations, s->rotations + 1,
+                    s->n_rotations * sizeof(s->rotations[0]));
+        }
+        timed_out = false;
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void dump_cleanup(DumpState *s)
+{
+    if (!s->running) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    s->stopping = true;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    qemu_thread_join(&s->thread);
+    s->running = false;
+
+    if (s->dropped) {
+        warn_report("net dump: %" PRIu64 " packets dropped", s->dropped);
+    }
+    if (s->rotations_delayed) {
+        warn_report("net dump: %" PRIu64 " rotations delayed",
+                    s->rotations_delayed);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    qemu_vfree(s->ring);
+    s->ring = NULL;
+    g_free(s->filename);
+    s->filename = NULL;
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+}
+
+static int net_dump_state_init(DumpState *s, const char *filename,
+                               int len, size_t bufsize, Error **errp)
+{
+    struct tm tm;
+
+    s->filename = g_strdup(filename);
+    s->file_index = 0;
     s->pcap_caplen = len;
+    if (dump_open(s, errp) < 0) {
+        g_free(s->filename);
+        s->filename = NULL;
+        return -1;
+    }
 
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
 
+    s->ring_size = pow2ceil(bufsize);
+    s->ring = qemu_memalign(DUMP_BATCH, s->ring_size);
+    s->head = 0;
+    s->tail = 0;
+    s->n_rotations = 0;
+    s->file_bytes = s->file_off;
+    s->file_start_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    s->stopping = false;
+    s->failed = false;
+    s->dropped = 0;
+    s->rotations_delayed = 0;
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    qemu_thread_create(&s->thread, "net-dump", dump_thread, s,
+                       QEMU_THREAD_JOINABLE);
+    s->running = true;
+
     return 0;
 }
 
@@ -147,6 +391,9 @@ struct NetFilterDumpState {
     DumpState ds;
     char *filename;
     uint32_t maxlen;
+    uint64_t bufsize;
+    uint64_t rotate_size;
+    uint32_t rotate_interval;
 };
 
 static ssize_t filter_dump_receive_iov(NetFilterState *nf, NetClientState *sndr,
@@ -175,7 +422,17 @@ static void filter_dump_setup(NetFilterState *nf, Error **errp)
         return;
     }
 
-    net_dump_state_init(&nfds->ds, nfds->filename, nfds->maxlen, errp);
+    if (nfds->bufsize < 2 * DUMP_BATCH + nfds->maxlen) {
+        error_setg(errp, "dump filter 'bufsize' must be at least %" PRIu64
+                   " bytes for 'maxlen' %" PRIu32,
+                   (uint64_t)(2 * DUMP_BATCH + nfds->maxlen), nfds->maxlen);
+        return;
+    }
+
+    nfds->ds.rotate_size = nfds->rotate_size;
+    nfds->ds.rotate_interval_ms = nfds->rotate_interval * 1000LL;
+    net_dump_state_init(&nfds->ds, nfds->filename, nfds->maxlen,
+                        nfds->bufsize, errp);
 }
 
 static void filter_dump_get_maxlen(Object *obj, Visitor *v, const char *name,
@@ -204,6 +461,81 @@ static void filter_dump_set_maxlen(Object *obj, Visitor *v, const char *name,
     nfds->maxlen = value;
 }
 
+static void filter_dump_get_bufsize(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+
+    visit_type_size(v, name, &nfds->bufsize, errp);
+}
+
+static void filter_dump_set_bufsize(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    uint64_t value;
+
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+    if (value > 1 * GiB) {
+        error_setg(errp, "Property '%s.%s' doesn't take value '%" PRIu64 "'",
+                   object_get_typename(obj), name, value);
+        return;
+    }
+    nfds->bufsize = value;
+}
+
+static void filter_dump_get_rotate_size(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+
+    visit_type_size(v, name, &nfds->rotate_size, errp);
+}
+
+static void filter_dump_set_rotate_size(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+
+    visit_type_size(v, name, &nfds->rotate_size, errp);
+}
+
+static void filter_dump_get_rotate_interval(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+
+    visit_type_uint32(v, name, &nfds->rotate_interval, errp);
+}
+
+static void filter_dump_set_rotate_interval(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+
+    visit_type_uint32(v, name, &nfds->rotate_interval, errp);
+}
+
+static void filter_dump_get_dropped(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    uint64_t value = 0;
+
+    if (nfds->ds.running) {
+        qemu_mutex_lock(&nfds->ds.lock);
+        value = nfds->ds.dropped;
+        qemu_mutex_unlock(&nfds->ds.lock);
+    }
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static char *file_dump_get_filename(Object *obj, Error **errp)
 {
     NetFilterDumpState *nfds = FILTER_DUMP(obj);
@@ -224,6 +556,7 @@ static void filter_dump_instance_init(Object *obj)
     NetFilterDumpState *nfds = FILTER_DUMP(obj);
 
     nfds->maxlen = 65536;
+    nfds->bufsize = 4 * MiB;
 }
 
 static void filter_dump_instance_finalize(Object *obj)
@@ -241,6 +574,16 @@ static void filter_dump_class_init(ObjectClass *oc, void *data)
                               filter_dump_set_maxlen, NULL, NULL);
     object_class_property_add_str(oc, "file", file_dump_get_filename,
                                   file_dump_set_filename);
+    object_class_property_add(oc, "bufsize", "size", filter_dump_get_bufsize,
+                              filter_dump_set_bufsize, NULL, NULL);
+    object_class_property_add(oc, "rotate-size", "size",
+                              filter_dump_get_rotate_size,
+                              filter_dump_set_rotate_size, NULL, NULL);
+    object_class_property_add(oc, "rotate-interval", "uint32",
+                              filter_dump_get_rotate_interval,
+                              filter_dump_set_rotate_interval, NULL, NULL);
+    object_class_property_add(oc, "dropped", "uint64",
+                              filter_dump_get_dropped, NULL, NULL, NULL);
 
     nfc->setup = filter_dump_setup;
     nfc->cleanup = filter_dump_cleanup;
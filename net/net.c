@@ -736,6 +736,20 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/*
+ * Like qemu_send_packet_async(), but if the packet has to be queued the
+ * queue refers to @buf instead of copying it.  @buf must stay valid until
+ * @sent_cb has been called.
+ */
+ssize_t qemu_send_packet_async_nocopy(NetClientState *sender,
+                                      const uint8_t *buf, int size,
+                                      NetPacketSent *sent_cb)
+{
+    return qemu_send_packet_async_with_flags(sender,
+                                             QEMU_NET_PACKET_FLAG_NOCOPY,
+                                             buf, size, sent_cb);
+}
+
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async(nc, buf, size, NULL);
@@ -847,9 +861,11 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -865,24 +881,46 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/*
+ * Like qemu_sendv_packet_async(), but if the packet has to be queued the
+ * queue refers to the buffers in @iov instead of copying them.  They must
+ * stay valid until @sent_cb has been called.
+ */
+ssize_t qemu_sendv_packet_async_nocopy(NetClientState *sender,
+                                       const struct iovec *iov, int iovcnt,
+                                       NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NOCOPY,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1501,6 +1539,9 @@ void print_net_client(Monitor *mon, NetClientState *nc)
                    nc->queue_index,
                    NetClientDriver_str(nc->info->type),
                    nc->info_str);
+    if (nc->info->print_stats) {
+        nc->info->print_stats(nc, mon);
+    }
     if (!QTAILQ_EMPTY(&nc->filters)) {
         monitor_printf(mon, "filters:\n");
     }
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -38,6 +39,12 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A sender that passes QEMU_NET_PACKET_FLAG_NOCOPY together with a sent
+ * callback promises that its buffers stay valid until the callback runs;
+ * the queued packet then only records the iovec array.  The callback is
+ * invoked when the packet is eventually delivered, when it is purged and
+ * when the queue is deleted, so the sender always gets its buffers back.
  */
 
 struct NetPacket {
@@ -46,9 +53,34 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[];
+    int pool;           /* size class, or -1 if not pooled */
+    int iovcnt;         /* >0 if data[] holds the sender's iovec array */
+    uint8_t data[] QEMU_ALIGNED(sizeof(void *));
+};
+
+/*
+ * Queued packets are recycled through per-queue free lists, one per size
+ * class, so that a peer that keeps pushing back does not cost a malloc and
+ * a free per packet.  The classes cover small frames, full-sized frames
+ * and jumbo frames; anything larger (GSO packets) is allocated to size,
+ * as are packets beyond the cap of their class.
+ */
+#define NET_PACKET_POOLS 3
+
+static const struct {
+    size_t size;
+    unsigned max;
+} net_packet_pools[NET_PACKET_POOLS] = {
+    { 256, 256 },
+    { 2048, 256 },
+    { 10240, 32 },
 };
 
+typedef struct NetPacketPool {
+    QTAILQ_HEAD(, NetPacket) free;
+    unsigned count;
+} NetPacketPool;
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
@@ -56,6 +88,7 @@ struct NetQueue {
     NetQueueDeliverFunc *deliver;
 
     QTAILQ_HEAD(, NetPacket) packets;
+    NetPacketPool pools[NET_PACKET_POOLS];
 
     unsigned delivering : 1;
 };
@@ -63,6 +96,7 @@ struct NetQueue {
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 {
     NetQueue *queue;
+    int i;
 
     queue = g_new0(NetQueue, 1);
 
@@ -72,45 +106,77 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    for (i = 0; i < NET_PACKET_POOLS; i++) {
+        QTAILQ_INIT(&queue->pools[i].free);
+    }
 
     queue->delivering = 0;
 
     return queue;
 }
 
-void qemu_del_net_queue(NetQueue *queue)
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue, size_t size)
 {
-    NetPacket *packet, *next;
+    NetPacket *packet;
+    int i;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    for (i = 0; i < NET_PACKET_POOLS; i++) {
+        NetPacketPool *pool = &queue->pools[i];
+
+        if (size > net_packet_pools[i].size) {
+            continue;
+        }
+        packet = QTAILQ_FIRST(&pool->free);
+        if (packet) {
+            QTAILQ_REMOVE(&pool->free, packet, entry);
+            pool->count--;
+        } else {
+            packet = g_malloc(sizeof(NetPacket) + net_packet_pools[i].size);
+            packet->pool = i;
+        }
+        return packet;
     }
 
-    g_free(queue);
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->pool = -1;
+    return packet;
 }
 
-static void qemu_net_queue_append(NetQueue *queue,
-                                  NetClientState *sender,
-                                  unsigned flags,
-                                  const uint8_t *buf,
-                                  size_t size,
-                                  NetPacketSent *sent_cb)
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
 {
-    NetPacket *packet;
+    NetPacketPool *pool;
+
+    if (packet->pool >= 0) {
+        pool = &queue->pools[packet->pool];
+        if (pool->count < net_packet_pools[packet->pool].max) {
+            QTAILQ_INSERT_HEAD(&pool->free, packet, entry);
+            pool->count++;
+            return;
+        }
+    }
+    g_free(packet);
+}
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
+void qemu_del_net_queue(NetQueue *queue)
+{
+    NetPacket *packet, *next;
+    int i;
+
+    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
+        QTAILQ_REMOVE(&queue->packets, packet, entry);
+        /* The buffers of a NOCOPY packet belong to the sender */
+        if (packet->iovcnt) {
+            packet->sent_cb(packet->sender, 0);
+        }
+        g_free(packet);
+    }
+    for (i = 0; i < NET_PACKET_POOLS; i++) {
+        QTAILQ_FOREACH_SAFE(packet, &queue->pools[i].free, entry, next) {
+            g_free(packet);
+        }
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    g_free(queue);
 }
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -121,33 +187,46 @@ void qemu_net_queue_append_iov(NetQueue *queue,
                                NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    size_t size;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
-    }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    size = iov_size(iov, iovcnt);
+    if ((flags & QEMU_NET_PACKET_FLAG_NOCOPY) && sent_cb && iovcnt > 0) {
+        packet = qemu_net_packet_alloc(queue, iovcnt * sizeof(*iov));
+        memcpy(packet->data, iov, iovcnt * sizeof(*iov));
+        packet->iovcnt = iovcnt;
+    } else {
+        packet = qemu_net_packet_alloc(queue, size);
+        iov_to_buf(iov, iovcnt, 0, packet->data, size);
+        packet->iovcnt = 0;
+    }
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
+    packet->size = size;
 
     queue->nq_count++;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+static void qemu_net_queue_append(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const uint8_t *buf,
+                                  size_t size,
+                                  NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size
+    };
+
+    qemu_net_queue_append_iov(queue, sender, flags, &iov, 1, sent_cb);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -265,7 +344,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
@@ -283,11 +362,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iovcnt) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             (struct iovec *)packet->data,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -298,7 +385,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
     return true;
 }
@@ -46,6 +46,14 @@
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
+#include "trace.h"
+
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#include "qemu/iov.h"
+#endif
+
+typedef struct TapUring TapUring;
 
 typedef struct TAPState {
     NetClientState nc;
@@ -62,6 +70,7 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    TapUring *uring;
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -70,8 +79,23 @@ static void launch_script(const char *setup_script, const char *ifname,
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
 
+#ifdef CONFIG_LINUX_IO_URING
+static ssize_t tap_uring_receive_iov(TAPState *s, const struct iovec *iov,
+                                     int iovcnt);
+static void tap_uring_rx_resume(TAPState *s);
+static void tap_uring_post_idle(TAPState *s);
+static void tap_uring_cleanup(TAPState *s);
+#endif
+
 static void tap_update_fd_handler(TAPState *s)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        /* Completions are always reaped, only reads depend on the state */
+        tap_uring_post_idle(s);
+        return;
+    }
+#endif
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -121,6 +145,12 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     g_autofree struct iovec *iov_copy = NULL;
     struct virtio_net_hdr hdr = { };
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        return tap_uring_receive_iov(s, iov, iovcnt);
+    }
+#endif
+
     if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
         iov_copy = g_new(struct iovec, iovcnt + 1);
         iov_copy[0].iov_base = &hdr;
@@ -153,9 +183,46 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_uring_rx_resume(s);
+        return;
+    }
+#endif
     tap_read_poll(s, true);
 }
 
+/*
+ * Strip the host vnet header and pad short frames, then pass the packet on.
+ * With @nocopy, the caller does not reuse @buf before tap_send_completed()
+ * if the packet was queued, so the queue can refer to it.
+ */
+static ssize_t tap_send_packet(TAPState *s, uint8_t *buf, int size,
+                               bool nocopy)
+{
+    uint8_t min_pkt[ETH_ZLEN];
+    size_t min_pktsz = sizeof(min_pkt);
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        buf  += s->host_vnet_hdr_len;
+        size -= s->host_vnet_hdr_len;
+    }
+
+    if (net_peer_needs_padding(&s->nc)) {
+        if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            return qemu_send_packet_async(&s->nc, min_pkt, min_pktsz,
+                                          tap_send_completed);
+        }
+    }
+
+    if (nocopy) {
+        return qemu_send_packet_async_nocopy(&s->nc, buf, size,
+                                             tap_send_completed);
+    }
+    return qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
@@ -163,28 +230,12 @@ static void tap_send(void *opaque)
     int packets = 0;
 
     while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
-
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
-
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
-            }
-        }
-
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+        size = tap_send_packet(s, s->buf, size, false);
         if (size == 0) {
             tap_read_poll(s, false);
             break;
@@ -205,6 +256,427 @@ static void tap_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * io_uring mode.  A pool of reads stays posted on the tap fd, so that the
+ * kernel fills the buffers as packets arrive, and packets from the peer
+ * are copied to a pool of write buffers.  The SQEs prepared during a main
+ * loop iteration are submitted together by a bottom half, and each wakeup
+ * of the ring fd reaps all the completions that are ready: under load
+ * many packets share one io_uring_enter() instead of one read() or
+ * writev() each.
+ */
+#define TAP_URING_RX_BUFS   32
+#define TAP_URING_TX_BUFS   64
+#define TAP_URING_ENTRIES   (TAP_URING_RX_BUFS + TAP_URING_TX_BUFS)
+/* Tags the user_data of writes, the low bits are the buffer index */
+#define TAP_URING_TX        (1u << 31)
+/* Tags the user_data of cancellations, which are not counted in inflight */
+#define TAP_URING_CANCEL    (1u << 30)
+
+typedef struct TapUringBuf {
+    struct iovec iov;
+    size_t size;
+    int len;
+} TapUringBuf;
+
+struct TapUring {
+    struct io_uring ring;
+    QEMUBH *submit_bh;
+    /* SQEs prepared but not submitted yet */
+    unsigned queued;
+    /* Reads and writes whose completion was not reaped yet */
+    unsigned inflight;
+
+    TapUringBuf rx[TAP_URING_RX_BUFS];
+    /* Completed reads not delivered yet, in completion order */
+    unsigned rx_done[TAP_URING_RX_BUFS];
+    unsigned rx_done_head;
+    unsigned rx_ndone;
+    /* Reads not posted while the peer is full or the queue is disabled */
+    unsigned rx_idle[TAP_URING_RX_BUFS];
+    unsigned rx_nidle;
+    bool rx_blocked;
+    /* Read buffer of the packet the peer queued, or -1 */
+    int rx_held;
+
+    TapUringBuf tx[TAP_URING_TX_BUFS];
+    unsigned tx_free[TAP_URING_TX_BUFS];
+    unsigned tx_nfree;
+    /* A packet was refused, flush the queue when a write completes */
+    bool tx_full;
+
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t syscalls;
+};
+
+/*
+ * The ring cannot be used anymore: drop it and go back to read() and
+ * writev() on the tap fd.  The packets whose writes were not submitted
+ * are lost, like any packet the tap device would drop.
+ */
+static void tap_uring_fallback(TAPState *s)
+{
+    /*
+     * The packet the peer queued may still point to a read buffer.  Drop
+     * the undelivered ones first, so that the completion of the purged
+     * packet does not hand the peer another buffer.
+     */
+    s->uring->rx_ndone = 0;
+    qemu_purge_queued_packets(&s->nc);
+    tap_uring_cleanup(s);
+
+    if (!g_unix_set_fd_nonblocking(s->fd, true, NULL)) {
+        error_report("tap: failed to make the tap fd non-blocking: %s",
+                     strerror(errno));
+    }
+    tap_read_poll(s, true);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static void tap_uring_submit_bh(void *opaque)
+{
+    TAPState *s = opaque;
+    TapUring *u = s->uring;
+    int ret;
+
+    if (!u->queued) {
+        return;
+    }
+
+    ret = io_uring_submit(&u->ring);
+    u->syscalls++;
+    trace_tap_uring_submit(u, u->queued, ret);
+    if (ret < 0) {
+        if (ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            error_report("tap: io_uring submission failed, "
+                         "falling back to read/write: %s", strerror(-ret));
+            tap_uring_fallback(s);
+            return;
+        }
+    } else {
+        u->queued -= ret;
+    }
+    if (u->queued) {
+        qemu_bh_schedule(u->submit_bh);
+    }
+}
+
+static struct io_uring_sqe *tap_uring_get_sqe(TapUring *u)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+    /* The ring has an entry for each buffer, and a buffer has one request */
+    assert(sqe);
+    u->queued++;
+    u->inflight++;
+    qemu_bh_schedule(u->submit_bh);
+    return sqe;
+}
+
+static void tap_uring_post_read(TAPState *s, unsigned i)
+{
+    TapUring *u = s->uring;
+    struct io_uring_sqe *sqe;
+
+    if (u->rx_blocked || !s->enabled) {
+        u->rx_idle[u->rx_nidle++] = i;
+        return;
+    }
+
+    sqe = tap_uring_get_sqe(u);
+    io_uring_prep_readv(sqe, s->fd, &u->rx[i].iov, 1, 0);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+}
+
+static void tap_uring_post_idle(TAPState *s)
+{
+    TapUring *u = s->uring;
+
+    while (u->rx_nidle && !u->rx_blocked && s->enabled) {
+        tap_uring_post_read(s, u->rx_idle[--u->rx_nidle]);
+    }
+}
+
+static void tap_uring_deliver(TAPState *s)
+{
+    TapUring *u = s->uring;
+
+    while (u->rx_ndone && !u->rx_blocked) {
+        unsigned i = u->rx_done[u->rx_done_head];
+
+        u->rx_done_head = (u->rx_done_head + 1) % TAP_URING_RX_BUFS;
+        u->rx_ndone--;
+        u->rx_packets++;
+        if (tap_send_packet(s, u->rx[i].iov.iov_base, u->rx[i].len,
+                            true) == 0) {
+            /*
+             * The peer queued the packet, which may still point to the
+             * buffer: keep it until tap_send_completed()
+             */
+            u->rx_blocked = true;
+            u->rx_held = i;
+            break;
+        }
+        tap_uring_post_read(s, i);
+    }
+}
+
+static void tap_uring_rx_resume(TAPState *s)
+{
+    TapUring *u = s->uring;
+
+    u->rx_blocked = false;
+    if (u->rx_held >= 0) {
+        tap_uring_post_read(s, u->rx_held);
+        u->rx_held = -1;
+    }
+    tap_uring_deliver(s);
+    tap_uring_post_idle(s);
+}
+
+static void tap_uring_completion(void *opaque)
+{
+    TAPState *s = opaque;
+    TapUring *u = s->uring;
+    struct io_uring_cqe *cqes[TAP_URING_ENTRIES];
+    unsigned n, i, tx = 0;
+
+    n = io_uring_peek_batch_cqe(&u->ring, cqes, ARRAY_SIZE(cqes));
+    for (i = 0; i < n; i++) {
+        unsigned idx = (uintptr_t)io_uring_cqe_get_data(cqes[i]);
+        int res = cqes[i]->res;
+
+        if (idx & TAP_URING_TX) {
+            if (res < 0) {
+                trace_tap_uring_error(s, "write", res);
+            }
+            u->tx_free[u->tx_nfree++] = idx & ~TAP_URING_TX;
+            tx++;
+        } else if (res > 0) {
+            u->rx[idx].len = res;
+            u->rx_done[(u->rx_done_head + u->rx_ndone++) %
+                       TAP_URING_RX_BUFS] = idx;
+        } else if (res == -EAGAIN || res == -EINTR) {
+            tap_uring_post_read(s, idx);
+        } else {
+            /*
+             * Reposting at once would fail again and spin: park the
+             * buffer until reads resume or the queue is enabled again
+             */
+            trace_tap_uring_error(s, "read", res);
+            error_report_once("tap: io_uring read failed: %s",
+                              res ? strerror(-res) : "end of file");
+            u->rx_idle[u->rx_nidle++] = idx;
+        }
+    }
+    io_uring_cq_advance(&u->ring, n);
+    u->inflight -= n;
+    trace_tap_uring_reap(s, n, n - tx, tx);
+
+    tap_uring_deliver(s);
+    if (tx && u->tx_full) {
+        u->tx_full = false;
+        qemu_flush_queued_packets(&s->nc);
+    }
+}
+
+static ssize_t tap_uring_receive_iov(TAPState *s, const struct iovec *iov,
+                                     int iovcnt)
+{
+    TapUring *u = s->uring;
+    size_t hdr_len = s->using_vnet_hdr ? 0 : s->host_vnet_hdr_len;
+    size_t size = hdr_len + iov_size(iov, iovcnt);
+    struct io_uring_sqe *sqe;
+    TapUringBuf *buf;
+    unsigned i;
+
+    if (!u->tx_nfree) {
+        u->tx_full = true;
+        return 0;
+    }
+
+    i = u->tx_free[--u->tx_nfree];
+    buf = &u->tx[i];
+    if (buf->size < size) {
+        g_free(buf->iov.iov_base);
+        buf->iov.iov_base = g_malloc(size);
+        buf->size = size;
+    }
+    memset(buf->iov.iov_base, 0, hdr_len);
+    iov_to_buf(iov, iovcnt, 0, buf->iov.iov_base + hdr_len, size - hdr_len);
+    buf->iov.iov_len = size;
+
+    sqe = tap_uring_get_sqe(u);
+    io_uring_prep_writev(sqe, s->fd, &buf->iov, 1, 0);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)(i | TAP_URING_TX));
+    u->tx_packets++;
+    return size;
+}
+
+static bool tap_uring_init(TAPState *s, Error **errp)
+{
+    TapUring *u = g_new0(TapUring, 1);
+    unsigned i;
+    int ret;
+
+    ret = io_uring_queue_init(TAP_URING_ENTRIES, &u->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to init tap io_uring");
+        g_free(u);
+        return false;
+    }
+
+    /*
+     * io_uring completes reads of an O_NONBLOCK file with -EAGAIN when no
+     * packet is waiting, instead of arming its own poll.  Nothing else
+     * reads or writes the fd in this mode, so it can block.
+     */
+    if (!g_unix_set_fd_nonblocking(s->fd, false, NULL)) {
+        error_setg_errno(errp, errno, "failed to make the tap fd blocking");
+        io_uring_queue_exit(&u->ring);
+        g_free(u);
+        return false;
+    }
+
+    tap_read_poll(s, false);
+    tap_write_poll(s, false);
+
+    u->submit_bh = qemu_bh_new(tap_uring_submit_bh, s);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        u->rx[i].size = NET_BUFSIZE;
+        u->rx[i].iov.iov_base = g_malloc(NET_BUFSIZE);
+        u->rx[i].iov.iov_len = NET_BUFSIZE;
+    }
+    for (i = 0; i < TAP_URING_TX_BUFS; i++) {
+        u->tx_free[i] = i;
+    }
+    u->tx_nfree = TAP_URING_TX_BUFS;
+    u->rx_held = -1;
+
+    s->uring = u;
+    qemu_set_fd_handler(u->ring.ring_fd, tap_uring_completion, NULL, s);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        tap_uring_post_read(s, i);
+    }
+    return true;
+}
+
+/*
+ * Cancel the reads posted on the tap fd and wait until every request has
+ * completed.  Closing the ring only starts cancelling them: until then the
+ * kernel could copy a packet into a freed buffer, or steal it from the
+ * read() handler after a fallback.  The packets that were read meanwhile
+ * are dropped.  Returns false if the requests could not be cancelled.
+ */
+static int tap_uring_drain_one(TapUring *u)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    do {
+        ret = io_uring_wait_cqe(&u->ring, &cqe);
+    } while (ret == -EINTR);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!((uintptr_t)io_uring_cqe_get_data(cqe) & TAP_URING_CANCEL)) {
+        u->inflight--;
+    }
+    io_uring_cqe_seen(&u->ring, cqe);
+    return 0;
+}
+
+static bool tap_uring_drain(TAPState *s)
+{
+    TapUring *u = s->uring;
+    unsigned i;
+    int ret;
+
+    while (u->queued) {
+        ret = io_uring_submit(&u->ring);
+        if (ret == -EAGAIN || ret == -EBUSY) {
+            /* Make room in the completion queue */
+            ret = u->inflight > u->queued ? tap_uring_drain_one(u) : ret;
+        }
+        if (ret < 0 && ret != -EINTR) {
+            return false;
+        }
+        u->queued -= MAX(ret, 0);
+    }
+
+    /* Writes complete on their own, only reads wait for packets */
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+        assert(sqe);
+        io_uring_prep_cancel(sqe, (void *)(uintptr_t)i, 0);
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)(i | TAP_URING_CANCEL));
+    }
+    do {
+        ret = io_uring_submit(&u->ring);
+    } while (ret == -EINTR);
+    if (ret < 0) {
+        return false;
+    }
+
+    while (u->inflight) {
+        if (tap_uring_drain_one(u) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tap_uring_cleanup(TAPState *s)
+{
+    TapUring *u = s->uring;
+    unsigned i;
+
+    if (!u) {
+        return;
+    }
+
+    qemu_set_fd_handler(u->ring.ring_fd, NULL, NULL, NULL);
+    qemu_bh_delete(u->submit_bh);
+    if (!tap_uring_drain(s)) {
+        /* The kernel may still write to the buffers: leak them */
+        error_report("tap: failed to cancel the io_uring requests");
+        io_uring_queue_exit(&u->ring);
+        s->uring = NULL;
+        return;
+    }
+    io_uring_queue_exit(&u->ring);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        g_free(u->rx[i].iov.iov_base);
+    }
+    for (i = 0; i < TAP_URING_TX_BUFS; i++) {
+        g_free(u->tx[i].iov.iov_base);
+    }
+    g_free(u);
+    s->uring = NULL;
+}
+
+static void tap_uring_print_stats(NetClientState *nc, Monitor *mon)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    TapUring *u = s->uring;
+    uint64_t packets;
+
+    if (!u) {
+        return;
+    }
+
+    packets = u->rx_packets + u->tx_packets;
+    monitor_printf(mon, "  io_uring: rx_packets=%" PRIu64
+                   " tx_packets=%" PRIu64 " syscalls=%" PRIu64
+                   " packets/syscall=%.1f\n",
+                   u->rx_packets, u->tx_packets, u->syscalls,
+                   u->syscalls ? (double)packets / u->syscalls : 0.0);
+}
+#endif
+
 static bool tap_has_ufo(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -301,6 +773,9 @@ static void tap_cleanup(NetClientState *nc)
     tap_exit_notify(&s->exit, NULL);
     qemu_remove_exit_notifier(&s->exit);
 
+#ifdef CONFIG_LINUX_IO_URING
+    tap_uring_cleanup(s);
+#endif
     tap_read_poll(s, false);
     tap_write_poll(s, false);
     close(s->fd);
@@ -347,6 +822,9 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+#ifdef CONFIG_LINUX_IO_URING
+    .print_stats = tap_uring_print_stats,
+#endif
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -718,6 +1196,21 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         goto failed;
     }
 
+    if (tap->has_io_uring && tap->io_uring) {
+        if (s->vhost_net) {
+            error_setg(errp, "io-uring=on is not valid with vhost");
+            goto failed;
+        }
+#ifdef CONFIG_LINUX_IO_URING
+        if (!tap_uring_init(s, errp)) {
+            goto failed;
+        }
+#else
+        error_setg(errp, "io-uring=on is not supported by this build");
+        goto failed;
+#endif
+    }
+
     return;
 
 failed:
@@ -28,6 +28,7 @@
 #include "monitor/monitor.h"
 #include "migration/misc.h"
 #include "hw/virtio/vhost.h"
+#include "sysemu/iothread.h"
 #include "trace.h"
 
 /* Todo:need to add the multiqueue support here */
@@ -47,6 +48,9 @@ typedef struct VhostVDPAState {
     /* The device can isolate CVQ in its own ASID */
     bool cvq_isolated;
 
+    /* IOThread relaying the data shadow virtqueues, if any */
+    IOThread *svq_iothread;
+
     bool started;
 } VhostVDPAState;
 
@@ -237,6 +241,10 @@ static void vhost_vdpa_cleanup(NetClientState *nc)
         g_free(s->vhost_net);
         s->vhost_net = NULL;
     }
+    if (s->svq_iothread) {
+        object_unref(OBJECT(s->svq_iothread));
+        s->svq_iothread = NULL;
+    }
     if (s->vhost_vdpa.index != 0) {
         return;
     }
@@ -426,6 +434,33 @@ static void vhost_vdpa_net_client_stop(NetClientState *nc)
     }
 }
 
+/* Relay counters of the shadow virtqueues, kept across SVQ restarts */
+static void vhost_vdpa_print_stats(NetClientState *nc, Monitor *mon)
+{
+    VhostVDPAState *s = DO_UPCAST(VhostVDPAState, nc, nc);
+    GPtrArray *svqs = s->vhost_vdpa.shadow_vqs;
+    unsigned i;
+
+    if (!svqs || !s->vhost_vdpa.dev) {
+        return;
+    }
+
+    for (i = 0; i < svqs->len; i++) {
+        VhostShadowVirtqueue *svq = g_ptr_array_index(svqs, i);
+        uint64_t runs = stat64_get(&svq->stats.relay_runs);
+
+        monitor_printf(mon, "  svq %u: avail=%" PRIu64 " used=%" PRIu64
+                       " kicks=%" PRIu64 " relay_runs=%" PRIu64
+                       " relay_ns_avg=%" PRIu64 " relay_ns_max=%" PRIu64 "\n",
+                       s->vhost_vdpa.dev->vq_index + i,
+                       stat64_get(&svq->stats.avail_elems),
+                       stat64_get(&svq->stats.used_elems),
+                       stat64_get(&svq->stats.device_kicks), runs,
+                       runs ? stat64_get(&svq->stats.relay_ns) / runs : 0,
+                       stat64_get(&svq->stats.relay_ns_max));
+    }
+}
+
 static NetClientInfo net_vhost_vdpa_info = {
         .type = NET_CLIENT_DRIVER_VHOST_VDPA,
         .size = sizeof(VhostVDPAState),
@@ -438,6 +473,7 @@ static NetClientInfo net_vhost_vdpa_info = {
         .has_ufo = vhost_vdpa_has_ufo,
         .check_peer_type = vhost_vdpa_check_peer_type,
         .set_steering_ebpf = vhost_vdpa_set_steering_ebpf,
+        .print_stats = vhost_vdpa_print_stats,
 };
 
 static int64_t vhost_vdpa_get_vring_group(int device_fd, unsigned vq_index,
@@ -1305,6 +1341,7 @@ static NetClientInfo net_vhost_vdpa_cvq_info = {
     .has_ufo = vhost_vdpa_has_ufo,
     .check_peer_type = vhost_vdpa_check_peer_type,
     .set_steering_ebpf = vhost_vdpa_set_steering_ebpf,
+    .print_stats = vhost_vdpa_print_stats,
 };
 
 /*
@@ -1675,6 +1712,8 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
                                        int nvqs,
                                        bool is_datapath,
                                        bool svq,
+                                       IOThread *svq_iothread,
+                                       bool svq_poll,
                                        struct vhost_vdpa_iova_range iova_range,
                                        uint64_t features,
                                        VhostVDPAShared *shared,
@@ -1707,6 +1746,12 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
     s->always_svq = svq;
     s->migration_state.notify = NULL;
     s->vhost_vdpa.shadow_vqs_enabled = svq;
+    if (svq_iothread) {
+        s->svq_iothread = svq_iothread;
+        object_ref(OBJECT(svq_iothread));
+        s->vhost_vdpa.svq_ctx = iothread_get_aio_context(svq_iothread);
+        s->vhost_vdpa.svq_poll = svq_poll;
+    }
     if (queue_pair_index == 0) {
         vhost_vdpa_net_valid_svq_features(features,
                                           &s->vhost_vdpa.migration_blocker);
@@ -1792,6 +1837,7 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
     g_autofree NetClientState **ncs = NULL;
     struct vhost_vdpa_iova_range iova_range;
     NetClientState *nc;
+    strList *svq_iothread = NULL;
     int queue_pairs, r, i = 0, has_cvq = 0;
 
     assert(netdev->type == NET_CLIENT_DRIVER_VHOST_VDPA);
@@ -1845,16 +1891,39 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
         goto err;
     }
 
+    for (strList *l = opts->x_svq_iothreads; l; l = l->next) {
+        if (!iothread_by_id(l->value)) {
+            error_setg(errp, "vhost-vdpa: IOThread '%s' not found", l->value);
+            goto err;
+        }
+    }
+
+    if (opts->x_svq_poll && !opts->x_svq_iothreads) {
+        error_setg(errp, "vhost-vdpa: x-svq-poll requires x-svq-iothreads");
+        goto err;
+    }
+
     ncs = g_malloc0(sizeof(*ncs) * queue_pairs);
 
     for (i = 0; i < queue_pairs; i++) {
         VhostVDPAShared *shared = NULL;
 
+        IOThread *iothread = NULL;
+
         if (i) {
             shared = DO_UPCAST(VhostVDPAState, nc, ncs[0])->vhost_vdpa.shared;
         }
+        if (opts->x_svq_iothreads) {
+            /* Spread the queue pairs round-robin over the IOThreads */
+            if (!svq_iothread) {
+                svq_iothread = opts->x_svq_iothreads;
+            }
+            iothread = iothread_by_id(svq_iothread->value);
+            svq_iothread = svq_iothread->next;
+        }
         ncs[i] = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                      vdpa_device_fd, i, 2, true, opts->x_svq,
+                                     iothread, opts->x_svq_poll,
                                      iova_range, features, shared, errp);
         if (!ncs[i])
             goto err;
@@ -1866,8 +1935,8 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
 
         nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                  vdpa_device_fd, i, 1, false,
-                                 opts->x_svq, iova_range, features, shared,
-                                 errp);
+                                 opts->x_svq, NULL, false, iova_range,
+                                 features, shared, errp);
         if (!nc)
             goto err;
     }
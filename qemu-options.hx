@@ -187,7 +187,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
-    "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                dirty-ring-size=n (KVM dirty ring GFN count or TCG dirty ring size, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n"
@@ -248,6 +248,16 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+        With the TCG accelerator, it enables a per-vCPU ring of the given
+        number of entries (a power of two, at most 65536) that records
+        pages written by the guest while dirty tracking is active, instead
+        of updating the shared migration dirty bitmap from every vCPU
+        thread.  The rings are harvested on
+        each dirty bitmap sync; when a ring fills up the vCPU harvests it
+        itself, which is reported as a "ring full exit" by ``info jit``.
+        TCG dirty rings also enable the dirty-ring mode of
+        ``calc-dirty-rate``.
+
     ``eager-split-size=n``
         KVM implements dirty page logging at the PAGE_SIZE granularity and
         enabling dirty-logging on a huge-page requires breaking it into
@@ -2645,6 +2655,27 @@ SRST
     ``power-control=on|off``
         Permit the remote client to issue shutdown, reboot or reset power
         control requests.
+
+    ``encoders=n``
+        Number of threads encoding framebuffer updates, between 1 and 64.
+        The threads are shared by all VNC displays and the largest value
+        wins. Updates of different clients are encoded in parallel, and
+        large updates using the raw or hextile encodings are split across
+        idle threads. Default is 1.
+
+    ``shared-encoding=on|off``
+        Encode an update only once for all the clients that use the same
+        encoding, pixel format and quality settings, and send each of them
+        a copy. This saves CPU time when many viewers watch the same
+        display. Clients using the zlib or ZRLE encodings always have
+        their own encoder. Default is off.
+
+    ``parallel-tight=on|off``
+        Split large updates of clients using the Tight encoding across
+        idle encoder threads, like the raw and hextile encodings. Each
+        part restarts the compression streams, so updates get somewhat
+        bigger in exchange for a lower latency. Only useful with
+        ``encoders`` greater than 1. Default is off.
 ERST
 
 ARCHHEADING(, QEMU_ARCH_I386)
@@ -2831,7 +2862,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,io-uring=on|off]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -2854,6 +2885,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to specify the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use io-uring=on to read and write packets with io_uring\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -2904,11 +2936,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev dgram,id=str,remote.type=inet,remote.host=maddr,remote.port=port[,local.type=fd,local.str=file-descriptor]\n"
     "                configure a network backend to connect to a multicast maddr and port\n"
     "                use ``local.host=addr`` to specify the host address to send packets from\n"
-    "-netdev dgram,id=str,local.type=inet,local.host=addr,local.port=port[,remote.type=inet,remote.host=addr,remote.port=port]\n"
+    "-netdev dgram,id=str,local.type=inet,local.host=addr,local.port=port[,remote.type=inet,remote.host=addr,remote.port=port][,gso=on|off]\n"
     "-netdev dgram,id=str,local.type=unix,local.path=path[,remote.type=unix,remote.path=path]\n"
-    "-netdev dgram,id=str,local.type=fd,local.str=file-descriptor\n"
+    "-netdev dgram,id=str,local.type=fd,local.str=file-descriptor[,gso=on|off]\n"
     "                configure a network backend to connect to another network\n"
     "                using an UDP tunnel\n"
+    "                use gso=on to send and receive bursts with UDP GSO and GRO (Linux only)\n"
 #ifdef CONFIG_VDE
     "-netdev vde,id=str[,sock=socketpath][,port=n][,group=groupname][,mode=octalmode]\n"
     "                configure a network backend to connect to port 'n' of a vde switch\n"
@@ -3238,6 +3271,13 @@ SRST
     ``fd``\ =h can be used to specify the handle of an already opened
     host TAP interface.
 
+    ``io-uring=on`` makes QEMU read and write packets through io_uring
+    instead of one system call per packet.  A pool of reads is kept
+    posted on the TAP device and the packets sent by the guest in one
+    main loop iteration are submitted together.  ``info network`` shows
+    the number of packets per ``io_uring_enter()`` call.  This option is
+    only available on Linux hosts and cannot be combined with vhost.
+
     Examples:
 
     .. parsed-literal::
@@ -5482,13 +5522,23 @@ SRST
         filter-redirector,id=f2,netdev=hn0,queue=rx,outdev=red1 -object
         filter-rewriter,id=rew0,netdev=hn0,queue=all
 
-    ``-object filter-dump,id=id,netdev=dev[,file=filename][,maxlen=len][,position=head|tail|id=<id>][,insert=behind|before]``
+    ``-object filter-dump,id=id,netdev=dev[,file=filename][,maxlen=len][,bufsize=size][,rotate-size=size][,rotate-interval=sec][,position=head|tail|id=<id>][,insert=behind|before]``
         Dump the network traffic on netdev dev to the file specified by
         filename. At most len bytes (64k by default) per packet are
         stored. The file format is libpcap, so it can be analyzed with
         tools such as tcpdump or Wireshark.
 
-    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}]``
+        Packets are written by a separate thread from a buffer of
+        ``bufsize`` bytes (4M by default). If the disk does not keep up
+        and the buffer fills, packets are left out of the dump rather
+        than slowing down the network; the read-only ``dropped`` property
+        counts them. With ``rotate-size`` or ``rotate-interval``, the dump
+        moves on to filename.1, filename.2 and so on when the current
+        file reaches that size or that age in seconds. If the writer falls
+        behind by more than 16 rotations, the current file grows past
+        these limits until it catches up, and a warning is printed.
+
+    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}][,shards=@var{n}]``
         Colo-compare gets packet from primary\_in chardevid and
         secondary\_in, then compare whether the payload of primary packet
         and secondary packet are the same. If same, it will output
@@ -5502,6 +5552,12 @@ SRST
         is to set the period of scanning expired primary node network packets.
         The max\_queue\_size=@var{size} is to set the max compare queue
         size depend on user environment.
+        The shards=@var{n} option spreads the connections over @var{n}
+        worker threads that compare their packets, leaving only the
+        parsing and the sending to the iothread; the default, 1, compares
+        everything in the iothread. The packets waiting for a worker are
+        limited by max\_queue\_size too. Per-shard counters are available
+        in the read-only ``stats`` property.
         If user want to use Xen COLO, need to add the notify\_dev to
         notify Xen colo-frame to do checkpoint.
 
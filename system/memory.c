@@ -50,6 +50,18 @@ static QTAILQ_HEAD(, AddressSpace) address_spaces
 
 static GHashTable *flat_views;
 
+/*
+ * Address ranges of each FlatView in flat_views that were touched by the
+ * current transaction, keyed by the FlatView's root.  Views without an
+ * entry can be reused as they are at commit time.
+ */
+static GHashTable *flat_views_dirty;
+static bool flat_views_full_update;
+static bool flat_views_incremental = true;
+
+/* Past this many dirty ranges, re-render the whole view. */
+#define FLATVIEW_MAX_DIRTY_RANGES 64
+
 typedef struct AddrRange AddrRange;
 
 /*
@@ -749,10 +761,25 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
+static void flatview_commit_topology(FlatView *view, MemoryRegion *mr)
+{
+    int i;
+
+    flatview_simplify(view);
+
+    view->dispatch = address_space_dispatch_new(view);
+    for (i = 0; i < view->nr; i++) {
+        MemoryRegionSection mrs =
+            section_from_flat_range(&view->ranges[i], view);
+        flatview_add_to_dispatch(view, &mrs);
+    }
+    address_space_dispatch_compact(view->dispatch);
+    g_hash_table_replace(flat_views, mr, view);
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
-    int i;
     FlatView *view;
 
     view = flatview_new(mr);
@@ -762,16 +789,176 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
                              addrrange_make(int128_zero(), int128_2_64()),
                              false, false, false);
     }
-    flatview_simplify(view);
+    flatview_commit_topology(view, mr);
 
-    view->dispatch = address_space_dispatch_new(view);
-    for (i = 0; i < view->nr; i++) {
-        MemoryRegionSection mrs =
-            section_from_flat_range(&view->ranges[i], view);
-        flatview_add_to_dispatch(view, &mrs);
+    return view;
+}
+
+/*
+ * Record that the rendering of @mr may have changed within @range, which
+ * is expressed in @mr's own coordinates.  The range is propagated to every
+ * FlatView root that renders @mr, both through containers and through
+ * aliases.  Callers mark the affected extent both before and after a
+ * topology change, so that the old and the new placement are covered.
+ */
+static void flatviews_mark_dirty(MemoryRegion *mr, AddrRange range)
+{
+    MemoryRegion *alias;
+    GArray *dirty;
+
+    if (!flat_views || flat_views_full_update || !flat_views_incremental ||
+        !mr->enabled) {
+        return;
     }
-    address_space_dispatch_compact(view->dispatch);
-    g_hash_table_replace(flat_views, mr, view);
+
+    range = addrrange_intersection(range,
+                                   addrrange_make(int128_zero(), mr->size));
+    if (int128_le(range.size, int128_zero())) {
+        return;
+    }
+
+    if (g_hash_table_contains(flat_views, mr)) {
+        dirty = g_hash_table_lookup(flat_views_dirty, mr);
+        if (!dirty) {
+            dirty = g_array_new(false, false, sizeof(AddrRange));
+            g_hash_table_insert(flat_views_dirty, mr, dirty);
+        }
+        if (dirty->len < FLATVIEW_MAX_DIRTY_RANGES) {
+            AddrRange abs = addrrange_shift(range, int128_make64(mr->addr));
+
+            abs = addrrange_intersection(abs,
+                                         addrrange_make(int128_zero(),
+                                                        int128_2_64()));
+            g_array_append_val(dirty, abs);
+        } else {
+            AddrRange all = addrrange_make(int128_zero(), int128_2_64());
+            g_array_set_size(dirty, 1);
+            g_array_index(dirty, AddrRange, 0) = all;
+        }
+    }
+
+    QLIST_FOREACH(alias, &mr->aliased_by, aliased_by_link) {
+        Int128 delta = int128_neg(int128_make64(alias->alias_offset));
+
+        flatviews_mark_dirty(alias, addrrange_shift(range, delta));
+    }
+
+    if (mr->container) {
+        flatviews_mark_dirty(mr->container,
+                             addrrange_shift(range, int128_make64(mr->addr)));
+    }
+}
+
+static void memory_region_mark_dirty(MemoryRegion *mr)
+{
+    flatviews_mark_dirty(mr, addrrange_make(int128_zero(), mr->size));
+}
+
+static gint addrrange_compare_start(gconstpointer a, gconstpointer b)
+{
+    const AddrRange *r1 = a, *r2 = b;
+
+    if (int128_lt(r1->start, r2->start)) {
+        return -1;
+    }
+    return int128_eq(r1->start, r2->start) ? 0 : 1;
+}
+
+/* Sort @dirty and merge overlapping or adjacent ranges. */
+static void flatview_normalize_dirty(GArray *dirty)
+{
+    unsigned i, j;
+
+    g_array_sort(dirty, addrrange_compare_start);
+    for (i = 0, j = 1; j < dirty->len; j++) {
+        AddrRange *cur = &g_array_index(dirty, AddrRange, i);
+        AddrRange *next = &g_array_index(dirty, AddrRange, j);
+
+        if (int128_le(next->start, addrrange_end(*cur))) {
+            Int128 end = int128_max(addrrange_end(*cur), addrrange_end(*next));
+            cur->size = int128_sub(end, cur->start);
+        } else {
+            g_array_index(dirty, AddrRange, ++i) = *next;
+        }
+    }
+    if (dirty->len) {
+        g_array_set_size(dirty, i + 1);
+    }
+}
+
+/*
+ * Copy the parts of @old that lie outside the sorted, disjoint ranges in
+ * @dirty into the empty view @view.
+ */
+static void flatview_copy_clean(FlatView *view, const FlatView *old,
+                                GArray *dirty)
+{
+    unsigned i, j = 0;
+
+    for (i = 0; i < old->nr; i++) {
+        FlatRange fr = old->ranges[i];
+        Int128 end = addrrange_end(fr.addr);
+
+        while (int128_lt(fr.addr.start, end)) {
+            Int128 stop = end;
+            Int128 now;
+
+            while (j < dirty->len &&
+                   int128_le(addrrange_end(g_array_index(dirty, AddrRange, j)),
+                             fr.addr.start)) {
+                j++;
+            }
+            if (j < dirty->len) {
+                AddrRange d = g_array_index(dirty, AddrRange, j);
+
+                if (int128_le(d.start, fr.addr.start)) {
+                    /* Skip the part that will be re-rendered. */
+                    now = int128_sub(int128_min(end, addrrange_end(d)),
+                                     fr.addr.start);
+                    int128_addto(&fr.addr.start, now);
+                    fr.offset_in_region += int128_get64(now);
+                    continue;
+                }
+                stop = int128_min(end, d.start);
+            }
+
+            now = int128_sub(stop, fr.addr.start);
+            fr.addr.size = now;
+            flatview_insert(view, view->nr, &fr);
+            int128_addto(&fr.addr.start, now);
+            fr.offset_in_region += int128_get64(now);
+        }
+    }
+}
+
+/*
+ * Build a new FlatView for @mr out of @old, re-rendering only the ranges
+ * in @dirty.  Everything else is known not to have changed since @old was
+ * generated.
+ *
+ * This only saves the walk of the MemoryRegion tree outside @dirty: every
+ * FlatRange of @old is still copied, and flatview_commit_topology() still
+ * rebuilds the whole dispatch tree of the new view.  The big win is for
+ * views that were not touched at all, which are reused as they are.
+ */
+static FlatView *update_memory_topology(MemoryRegion *mr, FlatView *old,
+                                        GArray *dirty)
+{
+    FlatView *view;
+    unsigned i;
+
+    flatview_normalize_dirty(dirty);
+
+    view = flatview_new(mr);
+    trace_flatview_update_incremental(view, mr, dirty->len);
+
+    flatview_copy_clean(view, old, dirty);
+    for (i = 0; i < dirty->len; i++) {
+        render_memory_region(view, mr, int128_zero(),
+                             g_array_index(dirty, AddrRange, i),
+                             false, false, false);
+    }
+    flatview_commit_topology(view, mr);
 
     return view;
 }
@@ -1020,6 +1207,10 @@ static void flatviews_init(void)
 
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                        (GDestroyNotify) flatview_unref);
+    flat_views_dirty = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL,
+                                             (GDestroyNotify) g_array_unref);
+    flat_views_full_update = false;
     if (!empty_view) {
         empty_view = generate_memory_topology(NULL);
         /* We keep it alive forever in the global variable.  */
@@ -1033,22 +1224,42 @@ static void flatviews_init(void)
 static void flatviews_reset(void)
 {
     AddressSpace *as;
+    GHashTable *old_views = flat_views;
+    GHashTable *dirty_views = flat_views_dirty;
+    bool full_update = flat_views_full_update || !flat_views_incremental;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /* Render unique FVs, reusing whatever the transaction did not touch */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view;
+        GArray *dirty;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
-        generate_memory_topology(physmr);
+        old_view = old_views && !full_update ?
+            g_hash_table_lookup(old_views, physmr) : NULL;
+        if (!old_view) {
+            generate_memory_topology(physmr);
+            continue;
+        }
+
+        dirty = g_hash_table_lookup(dirty_views, physmr);
+        if (dirty) {
+            update_memory_topology(physmr, old_view, dirty);
+        } else {
+            flatview_ref(old_view);
+            g_hash_table_replace(flat_views, physmr, old_view);
+        }
+    }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+        g_hash_table_unref(dirty_views);
     }
 }
 
@@ -1144,6 +1355,20 @@ void memory_region_transaction_commit(void)
    }
 }
 
+bool memory_region_get_incremental_update(void)
+{
+    return flat_views_incremental;
+}
+
+void memory_region_set_incremental_update(bool enable)
+{
+    /* Ranges were not recorded while disabled: start over from scratch */
+    if (enable && !flat_views_incremental) {
+        flat_views_full_update = true;
+    }
+    flat_views_incremental = enable;
+}
+
 static void memory_region_destructor_none(MemoryRegion *mr)
 {
 }
@@ -1279,6 +1504,7 @@ static void memory_region_initfn(Object *obj)
     mr->destructor = memory_region_destructor_none;
     QTAILQ_INIT(&mr->subregions);
     QTAILQ_INIT(&mr->coalesced);
+    QLIST_INIT(&mr->aliased_by);
 
     op = object_property_add(OBJECT(mr), "container",
                              "link<" TYPE_MEMORY_REGION ">",
@@ -1705,6 +1931,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, owner, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    QLIST_INSERT_HEAD(&orig->aliased_by, mr, aliased_by_link);
 }
 
 bool memory_region_init_rom_nomigrate(MemoryRegion *mr,
@@ -1787,6 +2014,12 @@ static void memory_region_finalize(Object *obj)
     }
     memory_region_transaction_commit();
 
+    QLIST_SAFE_REMOVE(mr, aliased_by_link);
+    while (!QLIST_EMPTY(&mr->aliased_by)) {
+        MemoryRegion *alias = QLIST_FIRST(&mr->aliased_by);
+        QLIST_SAFE_REMOVE(alias, aliased_by_link);
+    }
+
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
     g_free((char *)mr->name);
@@ -2235,6 +2468,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
+    memory_region_mark_dirty(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -2365,6 +2599,7 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
+        memory_region_mark_dirty(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -2375,6 +2610,7 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
+        memory_region_mark_dirty(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -2385,6 +2621,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
+        memory_region_mark_dirty(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -2621,6 +2858,7 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
+    memory_region_mark_dirty(subregion);
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
@@ -2664,6 +2902,7 @@ void memory_region_del_subregion(MemoryRegion *mr,
 
     memory_region_transaction_begin();
     assert(subregion->container == mr);
+    memory_region_mark_dirty(subregion);
     subregion->container = NULL;
     for (alias = subregion->alias; alias; alias = alias->alias) {
         alias->mapped_via_alias--;
@@ -2681,7 +2920,9 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_mark_dirty(mr);
     mr->enabled = enabled;
+    memory_region_mark_dirty(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -2697,7 +2938,9 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_mark_dirty(mr);
     mr->size = s;
+    memory_region_mark_dirty(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -2719,8 +2962,12 @@ static void memory_region_readd_subregion(MemoryRegion *mr)
 void memory_region_set_address(MemoryRegion *mr, hwaddr addr)
 {
     if (addr != mr->addr) {
+        memory_region_transaction_begin();
+        memory_region_mark_dirty(mr);
         mr->addr = addr;
         memory_region_readd_subregion(mr);
+        memory_region_mark_dirty(mr);
+        memory_region_transaction_commit();
     }
 }
 
@@ -2734,6 +2981,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
+    memory_region_mark_dirty(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -2746,6 +2994,7 @@ void memory_region_set_unmergeable(MemoryRegion *mr, bool unmergeable)
 
     memory_region_transaction_begin();
     mr->unmergeable = unmergeable;
+    memory_region_mark_dirty(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -2946,6 +3195,7 @@ bool memory_global_dirty_log_start(unsigned int flags, Error **errp)
 
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        flat_views_full_update = true;
         memory_region_transaction_commit();
     }
     return true;
@@ -2962,6 +3212,7 @@ static void memory_global_dirty_log_do_stop(unsigned int flags)
     if (!global_dirty_tracking) {
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        flat_views_full_update = true;
         memory_region_transaction_commit();
         MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
     }
@@ -0,0 +1,100 @@
+/*
+ * QEMU LUKS block driver speed benchmark
+ *
+ * Reads and writes a LUKS image in a temporary file through the whole
+ * block layer, one request at a time, so that the figures include the
+ * bounce buffer, the encryption offload and the file I/O.  With the
+ * image in the page cache, the cipher is what limits the throughput.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qom/object_interfaces.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "crypto/init.h"
+#include "crypto/secret.h"
+
+#define IMAGE_SIZE  (64 * MiB)
+#define TOTAL       (512 * MiB)
+
+static char *img_path;
+
+static void test_block_speed(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    g_autofree uint8_t *buf = g_malloc(chunk_size);
+    QDict *options = qdict_new();
+    BlockBackend *blk;
+    int64_t offset;
+    size_t remain;
+
+    memset(buf, g_test_rand_int(), chunk_size);
+
+    qdict_put_str(options, "driver", "luks");
+    qdict_put_str(options, "key-secret", "sec0");
+    blk = blk_new_open(img_path, NULL, options, BDRV_O_RDWR, &error_abort);
+
+    g_test_timer_start();
+    for (remain = TOTAL, offset = 0; remain; remain -= chunk_size) {
+        g_assert(blk_pwrite(blk, offset, chunk_size, buf, 0) == 0);
+        offset = (offset + chunk_size) % IMAGE_SIZE;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("write(luks) chunk %zu bytes %.2f MB/sec",
+                   chunk_size, (double)TOTAL / MiB / g_test_timer_last());
+
+    g_test_timer_start();
+    for (remain = TOTAL, offset = 0; remain; remain -= chunk_size) {
+        g_assert(blk_pread(blk, offset, chunk_size, buf, 0) == 0);
+        offset = (offset + chunk_size) % IMAGE_SIZE;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("read(luks) chunk %zu bytes %.2f MB/sec",
+                   chunk_size, (double)TOTAL / MiB / g_test_timer_last());
+
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    g_autofree char *opts = g_strdup("key-secret=sec0,iter-time=10");
+    size_t i;
+    int fd, ret;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+    g_assert(qcrypto_init(NULL) == 0);
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+
+    object_new_with_props(TYPE_QCRYPTO_SECRET, object_get_objects_root(),
+                          "sec0", &error_abort, "data", "123456", NULL);
+
+    fd = g_file_open_tmp("qemu-crypto-block-XXXXXX", &img_path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+    bdrv_img_create(img_path, "luks", NULL, NULL, opts, IMAGE_SIZE, 0, true,
+                    &error_abort);
+
+    for (i = 4 * KiB; i <= 1 * MiB; i *= 4) {
+        g_autofree char *name = g_strdup_printf("/crypto/block/luks/%zu", i);
+        g_test_add_data_func(name, (void *)i, test_block_speed);
+    }
+
+    ret = g_test_run();
+
+    unlink(img_path);
+    g_free(img_path);
+    return ret;
+}
@@ -0,0 +1,207 @@
+/*
+ * QEMU buffer_diff_copy speed benchmark
+ *
+ * Replays the framebuffer refresh of the VNC server on a 3840x2160 32bpp
+ * surface: for each frame, the runs of 16-pixel blocks marked dirty are
+ * compared with the server copy and the blocks that changed are copied.
+ * The damage patterns mimic what guests typically report: a whole screen
+ * marked dirty with nothing changed (framebuffers without dirty tracking),
+ * a terminal with a few characters changing, a video window, a full
+ * screen scroll and a moving cursor.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/bitops.h"
+#include "qemu/units.h"
+
+#define WIDTH       3840
+#define HEIGHT      2160
+#define BPP         4
+#define BLOCK_PX    16
+#define BLOCK       (BLOCK_PX * BPP)
+#define BLOCKS      (WIDTH / BLOCK_PX)
+#define STRIDE      (WIDTH * BPP)
+
+typedef struct Damage {
+    int x, y, w, h;
+    int changed_pct;    /* share of the damaged blocks with new content */
+} Damage;
+
+typedef struct DamagePattern {
+    const char *name;
+    const Damage *damage;
+    int n_damage;
+} DamagePattern;
+
+static const Damage idle_full[] = {
+    { 0, 0, WIDTH, HEIGHT, 0 },
+};
+
+static const Damage terminal[] = {
+    { 0, 0, 1280, 800, 2 },
+};
+
+static const Damage video[] = {
+    { 1280, 720, 1280, 720, 100 },
+};
+
+static const Damage scroll[] = {
+    { 0, 0, WIDTH, HEIGHT, 100 },
+};
+
+static const Damage cursor[] = {
+    { 1900, 1000, 32, 32, 100 },
+    { 1910, 1004, 32, 32, 100 },
+    { 1920, 1008, 32, 32, 100 },
+};
+
+static const DamagePattern patterns[] = {
+    { "idle-full", idle_full, ARRAY_SIZE(idle_full) },
+    { "terminal", terminal, ARRAY_SIZE(terminal) },
+    { "video", video, ARRAY_SIZE(video) },
+    { "scroll", scroll, ARRAY_SIZE(scroll) },
+    { "cursor", cursor, ARRAY_SIZE(cursor) },
+};
+
+typedef struct Frame {
+    uint8_t *guest;
+    uint8_t *server;
+    unsigned long *dirty;   /* HEIGHT lines of BLOCKS bits */
+    size_t dirty_bytes;     /* bytes covered by the dirty runs */
+} Frame;
+
+static unsigned long *frame_row(Frame *f, int y)
+{
+    return f->dirty + y * BITS_TO_LONGS(BLOCKS);
+}
+
+/* Mark the damage dirty and change the guest content of some blocks */
+static void frame_damage(Frame *f, const DamagePattern *p, uint32_t seed)
+{
+    int i, x, y;
+
+    f->dirty_bytes = 0;
+    for (i = 0; i < p->n_damage; i++) {
+        const Damage *d = &p->damage[i];
+        int x0 = d->x / BLOCK_PX;
+        int x1 = DIV_ROUND_UP(d->x + d->w, BLOCK_PX);
+
+        for (y = d->y; y < d->y + d->h; y++) {
+            bitmap_set(frame_row(f, y), x0, x1 - x0);
+            f->dirty_bytes += (x1 - x0) * BLOCK;
+            for (x = x0; x < x1; x++) {
+                seed = seed * 1103515245 + 12345;
+                if ((seed >> 16) % 100 < d->changed_pct) {
+                    f->guest[y * STRIDE + x * BLOCK + (seed & (BLOCK - 1))]++;
+                }
+            }
+        }
+    }
+}
+
+/* The refresh loop before buffer_diff_copy(), one block at a time */
+static size_t refresh_blocks(Frame *f)
+{
+    size_t n = 0;
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y++) {
+        unsigned long *row = frame_row(f, y);
+
+        for (x = find_first_bit(row, BLOCKS); x < BLOCKS;
+             x = find_next_bit(row, BLOCKS, x + 1)) {
+            uint8_t *g = f->guest + y * STRIDE + x * BLOCK;
+            uint8_t *s = f->server + y * STRIDE + x * BLOCK;
+
+            clear_bit(x, row);
+            if (memcmp(s, g, BLOCK)) {
+                memcpy(s, g, BLOCK);
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+static size_t refresh_runs(Frame *f)
+{
+    DECLARE_BITMAP(changed, BLOCKS);
+    size_t n = 0;
+    int x, x2, y;
+
+    for (y = 0; y < HEIGHT; y++) {
+        unsigned long *row = frame_row(f, y);
+
+        for (x = find_first_bit(row, BLOCKS); x < BLOCKS;
+             x = find_next_bit(row, BLOCKS, x2)) {
+            x2 = find_next_zero_bit(row, BLOCKS, x);
+            bitmap_clear(row, x, x2 - x);
+            bitmap_zero(changed, x2 - x);
+            n += buffer_diff_copy(f->server + y * STRIDE + x * BLOCK,
+                                  f->guest + y * STRIDE + x * BLOCK,
+                                  (x2 - x) * BLOCK, BLOCK, changed);
+        }
+    }
+    return n;
+}
+
+static void bench(const DamagePattern *p, const char *name,
+                  size_t (*refresh)(Frame *f), Frame *f)
+{
+    double elapsed = 0;
+    size_t bytes = 0, changed = 0;
+    int frames = 0;
+
+    do {
+        frame_damage(f, p, frames);
+        g_test_timer_start();
+        changed += refresh(f);
+        elapsed += g_test_timer_elapsed();
+        bytes += f->dirty_bytes;
+        frames++;
+    } while (elapsed < 0.5);
+
+    g_test_message("%-10s %-8s %8.1f us/frame %8.0f MB/sec %7zu blocks/frame",
+                   p->name, name, elapsed * 1e6 / frames,
+                   bytes / elapsed / MiB, changed / frames);
+}
+
+static void test(const void *opaque)
+{
+    Frame f = {
+        .guest = g_malloc0(STRIDE * HEIGHT),
+        .server = g_malloc0(STRIDE * HEIGHT),
+        .dirty = g_new0(unsigned long, HEIGHT * BITS_TO_LONGS(BLOCKS)),
+    };
+    int accel_index = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        bench(&patterns[i], "blocks", refresh_blocks, &f);
+    }
+    do {
+        char name[16];
+
+        g_test_message("%s", "");  /* gnu_printf Werror for simple "" */
+        snprintf(name, sizeof(name), "runs #%d", accel_index);
+        for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+            bench(&patterns[i], name, refresh_runs, &f);
+        }
+        accel_index++;
+    } while (test_buffer_diff_copy_next_accel());
+
+    g_free(f.guest);
+    g_free(f.server);
+    g_free(f.dirty);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/cutils/bufferdiff/speed", NULL, test);
+    return g_test_run();
+}
@@ -0,0 +1,102 @@
+/*
+ * Memory topology commit benchmark
+ *
+ * Populates the i440fx machine with many memory regions (one per pc-dimm)
+ * and times memory_region_transaction_commit() by toggling the PAM and
+ * SMRAM windows of the host bridge, which remap a handful of aliases per
+ * configuration write.
+ *
+ * Run with "-m perf" to use the full number of DIMM slots.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "tests/qtest/libqtest.h"
+#include "tests/qtest/libqos/pci.h"
+#include "tests/qtest/libqos/pci-pc.h"
+
+#define I440FX_PAM      0x59
+#define I440FX_SMRAM    0x72
+
+#define SMRAM_D_OPEN    (1 << 6)
+#define SMRAM_G_SMRAME  (1 << 3)
+
+static QTestState *bench_start(unsigned slots)
+{
+    GString *cmdline = g_string_new(NULL);
+    QTestState *qts;
+    unsigned i;
+
+    g_string_append_printf(cmdline,
+                           "-machine pc -m 128M,slots=%u,maxmem=%uM",
+                           slots, 128 + slots * 2);
+    for (i = 0; i < slots; i++) {
+        g_string_append_printf(cmdline,
+                               " -object memory-backend-ram,id=m%u,size=2M"
+                               " -device pc-dimm,id=d%u,memdev=m%u",
+                               i, i, i);
+    }
+
+    qts = qtest_init(cmdline->str);
+    g_string_free(cmdline, true);
+    return qts;
+}
+
+static void bench_commit(const char *name, unsigned slots,
+                         uint8_t reg, uint8_t on, uint8_t off)
+{
+    QTestState *qts = bench_start(slots);
+    QPCIBus *bus = qpci_new_pc(qts, NULL);
+    QPCIDevice *dev = qpci_device_find(bus, QPCI_DEVFN(0, 0));
+    unsigned iterations = g_test_perf() ? 20000 : 500;
+    unsigned i;
+    double elapsed;
+
+    g_assert(dev != NULL);
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        qpci_config_writeb(dev, reg, (i & 1) ? off : on);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_message("%s: %u regions, %u commits, %.2f us/commit",
+                   name, slots, iterations, elapsed * 1e6 / iterations);
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_quit(qts);
+}
+
+static void test_pam_toggle(gconstpointer opaque)
+{
+    unsigned slots = GPOINTER_TO_UINT(opaque);
+
+    /* PAM1 covers 0xC0000-0xC7FFF: read/write enable the RAM shadow */
+    bench_commit("pam", slots, I440FX_PAM + 1, 0x33, 0x00);
+}
+
+static void test_smram_toggle(gconstpointer opaque)
+{
+    unsigned slots = GPOINTER_TO_UINT(opaque);
+
+    bench_commit("smram", slots, I440FX_SMRAM,
+                 SMRAM_G_SMRAME | SMRAM_D_OPEN | 2, SMRAM_G_SMRAME | 2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned slots;
+
+    g_test_init(&argc, &argv, NULL);
+
+    slots = g_test_perf() ? 256 : 16;
+    qtest_add_data_func("/flatview-bench/pam", GUINT_TO_POINTER(slots),
+                        test_pam_toggle);
+    qtest_add_data_func("/flatview-bench/smram", GUINT_TO_POINTER(slots),
+                        test_smram_toggle);
+
+    return g_test_run();
+}
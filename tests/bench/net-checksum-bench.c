@@ -0,0 +1,147 @@
+/*
+ * QEMU Internet checksum speed benchmark
+ *
+ * Measures net_checksum_add_cont() on packet-sized buffers for each of the
+ * available kernels, then replays the software TSO of the emulated NICs:
+ * a 64 KiB TCP payload, scattered over 4 KiB guest pages, is cut into
+ * 1448-byte segments and each segment is checksummed either after its
+ * iovec has been built (as net_tx_pkt did before) or while it is built.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/units.h"
+#include "net/checksum.h"
+
+#define TSO_PAYLOAD (64 * KiB)
+#define TSO_PAGE    (4 * KiB)
+#define TSO_PAGES   (TSO_PAYLOAD / TSO_PAGE)
+#define TSO_MSS     1448
+#define SEG_IOV     8
+
+static uint8_t *buf;
+
+static void bench_sizes(const char *name)
+{
+    static const int sizes[] = { 20, 64, 576, 1500, 9000, 65536 };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        double elapsed = 0;
+        uint64_t bytes = 0;
+        uint32_t sum = 0;
+
+        do {
+            int n;
+
+            g_test_timer_start();
+            for (n = 0; n < 1000; n++) {
+                sum += net_checksum_add_cont(sizes[i], buf + n % 64, n);
+            }
+            elapsed += g_test_timer_elapsed();
+            bytes += 1000 * sizes[i];
+        } while (elapsed < 0.3);
+
+        g_test_message("%-8s %5d bytes %8.2f GB/sec (%04x)",
+                       name, sizes[i], bytes / elapsed / 1e9,
+                       net_checksum_finish(sum));
+    }
+}
+
+/* Build the iovec of the segment at @offset in the payload */
+static int tso_segment(const struct iovec *pages, size_t offset, size_t len,
+                       struct iovec *seg, uint32_t *csum)
+{
+    int n = 0;
+
+    while (len) {
+        const struct iovec *page = &pages[offset / TSO_PAGE];
+        size_t off = offset % TSO_PAGE;
+        size_t l = MIN(len, page->iov_len - off);
+
+        seg[n].iov_base = page->iov_base + off;
+        seg[n].iov_len = l;
+        if (csum) {
+            *csum += net_checksum_add_cont(l, seg[n].iov_base,
+                                           offset % TSO_MSS);
+        }
+        n++;
+        offset += l;
+        len -= l;
+    }
+    return n;
+}
+
+static void bench_tso(const char *name, bool fused)
+{
+    struct iovec pages[TSO_PAGES];
+    struct iovec seg[SEG_IOV];
+    double elapsed = 0;
+    uint64_t bytes = 0;
+    uint16_t last = 0;
+    int i;
+
+    for (i = 0; i < TSO_PAGES; i++) {
+        /* Guest pages are not contiguous in the host either */
+        pages[i].iov_base = buf + (i * 7 % TSO_PAGES) * TSO_PAGE;
+        pages[i].iov_len = TSO_PAGE;
+    }
+
+    do {
+        size_t offset;
+
+        g_test_timer_start();
+        for (offset = 0; offset < TSO_PAYLOAD; offset += TSO_MSS) {
+            size_t len = MIN(TSO_MSS, TSO_PAYLOAD - offset);
+            uint32_t csum = 0;
+            int n;
+
+            if (fused) {
+                tso_segment(pages, offset, len, seg, &csum);
+            } else {
+                n = tso_segment(pages, offset, len, seg, NULL);
+                csum = net_checksum_add_iov(seg, n, 0, len, 0);
+            }
+            last = net_checksum_finish(csum);
+        }
+        elapsed += g_test_timer_elapsed();
+        bytes += TSO_PAYLOAD;
+    } while (elapsed < 0.3);
+
+    g_test_message("%-8s tso %-9s %8.2f Gbit/sec (%04x)",
+                   name, fused ? "fused" : "two-pass",
+                   bytes * 8 / elapsed / 1e9, last);
+}
+
+static void test(const void *opaque)
+{
+    int accel_index = 0;
+
+    do {
+        char name[32];
+
+        snprintf(name, sizeof(name), "accel #%d", accel_index);
+        bench_sizes(name);
+        bench_tso(name, false);
+        bench_tso(name, true);
+        g_test_message("%s", "");  /* gnu_printf Werror for simple "" */
+        accel_index++;
+    } while (test_net_checksum_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    buf = g_malloc(TSO_PAYLOAD + 64);
+    for (i = 0; i < TSO_PAYLOAD + 64; i++) {
+        buf[i] = i * 31 + (i >> 8);
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/net/checksum/speed", NULL, test);
+    return g_test_run();
+}
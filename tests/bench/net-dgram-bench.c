@@ -0,0 +1,300 @@
+/*
+ * QEMU dgram netdev packet rate benchmark
+ *
+ * Moves bursts of Ethernet-sized frames between two datagram sockets the
+ * way two dgram netdevs wired to each other do: the sender gets a burst of
+ * packets from its guest within one main loop iteration, the receiver reads
+ * until it has seen them all.  Each burst is sent and received with:
+ *
+ *   - one sendto() and one recv() per packet, as before batching;
+ *   - sendmmsg() and recvmmsg() of up to 32 messages;
+ *   - the same with UDP GSO on the send side and UDP GRO on the receive
+ *     side (UDP sockets only).
+ *
+ * The benchmark reports the packet rate and the number of packets moved
+ * per system call, over UDP on the loopback and over a pair of AF_UNIX
+ * datagram sockets.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/sockets.h"
+#include <netinet/udp.h>
+
+#define BURST       32
+#define BUFSIZE     (64 * 1024)
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define HAVE_GSO
+#endif
+
+typedef enum BenchMode {
+    MODE_SINGLE,
+    MODE_MMSG,
+    MODE_GSO,
+} BenchMode;
+
+static const char *const mode_names[] = {
+    [MODE_SINGLE] = "sendto/recv",
+    [MODE_MMSG] = "mmsg",
+    [MODE_GSO] = "mmsg+gso",
+};
+
+typedef struct BenchPair {
+    const char *name;
+    int tx;
+    int rx;
+} BenchPair;
+
+typedef struct BenchStats {
+    uint64_t packets;
+    uint64_t syscalls;
+    uint64_t lost;
+} BenchStats;
+
+typedef union BenchCmsg {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} BenchCmsg;
+
+static uint8_t *tx_bufs[BURST];
+static uint8_t *rx_bufs[BURST];
+
+static void pair_udp(BenchPair *p)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct sockaddr_in rx_addr;
+    socklen_t len = sizeof(rx_addr);
+    int bufsize = 4 * 1024 * 1024;
+
+    p->name = "udp";
+    p->tx = socket(AF_INET, SOCK_DGRAM, 0);
+    p->rx = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert(p->tx >= 0 && p->rx >= 0);
+    g_assert(bind(p->rx, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(p->rx, (struct sockaddr *)&rx_addr, &len) == 0);
+    g_assert(connect(p->tx, (struct sockaddr *)&rx_addr, len) == 0);
+    setsockopt(p->rx, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    qemu_socket_set_nonblock(p->rx);
+}
+
+static void pair_unix(BenchPair *p)
+{
+    int sv[2];
+
+    p->name = "unix";
+    g_assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+    p->tx = sv[0];
+    p->rx = sv[1];
+    qemu_socket_set_nonblock(p->rx);
+}
+
+static void pair_close(BenchPair *p)
+{
+    close(p->tx);
+    close(p->rx);
+}
+
+static void send_burst(BenchPair *p, BenchMode mode, size_t size,
+                       BenchStats *st)
+{
+    struct iovec iov[BURST];
+    struct mmsghdr msgs[BURST];
+    BenchCmsg ctrl;
+    int i, n = 0;
+
+    for (i = 0; i < BURST; i++) {
+        iov[i] = (struct iovec) { .iov_base = tx_bufs[i], .iov_len = size };
+    }
+
+    if (mode == MODE_SINGLE) {
+        for (i = 0; i < BURST; i++) {
+            g_assert(send(p->tx, tx_bufs[i], size, 0) == size);
+            st->syscalls++;
+        }
+        return;
+    }
+
+    if (mode == MODE_GSO) {
+#ifdef HAVE_GSO
+        uint16_t gso_size = size;
+        struct cmsghdr *cmsg;
+        /* Same limits as the dgram netdev: 64 segments, 65000 bytes */
+        int per_msg = MIN(BURST, 65000 / size);
+
+        for (i = 0; i < BURST; i += per_msg) {
+            struct msghdr *m = &msgs[n++].msg_hdr;
+
+            *m = (struct msghdr) {
+                .msg_iov = &iov[i],
+                .msg_iovlen = MIN(per_msg, BURST - i),
+                .msg_control = ctrl.buf,
+                .msg_controllen = CMSG_SPACE(sizeof(gso_size)),
+            };
+            cmsg = CMSG_FIRSTHDR(m);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+#endif
+    } else {
+        for (i = 0; i < BURST; i++) {
+            msgs[n++].msg_hdr = (struct msghdr) {
+                .msg_iov = &iov[i],
+                .msg_iovlen = 1,
+            };
+        }
+    }
+
+    for (i = 0; i < n; ) {
+        int ret = sendmmsg(p->tx, &msgs[i], n - i, 0);
+
+        g_assert(ret > 0);
+        st->syscalls++;
+        i += ret;
+    }
+}
+
+static int gro_size(struct mmsghdr *msg)
+{
+#ifdef HAVE_GSO
+    struct cmsghdr *cmsg;
+    int gso_size;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg->msg_hdr); cmsg;
+         cmsg = CMSG_NXTHDR(&msg->msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            return gso_size;
+        }
+    }
+#endif
+    return msg->msg_len;
+}
+
+/* Wait for the receive side, in case the loopback defers delivery */
+static bool wait_readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, 100) > 0;
+}
+
+static void recv_burst(BenchPair *p, BenchMode mode, BenchStats *st)
+{
+    struct iovec iov[BURST];
+    struct mmsghdr msgs[BURST];
+    BenchCmsg ctrl[BURST];
+    int got = 0;
+    int i, n;
+
+    while (got < BURST) {
+        if (mode == MODE_SINGLE) {
+            n = recv(p->rx, rx_bufs[0], BUFSIZE, 0);
+            st->syscalls++;
+            if (n > 0) {
+                got++;
+                continue;
+            }
+        } else {
+            for (i = 0; i < BURST; i++) {
+                iov[i] = (struct iovec) {
+                    .iov_base = rx_bufs[i],
+                    .iov_len = BUFSIZE,
+                };
+                msgs[i].msg_hdr = (struct msghdr) {
+                    .msg_iov = &iov[i],
+                    .msg_iovlen = 1,
+                    .msg_control = mode == MODE_GSO ? ctrl[i].buf : NULL,
+                    .msg_controllen = mode == MODE_GSO ? sizeof(ctrl[i]) : 0,
+                };
+            }
+            n = recvmmsg(p->rx, msgs, BURST - got, 0, NULL);
+            st->syscalls++;
+            if (n > 0) {
+                for (i = 0; i < n; i++) {
+                    got += DIV_ROUND_UP(msgs[i].msg_len, gro_size(&msgs[i]));
+                }
+                continue;
+            }
+        }
+        if (!wait_readable(p->rx)) {
+            st->lost += BURST - got;
+            break;
+        }
+    }
+    st->packets += MIN(got, BURST);
+}
+
+static void bench(BenchPair *p, BenchMode mode, size_t size)
+{
+    BenchStats tx = { 0 }, rx = { 0 };
+    double elapsed;
+
+    g_test_timer_start();
+    do {
+        send_burst(p, mode, size, &tx);
+        recv_burst(p, mode, &rx);
+        elapsed = g_test_timer_elapsed();
+    } while (elapsed < 0.5);
+
+    g_test_message("%-5s %-12s %5zu bytes %7.3f Mpps %6.1f pkt/send "
+                   "%6.1f pkt/recv%s",
+                   p->name, mode_names[mode], size,
+                   rx.packets / elapsed / 1e6,
+                   (double)rx.packets / tx.syscalls,
+                   (double)rx.packets / rx.syscalls,
+                   rx.lost ? " (packets lost)" : "");
+}
+
+static void test(const void *opaque)
+{
+    static const size_t sizes[] = { 64, 590, 1514 };
+    void (*setup)(BenchPair *) = opaque;
+    BenchMode mode;
+    int i;
+
+    for (mode = MODE_SINGLE; mode <= MODE_GSO; mode++) {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            BenchPair p;
+
+            setup(&p);
+            if (mode == MODE_GSO) {
+#ifdef HAVE_GSO
+                int on = 1;
+
+                if (setup != pair_udp ||
+                    setsockopt(p.rx, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+                    pair_close(&p);
+                    continue;
+                }
+#else
+                pair_close(&p);
+                continue;
+#endif
+            }
+            bench(&p, mode, sizes[i]);
+            pair_close(&p);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < BURST; i++) {
+        tx_bufs[i] = g_malloc0(BUFSIZE);
+        rx_bufs[i] = g_malloc(BUFSIZE);
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/net/dgram/udp", pair_udp, test);
+    g_test_add_data_func("/net/dgram/unix", pair_unix, test);
+    return g_test_run();
+}
@@ -0,0 +1,747 @@
+/*
+ * VNC encoder benchmark
+ *
+ * Replays synthetic damage sequences on a 1920x1080 server surface through
+ * vnc_send_framebuffer_update(), the way the VNC worker thread does for a
+ * client, without a connection or a display: the vnc.c helpers that the
+ * encoders call are replaced by the small stand-ins below.
+ *
+ * The sequences mimic typical desktops: an office application with text
+ * being typed and dialogs popping up, a video playing in a window, a
+ * terminal scrolling and an idle desktop where only the clock changes.
+ * Each one runs for every encoding and a range of quality and compression
+ * levels, and reports the encode time and the bytes sent per frame.  For
+ * Tight, the JPEG rectangles are decoded again to report the PSNR of the
+ * frames against the server surface.  ZYWRLE is lossy as well but has no
+ * decoder here, so no PSNR is given for it.
+ *
+ * The tight-slices tests encode the large updates in slices, as the
+ * parallel-tight option does on several encoder threads.  They report the
+ * time of the longest slice, i.e. the latency with enough threads, the
+ * total CPU time and the bytes lost by restarting the zlib streams.
+ *
+ * Run with "-m perf" to go through every quality and compression level.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu/buffer.h"
+#include "ui/vnc.h"
+#include "ui/vnc-enc-tight.h"
+
+#ifdef CONFIG_VNC_JPEG
+/* see the comments about jpeglib.h in ui/vnc-enc-tight.c */
+#include <jpeglib.h>
+#endif
+
+#define WIDTH       1920
+#define HEIGHT      1080
+
+/*
+ * Stand-ins for vnc.c: the output only goes to the buffer and the update
+ * frequency of every region is the frame rate of the sequence.
+ */
+static double bench_update_freq;
+
+void vnc_write(VncState *vs, const void *data, size_t len)
+{
+    buffer_reserve(&vs->output, len);
+    buffer_append(&vs->output, data, len);
+}
+
+void vnc_write_s32(VncState *vs, int32_t value)
+{
+    vnc_write_u32(vs, *(uint32_t *)&value);
+}
+
+void vnc_write_u32(VncState *vs, uint32_t value)
+{
+    uint8_t buf[4];
+
+    stl_be_p(buf, value);
+    vnc_write(vs, buf, 4);
+}
+
+void vnc_write_u16(VncState *vs, uint16_t value)
+{
+    uint8_t buf[2];
+
+    stw_be_p(buf, value);
+    vnc_write(vs, buf, 2);
+}
+
+void vnc_write_u8(VncState *vs, uint8_t value)
+{
+    vnc_write(vs, &value, 1);
+}
+
+double vnc_update_freq(VncState *vs, int x, int y, int w, int h)
+{
+    return bench_update_freq;
+}
+
+void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
+{
+}
+
+static void bench_write_pixels(VncState *vs, void *pixels, int size)
+{
+    vnc_write(vs, pixels, size);
+}
+
+/* Damage sequences */
+
+typedef struct BenchRect {
+    int x, y, w, h;
+} BenchRect;
+
+#define MAX_RECTS   4
+
+typedef struct Sequence {
+    const char *name;
+    double fps;
+    void (*setup)(uint32_t *fb);
+    /* draw frame @t and return the damaged rectangles */
+    int (*frame)(uint32_t *fb, int t, BenchRect *damage);
+} Sequence;
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+static void fill_rect(uint32_t *fb, int x, int y, int w, int h, uint32_t c)
+{
+    int i, j;
+
+    for (j = y; j < y + h; j++) {
+        for (i = x; i < x + w; i++) {
+            fb[j * WIDTH + i] = c;
+        }
+    }
+}
+
+/* @n characters of 8x16 cells with a random 6x10 glyph each */
+static void draw_text(uint32_t *fb, int x, int y, int n,
+                      uint32_t fg, uint32_t bg, uint32_t seed)
+{
+    int c, i, j;
+
+    fill_rect(fb, x, y, n * 8, 16, bg);
+    for (c = 0; c < n; c++) {
+        uint32_t glyph = bench_rand(&seed) | bench_rand(&seed) << 16;
+
+        if (glyph % 7 == 0) {
+            continue;   /* space */
+        }
+        for (j = 0; j < 10; j++) {
+            for (i = 0; i < 6; i++) {
+                if ((glyph >> ((i + j * 3) % 32)) & 1) {
+                    fb[(y + 3 + j) * WIDTH + x + c * 8 + 1 + i] = fg;
+                }
+            }
+        }
+    }
+}
+
+/* Smooth moving gradients with some noise, like decoded video */
+static void draw_video(uint32_t *fb, int x, int y, int w, int h, int t)
+{
+    uint32_t seed = t;
+    int i, j;
+
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++) {
+            int n = bench_rand(&seed) & 7;
+            uint8_t r = (i + t * 4) * 255 / (w + t * 4) + n;
+            uint8_t g = (j * 2 + t * 3) & 0xff;
+            uint8_t b = ((i + j + t * 5) >> 1) & 0xff;
+
+            fb[(y + j) * WIDTH + x + i] = r << 16 | g << 8 | b;
+        }
+    }
+}
+
+static void setup_desktop(uint32_t *fb)
+{
+    int y;
+
+    for (y = 0; y < HEIGHT; y++) {
+        fill_rect(fb, 0, y, WIDTH, 1, 0x203050 + (y * 0x40 / HEIGHT));
+    }
+    fill_rect(fb, 0, HEIGHT - 32, WIDTH, 32, 0xd0d0d0);
+}
+
+#define OFFICE_X    160
+#define OFFICE_Y    80
+#define OFFICE_W    1600
+#define OFFICE_H    900
+
+static void setup_office(uint32_t *fb)
+{
+    int y;
+
+    setup_desktop(fb);
+    fill_rect(fb, OFFICE_X, OFFICE_Y, OFFICE_W, 40, 0x3060a0);
+    fill_rect(fb, OFFICE_X, OFFICE_Y + 40, OFFICE_W, OFFICE_H - 40, 0xffffff);
+    for (y = OFFICE_Y + 60; y < OFFICE_Y + 500; y += 16) {
+        draw_text(fb, OFFICE_X + 40, y, 180, 0x000000, 0xffffff, y);
+    }
+}
+
+#define DIALOG_X    660
+#define DIALOG_Y    340
+#define DIALOG_W    600
+#define DIALOG_H    400
+
+static uint32_t dialog_under[DIALOG_W * DIALOG_H];
+
+static int frame_office(uint32_t *fb, int t, BenchRect *damage)
+{
+    int line = (t / 20) % 24;
+    int col = t % 20;
+    int n = 0, y;
+
+    /* a few characters typed per frame, a dialog every 30 frames */
+    if (t % 30 == 0 && t) {
+        for (y = 0; y < DIALOG_H; y++) {
+            memcpy(fb + (DIALOG_Y + y) * WIDTH + DIALOG_X,
+                   dialog_under + y * DIALOG_W, DIALOG_W * 4);
+        }
+        damage[n++] = (BenchRect) { DIALOG_X, DIALOG_Y, DIALOG_W, DIALOG_H };
+    }
+
+    damage[n] = (BenchRect) {
+        OFFICE_X + 40 + col * 64, OFFICE_Y + 500 + line * 16, 64, 16
+    };
+    draw_text(fb, damage[n].x, damage[n].y, 8, 0x000000, 0xffffff, t);
+    n++;
+
+    if (t % 30 == 29) {
+        for (y = 0; y < DIALOG_H; y++) {
+            memcpy(dialog_under + y * DIALOG_W,
+                   fb + (DIALOG_Y + y) * WIDTH + DIALOG_X, DIALOG_W * 4);
+        }
+        fill_rect(fb, DIALOG_X, DIALOG_Y, DIALOG_W, DIALOG_H, 0xe0e0e0);
+        fill_rect(fb, DIALOG_X, DIALOG_Y, DIALOG_W, 28, 0x3060a0);
+        draw_text(fb, DIALOG_X + 40, DIALOG_Y + 60, 60,
+                  0x000000, 0xe0e0e0, t);
+        draw_text(fb, DIALOG_X + 40, DIALOG_Y + 80, 48,
+                  0x000000, 0xe0e0e0, t + 1);
+        fill_rect(fb, DIALOG_X + 440, DIALOG_Y + 350, 120, 32, 0xc0c0c0);
+        damage[n++] = (BenchRect) { DIALOG_X, DIALOG_Y, DIALOG_W, DIALOG_H };
+    }
+    return n;
+}
+
+#define VIDEO_X     640
+#define VIDEO_Y     300
+#define VIDEO_W     640
+#define VIDEO_H     360
+
+static void setup_video(uint32_t *fb)
+{
+    setup_desktop(fb);
+    fill_rect(fb, VIDEO_X - 4, VIDEO_Y - 30, VIDEO_W + 8, VIDEO_H + 60,
+              0x404040);
+    draw_video(fb, VIDEO_X, VIDEO_Y, VIDEO_W, VIDEO_H, 0);
+}
+
+static int frame_video(uint32_t *fb, int t, BenchRect *damage)
+{
+    draw_video(fb, VIDEO_X, VIDEO_Y, VIDEO_W, VIDEO_H, t);
+    damage[0] = (BenchRect) { VIDEO_X, VIDEO_Y, VIDEO_W, VIDEO_H };
+    /* progress bar */
+    fill_rect(fb, VIDEO_X, VIDEO_Y + VIDEO_H + 12,
+              (t * 4) % VIDEO_W, 6, 0xff0000);
+    damage[1] = (BenchRect) { VIDEO_X, VIDEO_Y + VIDEO_H + 12, VIDEO_W, 6 };
+    return 2;
+}
+
+#define TERM_X      320
+#define TERM_Y      140
+#define TERM_W      1280
+#define TERM_H      800
+
+static void setup_scrolling(uint32_t *fb)
+{
+    int y;
+
+    setup_desktop(fb);
+    for (y = TERM_Y; y < TERM_Y + TERM_H; y += 16) {
+        draw_text(fb, TERM_X, y, TERM_W / 8, 0xc0c0c0, 0x000000, y);
+    }
+}
+
+static int frame_scrolling(uint32_t *fb, int t, BenchRect *damage)
+{
+    int y;
+
+    /* one line of output per frame scrolls the whole terminal */
+    for (y = TERM_Y; y < TERM_Y + TERM_H - 16; y++) {
+        memmove(fb + y * WIDTH + TERM_X, fb + (y + 16) * WIDTH + TERM_X,
+                TERM_W * 4);
+    }
+    draw_text(fb, TERM_X, TERM_Y + TERM_H - 16, 40 + t % 100,
+              0xc0c0c0, 0x000000, t);
+    damage[0] = (BenchRect) { TERM_X, TERM_Y, TERM_W, TERM_H };
+    return 1;
+}
+
+static int frame_idle(uint32_t *fb, int t, BenchRect *damage)
+{
+    /* the clock and a blinking cursor */
+    damage[0] = (BenchRect) { WIDTH - 80, HEIGHT - 24, 64, 16 };
+    draw_text(fb, damage[0].x, damage[0].y, 8, 0x000000, 0xd0d0d0, t);
+    damage[1] = (BenchRect) { 400, 300, 8, 16 };
+    fill_rect(fb, 400, 300, 2, 16, t & 1 ? 0x203050 : 0xffffff);
+    return 2;
+}
+
+static const Sequence sequences[] = {
+    { "office", 2, setup_office, frame_office },
+    { "video", 25, setup_video, frame_video },
+    { "scrolling", 20, setup_scrolling, frame_scrolling },
+    { "desktop-idle", 1, setup_desktop, frame_idle },
+};
+
+/* Encoder settings */
+
+typedef struct Encoding {
+    const char *name;
+    int32_t encoding;
+    bool compression;   /* uses the compression level */
+    bool quality;       /* uses the quality level */
+} Encoding;
+
+static const Encoding encodings[] = {
+    { "raw", VNC_ENCODING_RAW, false, false },
+    { "hextile", VNC_ENCODING_HEXTILE, false, false },
+    { "zlib", VNC_ENCODING_ZLIB, true, false },
+    { "tight", VNC_ENCODING_TIGHT, true, true },
+#ifdef CONFIG_PNG
+    { "tight-png", VNC_ENCODING_TIGHT_PNG, true, true },
+#endif
+    { "zrle", VNC_ENCODING_ZRLE, false, false },
+    { "zywrle", VNC_ENCODING_ZYWRLE, false, true },
+};
+
+static VncDisplay *bench_display_new(void)
+{
+    VncDisplay *vd = g_new0(VncDisplay, 1);
+
+    vd->server = pixman_image_create_bits(VNC_SERVER_FB_FORMAT,
+                                          WIDTH, HEIGHT, NULL, 0);
+    vd->ds = g_new0(DisplaySurface, 1);
+    vd->ds->image = vd->server;
+    vd->lossy = true;
+    return vd;
+}
+
+static void bench_display_free(VncDisplay *vd)
+{
+    qemu_pixman_image_unref(vd->server);
+    g_free(vd->ds);
+    g_free(vd);
+}
+
+static VncState *bench_client_new(VncDisplay *vd, const Encoding *enc,
+                                  int quality, int compression)
+{
+    VncState *vs = g_new0(VncState, 1);
+
+    vs->magic = VNC_MAGIC;
+    vs->vd = vd;
+    vs->zrle = g_new0(VncZrle, 1);
+    vs->tight = g_new0(VncTight, 1);
+    buffer_init(&vs->output, "vnc-bench-output");
+    buffer_init(&vs->tight->tight, "vnc-bench-tight");
+    buffer_init(&vs->tight->zlib, "vnc-bench-tight-zlib");
+    buffer_init(&vs->tight->gradient, "vnc-bench-tight-gradient");
+#ifdef CONFIG_VNC_JPEG
+    buffer_init(&vs->tight->jpeg, "vnc-bench-tight-jpeg");
+#endif
+#ifdef CONFIG_PNG
+    buffer_init(&vs->tight->png, "vnc-bench-tight-png");
+#endif
+    vs->client_pf = qemu_pixelformat_from_pixman(VNC_SERVER_FB_FORMAT);
+    vs->client_format = VNC_SERVER_FB_FORMAT;
+    vs->write_pixels = bench_write_pixels;
+    vnc_hextile_set_pixel_conversion(vs, 0);
+    vs->client_width = WIDTH;
+    vs->client_height = HEIGHT;
+
+    vs->vnc_encoding = enc->encoding;
+    switch (enc->encoding) {
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+        vnc_set_feature(vs, VNC_FEATURE_TIGHT);
+        if (enc->encoding == VNC_ENCODING_TIGHT_PNG) {
+            vnc_set_feature(vs, VNC_FEATURE_TIGHT_PNG);
+        }
+        break;
+    case VNC_ENCODING_ZLIB:
+        vnc_set_feature(vs, VNC_FEATURE_ZLIB);
+        break;
+    case VNC_ENCODING_ZRLE:
+        vnc_set_feature(vs, VNC_FEATURE_ZRLE);
+        break;
+    case VNC_ENCODING_ZYWRLE:
+        vnc_set_feature(vs, VNC_FEATURE_ZYWRLE);
+        break;
+    case VNC_ENCODING_HEXTILE:
+        vnc_set_feature(vs, VNC_FEATURE_HEXTILE);
+        break;
+    }
+    vs->tight->quality = quality;
+    vs->tight->compression = compression;
+    return vs;
+}
+
+static void bench_client_free(VncState *vs)
+{
+    vnc_zlib_clear(vs);
+    vnc_tight_clear(vs);
+    vnc_zrle_clear(vs);
+    buffer_free(&vs->output);
+    g_free(vs->zrle);
+    g_free(vs->tight);
+    g_free(vs);
+}
+
+/* PSNR of the Tight JPEG rectangles */
+
+typedef struct BenchError {
+    uint64_t sse;       /* sum of the squared errors of all channels */
+    uint64_t pixels;    /* pixels sent */
+} BenchError;
+
+static size_t tight_compact_len(const uint8_t **p)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        uint8_t b = *(*p)++;
+
+        if (i == 2) {
+            return len | (size_t)b << 14;
+        }
+        len |= (size_t)(b & 0x7f) << (i * 7);
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    return len;
+}
+
+#ifdef CONFIG_VNC_JPEG
+static void bench_jpeg_error(VncDisplay *vd, const uint8_t *data, size_t len,
+                             int x, int y, int w, int h, BenchError *err)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    g_autofree uint8_t *row = g_malloc(w * 3);
+    int i;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)data, len);
+    jpeg_read_header(&cinfo, true);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    g_assert(cinfo.output_width == w && cinfo.output_height == h);
+
+    while (cinfo.output_scanline < h) {
+        uint32_t *fb = vnc_server_fb_ptr(vd, x, y + cinfo.output_scanline);
+
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        for (i = 0; i < w; i++) {
+            int dr = row[i * 3 + 0] - ((fb[i] >> 16) & 0xff);
+            int dg = row[i * 3 + 1] - ((fb[i] >> 8) & 0xff);
+            int db = row[i * 3 + 2] - (fb[i] & 0xff);
+
+            err->sse += dr * dr + dg * dg + db * db;
+        }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+}
+#endif
+
+/*
+ * Walk the Tight rectangles of a frame, with 24-bit pixels.  All but the
+ * JPEG subencoding are lossless, so only those need decoding.
+ */
+static void tight_frame_error(VncDisplay *vd, const uint8_t *p,
+                              const uint8_t *end, BenchError *err)
+{
+    while (p < end) {
+        int x = lduw_be_p(p);
+        int y = lduw_be_p(p + 2);
+        int w = lduw_be_p(p + 4);
+        int h = lduw_be_p(p + 6);
+        int type = p[12] >> 4;
+        size_t len;
+
+        p += 13;
+        err->pixels += w * h;
+
+        if (type == VNC_TIGHT_FILL) {
+            p += 3;
+            continue;
+        }
+        if (type == VNC_TIGHT_JPEG || type == VNC_TIGHT_PNG) {
+            len = tight_compact_len(&p);
+#ifdef CONFIG_VNC_JPEG
+            if (type == VNC_TIGHT_JPEG) {
+                bench_jpeg_error(vd, p, len, x, y, w, h, err);
+            }
+#endif
+            p += len;
+            continue;
+        }
+
+        /* basic compression */
+        len = w * h * 3;
+        if (type & VNC_TIGHT_EXPLICIT_FILTER && *p++ ==
+            VNC_TIGHT_FILTER_PALETTE) {
+            int colors = *p++ + 1;
+
+            p += colors * 3;
+            len = colors == 2 ? DIV_ROUND_UP(w, 8) * h : w * h;
+        }
+        if (len >= VNC_TIGHT_MIN_TO_COMPRESS) {
+            len = tight_compact_len(&p);
+        }
+        p += len;
+    }
+    g_assert(p == end);
+}
+
+static void bench_sequence(const Sequence *seq, const Encoding *enc,
+                           int quality, int compression, int frames)
+{
+    VncDisplay *vd = bench_display_new();
+    VncState *vs = bench_client_new(vd, enc, quality, compression);
+    uint32_t *fb = vnc_server_fb_ptr(vd, 0, 0);
+    BenchError err = { 0 };
+    BenchRect damage[MAX_RECTS];
+    double elapsed = 0;
+    size_t bytes = 0;
+    bool lossy_stats = false;
+    char psnr[16] = "";
+    int t, i, n;
+
+    bench_update_freq = seq->fps;
+
+    /* the initial full update is not part of the sequence */
+    seq->setup(fb);
+    vnc_send_framebuffer_update(vs, 0, 0, WIDTH, HEIGHT);
+    buffer_reset(&vs->output);
+
+    for (t = 0; t < frames; t++) {
+        n = seq->frame(fb, t, damage);
+        g_assert(n <= MAX_RECTS);
+
+        g_test_timer_start();
+        for (i = 0; i < n; i++) {
+            vnc_send_framebuffer_update(vs, damage[i].x, damage[i].y,
+                                        damage[i].w, damage[i].h);
+        }
+        elapsed += g_test_timer_elapsed();
+        bytes += vs->output.offset;
+
+        if (vs->vnc_encoding == VNC_ENCODING_TIGHT ||
+            vs->vnc_encoding == VNC_ENCODING_TIGHT_PNG) {
+            tight_frame_error(vd, vs->output.buffer,
+                              vs->output.buffer + vs->output.offset, &err);
+            lossy_stats = true;
+        }
+        buffer_reset(&vs->output);
+    }
+
+    if (lossy_stats && err.sse) {
+        double mse = (double)err.sse / (err.pixels * 3);
+
+        snprintf(psnr, sizeof(psnr), "%6.2f dB", 10 * log10(255 * 255 / mse));
+    } else if (lossy_stats) {
+        snprintf(psnr, sizeof(psnr), "lossless");
+    }
+
+    g_test_message("%-12s %-9s q%-2d c%d %9.1f us/frame %10.0f bytes/frame %s",
+                   seq->name, enc->name, quality, compression,
+                   elapsed * 1e6 / frames, (double)bytes / frames, psnr);
+
+    bench_client_free(vs);
+    bench_display_free(vd);
+}
+
+static void test_sequence(const void *opaque)
+{
+    const Sequence *seq = opaque;
+    static const int quick_quality[] = { -1, 0, 5, 9 };
+    static const int quick_compression[] = { 1, 6, 9 };
+    int frames = g_test_perf() ? 300 : 60;
+    int e, q, c, nq, nc;
+
+    for (e = 0; e < ARRAY_SIZE(encodings); e++) {
+        const Encoding *enc = &encodings[e];
+
+        nq = !enc->quality ? 1 : g_test_perf() ? 11 : ARRAY_SIZE(quick_quality);
+        nc = !enc->compression ? 1 :
+             g_test_perf() ? 10 : ARRAY_SIZE(quick_compression);
+
+        for (q = 0; q < nq; q++) {
+            for (c = 0; c < nc; c++) {
+                int quality = !enc->quality ? -1 :
+                              g_test_perf() ? q - 1 : quick_quality[q];
+                int compression = !enc->compression ? 0 :
+                                  g_test_perf() ? c : quick_compression[c];
+
+                bench_sequence(seq, enc, quality, compression, frames);
+            }
+        }
+    }
+}
+
+/*
+ * Encode band @slice out of @n_slices of each damaged rectangle, in @vs or,
+ * past the first slice, in a state of its own like vnc-jobs.c does.
+ */
+static size_t bench_tight_slice(VncState *vs, const BenchRect *damage,
+                                int n, int slice, int n_slices)
+{
+    VncState svs = {
+        .magic = VNC_MAGIC,
+        .vd = vs->vd,
+        .vnc_encoding = vs->vnc_encoding,
+        .features = vs->features,
+        .write_pixels = vs->write_pixels,
+        .client_pf = vs->client_pf,
+        .client_width = vs->client_width,
+        .client_height = vs->client_height,
+    };
+    VncState *enc = slice ? &svs : vs;
+    size_t bytes;
+    int i;
+
+    if (slice) {
+        buffer_init(&svs.output, "vnc-bench-slice");
+        vnc_tight_slice_start(&svs, vs->tight);
+    }
+    for (i = 0; i < n; i++) {
+        int band = ROUND_UP(DIV_ROUND_UP(damage[i].h, n_slices),
+                            VNC_DIRTY_PIXELS_PER_BIT);
+        int y = damage[i].y + slice * band;
+        int h = MIN(band, damage[i].y + damage[i].h - y);
+
+        if (h > 0) {
+            vnc_send_framebuffer_update(enc, damage[i].x, y, damage[i].w, h);
+        }
+    }
+    bytes = enc->output.offset;
+    buffer_reset(&enc->output);
+    if (slice) {
+        vnc_tight_slice_end(&svs);
+        buffer_free(&svs.output);
+    }
+    return bytes;
+}
+
+static size_t bench_tight_slices(const Sequence *seq, int quality,
+                                 int compression, int frames, int n_slices,
+                                 size_t base_bytes)
+{
+    static const Encoding tight = { "tight", VNC_ENCODING_TIGHT, true, true };
+    VncDisplay *vd = bench_display_new();
+    VncState *vs = bench_client_new(vd, &tight, quality, compression);
+    uint32_t *fb = vnc_server_fb_ptr(vd, 0, 0);
+    BenchRect damage[MAX_RECTS];
+    double latency = 0, cpu = 0;
+    size_t bytes = 0;
+    int t, i, n;
+
+    bench_update_freq = seq->fps;
+    seq->setup(fb);
+    vnc_send_framebuffer_update(vs, 0, 0, WIDTH, HEIGHT);
+    buffer_reset(&vs->output);
+
+    for (t = 0; t < frames; t++) {
+        double longest = 0;
+        size_t slice_bytes = 0;
+
+        n = seq->frame(fb, t, damage);
+        for (i = 0; i < n_slices; i++) {
+            double elapsed;
+
+            g_test_timer_start();
+            slice_bytes = bench_tight_slice(vs, damage, n, i, n_slices);
+            elapsed = g_test_timer_elapsed();
+            longest = MAX(longest, elapsed);
+            cpu += elapsed;
+            bytes += slice_bytes;
+        }
+        if (n_slices > 1) {
+            /* the client's streams were restarted by the slices */
+            vnc_tight_reset_streams(vs);
+        }
+        latency += longest;
+    }
+
+    g_test_message("%-12s tight q%-2d c%d %d slices %9.1f us/frame latency "
+                   "%9.1f us/frame cpu %10.0f bytes/frame %+6.1f%%",
+                   seq->name, quality, compression, n_slices,
+                   latency * 1e6 / frames, cpu * 1e6 / frames,
+                   (double)bytes / frames,
+                   base_bytes ? 100. * bytes / base_bytes - 100 : 0);
+
+    bench_client_free(vs);
+    bench_display_free(vd);
+    return bytes;
+}
+
+static void test_tight_slices(const void *opaque)
+{
+    const Sequence *seq = opaque;
+    static const int quality[] = { -1, 5 };
+    int frames = g_test_perf() ? 300 : 60;
+    int q, n;
+
+    for (q = 0; q < ARRAY_SIZE(quality); q++) {
+        size_t base_bytes = 0;
+
+        for (n = 1; n <= 8; n *= 2) {
+            size_t bytes = bench_tight_slices(seq, quality[q], 6, frames, n,
+                                              base_bytes);
+
+            if (n == 1) {
+                base_bytes = bytes;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(sequences); i++) {
+        g_autofree char *path = g_strdup_printf("/vnc/encode/%s",
+                                                sequences[i].name);
+
+        g_test_add_data_func(path, &sequences[i], test_sequence);
+    }
+    for (i = 0; i < ARRAY_SIZE(sequences); i++) {
+        g_autofree char *path = g_strdup_printf("/vnc/tight-slices/%s",
+                                                sequences[i].name);
+
+        g_test_add_data_func(path, &sequences[i], test_tight_slices);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,163 @@
+/*
+ * Incremental FlatView update test
+ *
+ * Applies the same sequence of memory topology changes to two i440fx
+ * machines, one of which regenerates every FlatView from scratch on each
+ * commit, and checks that "info mtree -f" agrees after every step.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+
+#define I440FX_PAM      0x59
+#define I440FX_PAM_NR   7
+#define I440FX_SMRAM    0x72
+
+#define SMRAM_D_OPEN    (1 << 6)
+#define SMRAM_G_SMRAME  (1 << 3)
+#define SMRAM_C_BASE    2
+
+#define SLOTS           4
+
+typedef struct TestMachine {
+    QTestState *qts;
+    QPCIBus *bus;
+    QPCIDevice *dev;
+} TestMachine;
+
+static void machine_start(TestMachine *m, bool incremental)
+{
+    m->qts = qtest_initf("-machine pc,x-incremental-flatview=%s"
+                         " -m 128M,slots=%d,maxmem=%dM"
+                         " -object memory-backend-ram,id=m0,size=2M"
+                         " -device pc-dimm,id=d0,memdev=m0",
+                         incremental ? "on" : "off", SLOTS, 128 + SLOTS * 2);
+    m->bus = qpci_new_pc(m->qts, NULL);
+    m->dev = qpci_device_find(m->bus, QPCI_DEVFN(0, 0));
+    g_assert(m->dev != NULL);
+}
+
+static void machine_stop(TestMachine *m)
+{
+    g_free(m->dev);
+    qpci_free_pc(m->bus);
+    qtest_quit(m->qts);
+}
+
+static int compare_views(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * "info mtree -f" prints the FlatViews in hash table order, which depends
+ * on where their root regions were allocated.  Drop the view numbers and
+ * sort the views so that two processes can be compared.
+ */
+static char *mtree_flat(QTestState *qts)
+{
+    g_autofree char *out = qtest_hmp(qts, "info mtree -f");
+    g_auto(GStrv) views = g_strsplit(out, "FlatView #", -1);
+    g_autoptr(GPtrArray) sorted = g_ptr_array_new();
+    GString *s = g_string_new(NULL);
+    size_t i;
+
+    for (i = 0; views[i]; i++) {
+        char *body = strchr(views[i], '\n');
+
+        g_ptr_array_add(sorted, body ? body + 1 : views[i]);
+    }
+    g_ptr_array_sort(sorted, compare_views);
+    for (i = 0; i < sorted->len; i++) {
+        g_string_append(s, g_ptr_array_index(sorted, i));
+    }
+    return g_string_free(s, false);
+}
+
+static void check_same(TestMachine *inc, TestMachine *full, const char *step)
+{
+    g_autofree char *inc_mtree = mtree_flat(inc->qts);
+    g_autofree char *full_mtree = mtree_flat(full->qts);
+
+    g_test_message("after %s", step);
+    g_assert_cmpstr(inc_mtree, ==, full_mtree);
+}
+
+static void write_both(TestMachine *inc, TestMachine *full,
+                       uint8_t reg, uint8_t val)
+{
+    g_autofree char *step = g_strdup_printf("writing 0x%02x to 0x%02x",
+                                            val, reg);
+
+    qpci_config_writeb(inc->dev, reg, val);
+    qpci_config_writeb(full->dev, reg, val);
+    check_same(inc, full, step);
+}
+
+static void hotplug_dimm(TestMachine *m, int i)
+{
+    g_autofree char *memdev = g_strdup_printf("m%d", i);
+    g_autofree char *id = g_strdup_printf("d%d", i);
+
+    qtest_qmp_assert_success(m->qts,
+                             "{ 'execute': 'object-add', 'arguments': {"
+                             " 'qom-type': 'memory-backend-ram',"
+                             " 'id': %s, 'size': 2097152 } }", memdev);
+    qtest_qmp_device_add(m->qts, "pc-dimm", id, "{'memdev': %s}", memdev);
+}
+
+static void test_incremental(void)
+{
+    /* Enable, make read-only, write-only and disable each PAM segment */
+    static const uint8_t pam[] = { 0x33, 0x11, 0x22, 0x00, 0x31, 0x13 };
+    static const uint8_t smram[] = {
+        SMRAM_G_SMRAME | SMRAM_D_OPEN | SMRAM_C_BASE,
+        SMRAM_G_SMRAME | SMRAM_C_BASE,
+        SMRAM_D_OPEN | SMRAM_C_BASE,
+        SMRAM_C_BASE,
+    };
+    TestMachine inc, full;
+    int i, j;
+
+    machine_start(&inc, true);
+    machine_start(&full, false);
+    check_same(&inc, &full, "startup");
+
+    for (i = 0; i < ARRAY_SIZE(pam); i++) {
+        for (j = 0; j < I440FX_PAM_NR; j++) {
+            write_both(&inc, &full, I440FX_PAM + j, pam[i]);
+        }
+    }
+
+    /* SMRAM changes overlap the PAM and VGA windows below 1 MiB */
+    for (i = 0; i < ARRAY_SIZE(smram); i++) {
+        write_both(&inc, &full, I440FX_SMRAM, smram[i]);
+        write_both(&inc, &full, I440FX_PAM + 1, pam[i]);
+        write_both(&inc, &full, I440FX_PAM + 6, pam[i + 1]);
+    }
+
+    /* New regions in the hotplug memory window */
+    for (i = 1; i < SLOTS; i++) {
+        hotplug_dimm(&inc, i);
+        hotplug_dimm(&full, i);
+        check_same(&inc, &full, "pc-dimm hotplug");
+        write_both(&inc, &full, I440FX_PAM + i, pam[i]);
+    }
+
+    machine_stop(&inc);
+    machine_stop(&full);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("flatview/incremental", test_incremental);
+
+    return g_test_run();
+}
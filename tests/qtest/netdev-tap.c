@@ -0,0 +1,156 @@
+/*
+ * QTest testcase for netdev tap with io-uring=on
+ *
+ * Tears the netdev down over and over while reads are posted on the tap
+ * fd and packets keep arriving, which exercises the cancellation of the
+ * in-flight requests.  Creating the tap device and injecting packets
+ * needs CAP_NET_ADMIN and CAP_NET_RAW, the test is skipped without them.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <linux/if_tun.h>
+#include "qemu/cutils.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#define ROUNDS  20
+#define BURST   256
+
+static int tap_open(char *ifname)
+{
+    struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI };
+    int fd = open("/dev/net/tun", O_RDWR);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
+    }
+    pstrcpy(ifname, IFNAMSIZ, ifr.ifr_name);
+    return fd;
+}
+
+/* Bring @ifname up and return a socket that transmits frames on it */
+static int packet_socket(const char *ifname)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = if_nametoindex(ifname),
+    };
+    struct ifreq ifr = { };
+    int sock = socket(AF_PACKET, SOCK_RAW, 0);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    pstrcpy(ifr.ifr_name, IFNAMSIZ, ifname);
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0) {
+        goto fail;
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(sock, SIOCSIFFLAGS, &ifr) < 0 ||
+        bind(sock, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        goto fail;
+    }
+    return sock;
+
+fail:
+    close(sock);
+    return -1;
+}
+
+static void send_burst(int sock)
+{
+    /* Broadcast, with the local experimental EtherType */
+    uint8_t frame[64] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x88, 0xb5,
+    };
+    int i;
+
+    for (i = 0; i < BURST; i++) {
+        frame[14] = i;
+        /* A full tap queue drops the frame, which is fine */
+        send(sock, frame, sizeof(frame), MSG_DONTWAIT);
+    }
+}
+
+static bool netdev_add(QTestState *qts, int fd)
+{
+    QDict *resp;
+    bool ok;
+
+    qtest_qmp_fds_assert_success(qts, &fd, 1,
+                                 "{ 'execute': 'getfd',"
+                                 "  'arguments': { 'fdname': 'tapfd' } }");
+    resp = qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                     " 'type': 'tap', 'id': 'hn0', 'fd': 'tapfd',"
+                     " 'io-uring': true } }");
+    ok = !qdict_haskey(resp, "error");
+    if (!ok) {
+        g_test_message("netdev_add failed: %s",
+                       qdict_get_str(qdict_get_qdict(resp, "error"),
+                                     "desc"));
+    }
+    qobject_unref(resp);
+    return ok;
+}
+
+static void test_uring_teardown(void)
+{
+    char ifname[IFNAMSIZ];
+    QTestState *qts;
+    int fd, sock, i;
+
+    fd = tap_open(ifname);
+    if (fd < 0) {
+        g_test_skip("cannot create a tap device");
+        return;
+    }
+    sock = packet_socket(ifname);
+    if (sock < 0) {
+        g_test_skip("cannot transmit on the tap device");
+        close(fd);
+        return;
+    }
+
+    qts = qtest_init("-machine none");
+    for (i = 0; i < ROUNDS; i++) {
+        if (!netdev_add(qts, fd)) {
+            g_assert_cmpint(i, ==, 0);
+            g_test_skip("io-uring=on is not available");
+            break;
+        }
+
+        /* Delete it while the ring is reading the burst */
+        send_burst(sock);
+        qtest_qmp_assert_success(qts, "{ 'execute': 'netdev_del',"
+                                 "  'arguments': { 'id': 'hn0' } }");
+
+        /* Reads left behind by the ring would land in freed buffers */
+        send_burst(sock);
+    }
+    qtest_qmp_assert_success(qts, "{ 'execute': 'query-status' }");
+
+    qtest_quit(qts);
+    close(sock);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/netdev/tap/io-uring/teardown", test_uring_teardown);
+
+    return g_test_run();
+}
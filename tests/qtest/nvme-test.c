@@ -14,6 +14,8 @@
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
 #include "block/nvme.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qnum.h"
 
 typedef struct QNvme QNvme;
 
@@ -142,6 +144,309 @@ static void nvmetest_pmr_reg_test(void *obj, void *data, QGuestAllocator *alloc)
     qpci_iounmap(pdev, pmr_bar);
 }
 
+/*
+ * A minimal host driver: an admin queue pair and one I/O queue pair, with
+ * interrupts disabled, whose completions are polled in guest memory.
+ */
+#define NVME_TEST_QSIZE         16
+#define NVME_TEST_TIMEOUT_US    (30 * G_USEC_PER_SEC)
+
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+} NvmeTestQueue;
+
+typedef struct NvmeTestCtrl {
+    QPCIDevice *pdev;
+    QTestState *qts;
+    QGuestAllocator *alloc;
+    QPCIBar bar;
+    NvmeTestQueue admin;
+    NvmeTestQueue io;
+    uint16_t cid;
+    /* Shadow doorbells and event indices, once Doorbell Buffer Config ran */
+    uint64_t dbbuf;
+    uint64_t eventidx;
+} NvmeTestCtrl;
+
+static void nvmetest_queue_init(NvmeTestCtrl *c, NvmeTestQueue *q,
+                                uint16_t qid)
+{
+    q->qid = qid;
+    q->sq = guest_alloc(c->alloc, NVME_TEST_QSIZE * sizeof(NvmeCmd));
+    q->cq = guest_alloc(c->alloc, NVME_TEST_QSIZE * sizeof(NvmeCqe));
+    qtest_memset(c->qts, q->cq, 0, NVME_TEST_QSIZE * sizeof(NvmeCqe));
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+}
+
+static void nvmetest_queue_free(NvmeTestCtrl *c, NvmeTestQueue *q)
+{
+    guest_free(c->alloc, q->sq);
+    guest_free(c->alloc, q->cq);
+}
+
+static void nvmetest_wait_ready(NvmeTestCtrl *c, bool ready)
+{
+    gint64 end = g_get_monotonic_time() + NVME_TEST_TIMEOUT_US;
+
+    while (NVME_CSTS_RDY(qpci_io_readl(c->pdev, c->bar, NVME_REG_CSTS)) !=
+           ready) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+    }
+}
+
+static void nvmetest_enable(NvmeTestCtrl *c)
+{
+    uint32_t cc = 0;
+
+    nvmetest_queue_init(c, &c->admin, 0);
+    qpci_io_writel(c->pdev, c->bar, NVME_REG_AQA,
+                   (NVME_TEST_QSIZE - 1) << AQA_ACQS_SHIFT |
+                   (NVME_TEST_QSIZE - 1) << AQA_ASQS_SHIFT);
+    qpci_io_writeq(c->pdev, c->bar, NVME_REG_ASQ, c->admin.sq);
+    qpci_io_writeq(c->pdev, c->bar, NVME_REG_ACQ, c->admin.cq);
+
+    NVME_SET_CC_EN(cc, 1);
+    NVME_SET_CC_IOSQES(cc, 6);
+    NVME_SET_CC_IOCQES(cc, 4);
+    qpci_io_writel(c->pdev, c->bar, NVME_REG_CC, cc);
+    nvmetest_wait_ready(c, true);
+}
+
+static void nvmetest_disable(NvmeTestCtrl *c)
+{
+    qpci_io_writel(c->pdev, c->bar, NVME_REG_CC, 0);
+    nvmetest_wait_ready(c, false);
+    nvmetest_queue_free(c, &c->admin);
+}
+
+/*
+ * Doorbells are at 0x1000, CAP.DSTRD is 0.  With a shadow doorbell, ring
+ * the real one only when @val moves past the event index, like Linux does
+ * for the I/O queues.
+ */
+static void nvmetest_ring(NvmeTestCtrl *c, NvmeTestQueue *q, bool cq,
+                          uint16_t old, uint16_t val)
+{
+    uint32_t offset = (q->qid << 3) + (cq << 2);
+
+    if (c->dbbuf && q->qid) {
+        uint32_t le = cpu_to_le32(val), ei;
+
+        qtest_memwrite(c->qts, c->dbbuf + offset, &le, sizeof(le));
+        qtest_memread(c->qts, c->eventidx + offset, &ei, sizeof(ei));
+        ei = le32_to_cpu(ei);
+        if ((val - ei - 1 + 2 * NVME_TEST_QSIZE) % NVME_TEST_QSIZE >=
+            (val - old + NVME_TEST_QSIZE) % NVME_TEST_QSIZE) {
+            return;
+        }
+    }
+    qpci_io_writel(c->pdev, c->bar, 0x1000 + offset, val);
+}
+
+static uint16_t nvmetest_submit(NvmeTestCtrl *c, NvmeTestQueue *q,
+                                NvmeCmd *cmd)
+{
+    uint16_t old = q->sq_tail;
+
+    cmd->cid = cpu_to_le16(++c->cid);
+    qtest_memwrite(c->qts, q->sq + q->sq_tail * sizeof(NvmeCmd),
+                   cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % NVME_TEST_QSIZE;
+    nvmetest_ring(c, q, false, old, q->sq_tail);
+    return c->cid;
+}
+
+/* Poll the completion of command @cid, which must succeed */
+static void nvmetest_complete(NvmeTestCtrl *c, NvmeTestQueue *q, uint16_t cid)
+{
+    gint64 end = g_get_monotonic_time() + NVME_TEST_TIMEOUT_US;
+    uint16_t old = q->cq_head;
+    NvmeCqe cqe;
+
+    for (;;) {
+        qtest_memread(c->qts, q->cq + q->cq_head * sizeof(cqe),
+                      &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+    }
+
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, cid);
+    g_assert_cmphex(le16_to_cpu(cqe.status) >> 1, ==, NVME_SUCCESS);
+    g_assert_cmpint(le16_to_cpu(cqe.sq_id), ==, q->qid);
+
+    q->cq_head = (q->cq_head + 1) % NVME_TEST_QSIZE;
+    if (!q->cq_head) {
+        q->phase ^= 1;
+    }
+    nvmetest_ring(c, q, true, old, q->cq_head);
+}
+
+static void nvmetest_admin(NvmeTestCtrl *c, NvmeCmd *cmd)
+{
+    nvmetest_complete(c, &c->admin, nvmetest_submit(c, &c->admin, cmd));
+}
+
+static void nvmetest_create_ioq(NvmeTestCtrl *c)
+{
+    nvmetest_queue_init(c, &c->io, 1);
+
+    nvmetest_admin(c, &(NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .dptr.prp1 = cpu_to_le64(c->io.cq),
+        .cdw10 = cpu_to_le32((NVME_TEST_QSIZE - 1) << 16 | c->io.qid),
+        .cdw11 = cpu_to_le32(NVME_CQ_PC),
+    });
+    nvmetest_admin(c, &(NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .dptr.prp1 = cpu_to_le64(c->io.sq),
+        .cdw10 = cpu_to_le32((NVME_TEST_QSIZE - 1) << 16 | c->io.qid),
+        .cdw11 = cpu_to_le32(c->io.qid << 16 | NVME_SQ_PC),
+    });
+}
+
+static void nvmetest_delete_ioq(NvmeTestCtrl *c)
+{
+    nvmetest_admin(c, &(NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_SQ,
+        .cdw10 = cpu_to_le32(c->io.qid),
+    });
+    nvmetest_admin(c, &(NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(c->io.qid),
+    });
+    nvmetest_queue_free(c, &c->io);
+}
+
+/* Read the first block of the namespace, which reads as zeroes */
+static void nvmetest_read(NvmeTestCtrl *c)
+{
+    uint64_t buf = guest_alloc(c->alloc, 4096);
+    uint8_t data[512];
+    int i;
+
+    qtest_memset(c->qts, buf, 0xff, sizeof(data));
+    nvmetest_complete(c, &c->io, nvmetest_submit(c, &c->io, &(NvmeCmd) {
+        .opcode = NVME_CMD_READ,
+        .nsid = cpu_to_le32(1),
+        .dptr.prp1 = cpu_to_le64(buf),
+    }));
+
+    qtest_memread(c->qts, buf, data, sizeof(data));
+    for (i = 0; i < sizeof(data); i++) {
+        g_assert_cmphex(data[i], ==, 0);
+    }
+    guest_free(c->alloc, buf);
+}
+
+static void nvmetest_ioq_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    NvmeTestCtrl c = {
+        .pdev = &nvme->dev,
+        .qts = nvme->dev.bus->qts,
+        .alloc = alloc,
+    };
+    int i;
+
+    qpci_device_enable(c.pdev);
+    c.bar = qpci_iomap(c.pdev, 0, NULL);
+
+    /* The second round checks that the reset released the queues */
+    for (i = 0; i < 2; i++) {
+        nvmetest_enable(&c);
+        nvmetest_create_ioq(&c);
+        nvmetest_read(&c);
+        nvmetest_read(&c);
+        nvmetest_delete_ioq(&c);
+        nvmetest_disable(&c);
+    }
+
+    qpci_iounmap(c.pdev, c.bar);
+}
+
+static uint64_t nvmetest_stat(NvmeTestCtrl *c, const char *name)
+{
+    g_autofree char *prop = g_strdup_printf("stats.%s", name);
+    QDict *rsp;
+    uint64_t val;
+
+    rsp = qtest_qmp(c->qts, "{ 'execute': 'qom-get', 'arguments': { "
+                    "'path': '/machine/peripheral/nvme0', 'property': %s } }",
+                    prop);
+    g_assert(qdict_haskey(rsp, "return"));
+    val = qnum_get_uint(qobject_to(QNum, qdict_get(rsp, "return")));
+    qobject_unref(rsp);
+    return val;
+}
+
+/*
+ * With the shadow doorbells set up, the IOThread polls them and moves the
+ * event indices so that the host does not ring the doorbells at all.
+ */
+static void nvmetest_dbbuf_poll_test(void *obj, void *data,
+                                     QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    NvmeTestCtrl c = {
+        .pdev = &nvme->dev,
+        .qts = nvme->dev.bus->qts,
+        .alloc = alloc,
+    };
+    uint64_t mmio, ioeventfd, polled, completions;
+    int i;
+
+    qpci_device_enable(c.pdev);
+    c.bar = qpci_iomap(c.pdev, 0, NULL);
+    nvmetest_enable(&c);
+
+    c.dbbuf = guest_alloc(alloc, 4096);
+    c.eventidx = guest_alloc(alloc, 4096);
+    qtest_memset(c.qts, c.dbbuf, 0, 4096);
+    qtest_memset(c.qts, c.eventidx, 0, 4096);
+    nvmetest_admin(&c, &(NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DBBUF_CONFIG,
+        .dptr.prp1 = cpu_to_le64(c.dbbuf),
+        .dptr.prp2 = cpu_to_le64(c.eventidx),
+    });
+    nvmetest_create_ioq(&c);
+
+    mmio = nvmetest_stat(&c, "mmio-doorbells");
+    ioeventfd = nvmetest_stat(&c, "ioeventfd-doorbells");
+    polled = nvmetest_stat(&c, "polled-doorbells");
+    completions = nvmetest_stat(&c, "completions");
+    g_assert_cmpuint(polled, ==, 0);
+    g_assert_cmpuint(completions, ==, 0);
+
+    /* Enough commands for the adaptive poll window to open up */
+    for (i = 0; i < 64; i++) {
+        nvmetest_read(&c);
+    }
+
+    /* I/O doorbells go through the eventfds or the shadow, never MMIO */
+    g_assert_cmpuint(nvmetest_stat(&c, "mmio-doorbells"), ==, mmio);
+    g_assert_cmpuint(nvmetest_stat(&c, "polled-doorbells"), >, polled);
+    g_assert_cmpuint(nvmetest_stat(&c, "ioeventfd-doorbells"), >=, ioeventfd);
+    g_assert_cmpuint(nvmetest_stat(&c, "completions"), ==, 64);
+    g_assert_cmpuint(nvmetest_stat(&c, "latency-ns"), >=,
+                     nvmetest_stat(&c, "max-latency-ns"));
+    g_assert_cmpuint(nvmetest_stat(&c, "max-latency-ns"), >, 0);
+
+    nvmetest_delete_ioq(&c);
+    nvmetest_disable(&c);
+    guest_free(alloc, c.dbbuf);
+    guest_free(alloc, c.eventidx);
+    qpci_iounmap(c.pdev, c.bar);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -168,6 +473,29 @@ static void nvme_register_nodes(void)
     });
 
     qos_add_test("reg-read", "nvme", nvmetest_reg_read_test, NULL);
+
+    qos_add_test("reg-read-iothread", "nvme", nvmetest_reg_read_test,
+                 &(QOSGraphTestOptions) {
+        .edge.before_cmd_line = "-object iothread,id=thread0",
+        .edge.extra_device_opts = "iothread=thread0"
+    });
+
+    qos_add_test("ioq", "nvme", nvmetest_ioq_test, NULL);
+
+    qos_add_test("ioq-iothread", "nvme", nvmetest_ioq_test,
+                 &(QOSGraphTestOptions) {
+        .edge.before_cmd_line = "-object iothread,id=thread0",
+        .edge.extra_device_opts = "iothread=thread0"
+    });
+
+    /* A long poll window, so the IOThread still polls at the next command */
+    qos_add_test("dbbuf-poll", "nvme", nvmetest_dbbuf_poll_test,
+                 &(QOSGraphTestOptions) {
+        .edge.before_cmd_line = "-object iothread,id=thread0,"
+                                "poll-max-ns=1000000000",
+        .edge.extra_device_opts = "id=nvme0,iothread=thread0,ioeventfd=on,"
+                                  "dbbuf-poll=on"
+    });
 }
 
 libqos_init(nvme_register_nodes);
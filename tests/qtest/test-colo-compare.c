@@ -0,0 +1,300 @@
+/*
+ * QTest testcase for colo-compare with several shards
+ *
+ * qemu side                          | test side
+ *                                    |
+ * +--------------+                   |  +-------+
+ * |              <----- primary_in -----+ pri   |
+ * |              <---- secondary_in ----+ sec   |
+ * | colo-compare +------ outdev ------->+ out   |
+ * |   shards=4   <---- notify_dev ----->+ notify|
+ * +--------------+                   |  +-------+
+ *
+ * The notify chardev is the Xen COLO interface: it reports miscompares and
+ * takes checkpoint requests, which flush the packets not compared yet.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#define CONNS       16
+#define PAYLOAD     32
+#define FRAME_LEN   (14 + 20 + 8 + PAYLOAD)
+
+typedef struct TestColo {
+    QTestState *qts;
+    int pri, sec, out, notify;
+} TestColo;
+
+/* A UDP frame of connection @conn, tagged with @round */
+static void build_frame(uint8_t *buf, unsigned conn, uint8_t round,
+                        uint8_t fill)
+{
+    uint8_t *ip = buf + 14, *udp = ip + 20, *data = udp + 8;
+
+    memset(buf, 0, FRAME_LEN);
+    memset(buf, 0xff, 6);
+    buf[6] = 0x52;
+    buf[7] = 0x54;
+    buf[11] = 1;
+    stw_be_p(buf + 12, 0x0800);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 8 + PAYLOAD);
+    ip[8] = 64;
+    ip[9] = 17;
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+
+    stw_be_p(udp, 1000 + conn);
+    stw_be_p(udp + 2, 7);
+    stw_be_p(udp + 4, 8 + PAYLOAD);
+
+    data[0] = round;
+    memset(data + 1, fill, PAYLOAD - 1);
+}
+
+static void send_msg(int fd, const void *buf, uint32_t size)
+{
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        { .iov_base = &len, .iov_len = sizeof(len) },
+        { .iov_base = (void *)buf, .iov_len = size },
+    };
+    ssize_t ret;
+
+    ret = iov_send(fd, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+static void send_frame(int fd, unsigned conn, uint8_t round, uint8_t fill)
+{
+    uint8_t buf[FRAME_LEN];
+
+    build_frame(buf, conn, round, fill);
+    send_msg(fd, buf, sizeof(buf));
+}
+
+static uint32_t recv_msg(int fd, uint8_t *buf, uint32_t size)
+{
+    uint32_t len;
+    ssize_t ret;
+
+    ret = recv(fd, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpuint(len, <=, size);
+    ret = recv(fd, buf, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+    return len;
+}
+
+/*
+ * Receive @n frames from outdev.  Shards release their packets
+ * independently, but each connection must see its rounds in order,
+ * starting at @round.
+ */
+static void recv_frames(TestColo *t, int n, uint8_t round)
+{
+    uint8_t next[CONNS];
+    uint8_t buf[FRAME_LEN];
+    int i;
+
+    memset(next, round, sizeof(next));
+    for (i = 0; i < n; i++) {
+        unsigned conn;
+
+        g_assert_cmpuint(recv_msg(t->out, buf, sizeof(buf)), ==, FRAME_LEN);
+        conn = lduw_be_p(buf + 14 + 20) - 1000;
+        g_assert_cmpuint(conn, <, CONNS);
+        g_assert_cmpuint(buf[14 + 20 + 8], ==, next[conn]);
+        next[conn]++;
+    }
+}
+
+/* Sum the @key counters of all the shards */
+static uint64_t stats_sum(TestColo *t, const char *key)
+{
+    QDict *resp;
+    g_auto(GStrv) fields = NULL;
+    g_autofree char *prefix = g_strdup_printf("%s=", key);
+    uint64_t sum = 0;
+    int shards = 0;
+    int i;
+
+    resp = qtest_qmp(t->qts, "{ 'execute': 'qom-get', 'arguments': {"
+                     " 'path': '/objects/comp0', 'property': 'stats' } }");
+    g_assert(qdict_haskey(resp, "return"));
+    fields = g_strsplit(qdict_get_str(resp, "return"), " ", -1);
+    qobject_unref(resp);
+
+    for (i = 0; fields[i]; i++) {
+        if (g_str_has_prefix(fields[i], "shard")) {
+            shards++;
+        } else if (g_str_has_prefix(fields[i], prefix)) {
+            sum += g_ascii_strtoull(fields[i] + strlen(prefix), NULL, 10);
+        }
+    }
+    g_assert_cmpint(shards, ==, 4);
+    return sum;
+}
+
+static void wait_stats(TestColo *t, const char *key, uint64_t value)
+{
+    g_test_timer_start();
+    while (stats_sum(t, key) != value) {
+        g_assert_cmpfloat(g_test_timer_elapsed(), <, 60);
+        g_usleep(10 * 1000);
+    }
+}
+
+static void colo_start(TestColo *t, const char *opts)
+{
+    int pri[2], sec[2], out[2], notify[2];
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, pri), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sec), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, out), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, notify), !=, -1);
+
+    t->qts = qtest_initf(
+        "-object iothread,id=iothread0 "
+        "-chardev socket,id=pri0,fd=%d "
+        "-chardev socket,id=sec0,fd=%d "
+        "-chardev socket,id=out0,fd=%d "
+        "-chardev socket,id=notify0,fd=%d "
+        "-object colo-compare,id=comp0,primary_in=pri0,secondary_in=sec0,"
+        "outdev=out0,notify_dev=notify0,iothread=iothread0,shards=4,"
+        "compare_timeout=60000,%s",
+        pri[1], sec[1], out[1], notify[1], opts);
+    t->pri = pri[0];
+    t->sec = sec[0];
+    t->out = out[0];
+    t->notify = notify[0];
+    close(pri[1]);
+    close(sec[1]);
+    close(out[1]);
+    close(notify[1]);
+
+    /* Make sure that the chardevs are connected */
+    qtest_qmp_assert_success(t->qts, "{ 'execute' : 'query-status'}");
+}
+
+static void colo_stop(TestColo *t)
+{
+    qtest_quit(t->qts);
+    close(t->pri);
+    close(t->sec);
+    close(t->out);
+    close(t->notify);
+}
+
+static void checkpoint(TestColo *t)
+{
+    send_msg(t->notify, "COLO_CHECKPOINT", strlen("COLO_CHECKPOINT"));
+}
+
+static void test_colo_compare_shards(void)
+{
+    uint8_t buf[64];
+    TestColo t;
+    int i, round;
+
+    colo_start(&t, "max_queue_size=1024");
+
+    /* Identical packets are released, in order within each connection */
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < CONNS; i++) {
+            send_frame(t.pri, i, round, 0xaa);
+        }
+        for (i = 0; i < CONNS; i++) {
+            send_frame(t.sec, i, round, 0xaa);
+        }
+    }
+    recv_frames(&t, 2 * CONNS, 0);
+    wait_stats(&t, "released", 2 * CONNS);
+    g_assert_cmpuint(stats_sum(&t, "connections"), ==, CONNS);
+
+    /* A checkpoint flushes what the secondary did not answer yet */
+    for (i = 0; i < CONNS; i++) {
+        send_frame(t.pri, i, 2, 0xaa);
+    }
+    wait_stats(&t, "packets", 5 * CONNS);
+    checkpoint(&t);
+    recv_frames(&t, CONNS, 2);
+
+    /* A miscompare asks for a checkpoint */
+    send_frame(t.pri, 0, 3, 0xaa);
+    send_frame(t.sec, 0, 3, 0x55);
+    g_assert_cmpuint(recv_msg(t.notify, buf, sizeof(buf)), ==,
+                     strlen("DO_CHECKPOINT"));
+    g_assert(!memcmp(buf, "DO_CHECKPOINT", strlen("DO_CHECKPOINT")));
+    g_assert_cmpuint(stats_sum(&t, "miscompares"), ==, 1);
+    g_assert_cmpuint(stats_sum(&t, "dropped"), ==, 0);
+
+    checkpoint(&t);
+    recv_frames(&t, 1, 3);
+
+    colo_stop(&t);
+}
+
+static void test_colo_compare_queue_limit(void)
+{
+    uint8_t arp[60] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    uint8_t buf[FRAME_LEN];
+    uint64_t dropped;
+    uint8_t round = 0;
+    TestColo t;
+    int i;
+
+    colo_start(&t, "max_queue_size=8");
+
+    /*
+     * Unanswered packets of one connection wait in the input queue of its
+     * shard, then in the connection: both hold a bounded number of them,
+     * the rest is dropped.
+     */
+    for (i = 0; i < 64; i++) {
+        send_frame(t.pri, 0, i, 0xaa);
+    }
+
+    /* Non-IP frames go straight out: this one follows the others */
+    stw_be_p(arp + 12, 0x0806);
+    send_msg(t.pri, arp, sizeof(arp));
+    g_assert_cmpuint(recv_msg(t.out, buf, sizeof(buf)), ==, sizeof(arp));
+    g_assert_cmphex(lduw_be_p(buf + 12), ==, 0x0806);
+    wait_stats(&t, "queued", 0);
+
+    dropped = stats_sum(&t, "dropped");
+    g_assert_cmpuint(dropped, >=, 64 - 9);
+    g_assert_cmpuint(dropped, <, 64);
+
+    /* The packets that were kept are flushed, oldest first */
+    checkpoint(&t);
+    for (i = 0; i < 64 - dropped; i++) {
+        g_assert_cmpuint(recv_msg(t.out, buf, sizeof(buf)), ==, FRAME_LEN);
+        g_assert_cmpuint(lduw_be_p(buf + 14 + 20), ==, 1000);
+        if (i) {
+            g_assert_cmpuint(buf[14 + 20 + 8], >, round);
+        }
+        round = buf[14 + 20 + 8];
+    }
+
+    colo_stop(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/netfilter/colo-compare/shards", test_colo_compare_shards);
+    qtest_add_func("/netfilter/colo-compare/queue-limit",
+                   test_colo_compare_queue_limit);
+
+    return g_test_run();
+}
@@ -0,0 +1,154 @@
+/*
+ * QTest testcase for filter-dump
+ *
+ * Packets come in on a socket netdev, which is plugged in a hub so that
+ * nothing holds them back, and are dumped by the writer thread of the
+ * filter, with or without file rotation.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "libqtest.h"
+
+#define PACKETS     200
+#define PACKET_LEN  1000
+#define PCAP_HDR    24
+#define RECORD_HDR  16
+#define RECORD_LEN  (RECORD_HDR + PACKET_LEN)
+
+static void send_packet(int fd, uint32_t index)
+{
+    uint8_t buf[PACKET_LEN];
+    uint32_t len = htonl(sizeof(buf));
+    struct iovec iov[] = {
+        { .iov_base = &len, .iov_len = sizeof(len) },
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+    };
+    ssize_t ret;
+
+    memset(buf, index, sizeof(buf));
+    stl_be_p(buf, index);
+    ret = iov_send(fd, iov, 2, 0, sizeof(len) + sizeof(buf));
+    g_assert_cmpint(ret, ==, sizeof(len) + sizeof(buf));
+}
+
+static char *dump_file(const char *base, unsigned i)
+{
+    return i ? g_strdup_printf("%s.%u", base, i) : g_strdup(base);
+}
+
+static uint64_t dump_size(const char *base, unsigned files)
+{
+    uint64_t size = 0;
+    unsigned i;
+
+    for (i = 0; i < files; i++) {
+        g_autofree char *name = dump_file(base, i);
+        struct stat st;
+
+        if (stat(name, &st) == 0) {
+            size += st.st_size;
+        }
+    }
+    return size;
+}
+
+/* Check that file @i holds the packets from @first on, return the next one */
+static uint32_t check_file(const char *base, unsigned i, uint32_t first,
+                           uint32_t count)
+{
+    g_autofree char *name = dump_file(base, i);
+    g_autofree char *contents = NULL;
+    uint8_t *p;
+    gsize len;
+    uint32_t n;
+
+    g_assert(g_file_get_contents(name, &contents, &len, NULL));
+    g_assert_cmpuint(len, ==, PCAP_HDR + count * RECORD_LEN);
+    p = (uint8_t *)contents;
+    g_assert_cmphex(ldl_he_p(p), ==, 0xa1b2c3d4);
+
+    p += PCAP_HDR;
+    for (n = first; n < first + count; n++, p += RECORD_LEN) {
+        g_assert_cmpuint(ldl_he_p(p + 8), ==, PACKET_LEN);
+        g_assert_cmpuint(ldl_he_p(p + 12), ==, PACKET_LEN);
+        g_assert_cmpuint(ldl_be_p(p + RECORD_HDR), ==, n);
+    }
+    unlink(name);
+    return n;
+}
+
+static void test_dump(const void *opaque)
+{
+    uint64_t rotate_size = (uintptr_t)opaque;
+    g_autofree char *dir = g_dir_make_tmp("filter-dump-XXXXXX", NULL);
+    g_autofree char *base = NULL;
+    g_autofree char *rotate = NULL;
+    g_autofree char *extra = NULL;
+    uint32_t per_file = PACKETS, n;
+    unsigned files = 1, i;
+    QTestState *qts;
+    int sock[2];
+
+    g_assert(dir);
+    base = g_build_filename(dir, "dump.pcap", NULL);
+    if (rotate_size) {
+        per_file = (rotate_size - PCAP_HDR) / RECORD_LEN;
+        files = DIV_ROUND_UP(PACKETS, per_file);
+        rotate = g_strdup_printf(",rotate-size=%" PRIu64, rotate_size);
+    }
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sock), !=, -1);
+    qts = qtest_initf(
+        "-machine none "
+        "-netdev socket,id=qtest-bn0,fd=%d "
+        "-netdev hubport,id=hp0,hubid=0,netdev=qtest-bn0 "
+        "-netdev hubport,id=hp1,hubid=0 "
+        "-object filter-dump,id=qtest-f0,netdev=qtest-bn0,file=%s%s",
+        sock[1], base, rotate ? rotate : "");
+    close(sock[1]);
+
+    /* Make sure that the netdev is connected */
+    qtest_qmp_assert_success(qts, "{ 'execute' : 'query-status'}");
+    for (n = 0; n < PACKETS; n++) {
+        send_packet(sock[0], n);
+    }
+
+    /* The writer thread flushes partial batches on its own */
+    g_test_timer_start();
+    while (dump_size(base, files) != files * PCAP_HDR +
+                                     PACKETS * RECORD_LEN) {
+        g_assert_cmpfloat(g_test_timer_elapsed(), <, 60);
+        g_usleep(10 * 1000);
+    }
+    qtest_qmp_assert_success(qts, "{ 'execute': 'object-del',"
+                             "  'arguments': { 'id': 'qtest-f0' } }");
+
+    for (i = 0, n = 0; i < files; i++) {
+        n = check_file(base, i, n, MIN(per_file, PACKETS - n));
+    }
+    g_assert_cmpuint(n, ==, PACKETS);
+    extra = dump_file(base, files);
+    g_assert(!g_file_test(extra, G_FILE_TEST_EXISTS));
+
+    qtest_quit(qts);
+    close(sock[0]);
+    rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    /* More than a few 64 KiB batches in a single file */
+    qtest_add_data_func("/netfilter/dump/batch", (void *)0, test_dump);
+    /* 19 packets per file */
+    qtest_add_data_func("/netfilter/dump/rotate", (void *)(uintptr_t)20000,
+                        test_dump);
+
+    return g_test_run();
+}
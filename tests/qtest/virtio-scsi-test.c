@@ -12,6 +12,7 @@
 #include "libqtest-single.h"
 #include "qemu/module.h"
 #include "scsi/constants.h"
+#include "qapi/qmp/qdict.h"
 #include "libqos/libqos-pc.h"
 #include "libqos/libqos-spapr.h"
 #include "libqos/virtio.h"
@@ -27,10 +28,12 @@
 #define QVIRTIO_SCSI_TIMEOUT_US (1 * 1000 * 1000)
 
 #define MAX_NUM_QUEUES 64
+#define PCI_SLOT_HP             0x06
 
 typedef struct {
     QVirtioDevice *dev;
     int num_queues;
+    int cmd_vq; /* command virtqueue of virtio_scsi_do_command() */
     QVirtQueue *vq[MAX_NUM_QUEUES + 2];
 } QVirtioSCSIQueues;
 
@@ -74,7 +77,7 @@ static uint8_t virtio_scsi_do_command(QVirtioSCSIQueues *vs,
     uint32_t free_head;
     QTestState *qts = global_qtest;
 
-    vq = vs->vq[2];
+    vq = vs->vq[2 + vs->cmd_vq];
 
     req.lun[0] = 1; /* Select LUN */
     req.lun[1] = 1; /* Select target 1 */
@@ -118,11 +121,9 @@ static uint8_t virtio_scsi_do_command(QVirtioSCSIQueues *vs,
     return response;
 }
 
-static QVirtioSCSIQueues *qvirtio_scsi_init(QVirtioDevice *dev)
+static QVirtioSCSIQueues *qvirtio_scsi_setup_queues(QVirtioDevice *dev)
 {
     QVirtioSCSIQueues *vs;
-    const uint8_t test_unit_ready_cdb[VIRTIO_SCSI_CDB_SIZE] = {};
-    struct virtio_scsi_cmd_resp resp;
     uint64_t features;
     int i;
 
@@ -143,6 +144,15 @@ static QVirtioSCSIQueues *qvirtio_scsi_init(QVirtioDevice *dev)
 
     qvirtio_set_driver_ok(dev);
 
+    return vs;
+}
+
+static QVirtioSCSIQueues *qvirtio_scsi_init(QVirtioDevice *dev)
+{
+    QVirtioSCSIQueues *vs = qvirtio_scsi_setup_queues(dev);
+    const uint8_t test_unit_ready_cdb[VIRTIO_SCSI_CDB_SIZE] = {};
+    struct virtio_scsi_cmd_resp resp;
+
     /* Clear the POWER ON OCCURRED unit attention */
     g_assert_cmpint(virtio_scsi_do_command(vs, test_unit_ready_cdb,
                                            NULL, 0, NULL, 0, &resp),
@@ -311,6 +321,217 @@ fail:
     unlink(tmp_path);
 }
 
+/* Wait for @head on @vq.  The ISR is shared by all virtqueues, so poll. */
+static void virtio_scsi_wait_used(QVirtQueue *vq, uint32_t head)
+{
+    gint64 end = g_get_monotonic_time() + QVIRTIO_SCSI_TIMEOUT_US;
+    uint32_t got;
+
+    while (!qvirtqueue_get_buf(global_qtest, vq, &got, NULL)) {
+        qtest_clock_step(global_qtest, 100);
+        g_assert(g_get_monotonic_time() <= end);
+    }
+    g_assert_cmpint(got, ==, head);
+}
+
+/* A READ(10) of one block, left in flight on a command virtqueue */
+typedef struct {
+    QVirtQueue *vq;
+    uint32_t head;
+    uint64_t req_addr;
+    uint64_t resp_addr;
+    uint64_t data_addr;
+} VirtioSCSIPendingRead;
+
+static void virtio_scsi_start_read(QVirtioSCSIQueues *vs, int n,
+                                   VirtioSCSIPendingRead *p)
+{
+    QTestState *qts = global_qtest;
+    struct virtio_scsi_cmd_req req = { { 0 } };
+    struct virtio_scsi_cmd_resp resp = { .response = 0xff, .status = 0xff };
+    const uint8_t read_cdb[VIRTIO_SCSI_CDB_SIZE] = {
+        /* READ(10) from LBA 0, transfer length 1 */
+        0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00
+    };
+
+    req.lun[0] = 1;
+    req.lun[1] = 1;
+    memcpy(req.cdb, read_cdb, VIRTIO_SCSI_CDB_SIZE);
+
+    p->vq = vs->vq[2 + n];
+    p->req_addr = qvirtio_scsi_alloc(vs, sizeof(req), &req);
+    p->resp_addr = qvirtio_scsi_alloc(vs, sizeof(resp), &resp);
+    p->data_addr = qvirtio_scsi_alloc(vs, 512, NULL);
+    p->head = qvirtqueue_add(qts, p->vq, p->req_addr, sizeof(req),
+                             false, true);
+    qvirtqueue_add(qts, p->vq, p->resp_addr, sizeof(resp), true, true);
+    qvirtqueue_add(qts, p->vq, p->data_addr, 512, true, false);
+    qvirtqueue_kick(qts, vs->dev, p->vq, p->head);
+}
+
+static uint8_t virtio_scsi_finish_read(VirtioSCSIPendingRead *p)
+{
+    uint8_t response;
+
+    virtio_scsi_wait_used(p->vq, p->head);
+    response = readb(p->resp_addr +
+                     offsetof(struct virtio_scsi_cmd_resp, response));
+    guest_free(alloc, p->req_addr);
+    guest_free(alloc, p->resp_addr);
+    guest_free(alloc, p->data_addr);
+    return response;
+}
+
+static uint8_t virtio_scsi_do_tmf(QVirtioSCSIQueues *vs, uint32_t subtype)
+{
+    QTestState *qts = global_qtest;
+    bool be = qvirtio_is_big_endian(vs->dev);
+    struct virtio_scsi_ctrl_tmf_req req = {
+        .type = be ? cpu_to_be32(VIRTIO_SCSI_T_TMF)
+                   : cpu_to_le32(VIRTIO_SCSI_T_TMF),
+        .subtype = be ? cpu_to_be32(subtype) : cpu_to_le32(subtype),
+        .lun = { 1, 1 },
+    };
+    struct virtio_scsi_ctrl_tmf_resp resp = { .response = 0xff };
+    uint64_t req_addr, resp_addr;
+    uint32_t head;
+    uint8_t response;
+
+    req_addr = qvirtio_scsi_alloc(vs, sizeof(req), &req);
+    resp_addr = qvirtio_scsi_alloc(vs, sizeof(resp), &resp);
+    head = qvirtqueue_add(qts, vs->vq[0], req_addr, sizeof(req), false, true);
+    qvirtqueue_add(qts, vs->vq[0], resp_addr, sizeof(resp), true, false);
+    qvirtqueue_kick(qts, vs->dev, vs->vq[0], head);
+
+    virtio_scsi_wait_used(vs->vq[0], head);
+    response = readb(resp_addr);
+    guest_free(alloc, req_addr);
+    guest_free(alloc, resp_addr);
+    return response;
+}
+
+/*
+ * Hotplug a virtio-scsi-pci with its four command virtqueues spread over
+ * two IOThreads, which can only be set up with JSON, then a disk on it.
+ */
+static void test_iothread_vq_mapping(void *obj, void *data,
+                                     QGuestAllocator *t_alloc)
+{
+    QVirtioSCSIPCI *scsi_pci = obj;
+    QPCIBus *bus = scsi_pci->pci_vdev.pdev->bus;
+    QTestState *qts = bus->qts;
+    QVirtioPCIDevice *dev;
+    QVirtioSCSIQueues *vs;
+    VirtioSCSIPendingRead reads[4];
+    uint8_t buf[512] = { 0 };
+    const uint8_t test_unit_ready_cdb[VIRTIO_SCSI_CDB_SIZE] = {};
+    const uint8_t write_cdb[VIRTIO_SCSI_CDB_SIZE] = {
+        /* WRITE(10) to LBA 0, transfer length 1 */
+        0x2a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00
+    };
+    struct virtio_scsi_cmd_resp resp;
+    int i;
+
+    if (bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    alloc = t_alloc;
+    qtest_qmp_device_add(qts, "virtio-scsi-pci", "scsi-mq",
+                         "{'addr': %s, 'num_queues': 4,"
+                         " 'iothread-vq-mapping': [{'iothread': 'thread0'},"
+                         "                         {'iothread': 'thread1'}]}",
+                         stringify(PCI_SLOT_HP) ".0");
+
+    dev = virtio_pci_new(bus, &(QPCIAddress) {
+                             .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0) });
+    g_assert_nonnull(dev);
+    g_assert_cmpint(dev->vdev.device_type, ==, VIRTIO_ID_SCSI);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(&dev->vdev);
+    vs = qvirtio_scsi_setup_queues(&dev->vdev);
+    g_assert_cmpint(vs->num_queues, ==, 4);
+
+    /* The disk moves to the IOThreads while the device is running */
+    qtest_qmp_device_add(qts, "scsi-hd", "scsihd",
+                         "{'bus': 'scsi-mq.0', 'drive': 'drv1',"
+                         " 'scsi-id': 1, 'lun': 0}");
+
+    /* Clear the unit attentions of the hotplug */
+    for (i = 0; i < 3; i++) {
+        g_assert_cmphex(virtio_scsi_do_command(vs, test_unit_ready_cdb,
+                                               NULL, 0, NULL, 0, &resp),
+                        ==, VIRTIO_SCSI_S_OK);
+        if (resp.status == GOOD) {
+            break;
+        }
+        g_assert_cmphex(resp.sense[2], ==, UNIT_ATTENTION);
+    }
+    g_assert_cmphex(resp.status, ==, GOOD);
+
+    /* Every command virtqueue, so that both IOThreads submit I/O */
+    for (i = 0; i < vs->num_queues; i++) {
+        vs->cmd_vq = i;
+        g_assert_cmphex(virtio_scsi_do_command(vs, write_cdb, NULL, 0,
+                                               buf, sizeof(buf), &resp),
+                        ==, VIRTIO_SCSI_S_OK);
+        g_assert_cmphex(resp.status, ==, GOOD);
+    }
+
+    /*
+     * Abort reads in flight in both IOThreads.  Each one is either aborted
+     * or done before the TMF reaches it.
+     */
+    for (i = 0; i < ARRAY_SIZE(reads); i++) {
+        virtio_scsi_start_read(vs, i, &reads[i]);
+    }
+    g_assert_cmphex(virtio_scsi_do_tmf(vs, VIRTIO_SCSI_T_TMF_ABORT_TASK_SET),
+                    ==, VIRTIO_SCSI_S_FUNCTION_COMPLETE);
+    for (i = 0; i < ARRAY_SIZE(reads); i++) {
+        uint8_t response = virtio_scsi_finish_read(&reads[i]);
+
+        g_assert(response == VIRTIO_SCSI_S_OK ||
+                 response == VIRTIO_SCSI_S_ABORTED);
+    }
+
+    /* The queues still work after the abort */
+    vs->cmd_vq = 1;
+    g_assert_cmphex(virtio_scsi_do_command(vs, write_cdb, NULL, 0,
+                                           buf, sizeof(buf), &resp),
+                    ==, VIRTIO_SCSI_S_OK);
+    g_assert_cmphex(resp.status, ==, GOOD);
+
+    qtest_qmp_device_del(qts, "scsihd");
+    qvirtio_scsi_pci_free(vs);
+    qvirtio_pci_device_disable(dev);
+    qos_object_destroy((QOSGraphObject *)dev);
+}
+
+static void test_iothread_vq_mapping_conflict(void *obj, void *data,
+                                              QGuestAllocator *t_alloc)
+{
+    QVirtioSCSIPCI *scsi_pci = obj;
+    QPCIBus *bus = scsi_pci->pci_vdev.pdev->bus;
+    QDict *rsp;
+
+    if (bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    rsp = qtest_qmp(bus->qts, "{'execute': 'device_add', 'arguments': {"
+                    " 'driver': 'virtio-scsi-pci', 'id': 'scsi-bad',"
+                    " 'addr': %s, 'iothread': 'thread0',"
+                    " 'iothread-vq-mapping': [{'iothread': 'thread1'}]}}",
+                    stringify(PCI_SLOT_HP) ".0");
+    g_assert(qdict_haskey(rsp, "error"));
+    g_assert_nonnull(strstr(qdict_get_str(qdict_get_qdict(rsp, "error"),
+                                          "desc"),
+                            "cannot be set at the same time"));
+    qobject_unref(rsp);
+}
+
 static void *virtio_scsi_hotplug_setup(GString *cmd_line, void *arg)
 {
     g_string_append(cmd_line,
@@ -359,6 +580,19 @@ static void *virtio_scsi_setup_iothread(GString *cmd_line, void *arg)
     return arg;
 }
 
+/* Reads and writes of drv1 take 100 ms, so that a TMF finds them in flight */
+static void *virtio_scsi_setup_iothread_vq_mapping(GString *cmd_line,
+                                                   void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=thread0"
+                    " -object iothread,id=thread1"
+                    " -drive id=drv1,if=none,file=null-co://,"
+                    "file.read-zeroes=on,file.latency-ns=100000000,"
+                    "format=raw");
+    return arg;
+}
+
 static void register_virtio_scsi_test(void)
 {
     QOSGraphTestOptions opts = { };
@@ -383,6 +617,13 @@ static void register_virtio_scsi_test(void)
     };
     qos_add_test("iothread-attach-node", "virtio-scsi-pci",
                  test_iothread_attach_node, &opts);
+
+    opts.before = virtio_scsi_setup_iothread_vq_mapping;
+    opts.edge = (QOSGraphEdgeOptions) { };
+    qos_add_test("iothread-vq-mapping", "virtio-scsi-pci",
+                 test_iothread_vq_mapping, &opts);
+    qos_add_test("iothread-vq-mapping-conflict", "virtio-scsi-pci",
+                 test_iothread_vq_mapping_conflict, &opts);
 }
 
 libqos_init(register_virtio_scsi_test);
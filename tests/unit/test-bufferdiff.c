@@ -0,0 +1,180 @@
+/*
+ * QEMU buffer_diff_copy test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/bitmap.h"
+
+#define MAX_LEN     4096
+#define GUARD       64
+#define MAX_BLOCKS  (MAX_LEN / 4 + 1)
+
+static uint8_t src_buf[MAX_LEN + 2 * GUARD];
+static uint8_t dst_buf[MAX_LEN + 2 * GUARD];
+static uint8_t ref_buf[MAX_LEN + 2 * GUARD];
+
+/* The obvious implementation, against which the accelerated ones are run */
+static size_t ref_diff_copy(uint8_t *dst, const uint8_t *src, size_t len,
+                            size_t block, unsigned long *changed)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i * block < len; i++) {
+        size_t l = MIN(block, len - i * block);
+
+        if (memcmp(dst + i * block, src + i * block, l)) {
+            memcpy(dst + i * block, src + i * block, l);
+            set_bit(i, changed);
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Run buffer_diff_copy() on @len bytes at @doff in dst_buf and @soff in
+ * src_buf, and check the return value, the bitmap and the whole of dst_buf,
+ * including the guard bytes around the destination.
+ */
+static void check(size_t doff, size_t soff, size_t len, size_t block)
+{
+    DECLARE_BITMAP(changed, MAX_BLOCKS);
+    DECLARE_BITMAP(ref_changed, MAX_BLOCKS);
+    size_t n, ref_n;
+
+    memcpy(ref_buf, dst_buf, sizeof(dst_buf));
+    bitmap_zero(changed, MAX_BLOCKS);
+    bitmap_zero(ref_changed, MAX_BLOCKS);
+
+    /* A bit that was already set stays set */
+    set_bit(MAX_BLOCKS - 1, changed);
+    set_bit(MAX_BLOCKS - 1, ref_changed);
+
+    ref_n = ref_diff_copy(ref_buf + doff, src_buf + soff, len, block,
+                          ref_changed);
+    n = buffer_diff_copy(dst_buf + doff, src_buf + soff, len, block, changed);
+
+    g_assert_cmpuint(n, ==, ref_n);
+    g_assert(bitmap_equal(changed, ref_changed, MAX_BLOCKS));
+    g_assert(memcmp(dst_buf, ref_buf, sizeof(dst_buf)) == 0);
+    g_assert(memcmp(dst_buf + doff, src_buf + soff, len) == 0);
+}
+
+static void fill(uint8_t *buf, size_t len, uint32_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = seed = seed * 1103515245 + 12345;
+    }
+}
+
+static void test_identical(size_t block)
+{
+    size_t len, off;
+
+    for (off = 0; off < 32; off++) {
+        for (len = 1; len <= MAX_LEN; len = len * 3 + 1) {
+            DECLARE_BITMAP(changed, MAX_BLOCKS);
+
+            fill(src_buf + GUARD + off, len, len);
+            memcpy(dst_buf + GUARD + off, src_buf + GUARD + off, len);
+            bitmap_zero(changed, MAX_BLOCKS);
+
+            g_assert_cmpuint(buffer_diff_copy(dst_buf + GUARD + off,
+                                              src_buf + GUARD + off,
+                                              len, block, changed), ==, 0);
+            g_assert(bitmap_empty(changed, MAX_BLOCKS));
+        }
+    }
+}
+
+static void test_last_byte(size_t block)
+{
+    size_t len, off;
+
+    for (off = 0; off < 32; off++) {
+        for (len = 1; len <= MAX_LEN; len += len < 64 ? 1 : 61) {
+            DECLARE_BITMAP(changed, MAX_BLOCKS);
+
+            fill(src_buf + GUARD + off, len, off);
+            memcpy(dst_buf + GUARD + off, src_buf + GUARD + off, len);
+            dst_buf[GUARD + off + len - 1] ^= 0x80;
+            bitmap_zero(changed, MAX_BLOCKS);
+
+            g_assert_cmpuint(buffer_diff_copy(dst_buf + GUARD + off,
+                                              src_buf + GUARD + off,
+                                              len, block, changed), ==, 1);
+            g_assert_cmpuint(find_first_bit(changed, MAX_BLOCKS), ==,
+                             (len - 1) / block);
+            g_assert_cmpuint(find_next_bit(changed, MAX_BLOCKS,
+                                           (len - 1) / block + 1),
+                             ==, MAX_BLOCKS);
+            g_assert(memcmp(dst_buf + GUARD + off, src_buf + GUARD + off,
+                            len) == 0);
+        }
+    }
+}
+
+static void test_random(size_t block)
+{
+    size_t len, doff, soff, i;
+
+    for (doff = 0; doff < 16; doff += 3) {
+        for (soff = 0; soff < 16; soff += 5) {
+            for (len = 1; len <= MAX_LEN; len += len < 64 ? 1 : 127) {
+                fill(src_buf, sizeof(src_buf), len);
+                fill(dst_buf, sizeof(dst_buf), ~len);
+                memcpy(dst_buf + GUARD + doff, src_buf + GUARD + soff, len);
+
+                /* Dirty roughly every third block, at a varying position */
+                for (i = 0; i < len; i += block * 3) {
+                    size_t pos = i + (i / block * 7) % block;
+
+                    dst_buf[GUARD + doff + MIN(pos, len - 1)]++;
+                }
+                check(GUARD + doff, GUARD + soff, len, block);
+
+                /* Everything differs: the first and last blocks included */
+                fill(dst_buf + GUARD + doff, len, len + 1);
+                check(GUARD + doff, GUARD + soff, len, block);
+            }
+        }
+    }
+}
+
+static void test_1(void)
+{
+    /* Narrow VNC surfaces have strides such as 36 bytes */
+    static const size_t blocks[] = { 4, 16, 36, 48, 64, 100, 128 };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(blocks); i++) {
+        test_identical(blocks[i]);
+        test_last_byte(blocks[i]);
+        test_random(blocks[i]);
+    }
+}
+
+static void test_2(void)
+{
+    if (g_test_perf()) {
+        test_1();
+    } else {
+        do {
+            test_1();
+        } while (test_buffer_diff_copy_next_accel());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/bufferdiff", test_2);
+
+    return g_test_run();
+}
@@ -498,6 +498,63 @@ static void test_xts_unaligned(const void *opaque)
 }
 
 
+static void test_xts_aes_accel(void)
+{
+    uint8_t out[512], Torg[16], T[16];
+    struct TestAES aesdata;
+    struct TestAES aestweak;
+    size_t i;
+
+    do {
+        for (i = 0; i < G_N_ELEMENTS(test_data); i++) {
+            const QCryptoXTSTestData *data = &test_data[i];
+            unsigned long len = data->PTLEN / 2;
+
+            AES_set_encrypt_key(data->key1, data->keylen / 2 * 8,
+                                &aesdata.enc);
+            AES_set_decrypt_key(data->key1, data->keylen / 2 * 8,
+                                &aesdata.dec);
+            AES_set_encrypt_key(data->key2, data->keylen / 2 * 8,
+                                &aestweak.enc);
+            AES_set_decrypt_key(data->key2, data->keylen / 2 * 8,
+                                &aestweak.dec);
+
+            STORE64L(data->seqnum, Torg);
+            memset(Torg + 8, 0, 8);
+
+            memcpy(T, Torg, sizeof(T));
+            xts_aes_encrypt(&aesdata.enc, &aestweak.enc, &aestweak.dec,
+                            T, data->PTLEN, out, data->PTX);
+            g_assert(memcmp(out, data->CTX, data->PTLEN) == 0);
+
+            memcpy(T, Torg, sizeof(T));
+            xts_aes_decrypt(&aesdata.dec, &aestweak.enc, &aestweak.dec,
+                            T, data->PTLEN, out, data->CTX);
+            g_assert(memcmp(out, data->PTX, data->PTLEN) == 0);
+
+            /* the same cases as test_xts_split */
+            if ((data->PTLEN < 32) || (data->PTLEN % 32)) {
+                continue;
+            }
+
+            memcpy(T, Torg, sizeof(T));
+            xts_aes_encrypt(&aesdata.enc, &aestweak.enc, &aestweak.dec,
+                            T, len, out, data->PTX);
+            xts_aes_encrypt(&aesdata.enc, &aestweak.enc, &aestweak.dec,
+                            T, len, &out[len], &data->PTX[len]);
+            g_assert(memcmp(out, data->CTX, data->PTLEN) == 0);
+
+            memcpy(T, Torg, sizeof(T));
+            xts_aes_decrypt(&aesdata.dec, &aestweak.enc, &aestweak.dec,
+                            T, len, out, data->CTX);
+            xts_aes_decrypt(&aesdata.dec, &aestweak.enc, &aestweak.dec,
+                            T, len, &out[len], &data->CTX[len]);
+            g_assert(memcmp(out, data->PTX, data->PTLEN) == 0);
+        }
+    } while (test_xts_aes_next_accel());
+}
+
+
 int main(int argc, char **argv)
 {
     size_t i;
@@ -525,5 +582,7 @@ int main(int argc, char **argv)
         g_free(path);
     }
 
+    g_test_add_func("/crypto/xts/aes/accel", test_xts_aes_accel);
+
     return g_test_run();
 }
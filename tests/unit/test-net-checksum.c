@@ -0,0 +1,148 @@
+/*
+ * Internet checksum test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "net/checksum.h"
+
+#define MAX_LEN     (192 * KiB)
+
+static uint8_t buffer[MAX_LEN + 64];
+
+static uint32_t ref_fold(uint64_t sum)
+{
+    while (sum >> 32) {
+        sum = (sum & 0xffffffff) + (sum >> 32);
+    }
+    return sum;
+}
+
+/* The byte-by-byte algorithm, with a sum wide enough for any length */
+static uint64_t ref_checksum_add_cont(size_t len, const uint8_t *buf, int seq)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i + seq) & 1 ? buf[i] : (uint32_t)buf[i] << 8;
+    }
+    return sum;
+}
+
+static void check(size_t off, size_t len, int seq)
+{
+    uint32_t ref = ref_fold(ref_checksum_add_cont(len, buffer + off, seq));
+    uint32_t sum = net_checksum_add_cont(len, buffer + off, seq);
+
+    /* Partial sums may differ by a fold, the final checksum may not */
+    g_assert_cmphex(net_checksum_finish(sum), ==, net_checksum_finish(ref));
+}
+
+static void fill(uint32_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = seed = seed * 1103515245 + 12345;
+    }
+}
+
+static void test_1(void)
+{
+    static const size_t big[] = {
+        64 * KiB - 1, 64 * KiB, 64 * KiB + 1, 65535 + 4096 + 3, MAX_LEN,
+    };
+    size_t off, len, i;
+    int seq;
+
+    fill(1);
+    for (off = 0; off < 32; off++) {
+        for (seq = 0; seq < 4; seq++) {
+            for (len = 0; len < 300; len++) {
+                check(off, len, seq);
+            }
+            for (; len < 4096; len += 97) {
+                check(off, len, seq);
+            }
+        }
+    }
+
+    /* Long buffers, where narrow lane accumulators would overflow */
+    memset(buffer, 0xff, sizeof(buffer));
+    for (i = 0; i < ARRAY_SIZE(big); i++) {
+        for (off = 0; off < 4; off++) {
+            check(off, big[i], off);
+        }
+    }
+
+    fill(2);
+    for (i = 0; i < ARRAY_SIZE(big); i++) {
+        check(1, big[i], 0);
+        check(3, big[i], 1);
+    }
+
+    /* Zeroes must still checksum to 0xffff */
+    memset(buffer, 0, sizeof(buffer));
+    for (len = 1; len < 256; len += 17) {
+        check(1, len, 1);
+        g_assert_cmphex(net_checksum_finish(net_checksum_add(len, buffer)),
+                        ==, 0xffff);
+    }
+}
+
+static void test_iov(void)
+{
+    struct iovec iov[5];
+    size_t cuts[] = { 1, 14, 35, 1500, 64 * KiB + 3 };
+    size_t total = 0, i, off;
+
+    fill(3);
+    for (i = 0; i < ARRAY_SIZE(cuts); i++) {
+        iov[i].iov_base = buffer + 1 + total + i;
+        iov[i].iov_len = cuts[i];
+        total += cuts[i];
+    }
+
+    /* Chunks at odd offsets of the packet swap the bytes of their sum */
+    for (off = 0; off < 40; off += 7) {
+        uint64_t ref = 0;
+        size_t skip = off, pos = 0;
+
+        for (i = 0; i < ARRAY_SIZE(iov); i++) {
+            size_t l = iov[i].iov_len, s = MIN(skip, l);
+
+            ref += ref_checksum_add_cont(l - s, iov[i].iov_base + s, pos);
+            pos += l - s;
+            skip -= s;
+        }
+        g_assert_cmphex(net_checksum_finish(
+                            net_checksum_add_iov(iov, ARRAY_SIZE(iov), off,
+                                                 total - off, 0)),
+                        ==, net_checksum_finish(ref_fold(ref)));
+    }
+}
+
+static void test_2(void)
+{
+    if (g_test_perf()) {
+        test_1();
+        test_iov();
+    } else {
+        do {
+            test_1();
+            test_iov();
+        } while (test_net_checksum_next_accel());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum", test_2);
+
+    return g_test_run();
+}
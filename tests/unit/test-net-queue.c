@@ -0,0 +1,250 @@
+/*
+ * NetQueue packet pool and NOCOPY tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+typedef struct TestPeer {
+    bool refuse;            /* return 0 from the delivery handler */
+    int delivered;
+    const void *last_base;  /* iov_base of the first element delivered */
+    uint8_t last[16384];
+    size_t last_size;
+} TestPeer;
+
+static int sent_count;
+static ssize_t sent_ret;
+
+/* net/queue.c only asks whether a sender may send; the tests never do */
+int qemu_can_send_packet(NetClientState *sender)
+{
+    return 1;
+}
+
+static ssize_t test_deliver(NetClientState *sender, unsigned flags,
+                            const struct iovec *iov, int iovcnt,
+                            void *opaque)
+{
+    TestPeer *peer = opaque;
+
+    if (peer->refuse) {
+        return 0;
+    }
+
+    peer->delivered++;
+    peer->last_base = iov[0].iov_base;
+    peer->last_size = iov_to_buf(iov, iovcnt, 0, peer->last,
+                                 sizeof(peer->last));
+    return peer->last_size;
+}
+
+static void test_sent(NetClientState *sender, ssize_t ret)
+{
+    sent_count++;
+    sent_ret = ret;
+}
+
+/* Queue one copied packet of @size bytes filled with @pattern and flush it */
+static const void *queue_and_flush(NetQueue *queue, TestPeer *peer,
+                                   size_t size, uint8_t pattern)
+{
+    g_autofree uint8_t *buf = g_malloc(size);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    size_t i;
+
+    memset(buf, pattern, size);
+    qemu_net_queue_append_iov(queue, NULL, 0, &iov, 1, test_sent);
+
+    /* Scribble over the source: the queue must have taken a copy */
+    memset(buf, ~pattern, size);
+
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpuint(peer->last_size, ==, size);
+    for (i = 0; i < size; i++) {
+        g_assert_cmphex(peer->last[i], ==, pattern);
+    }
+    return peer->last_base;
+}
+
+static void test_pool_reuse(void)
+{
+    TestPeer peer = { };
+    NetQueue *queue = qemu_new_net_queue(test_deliver, &peer);
+    const void *small, *full, *jumbo, *base;
+
+    sent_count = 0;
+
+    /* A freed packet is handed out again for the next packet of its class */
+    small = queue_and_flush(queue, &peer, 60, 0x11);
+    base = queue_and_flush(queue, &peer, 256, 0x22);
+    g_assert(base == small);
+
+    full = queue_and_flush(queue, &peer, 1514, 0x33);
+    g_assert(full != small);
+    base = queue_and_flush(queue, &peer, 257, 0x44);
+    g_assert(base == full);
+
+    jumbo = queue_and_flush(queue, &peer, 9000, 0x55);
+    g_assert(jumbo != small && jumbo != full);
+    base = queue_and_flush(queue, &peer, 10240, 0x66);
+    g_assert(base == jumbo);
+
+    /* Larger packets are allocated to size and still delivered intact */
+    queue_and_flush(queue, &peer, 16384, 0x77);
+
+    /* Reused buffers carry the new contents, not the previous ones */
+    base = queue_and_flush(queue, &peer, 1, 0x88);
+    g_assert(base == small);
+
+    g_assert_cmpint(peer.delivered, ==, 8);
+    g_assert_cmpint(sent_count, ==, 8);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_pool_backlog(void)
+{
+    TestPeer peer = { .refuse = true };
+    NetQueue *queue = qemu_new_net_queue(test_deliver, &peer);
+    uint8_t buf[1514];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    int i;
+
+    sent_count = 0;
+
+    /* Build a backlog larger than the pool cap, then drain it twice */
+    for (i = 0; i < 512; i++) {
+        memset(buf, i, sizeof(buf));
+        qemu_net_queue_append_iov(queue, NULL, 0, &iov, 1, test_sent);
+    }
+    g_assert_false(qemu_net_queue_flush(queue));
+    g_assert_cmpint(peer.delivered, ==, 0);
+
+    peer.refuse = false;
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpint(peer.delivered, ==, 512);
+    g_assert_cmpint(sent_count, ==, 512);
+    g_assert_cmphex(peer.last[0], ==, 511 & 0xff);
+
+    peer.refuse = true;
+    for (i = 0; i < 512; i++) {
+        qemu_net_queue_append_iov(queue, NULL, 0, &iov, 1, test_sent);
+    }
+    qemu_net_queue_purge(queue, NULL);
+    g_assert_cmpint(sent_count, ==, 1024);
+    g_assert_cmpint(sent_ret, ==, 0);
+
+    /* The free lists go away with the queue */
+    qemu_del_net_queue(queue);
+}
+
+static void test_nocopy(void)
+{
+    TestPeer peer = { .refuse = true };
+    NetQueue *queue = qemu_new_net_queue(test_deliver, &peer);
+    uint8_t hdr[12], payload[1500];
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = payload, .iov_len = sizeof(payload) },
+    };
+
+    sent_count = 0;
+    memset(hdr, 0xaa, sizeof(hdr));
+    memset(payload, 0xbb, sizeof(payload));
+
+    qemu_net_queue_append_iov(queue, NULL, QEMU_NET_PACKET_FLAG_NOCOPY,
+                              iov, ARRAY_SIZE(iov), test_sent);
+
+    /* The sender still owns the buffers: the queue only kept the iovec */
+    memset(payload, 0xcc, sizeof(payload));
+    iov[0].iov_base = NULL;
+
+    g_assert_false(qemu_net_queue_flush(queue));
+    g_assert_cmpint(sent_count, ==, 0);
+
+    peer.refuse = false;
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpint(peer.delivered, ==, 1);
+    g_assert(peer.last_base == hdr);
+    g_assert_cmpuint(peer.last_size, ==, sizeof(hdr) + sizeof(payload));
+    g_assert_cmphex(peer.last[0], ==, 0xaa);
+    g_assert_cmphex(peer.last[sizeof(hdr)], ==, 0xcc);
+    g_assert_cmpint(sent_count, ==, 1);
+    g_assert_cmpint(sent_ret, ==, sizeof(hdr) + sizeof(payload));
+
+    /* Purging hands the buffers back through the sent callback too */
+    iov[0].iov_base = hdr;
+    peer.refuse = true;
+    qemu_net_queue_append_iov(queue, NULL, QEMU_NET_PACKET_FLAG_NOCOPY,
+                              iov, ARRAY_SIZE(iov), test_sent);
+    qemu_net_queue_purge(queue, NULL);
+    g_assert_cmpint(sent_count, ==, 2);
+    g_assert_cmpint(sent_ret, ==, 0);
+    g_assert_cmpint(peer.delivered, ==, 1);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_nocopy_without_callback(void)
+{
+    TestPeer peer = { .refuse = true };
+    NetQueue *queue = qemu_new_net_queue(test_deliver, &peer);
+    uint8_t buf[64];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    /* Without a sent callback the flag is ignored and the data copied */
+    memset(buf, 0x5a, sizeof(buf));
+    qemu_net_queue_append_iov(queue, NULL, QEMU_NET_PACKET_FLAG_NOCOPY,
+                              &iov, 1, NULL);
+    memset(buf, 0xa5, sizeof(buf));
+
+    peer.refuse = false;
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpint(peer.delivered, ==, 1);
+    g_assert(peer.last_base != buf);
+    g_assert_cmphex(peer.last[0], ==, 0x5a);
+    g_assert_cmphex(peer.last[sizeof(buf) - 1], ==, 0x5a);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_nocopy_delete(void)
+{
+    TestPeer peer = { .refuse = true };
+    NetQueue *queue = qemu_new_net_queue(test_deliver, &peer);
+    uint8_t buf[64];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    sent_count = 0;
+    sent_ret = -1;
+
+    /* Deleting the queue also hands the buffers back */
+    qemu_net_queue_append_iov(queue, NULL, QEMU_NET_PACKET_FLAG_NOCOPY,
+                              &iov, 1, test_sent);
+    qemu_net_queue_append_iov(queue, NULL, QEMU_NET_PACKET_FLAG_NOCOPY,
+                              &iov, 1, test_sent);
+    qemu_del_net_queue(queue);
+
+    g_assert_cmpint(sent_count, ==, 2);
+    g_assert_cmpint(sent_ret, ==, 0);
+    g_assert_cmpint(peer.delivered, ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/pool-reuse", test_pool_reuse);
+    g_test_add_func("/net/queue/pool-backlog", test_pool_backlog);
+    g_test_add_func("/net/queue/nocopy", test_nocopy);
+    g_test_add_func("/net/queue/nocopy-without-callback",
+                    test_nocopy_without_callback);
+    g_test_add_func("/net/queue/nocopy-delete", test_nocopy_delete);
+
+    return g_test_run();
+}
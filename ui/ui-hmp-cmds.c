@@ -130,6 +130,22 @@ static void hmp_info_vnc_clients(Monitor *mon, VncClientInfoList *client)
                        cinfo->x509_dname ?: "none");
         monitor_printf(mon, "    sasl_username: %s\n",
                        cinfo->sasl_username ?: "none");
+        if (cinfo->encode_stats) {
+            VncClientEncodeStats *stats = cinfo->encode_stats;
+
+            monitor_printf(mon, "    frames: %" PRIu64 " rects: %" PRIu64
+                           " bytes: %" PRIu64 "\n",
+                           stats->frames, stats->rects, stats->bytes);
+            monitor_printf(mon, "    encode: avg %" PRIu64 "us max %" PRIu64
+                           "us, latency: avg %" PRIu64 "us max %" PRIu64
+                           "us\n",
+                           stats->encode_avg_us, stats->encode_max_us,
+                           stats->latency_avg_us, stats->latency_max_us);
+            monitor_printf(mon, "    link: %" PRIu64 " bytes/s rtt %" PRIu64
+                           "us congestion %" PRId64 "\n",
+                           stats->link_throughput, stats->link_rtt_us,
+                           stats->link_congestion);
+        }
 
         client = client->next;
     }
@@ -112,6 +112,7 @@ size_t vnc_client_write_sasl(VncState *vs)
         }
         offset = vs->output.offset;
         buffer_advance(&vs->output, vs->sasl.encodedRawLength);
+        vnc_link_written(vs, vs->sasl.encodedRawLength);
         if (offset >= vs->throttle_output_offset &&
             vs->output.offset < vs->throttle_output_offset) {
             trace_vnc_client_unthrottle_incremental(vs, vs->ioc,
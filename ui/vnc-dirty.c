@@ -0,0 +1,165 @@
+/*
+ * QEMU VNC display driver -- dirty maps
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "vnc.h"
+
+/*
+ * The summary has one bit per word of the map.  A set bit means that the
+ * word may be non-zero: setting dirty bits goes through the helpers below,
+ * which keep the summary up to date, while clearing them only touches the
+ * map and the summary catches up during the next scan.
+ */
+
+static size_t vnc_dirty_words(VncDirtyMap *map)
+{
+    return (size_t)map->height * (map->bpl / BITS_PER_LONG);
+}
+
+void vnc_dirty_resize(VncDirtyMap *map, int width, int height)
+{
+    int bpl = ROUND_UP(MAX(DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT), 1),
+                       BITS_PER_LONG);
+
+    if (map->bits && map->bpl == bpl && map->height == height) {
+        vnc_dirty_clear_all(map);
+        return;
+    }
+
+    vnc_dirty_free(map);
+    map->bpl = bpl;
+    map->height = height;
+    map->bits = g_new0(unsigned long, vnc_dirty_words(map));
+    map->summary = bitmap_new(vnc_dirty_words(map));
+}
+
+void vnc_dirty_free(VncDirtyMap *map)
+{
+    g_free(map->bits);
+    g_free(map->summary);
+    map->bits = NULL;
+    map->summary = NULL;
+    map->bpl = 0;
+    map->height = 0;
+}
+
+void vnc_dirty_clear_all(VncDirtyMap *map)
+{
+    size_t words = vnc_dirty_words(map);
+    unsigned long i;
+
+    for (i = find_first_bit(map->summary, words); i < words;
+         i = find_next_bit(map->summary, words, i + 1)) {
+        map->bits[i] = 0;
+    }
+    bitmap_zero(map->summary, words);
+}
+
+void vnc_dirty_set(VncDirtyMap *map, int y, int x, int n)
+{
+    size_t first = (size_t)y * map->bpl + x;
+
+    if (n <= 0) {
+        return;
+    }
+    bitmap_set(vnc_dirty_row(map, y), x, n);
+    bitmap_set(map->summary, first / BITS_PER_LONG,
+               (first + n - 1) / BITS_PER_LONG - first / BITS_PER_LONG + 1);
+}
+
+/* Set the bits of line @y from @x on that are set among @n bits of @src */
+void vnc_dirty_set_bits(VncDirtyMap *map, int y, int x,
+                        const unsigned long *src, int n)
+{
+    unsigned long *row = vnc_dirty_row(map, y);
+    size_t base = (size_t)y * map->bpl + x;
+    int i;
+
+    for (i = find_first_bit(src, n); i < n;
+         i = find_next_bit(src, n, i + 1)) {
+        set_bit(x + i, row);
+        set_bit((base + i) / BITS_PER_LONG, map->summary);
+    }
+}
+
+void vnc_dirty_or_row(VncDirtyMap *map, int y, const unsigned long *src)
+{
+    unsigned long *row = vnc_dirty_row(map, y);
+    size_t word = (size_t)y * (map->bpl / BITS_PER_LONG);
+    int i;
+
+    for (i = 0; i < map->bpl / BITS_PER_LONG; i++) {
+        if (src[i]) {
+            row[i] |= src[i];
+            set_bit(word + i, map->summary);
+        }
+    }
+}
+
+void vnc_dirty_merge(VncDirtyMap *dst, VncDirtyMap *src)
+{
+    size_t words = vnc_dirty_words(src);
+    unsigned long i;
+
+    assert(dst->bpl == src->bpl && dst->height == src->height);
+    for (i = find_first_bit(src->summary, words); i < words;
+         i = find_next_bit(src->summary, words, i + 1)) {
+        if (src->bits[i]) {
+            dst->bits[i] |= src->bits[i];
+            set_bit(i, dst->summary);
+            src->bits[i] = 0;
+        }
+    }
+    bitmap_zero(src->summary, words);
+}
+
+/*
+ * Like find_next_bit() over the whole map, with @size a multiple of the
+ * line length.  Words found clean on the way drop out of the summary.
+ */
+unsigned long vnc_dirty_find_next(VncDirtyMap *map, unsigned long size,
+                                  unsigned long offset)
+{
+    unsigned long words = size / BITS_PER_LONG;
+    unsigned long word = offset / BITS_PER_LONG;
+    unsigned long tmp;
+
+    if (offset >= size) {
+        return size;
+    }
+
+    tmp = map->bits[word] & (~0UL << (offset % BITS_PER_LONG));
+    if (tmp) {
+        return word * BITS_PER_LONG + ctzl(tmp);
+    }
+
+    for (word = find_next_bit(map->summary, words, word + 1); word < words;
+         word = find_next_bit(map->summary, words, word + 1)) {
+        tmp = map->bits[word];
+        if (tmp) {
+            return word * BITS_PER_LONG + ctzl(tmp);
+        }
+        clear_bit(word, map->summary);
+    }
+    return size;
+}
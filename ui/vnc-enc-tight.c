@@ -93,6 +93,15 @@ static const struct {
     { 0.4, 14, 0, 0 },
     { 0.5, 16, 0, 0 },
 };
+
+/*
+ * On a congested link, regions count as busier than they are, so that they
+ * switch to JPEG sooner.
+ */
+static double tight_update_freq(VncState *vs, int x, int y, int w, int h)
+{
+    return vnc_update_freq(vs, x, y, w, h) * (1 + vs->link.level);
+}
 #endif
 
 #ifdef CONFIG_PNG
@@ -297,7 +306,7 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
 {
     unsigned int errors;
     int compression = vs->tight->compression;
-    int quality = vs->tight->quality;
+    int quality = vs->tight->link_quality;
 
     if (!vs->vd->lossy) {
         return 0;
@@ -309,7 +318,7 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
         return 0;
     }
 
-    if (vs->tight->quality != (uint8_t)-1) {
+    if (vs->tight->link_quality != (uint8_t)-1) {
         if (w * h < VNC_TIGHT_JPEG_MIN_RECT_SIZE) {
             return 0;
         }
@@ -322,7 +331,7 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
     if (vs->client_pf.bytes_per_pixel == 4) {
         if (vs->tight->pixel24) {
             errors = tight_detect_smooth_image24(vs, w, h);
-            if (vs->tight->quality != (uint8_t)-1) {
+            if (vs->tight->link_quality != (uint8_t)-1) {
                 return (errors < tight_conf[quality].jpeg_threshold24);
             }
             return (errors < tight_conf[compression].gradient_threshold24);
@@ -816,6 +825,16 @@ static int tight_init_stream(VncState *vs, int stream_id,
     return 0;
 }
 
+/*
+ * The low bits of the compression control byte tell the client to reset
+ * its zlib streams, which vnc_tight_reset_streams() asks for.
+ */
+static void tight_write_ccb(VncState *vs, uint8_t ccb)
+{
+    vnc_write_u8(vs, ccb | vs->tight->reset_streams);
+    vs->tight->reset_streams = 0;
+}
+
 static void tight_send_compact_size(VncState *vs, size_t len)
 {
     int lpc = 0;
@@ -925,7 +944,7 @@ static int send_full_color_rect(VncState *vs, int x, int y, int w, int h)
     }
 #endif
 
-    vnc_write_u8(vs, stream << 4); /* no flushing, no filter */
+    tight_write_ccb(vs, stream << 4); /* no flushing, no filter */
 
     if (vs->tight->pixel24) {
         tight_pack24(vs, vs->tight->tight.buffer, w * h,
@@ -946,7 +965,7 @@ static int send_solid_rect(VncState *vs)
 {
     size_t bytes;
 
-    vnc_write_u8(vs, VNC_TIGHT_FILL << 4); /* no flushing, no filter */
+    tight_write_ccb(vs, VNC_TIGHT_FILL << 4); /* no flushing, no filter */
 
     if (vs->tight->pixel24) {
         tight_pack24(vs, vs->tight->tight.buffer, 1, &vs->tight->tight.offset);
@@ -982,7 +1001,7 @@ static int send_mono_rect(VncState *vs, int x, int y,
 
     bytes = DIV_ROUND_UP(w, 8) * h;
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_ccb(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, 1);
 
@@ -1048,7 +1067,7 @@ static bool send_gradient_rect(VncState *vs, int x, int y, int w, int h)
         return send_full_color_rect(vs, x, y, w, h);
     }
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_ccb(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_GRADIENT);
 
     buffer_reserve(&vs->tight->gradient, w * 3 * sizeof(int));
@@ -1090,7 +1109,7 @@ static int send_palette_rect(VncState *vs, int x, int y,
 
     colors = palette_size(palette);
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_ccb(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, colors - 1);
 
@@ -1221,7 +1240,7 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
 
-    vnc_write_u8(vs, VNC_TIGHT_JPEG << 4);
+    tight_write_ccb(vs, VNC_TIGHT_JPEG << 4);
 
     tight_send_compact_size(vs, vs->tight->jpeg.offset);
     vnc_write(vs, vs->tight->jpeg.buffer, vs->tight->jpeg.offset);
@@ -1373,7 +1392,7 @@ static int send_png_rect(VncState *vs, int x, int y, int w, int h,
 
     png_destroy_write_struct(&png_ptr, &info_ptr);
 
-    vnc_write_u8(vs, VNC_TIGHT_PNG << 4);
+    tight_write_ccb(vs, VNC_TIGHT_PNG << 4);
 
     tight_send_compact_size(vs, vs->tight->png.offset);
     vnc_write(vs, vs->tight->png.buffer, vs->tight->png.offset);
@@ -1429,9 +1448,9 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     int ret;
 
     if (colors == 0) {
-        if (force || (tight_jpeg_conf[vs->tight->quality].jpeg_full &&
+        if (force || (tight_jpeg_conf[vs->tight->link_quality].jpeg_full &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight->quality].jpeg_quality;
+            int quality = tight_conf[vs->tight->link_quality].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -1443,9 +1462,9 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
         ret = send_mono_rect(vs, x, y, w, h, bg, fg);
     } else if (colors <= 256) {
         if (force || (colors > 96 &&
-                      tight_jpeg_conf[vs->tight->quality].jpeg_idx &&
+                      tight_jpeg_conf[vs->tight->link_quality].jpeg_idx &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight->quality].jpeg_quality;
+            int quality = tight_conf[vs->tight->link_quality].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -1490,13 +1509,14 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
     vnc_tight_stop(vs);
 
 #ifdef CONFIG_VNC_JPEG
-    if (!vs->vd->non_adaptive && vs->tight->quality != (uint8_t)-1) {
-        double freq = vnc_update_freq(vs, x, y, w, h);
+    if (!vs->vd->non_adaptive && vs->tight->link_quality != (uint8_t)-1) {
+        double freq = tight_update_freq(vs, x, y, w, h);
+        int quality = vs->tight->link_quality;
 
-        if (freq < tight_jpeg_conf[vs->tight->quality].jpeg_freq_min) {
+        if (freq < tight_jpeg_conf[quality].jpeg_freq_min) {
             allow_jpeg = false;
         }
-        if (freq >= tight_jpeg_conf[vs->tight->quality].jpeg_freq_threshold) {
+        if (freq >= tight_jpeg_conf[quality].jpeg_freq_threshold) {
             force_jpeg = true;
             vnc_sent_lossy_rect(vs, x, y, w, h);
         }
@@ -1506,7 +1526,7 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
     colors = tight_fill_palette(vs, x, y, w * h, &bg, &fg, color_count_palette);
 
 #ifdef CONFIG_VNC_JPEG
-    if (allow_jpeg && vs->tight->quality != (uint8_t)-1) {
+    if (allow_jpeg && vs->tight->link_quality != (uint8_t)-1) {
         ret = send_sub_rect_jpeg(vs, x, y, w, h, bg, fg, colors,
                                  color_count_palette, force_jpeg);
     } else {
@@ -1657,10 +1677,11 @@ static int tight_send_framebuffer_update(VncState *vs, int x, int y,
     }
 
 #ifdef CONFIG_VNC_JPEG
-    if (vs->tight->quality != (uint8_t)-1) {
-        double freq = vnc_update_freq(vs, x, y, w, h);
+    if (vs->tight->link_quality != (uint8_t)-1) {
+        double freq = tight_update_freq(vs, x, y, w, h);
+        int quality = vs->tight->link_quality;
 
-        if (freq > tight_jpeg_conf[vs->tight->quality].jpeg_freq_threshold) {
+        if (freq > tight_jpeg_conf[quality].jpeg_freq_threshold) {
             return send_rect_simple(vs, x, y, w, h, false);
         }
     }
@@ -1678,9 +1699,24 @@ static int tight_send_framebuffer_update(VncState *vs, int x, int y,
     return find_large_solid_color_rect(vs, x, y, w, h, max_rows);
 }
 
+/*
+ * Trade quality for smoothness while the client link is congested: each
+ * congestion level takes two steps off the JPEG quality the client asked for.
+ */
+static void tight_update_link_quality(VncState *vs)
+{
+    if (vs->tight->quality == (uint8_t)-1) {
+        vs->tight->link_quality = vs->tight->quality;
+    } else {
+        vs->tight->link_quality = MAX(vs->tight->quality - 2 * vs->link.level,
+                                      0);
+    }
+}
+
 int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y,
                                       int w, int h)
 {
+    tight_update_link_quality(vs);
     vs->tight->type = VNC_ENCODING_TIGHT;
     return tight_send_framebuffer_update(vs, x, y, w, h);
 }
@@ -1688,10 +1724,58 @@ int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y,
 int vnc_tight_png_send_framebuffer_update(VncState *vs, int x, int y,
                                           int w, int h)
 {
+    tight_update_link_quality(vs);
     vs->tight->type = VNC_ENCODING_TIGHT_PNG;
     return tight_send_framebuffer_update(vs, x, y, w, h);
 }
 
+/*
+ * Restart the zlib streams on both ends, for a client whose streams were
+ * fed by another encoder.
+ */
+void vnc_tight_reset_streams(VncState *vs)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vs->tight->stream); i++) {
+        if (vs->tight->stream[i].opaque) {
+            deflateReset(&vs->tight->stream[i]);
+        }
+    }
+    vs->tight->reset_streams = VNC_TIGHT_CCB_RESET_MASK;
+}
+
+/*
+ * Give @vs a Tight state of its own, with the settings of @orig, to encode
+ * part of an update on another thread.  Its zlib streams start afresh, so
+ * the first rectangle tells the client to reset its streams too.
+ */
+void vnc_tight_slice_start(VncState *vs, VncTight *orig)
+{
+    VncTight *tight = g_new0(VncTight, 1);
+
+    buffer_init(&tight->tight,    "vnc-slice-tight/%p", vs);
+    buffer_init(&tight->zlib,     "vnc-slice-tight-zlib/%p", vs);
+    buffer_init(&tight->gradient, "vnc-slice-tight-gradient/%p", vs);
+#ifdef CONFIG_VNC_JPEG
+    buffer_init(&tight->jpeg,     "vnc-slice-tight-jpeg/%p", vs);
+#endif
+#ifdef CONFIG_PNG
+    buffer_init(&tight->png,      "vnc-slice-tight-png/%p", vs);
+#endif
+    tight->quality = orig->quality;
+    tight->compression = orig->compression;
+    tight->reset_streams = VNC_TIGHT_CCB_RESET_MASK;
+    vs->tight = tight;
+}
+
+void vnc_tight_slice_end(VncState *vs)
+{
+    vnc_tight_clear(vs);
+    g_free(vs->tight);
+    vs->tight = NULL;
+}
+
 void vnc_tight_clear(VncState *vs)
 {
     int i;
@@ -31,6 +31,7 @@
 #include "vnc-jobs.h"
 #include "qemu/sockets.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "block/aio.h"
 #include "trace.h"
 
@@ -45,27 +46,53 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, the VncDisplay global lock is held
+ * in shared mode to avoid screen corruption (this does not block vnc_refresh()
+ * because it uses trylock()) but the output lock is not held because the
+ * thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * The worker threads form a pool that takes jobs from a single global queue.
+ * Jobs of different clients are encoded in parallel, and each client has at
+ * most one job in flight, so the per-client encoder state is never shared.
+ * A job of a shared encoding group is encoded once, in the group's own
+ * state, and its output is copied to every client of the group.
+ * For encodings that keep no state between rectangles, the thread running
+ * a large job also splits its rectangles into slices that idle threads
+ * encode into private buffers; the slices are appended in order to the job's
+ * output so the framebuffer update is the same as if one thread encoded it.
+ * Tight slices restart the zlib streams instead, at some cost in
+ * compression, when the display has parallel-tight enabled.
  */
 
+/* Jobs covering less than this many pixels are not worth splitting */
+#define VNC_JOB_SPLIT_MIN_AREA (256 * 256)
+
+typedef struct VncJobSlice VncJobSlice;
+
+struct VncJobSlice {
+    VncJob *job;
+    QLIST_HEAD(, VncRectEntry) rectangles;
+    Buffer output;
+    int n_rectangles;
+    bool done;
+    QSIMPLEQ_ENTRY(VncJobSlice) next;
+};
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
+    int nthreads;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
+    QSIMPLEQ_HEAD(, VncJobSlice) slices;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, served by a pool of encoding threads
  */
 static VncJobQueue *queue;
 
@@ -108,24 +135,51 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+void vnc_job_set_copy(VncJob *job, const VncCopyRect *copy)
+{
+    trace_vnc_job_set_copy(job->vs, job, copy->src_x, copy->src_y,
+                           copy->dst.x, copy->dst.y, copy->dst.w, copy->dst.h);
+
+    job->copy = *copy;
+    job->has_copy = true;
+}
+
 void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
-    if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
+    if (queue->exit ||
+        (QLIST_EMPTY(&job->rectangles) && !job->has_copy)) {
+        g_free(job->members);
         g_free(job);
     } else {
+        job->queued_ns = get_clock();
         QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
         qemu_cond_broadcast(&queue->cond);
     }
     vnc_unlock_queue(queue);
 }
 
+static bool vnc_job_has_client(VncJob *job, VncState *vs)
+{
+    int i;
+
+    if (job->vs == vs) {
+        return true;
+    }
+    for (i = 0; i < job->n_members; i++) {
+        if (job->members[i] == vs) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool vnc_has_job_locked(VncState *vs)
 {
     VncJob *job;
 
     QTAILQ_FOREACH(job, &queue->jobs, next) {
-        if (job->vs == vs || !vs) {
+        if (!vs || vnc_job_has_client(job, vs)) {
             return true;
         }
     }
@@ -158,7 +212,13 @@ void vnc_jobs_consume_buffer(VncState *vs)
                     vnc_client_io, vs, NULL);
             }
         }
+        vs->link.update_bytes = vs->jobs_buffer.offset;
+        vs->link.update_ns = get_clock();
+        vs->link.drained_ns = 0;
         buffer_move(&vs->output, &vs->jobs_buffer);
+        if (vs->continuous) {
+            vnc_fence_ping_locked(vs);
+        }
 
         if (vs->job_update == VNC_STATE_UPDATE_FORCE) {
             vs->force_update_offset = vs->output.offset;
@@ -195,6 +255,7 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zrle = orig->zrle;
     local->client_width = orig->client_width;
     local->client_height = orig->client_height;
+    local->link.level = qatomic_read(&orig->link.level);
 }
 
 static void vnc_async_encoding_end(VncState *orig, VncState *local)
@@ -235,46 +296,369 @@ static bool vnc_worker_clamp_rect(VncState *vs, VncJob *job, VncRect *rect)
     return false;
 }
 
+/*
+ * The client executes a CopyRect on its own framebuffer, so it has to come
+ * first: the other rectangles of the update already carry the new content.
+ */
+static int vnc_worker_send_copy(VncState *vs, VncJob *job)
+{
+    VncCopyRect *copy = &job->copy;
+
+    if (copy->dst.x + copy->dst.w > vs->client_width ||
+        copy->dst.y + copy->dst.h > vs->client_height ||
+        copy->src_x + copy->dst.w > vs->client_width ||
+        copy->src_y + copy->dst.h > vs->client_height) {
+        trace_vnc_job_discard_rect(vs, job, copy->dst.x, copy->dst.y,
+                                   copy->dst.w, copy->dst.h);
+        return 0;
+    }
+
+    vnc_framebuffer_update(vs, copy->dst.x, copy->dst.y,
+                           copy->dst.w, copy->dst.h, VNC_ENCODING_COPYRECT);
+    vnc_write_u16(vs, copy->src_x);
+    vnc_write_u16(vs, copy->src_y);
+    return 1;
+}
+
+static bool vnc_worker_tight(VncState *vs)
+{
+    return vs->vnc_encoding == VNC_ENCODING_TIGHT ||
+           vs->vnc_encoding == VNC_ENCODING_TIGHT_PNG;
+}
+
+/*
+ * Encodings whose output for a rectangle does not depend on the rectangles
+ * sent before it, so that any thread can encode it.  With parallel-tight,
+ * each slice of a Tight update gets zlib streams of its own, which the
+ * client resets when the slice starts.
+ */
+static bool vnc_worker_can_split(VncState *vs)
+{
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_RAW:
+    case VNC_ENCODING_HEXTILE:
+        return true;
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+        return vs->vd->parallel_tight;
+    default:
+        return false;
+    }
+}
+
+static VncJobSlice *vnc_worker_find_slice_locked(VncJobQueue *queue)
+{
+    VncJobSlice *slice = QSIMPLEQ_FIRST(&queue->slices);
+
+    if (slice) {
+        QSIMPLEQ_REMOVE_HEAD(&queue->slices, next);
+    }
+    return slice;
+}
+
+static void vnc_worker_encode_slice(VncJobSlice *slice)
+{
+    g_autofree VncState *vs = g_new0(VncState, 1);
+    VncRectEntry *entry, *tmp;
+
+    vnc_async_encoding_start(slice->job->vs, vs);
+    vs->magic = VNC_MAGIC;
+    if (vnc_worker_tight(vs)) {
+        vnc_tight_slice_start(vs, vs->tight);
+    }
+
+    QLIST_FOREACH_SAFE(entry, &slice->rectangles, next, tmp) {
+        int n = vnc_send_framebuffer_update(vs, entry->rect.x, entry->rect.y,
+                                            entry->rect.w, entry->rect.h);
+
+        if (n >= 0) {
+            slice->n_rectangles += n;
+        }
+        g_free(entry);
+    }
+
+    if (vnc_worker_tight(vs)) {
+        vnc_tight_slice_end(vs);
+    }
+    buffer_move(&slice->output, &vs->output);
+    buffer_free(&vs->output);
+    vs->magic = 0;
+}
+
+/*
+ * Split the rectangles of @job in @nparts parts of roughly the same area,
+ * cutting tall rectangles in bands.  The first part stays in the job, the
+ * others are returned as slices.  Rectangles keep their relative order.
+ */
+static VncJobSlice *vnc_worker_split_job(VncJob *job, int nparts)
+{
+    QLIST_HEAD(, VncRectEntry) rects = QLIST_HEAD_INITIALIZER(rects);
+    VncRectEntry *entry, *tmp, *last = NULL;
+    VncRectEntry **tails = g_new0(VncRectEntry *, nparts);
+    VncJobSlice *slices;
+    uint64_t area = 0, part_area, done = 0;
+
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        area += (uint64_t)entry->rect.w * entry->rect.h;
+    }
+    part_area = DIV_ROUND_UP(area, nparts);
+
+    /* Cut the rectangles that span more than one part in bands */
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        int band = ROUND_UP(DIV_ROUND_UP(part_area, entry->rect.w),
+                            VNC_DIRTY_PIXELS_PER_BIT);
+
+        QLIST_REMOVE(entry, next);
+        while (entry->rect.h > band) {
+            VncRectEntry *split = g_new0(VncRectEntry, 1);
+
+            split->rect = entry->rect;
+            split->rect.h = band;
+            entry->rect.y += band;
+            entry->rect.h -= band;
+            if (last) {
+                QLIST_INSERT_AFTER(last, split, next);
+            } else {
+                QLIST_INSERT_HEAD(&rects, split, next);
+            }
+            last = split;
+        }
+        if (last) {
+            QLIST_INSERT_AFTER(last, entry, next);
+        } else {
+            QLIST_INSERT_HEAD(&rects, entry, next);
+        }
+        last = entry;
+    }
+
+    slices = g_new0(VncJobSlice, nparts - 1);
+    for (int i = 0; i < nparts - 1; i++) {
+        slices[i].job = job;
+        QLIST_INIT(&slices[i].rectangles);
+        buffer_init(&slices[i].output, "vnc-worker-slice");
+    }
+
+    QLIST_FOREACH_SAFE(entry, &rects, next, tmp) {
+        int part = MIN(done / part_area, (uint64_t)nparts - 1);
+
+        done += (uint64_t)entry->rect.w * entry->rect.h;
+        QLIST_REMOVE(entry, next);
+        if (tails[part]) {
+            QLIST_INSERT_AFTER(tails[part], entry, next);
+        } else if (part) {
+            QLIST_INSERT_HEAD(&slices[part - 1].rectangles, entry, next);
+        } else {
+            QLIST_INSERT_HEAD(&job->rectangles, entry, next);
+        }
+        tails[part] = entry;
+    }
+
+    g_free(tails);
+    return slices;
+}
+
+/* Hand the slices over to the pool, empty ones are complete already */
+static void vnc_worker_push_slices(VncJobQueue *queue, VncJobSlice *slices,
+                                   int n_slices)
+{
+    vnc_lock_queue(queue);
+    for (int i = 0; i < n_slices; i++) {
+        if (QLIST_EMPTY(&slices[i].rectangles)) {
+            slices[i].done = true;
+        } else {
+            QSIMPLEQ_INSERT_TAIL(&queue->slices, &slices[i], next);
+        }
+    }
+    qemu_cond_broadcast(&queue->cond);
+    vnc_unlock_queue(queue);
+}
+
+/* Wait for the slices of a job, encoding queued slices in the meantime */
+static void vnc_worker_wait_slices(VncJobQueue *queue, VncJobSlice *slices,
+                                   int n_slices)
+{
+    int i = 0;
+
+    vnc_lock_queue(queue);
+    while (i < n_slices) {
+        VncJobSlice *slice;
+
+        if (slices[i].done) {
+            i++;
+            continue;
+        }
+
+        slice = vnc_worker_find_slice_locked(queue);
+        if (slice) {
+            vnc_unlock_queue(queue);
+            vnc_worker_encode_slice(slice);
+            vnc_lock_queue(queue);
+            slice->done = true;
+            qemu_cond_broadcast(&queue->cond);
+        } else {
+            qemu_cond_wait(&queue->cond, &queue->mutex);
+        }
+    }
+    vnc_unlock_queue(queue);
+}
+
+static void vnc_worker_account(VncState *orig, VncJob *job, int n_rectangles,
+                               size_t bytes, int64_t start_ns)
+{
+    VncEncodeStats *stats = &orig->encode_stats;
+    int64_t now = get_clock();
+
+    stats->frames++;
+    stats->rects += n_rectangles;
+    stats->bytes += bytes;
+    stats->encode_ns += now - start_ns;
+    stats->encode_ns_max = MAX(stats->encode_ns_max, now - start_ns);
+    stats->latency_ns += now - job->queued_ns;
+    stats->latency_ns_max = MAX(stats->latency_ns_max, now - job->queued_ns);
+}
+
+/* A group job is worth encoding as long as one of its clients is there */
+static bool vnc_worker_group_alive(VncJob *job)
+{
+    bool alive = false;
+    int i;
+
+    for (i = 0; i < job->n_members && !alive; i++) {
+        VncState *vs = job->members[i];
+
+        vnc_lock_output(vs);
+        alive = vs->ioc != NULL && !vs->abort;
+        vnc_unlock_output(vs);
+    }
+    return alive;
+}
+
+/*
+ * Hand the update of a group job to each of its clients, along with the
+ * regions that were sent lossy so that they get their lossless refresh.
+ */
+static void vnc_worker_fan_out(VncJob *job, VncState *local, int n_rectangles,
+                               int64_t start_ns)
+{
+    int i, j, k;
+
+    for (i = 0; i < job->n_members; i++) {
+        VncState *vs = job->members[i];
+
+        vnc_lock_output(vs);
+        if (vs->ioc != NULL) {
+            vnc_worker_account(vs, job, n_rectangles, local->output.offset,
+                               start_ns);
+            buffer_append(&vs->jobs_buffer, local->output.buffer,
+                          local->output.offset);
+            qemu_bh_schedule(vs->bh);
+        }
+        vnc_unlock_output(vs);
+
+        for (j = 0; j < VNC_STAT_ROWS; j++) {
+            for (k = 0; k < VNC_STAT_COLS; k++) {
+                vs->lossy_rect[j][k] |= local->lossy_rect[j][k];
+            }
+        }
+    }
+    for (j = 0; j < VNC_STAT_ROWS; j++) {
+        memset(local->lossy_rect[j], 0, VNC_STAT_COLS);
+    }
+    buffer_reset(&local->output);
+}
+
+static VncJob *vnc_worker_find_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *other;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        bool busy = job->running;
+
+        QTAILQ_FOREACH(other, &queue->jobs, next) {
+            if (other == job) {
+                break;
+            }
+            /* Jobs of a client share its encoder state, keep them in order */
+            busy |= other->vs == job->vs;
+        }
+        if (!busy) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
 static int vnc_worker_thread_loop(VncJobQueue *queue)
 {
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs = {};
-    int n_rectangles;
+    VncJobSlice *slices = NULL;
+    int n_rectangles, n_slices = 0;
     int saved_offset;
+    int64_t start_ns;
+    bool disconnected = false;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    for (;;) {
+        VncJobSlice *slice;
+
+        if (queue->exit) {
+            vnc_unlock_queue(queue);
+            return -1;
+        }
+
+        /* Help with the jobs in progress before starting a new one */
+        slice = vnc_worker_find_slice_locked(queue);
+        if (slice) {
+            vnc_unlock_queue(queue);
+            vnc_worker_encode_slice(slice);
+            vnc_lock_queue(queue);
+            slice->done = true;
+            qemu_cond_broadcast(&queue->cond);
+            continue;
+        }
+
+        job = vnc_worker_find_job_locked(queue);
+        if (job) {
+            job->running = true;
+            break;
+        }
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
     vnc_unlock_queue(queue);
 
-    if (queue->exit) {
-        return -1;
-    }
-
     assert(job->vs->magic == VNC_MAGIC);
 
-    vnc_lock_output(job->vs);
-    if (job->vs->ioc == NULL || job->vs->abort == true) {
+    if (job->n_members) {
+        if (!vnc_worker_group_alive(job)) {
+            goto disconnected;
+        }
+    } else {
+        vnc_lock_output(job->vs);
+        if (job->vs->ioc == NULL || job->vs->abort == true) {
+            vnc_unlock_output(job->vs);
+            goto disconnected;
+        }
+        if (buffer_empty(&job->vs->output)) {
+            /*
+             * Looks like a NOP as it obviously moves no data.  But it
+             * moves the empty buffer, so we don't have to malloc a new
+             * one for vs.output
+             */
+            buffer_move_empty(&vs.output, &job->vs->output);
+        }
         vnc_unlock_output(job->vs);
-        goto disconnected;
     }
-    if (buffer_empty(&job->vs->output)) {
-        /*
-         * Looks like a NOP as it obviously moves no data.  But it
-         * moves the empty buffer, so we don't have to malloc a new
-         * one for vs.output
-         */
-        buffer_move_empty(&vs.output, &job->vs->output);
-    }
-    vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
     vnc_async_encoding_start(job->vs, &vs);
     vs.magic = VNC_MAGIC;
+    start_ns = get_clock();
+
+    if (job->reset_streams && vnc_worker_tight(&vs)) {
+        vnc_tight_reset_streams(&vs);
+    }
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -283,18 +667,41 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    if (job->has_copy) {
+        n_rectangles += vnc_worker_send_copy(&vs, job);
+    }
+
+    vnc_lock_display_shared(job->vs->vd);
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        if (!vnc_worker_clamp_rect(&vs, job, &entry->rect)) {
+            QLIST_REMOVE(entry, next);
+            g_free(entry);
+        }
+    }
+
+    if (vnc_worker_can_split(&vs)) {
+        uint64_t area = 0;
+        int nthreads = qatomic_read(&queue->nthreads);
+
+        QLIST_FOREACH(entry, &job->rectangles, next) {
+            area += (uint64_t)entry->rect.w * entry->rect.h;
+        }
+        if (nthreads > 1 && area >= VNC_JOB_SPLIT_MIN_AREA) {
+            n_slices = MIN((uint64_t)nthreads,
+                           area / (VNC_JOB_SPLIT_MIN_AREA / 4)) - 1;
+            slices = vnc_worker_split_job(job, n_slices + 1);
+            vnc_worker_push_slices(queue, slices, n_slices);
+        }
+    }
+
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
-        if (job->vs->ioc == NULL) {
-            vnc_unlock_display(job->vs->vd);
-            /* Copy persistent encoding data */
-            vnc_async_encoding_end(job->vs, &vs);
-            goto disconnected;
+        if (!disconnected && !job->n_members && job->vs->ioc == NULL) {
+            disconnected = true;
         }
 
-        if (vnc_worker_clamp_rect(&vs, job, &entry->rect)) {
+        if (!disconnected) {
             n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
                                             entry->rect.w, entry->rect.h);
 
@@ -304,8 +711,39 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
+
+    if (n_slices) {
+        vnc_worker_wait_slices(queue, slices, n_slices);
+    }
+    for (int i = 0; i < n_slices; i++) {
+        if (slices[i].output.offset && vnc_worker_tight(&vs)) {
+            /* the client's streams now follow those of the slice */
+            vnc_tight_reset_streams(&vs);
+        }
+        buffer_append(&vs.output, slices[i].output.buffer,
+                      slices[i].output.offset);
+        n_rectangles += slices[i].n_rectangles;
+        buffer_free(&slices[i].output);
+    }
+    g_free(slices);
+
+    if (disconnected) {
+        vnc_unlock_display_shared(job->vs->vd);
+        /* Copy persistent encoding data */
+        vnc_async_encoding_end(job->vs, &vs);
+        goto disconnected;
+    }
     trace_vnc_job_nrects(&vs, job, n_rectangles);
-    vnc_unlock_display(job->vs->vd);
+
+    if (job->n_members) {
+        vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
+        vs.output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
+        vnc_worker_fan_out(job, &vs, n_rectangles, start_ns);
+        vnc_unlock_display_shared(job->vs->vd);
+        vnc_async_encoding_end(job->vs, &vs);
+        goto disconnected;
+    }
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -313,6 +751,8 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
 
     vnc_lock_output(job->vs);
     if (job->vs->ioc != NULL) {
+        vnc_worker_account(job->vs, job, n_rectangles, vs.output.offset,
+                           start_ns);
         buffer_move(&job->vs->jobs_buffer, &vs.output);
         /* Copy persistent encoding data */
         vnc_async_encoding_end(job->vs, &vs);
@@ -330,6 +770,10 @@ disconnected:
     QTAILQ_REMOVE(&queue->jobs, job, next);
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    g_free(job->members);
     g_free(job);
     vs.magic = 0;
     return 0;
@@ -342,6 +786,7 @@ static VncJobQueue *vnc_queue_init(void)
     qemu_cond_init(&queue->cond);
     qemu_mutex_init(&queue->mutex);
     QTAILQ_INIT(&queue->jobs);
+    QSIMPLEQ_INIT(&queue->slices);
     return queue;
 }
 
@@ -356,28 +801,40 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
-
-    qemu_thread_get_self(&queue->thread);
+    bool last;
 
     while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+
+    vnc_lock_queue(queue);
+    qatomic_set(&queue->nthreads, queue->nthreads - 1);
+    last = !queue->nthreads;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
-static bool vnc_worker_thread_running(void)
+/*
+ * Grow the encoder pool to @nthreads threads.  The pool is shared by all
+ * displays, so it never shrinks.
+ */
+void vnc_start_worker_threads(int nthreads)
 {
-    return queue; /* Check global queue */
-}
+    VncJobQueue *q = queue;
 
-void vnc_start_worker_thread(void)
-{
-    VncJobQueue *q;
+    if (!q) {
+        q = vnc_queue_init();
+        queue = q; /* Set global queue */
+    }
 
-    if (vnc_worker_thread_running())
-        return;
+    vnc_lock_queue(q);
+    while (q->nthreads < nthreads) {
+        QemuThread thread;
 
-    q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
-    queue = q; /* Set global queue */
+        qemu_thread_create(&thread, "vnc_worker", vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+        qatomic_set(&q->nthreads, q->nthreads + 1);
+    }
+    vnc_unlock_queue(q);
 }
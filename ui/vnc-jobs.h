@@ -33,25 +33,47 @@
 /* Jobs */
 VncJob *vnc_job_new(VncState *vs);
 int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h);
+void vnc_job_set_copy(VncJob *job, const VncCopyRect *copy);
 void vnc_job_push(VncJob *job);
 void vnc_jobs_join(VncState *vs);
 
 void vnc_jobs_consume_buffer(VncState *vs);
-void vnc_start_worker_thread(void);
+void vnc_start_worker_threads(int nthreads);
 
 /* Locks */
+
+/*
+ * The display lock is taken exclusively by vnc_refresh() to update the server
+ * surface, and shared by the encoder threads that read it.
+ */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -EBUSY;
+    }
+    if (vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -EBUSY;
+    }
+    return 0;
 }
 
-static inline void vnc_lock_display(VncDisplay *vd)
+static inline void vnc_unlock_display(VncDisplay *vd)
+{
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_lock_display_shared(VncDisplay *vd)
 {
     qemu_mutex_lock(&vd->mutex);
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
 }
 
-static inline void vnc_unlock_display(VncDisplay *vd)
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
 {
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders--;
     qemu_mutex_unlock(&vd->mutex);
 }
 
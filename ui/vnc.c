@@ -59,8 +59,12 @@
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  GUI_REFRESH_INTERVAL_IDLE
-static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
-static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
+#define VNC_REFRESH_STATS_NS      (500 * SCALE_MS)
+#define VNC_REFRESH_LOSSY_NS      (2 * NANOSECONDS_PER_SECOND)
+/* Updates of a tile needed before it gets a frequency */
+#define VNC_STAT_MIN_UPDATES      10
+/* The newest interval weighs 1/VNC_STAT_DECAY in the average */
+#define VNC_STAT_DECAY            8
 
 #include "vnc_keysym.h"
 #include "crypto/cipher.h"
@@ -317,7 +321,31 @@ static void vnc_qmp_event(VncState *vs, QAPIEvent event)
     qapi_free_VncServerInfo(si);
 }
 
-static VncClientInfo *qmp_query_vnc_client(const VncState *client)
+static VncClientEncodeStats *qmp_query_vnc_encode_stats(VncState *client)
+{
+    VncClientEncodeStats *stats = g_new0(VncClientEncodeStats, 1);
+    VncEncodeStats *es = &client->encode_stats;
+
+    vnc_lock_output(client);
+    stats->frames = es->frames;
+    stats->rects = es->rects;
+    stats->bytes = es->bytes;
+    if (es->frames) {
+        stats->encode_avg_us = es->encode_ns / es->frames / SCALE_US;
+        stats->latency_avg_us = es->latency_ns / es->frames / SCALE_US;
+    }
+    stats->encode_max_us = es->encode_ns_max / SCALE_US;
+    stats->latency_max_us = es->latency_ns_max / SCALE_US;
+    vnc_unlock_output(client);
+
+    stats->link_throughput = client->link.throughput;
+    stats->link_rtt_us = client->link.rtt_ns / SCALE_US;
+    stats->link_congestion = client->link.level;
+
+    return stats;
+}
+
+static VncClientInfo *qmp_query_vnc_client(VncState *client)
 {
     VncClientInfo *info;
     Error *err = NULL;
@@ -343,6 +371,7 @@ static VncClientInfo *qmp_query_vnc_client(const VncState *client)
         info->sasl_username = g_strdup(client->sasl.username);
     }
 #endif
+    info->encode_stats = qmp_query_vnc_encode_stats(client);
 
     return info;
 }
@@ -613,6 +642,7 @@ bool vnc_display_reload_certs(const char *id, Error **errp)
 */
 
 static int vnc_update_client(VncState *vs, int has_dirty);
+static void vnc_free_groups(VncDisplay *vd);
 static void vnc_disconnect_start(VncState *vs);
 
 static void vnc_colordepth(VncState *vs);
@@ -638,13 +668,11 @@ static int vnc_height(VncDisplay *vd)
     return MIN(VNC_MAX_HEIGHT, surface_height(vd->ds));
 }
 
-static void vnc_set_area_dirty(DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT],
-                               VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT),
-                               VncDisplay *vd,
+static void vnc_set_area_dirty(VncDirtyMap *dirty, VncDisplay *vd,
                                int x, int y, int w, int h)
 {
-    int width = vnc_width(vd);
-    int height = vnc_height(vd);
+    int width = MIN(vnc_width(vd), dirty->bpl * VNC_DIRTY_PIXELS_PER_BIT);
+    int height = MIN(vnc_height(vd), dirty->height);
 
     /* this is needed this to ensure we updated all affected
      * blocks if x % VNC_DIRTY_PIXELS_PER_BIT != 0 */
@@ -657,8 +685,8 @@ static void vnc_set_area_dirty(DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT],
     h = MIN(y + h, height);
 
     for (; y < h; y++) {
-        bitmap_set(dirty[y], x / VNC_DIRTY_PIXELS_PER_BIT,
-                   DIV_ROUND_UP(w, VNC_DIRTY_PIXELS_PER_BIT));
+        vnc_dirty_set(dirty, y, x / VNC_DIRTY_PIXELS_PER_BIT,
+                      DIV_ROUND_UP(w, VNC_DIRTY_PIXELS_PER_BIT));
     }
 }
 
@@ -668,18 +696,7 @@ static void vnc_dpy_update(DisplayChangeListener *dcl,
     VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
     struct VncSurface *s = &vd->guest;
 
-    vnc_set_area_dirty(s->dirty, vd, x, y, w, h);
-}
-
-void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
-                            int32_t encoding)
-{
-    vnc_write_u16(vs, x);
-    vnc_write_u16(vs, y);
-    vnc_write_u16(vs, w);
-    vnc_write_u16(vs, h);
-
-    vnc_write_s32(vs, encoding);
+    vnc_set_area_dirty(&s->dirty, vd, x, y, w, h);
 }
 
 static void vnc_desktop_resize_ext(VncState *vs, int reject_reason)
@@ -771,21 +788,6 @@ static void vnc_abort_display_jobs(VncDisplay *vd)
     }
 }
 
-int vnc_server_fb_stride(VncDisplay *vd)
-{
-    return pixman_image_get_stride(vd->server);
-}
-
-void *vnc_server_fb_ptr(VncDisplay *vd, int x, int y)
-{
-    uint8_t *ptr;
-
-    ptr  = (uint8_t *)pixman_image_get_data(vd->server);
-    ptr += y * vnc_server_fb_stride(vd);
-    ptr += x * VNC_SERVER_FB_BYTES;
-    return ptr;
-}
-
 static void vnc_update_server_surface(VncDisplay *vd)
 {
     int width, height;
@@ -804,11 +806,31 @@ static void vnc_update_server_surface(VncDisplay *vd)
                                           width, height,
                                           NULL, 0);
 
-    memset(vd->guest.dirty, 0x00, sizeof(vd->guest.dirty));
-    vnc_set_area_dirty(vd->guest.dirty, vd, 0, 0,
+    vnc_dirty_clear_all(&vd->guest.dirty);
+    vnc_set_area_dirty(&vd->guest.dirty, vd, 0, 0,
                        width, height);
 }
 
+/* Size the guest dirty map and the update statistics to a new surface */
+static void vnc_resize_guest_maps(VncDisplay *vd)
+{
+    struct VncSurface *s = &vd->guest;
+    int width = vnc_width(vd);
+    int height = vnc_height(vd);
+
+    vnc_dirty_resize(&s->dirty, width, height);
+
+    /* vnc_update_freq() may look at the tiles just past the surface */
+    g_free(s->stats);
+    g_free(s->stat_active);
+    g_free(s->stat_sums);
+    s->stat_cols = width / VNC_STAT_RECT + 1;
+    s->stat_rows = height / VNC_STAT_RECT + 1;
+    s->stats = g_new0(VncRectStat, s->stat_rows * s->stat_cols);
+    s->stat_active = bitmap_new(s->stat_rows * s->stat_cols);
+    s->stat_sums = g_new0(uint64_t, (s->stat_rows + 1) * (s->stat_cols + 1));
+}
+
 static bool vnc_check_pageflip(DisplaySurface *s1,
                                DisplaySurface *s2)
 {
@@ -841,12 +863,15 @@ static void vnc_dpy_switch(DisplayChangeListener *dcl,
                                       surface_width(surface),
                                       surface_height(surface),
                                       surface_format(surface));
-        vnc_set_area_dirty(vd->guest.dirty, vd, 0, 0,
+        vnc_set_area_dirty(&vd->guest.dirty, vd, 0, 0,
                            surface_width(surface),
                            surface_height(surface));
         return;
     }
 
+    vnc_free_groups(vd);
+    vnc_resize_guest_maps(vd);
+
     trace_vnc_server_dpy_recreate(vd,
                                   surface_width(surface),
                                   surface_height(surface),
@@ -858,10 +883,11 @@ static void vnc_dpy_switch(DisplayChangeListener *dcl,
         vnc_colordepth(vs);
         vnc_desktop_resize(vs);
         vnc_cursor_define(vs);
-        memset(vs->dirty, 0x00, sizeof(vs->dirty));
-        vnc_set_area_dirty(vs->dirty, vd, 0, 0,
+        vnc_dirty_resize(&vs->dirty, vnc_width(vd), vnc_height(vd));
+        vnc_set_area_dirty(&vs->dirty, vd, 0, 0,
                            vnc_width(vd),
                            vnc_height(vd));
+        vs->copy_pending = false;
         vnc_update_throttle_offset(vs);
     }
 }
@@ -873,51 +899,6 @@ static void vnc_write_pixels_copy(VncState *vs,
     vnc_write(vs, pixels, size);
 }
 
-/* slowest but generic code. */
-void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
-{
-    uint8_t r, g, b;
-
-#if VNC_SERVER_FB_FORMAT == PIXMAN_FORMAT(32, PIXMAN_TYPE_ARGB, 0, 8, 8, 8)
-    r = (((v & 0x00ff0000) >> 16) << vs->client_pf.rbits) >> 8;
-    g = (((v & 0x0000ff00) >>  8) << vs->client_pf.gbits) >> 8;
-    b = (((v & 0x000000ff) >>  0) << vs->client_pf.bbits) >> 8;
-#else
-# error need some bits here if you change VNC_SERVER_FB_FORMAT
-#endif
-    v = (r << vs->client_pf.rshift) |
-        (g << vs->client_pf.gshift) |
-        (b << vs->client_pf.bshift);
-    switch (vs->client_pf.bytes_per_pixel) {
-    case 1:
-        buf[0] = v;
-        break;
-    case 2:
-        if (vs->client_be) {
-            buf[0] = v >> 8;
-            buf[1] = v;
-        } else {
-            buf[1] = v >> 8;
-            buf[0] = v;
-        }
-        break;
-    default:
-    case 4:
-        if (vs->client_be) {
-            buf[0] = v >> 24;
-            buf[1] = v >> 16;
-            buf[2] = v >> 8;
-            buf[3] = v;
-        } else {
-            buf[3] = v >> 24;
-            buf[2] = v >> 16;
-            buf[1] = v >> 8;
-            buf[0] = v;
-        }
-        break;
-    }
-}
-
 static void vnc_write_pixels_generic(VncState *vs,
                                      void *pixels1, int size)
 {
@@ -934,52 +915,6 @@ static void vnc_write_pixels_generic(VncState *vs,
     }
 }
 
-int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
-{
-    int i;
-    uint8_t *row;
-    VncDisplay *vd = vs->vd;
-
-    row = vnc_server_fb_ptr(vd, x, y);
-    for (i = 0; i < h; i++) {
-        vs->write_pixels(vs, row, w * VNC_SERVER_FB_BYTES);
-        row += vnc_server_fb_stride(vd);
-    }
-    return 1;
-}
-
-int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
-{
-    int n = 0;
-
-    switch(vs->vnc_encoding) {
-        case VNC_ENCODING_ZLIB:
-            n = vnc_zlib_send_framebuffer_update(vs, x, y, w, h);
-            break;
-        case VNC_ENCODING_HEXTILE:
-            vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_HEXTILE);
-            n = vnc_hextile_send_framebuffer_update(vs, x, y, w, h);
-            break;
-        case VNC_ENCODING_TIGHT:
-            n = vnc_tight_send_framebuffer_update(vs, x, y, w, h);
-            break;
-        case VNC_ENCODING_TIGHT_PNG:
-            n = vnc_tight_png_send_framebuffer_update(vs, x, y, w, h);
-            break;
-        case VNC_ENCODING_ZRLE:
-            n = vnc_zrle_send_framebuffer_update(vs, x, y, w, h);
-            break;
-        case VNC_ENCODING_ZYWRLE:
-            n = vnc_zywrle_send_framebuffer_update(vs, x, y, w, h);
-            break;
-        default:
-            vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_RAW);
-            n = vnc_raw_send_framebuffer_update(vs, x, y, w, h);
-            break;
-    }
-    return n;
-}
-
 static void vnc_mouse_set(DisplayChangeListener *dcl,
                           int x, int y, int visible)
 {
@@ -1045,10 +980,12 @@ static int find_and_clear_dirty_height(VncState *vs,
     int h;
 
     for (h = 1; h < (height - y); h++) {
-        if (!test_bit(last_x, vs->dirty[y + h])) {
+        unsigned long *row = vnc_dirty_row(&vs->dirty, y + h);
+
+        if (!test_bit(last_x, row)) {
             break;
         }
-        bitmap_clear(vs->dirty[y + h], last_x, x - last_x);
+        bitmap_clear(row, last_x, x - last_x);
     }
 
     return h;
@@ -1104,6 +1041,138 @@ static void vnc_update_throttle_offset(VncState *vs)
     vs->throttle_output_offset = offset;
 }
 
+/*
+ * Link estimation
+ *
+ * The throughput of a client link is sampled while its output buffer does
+ * not drain completely, i.e. while the socket is the bottleneck, and the
+ * round trip time is the delay from the last byte of an update leaving the
+ * output buffer to the next update request.  From these a controller
+ * derives a congestion level, which lowers the JPEG quality and makes the
+ * Tight encoder switch to JPEG sooner, and a minimum interval between
+ * incremental updates sized to what the link can carry.
+ */
+#define VNC_LINK_SAMPLE_NS        (50 * SCALE_MS)
+#define VNC_LINK_CHECK_NS         (250 * SCALE_MS)
+#define VNC_LINK_TARGET_DELAY_NS  (100 * SCALE_MS)
+#define VNC_LINK_MAX_INTERVAL_NS  (NANOSECONDS_PER_SECOND)
+#define VNC_LINK_STABLE_CHECKS    8
+#define VNC_LINK_MAX_LEVEL        4
+
+void vnc_link_written(VncState *vs, size_t bytes)
+{
+    VncLink *link = &vs->link;
+    int64_t now = get_clock();
+
+    if (!vs->output.offset) {
+        /* The link kept up, this says nothing about its throughput */
+        link->sample_ns = 0;
+        if (link->update_ns && !link->drained_ns) {
+            link->drained_ns = now;
+        }
+        return;
+    }
+
+    if (!link->sample_ns) {
+        link->sample_ns = now;
+        link->sample_bytes = 0;
+        return;
+    }
+
+    link->sample_bytes += bytes;
+    if (now - link->sample_ns >= VNC_LINK_SAMPLE_NS) {
+        uint64_t rate = link->sample_bytes * NANOSECONDS_PER_SECOND /
+                        (now - link->sample_ns);
+
+        link->throughput = link->throughput ?
+                           (link->throughput * 7 + rate) / 8 : rate;
+        link->sample_ns = now;
+        link->sample_bytes = 0;
+    }
+}
+
+static void vnc_link_rtt(VncState *vs, int64_t rtt)
+{
+    VncLink *link = &vs->link;
+
+    link->rtt_ns = link->rtt_ns ? (link->rtt_ns * 7 + rtt) / 8 : rtt;
+}
+
+static void vnc_link_request(VncState *vs)
+{
+    VncLink *link = &vs->link;
+
+    if (link->drained_ns <= 0) {
+        return;
+    }
+
+    vnc_link_rtt(vs, get_clock() - link->drained_ns);
+    link->drained_ns = -1;
+}
+
+static void vnc_link_check(VncState *vs)
+{
+    VncLink *link = &vs->link;
+    int64_t now = get_clock();
+    int64_t delay = 0;
+    int level = link->level;
+    bool congested;
+
+    if (vs->vd->non_adaptive || now - link->check_ns < VNC_LINK_CHECK_NS) {
+        return;
+    }
+    link->check_ns = now;
+
+    /* How long the data queued right now will take to go out */
+    if (link->throughput) {
+        delay = vs->output.offset * NANOSECONDS_PER_SECOND / link->throughput;
+    }
+    congested = delay > VNC_LINK_TARGET_DELAY_NS ||
+                vs->output.offset >= vs->throttle_output_offset ||
+                (vs->force_update_offset &&
+                 now - link->update_ns > VNC_LINK_TARGET_DELAY_NS);
+
+    if (congested) {
+        link->stable = 0;
+        level = MIN(level + 1, VNC_LINK_MAX_LEVEL);
+    } else if (level && delay < VNC_LINK_TARGET_DELAY_NS / 4 &&
+               ++link->stable >= VNC_LINK_STABLE_CHECKS) {
+        link->stable = 0;
+        level--;
+    }
+
+    if (level && link->throughput) {
+        int64_t send_ns = link->update_bytes * NANOSECONDS_PER_SECOND /
+                          link->throughput;
+
+        link->interval_ns = MIN(MAX(send_ns, link->rtt_ns),
+                                VNC_LINK_MAX_INTERVAL_NS);
+    } else {
+        link->interval_ns = 0;
+    }
+
+    if (level != link->level) {
+        trace_vnc_client_link_level(vs, vs->ioc, level, link->throughput,
+                                    link->rtt_ns, link->interval_ns);
+        qatomic_set(&link->level, level);
+    }
+}
+
+/* Nanoseconds until the pacing of @vs lets an incremental update out */
+static int64_t vnc_link_pace_left(VncState *vs)
+{
+    if (!vs->link.interval_ns || !vs->link.update_ns) {
+        return 0;
+    }
+    return MAX(vs->link.interval_ns - (get_clock() - vs->link.update_ns), 0);
+}
+
+/* Space incremental updates so that the link is not oversubscribed */
+static bool vnc_link_paced(VncState *vs)
+{
+    return vnc_link_pace_left(vs) > 0;
+}
+
 static bool vnc_should_update(VncState *vs)
 {
     switch (vs->update) {
@@ -1115,7 +1184,8 @@ static bool vnc_should_update(VncState *vs)
          * is completely idle.
          */
         if (vs->output.offset < vs->throttle_output_offset &&
-            vs->job_update == VNC_STATE_UPDATE_NONE) {
+            vs->job_update == VNC_STATE_UPDATE_NONE &&
+            !vnc_link_paced(vs)) {
             return true;
         }
         trace_vnc_client_throttle_incremental(
@@ -1141,13 +1211,70 @@ static bool vnc_should_update(VncState *vs)
     return false;
 }
 
+/*
+ * With continuous updates, an update goes out without a request as soon as
+ * the throttling allows it, but no more than VNC_FENCE_MAX_PENDING ahead of
+ * what the client has acknowledged.
+ */
+static bool vnc_continuous_ready(VncState *vs)
+{
+    return vs->continuous && vs->fences_pending < VNC_FENCE_MAX_PENDING;
+}
+
+/*
+ * Queue the dirty areas of @vs within dirty bit columns [@x0, @x1) and rows
+ * [@y0, @y1) as rectangles of @job, and clear them.
+ */
+static int vnc_job_add_dirty(VncJob *job, VncState *vs,
+                             int x0, int x1, int y0, int y1)
+{
+    int width = pixman_image_get_width(vs->vd->server);
+    int xs = x0, y = y0;
+    int n = 0;
+
+    while (y < y1 && x0 < x1) {
+        int x, h;
+        unsigned long x2;
+        unsigned long offset = vnc_dirty_find_next(&vs->dirty,
+                                                   y1 * VNC_DIRTY_BPL(vs),
+                                                   y * VNC_DIRTY_BPL(vs) + xs);
+        if (offset == y1 * VNC_DIRTY_BPL(vs)) {
+            /* no more dirty bits */
+            break;
+        }
+        y = offset / VNC_DIRTY_BPL(vs);
+        x = offset % VNC_DIRTY_BPL(vs);
+        xs = x0;
+        if (x < x0) {
+            continue;
+        }
+        if (x >= x1) {
+            y++;
+            continue;
+        }
+        x2 = find_next_zero_bit(vnc_dirty_row(&vs->dirty, y), x1, x);
+        bitmap_clear(vnc_dirty_row(&vs->dirty, y), x, x2 - x);
+        h = find_and_clear_dirty_height(vs, y, x, x2, y1);
+        x2 = MIN(x2, width / VNC_DIRTY_PIXELS_PER_BIT);
+        if (x2 > x) {
+            n += vnc_job_add_rect(job, x * VNC_DIRTY_PIXELS_PER_BIT, y,
+                                  (x2 - x) * VNC_DIRTY_PIXELS_PER_BIT, h);
+        }
+        if (x == x0 && x2 == MIN(x1, width / VNC_DIRTY_PIXELS_PER_BIT)) {
+            y += h;
+        }
+    }
+    return n;
+}
+
 static int vnc_update_client(VncState *vs, int has_dirty)
 {
     VncDisplay *vd = vs->vd;
     VncJob *job;
-    int y;
+    int x0, x1, y0, y1;
     int height, width;
     int n = 0;
+    bool continuous, partial = false;
 
     if (vs->disconnecting) {
         vnc_disconnect_finish(vs);
@@ -1155,11 +1282,20 @@ static int vnc_update_client(VncState *vs, int has_dirty)
     }
 
     vs->has_dirty += has_dirty;
-    if (!vnc_should_update(vs)) {
-        return 0;
+    vnc_link_check(vs);
+
+    continuous = vs->update == VNC_STATE_UPDATE_NONE &&
+                 vnc_continuous_ready(vs);
+    if (continuous) {
+        vs->update = VNC_STATE_UPDATE_INCREMENTAL;
     }
 
-    if (!vs->has_dirty && vs->update != VNC_STATE_UPDATE_FORCE) {
+    if (!vnc_should_update(vs) ||
+        (!vs->has_dirty && !vs->copy_pending &&
+         vs->update != VNC_STATE_UPDATE_FORCE)) {
+        if (continuous) {
+            vs->update = VNC_STATE_UPDATE_NONE;
+        }
         return 0;
     }
 
@@ -1170,45 +1306,297 @@ static int vnc_update_client(VncState *vs, int has_dirty)
      * send them to the client.
      */
     job = vnc_job_new(vs);
+    if (vs->copy_pending) {
+        vnc_job_set_copy(job, &vs->copy);
+        vs->copy_pending = false;
+        n++;
+    }
 
     height = pixman_image_get_height(vd->server);
     width = pixman_image_get_width(vd->server);
 
-    y = 0;
-    for (;;) {
-        int x, h;
-        unsigned long x2;
-        unsigned long offset = find_next_bit((unsigned long *) &vs->dirty,
-                                             height * VNC_DIRTY_BPL(vs),
-                                             y * VNC_DIRTY_BPL(vs));
-        if (offset == height * VNC_DIRTY_BPL(vs)) {
-            /* no more dirty bits */
-            break;
+    x0 = 0;
+    x1 = VNC_DIRTY_BPL(vs);
+    y0 = 0;
+    y1 = height;
+    if (continuous) {
+        VncRect *area = &vs->continuous_area;
+
+        /* The rest of the screen waits for a request */
+        x0 = MIN(area->x / VNC_DIRTY_PIXELS_PER_BIT, x1);
+        x1 = MIN(DIV_ROUND_UP(area->x + area->w, VNC_DIRTY_PIXELS_PER_BIT),
+                 x1);
+        y0 = MIN(area->y, height);
+        y1 = MIN(area->y + area->h, height);
+        partial = x0 || x1 < width / VNC_DIRTY_PIXELS_PER_BIT ||
+                  y0 || y1 < height;
+    }
+
+    n += vnc_job_add_dirty(job, vs, x0, x1, y0, y1);
+
+    if (!n) {
+        /*
+         * Nothing changed in the continuous update area, or the dirty
+         * areas went out through an encoding group: the request waits.
+         */
+        vnc_job_push(job);
+        if (continuous) {
+            vs->update = VNC_STATE_UPDATE_NONE;
         }
-        y = offset / VNC_DIRTY_BPL(vs);
-        x = offset % VNC_DIRTY_BPL(vs);
-        x2 = find_next_zero_bit((unsigned long *) &vs->dirty[y],
-                                VNC_DIRTY_BPL(vs), x);
-        bitmap_clear(vs->dirty[y], x, x2 - x);
-        h = find_and_clear_dirty_height(vs, y, x, x2, height);
-        x2 = MIN(x2, width / VNC_DIRTY_PIXELS_PER_BIT);
-        if (x2 > x) {
-            n += vnc_job_add_rect(job, x * VNC_DIRTY_PIXELS_PER_BIT, y,
-                                  (x2 - x) * VNC_DIRTY_PIXELS_PER_BIT, h);
+        if (!partial) {
+            vs->has_dirty = 0;
         }
-        if (!x && x2 == width / VNC_DIRTY_PIXELS_PER_BIT) {
-            y += h;
-            if (y == height) {
-                break;
+        return 0;
+    }
+
+    if (vs->encode_group) {
+        /* The client's streams were fed by a group, restart them */
+        job->reset_streams = true;
+        vs->encode_group = 0;
+    }
+    vs->job_update = vs->update;
+    vs->update = VNC_STATE_UPDATE_NONE;
+    vnc_job_push(job);
+    if (!partial) {
+        vs->has_dirty = 0;
+    }
+    return n;
+}
+
+/* Encoding groups nobody used for this long are freed */
+#define VNC_ENCODE_GROUP_IDLE_NS (10 * NANOSECONDS_PER_SECOND)
+
+/*
+ * Clients of an encoding group get the union of their dirty areas with one
+ * shared encoder state.  ZLIB and ZRLE keep a single zlib stream that the
+ * client cannot be told to reset, so their clients are not grouped.
+ */
+static bool vnc_encode_group_ready(VncState *vs, int has_dirty)
+{
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_RAW:
+    case VNC_ENCODING_HEXTILE:
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+        break;
+    default:
+        return false;
+    }
+    return !vs->disconnecting && !vs->continuous && !vs->copy_pending &&
+           (vs->has_dirty || has_dirty) &&
+           vs->update == VNC_STATE_UPDATE_INCREMENTAL &&
+           vnc_should_update(vs);
+}
+
+static bool vnc_encode_group_match(VncState *a, VncState *b)
+{
+    return a->vnc_encoding == b->vnc_encoding &&
+           a->features == b->features &&
+           a->write_pixels == b->write_pixels &&
+           !memcmp(&a->client_pf, &b->client_pf, sizeof(a->client_pf)) &&
+           a->client_be == b->client_be &&
+           a->client_width == b->client_width &&
+           a->client_height == b->client_height &&
+           a->tight->quality == b->tight->quality &&
+           a->tight->compression == b->tight->compression &&
+           a->link.level == b->link.level;
+}
+
+/*
+ * The settings of a group never change: clients that change theirs move
+ * to another group.
+ */
+static VncEncodeGroup *vnc_encode_group_get(VncDisplay *vd, VncState *vs)
+{
+    VncEncodeGroup *group;
+    VncState *gvs;
+    int i;
+
+    QTAILQ_FOREACH(group, &vd->encode_groups, next) {
+        if (vnc_encode_group_match(group->vs, vs)) {
+            return group;
+        }
+    }
+
+    group = g_new0(VncEncodeGroup, 1);
+    group->id = ++vd->encode_group_id;
+    gvs = g_new0(VncState, 1);
+    gvs->magic = VNC_MAGIC;
+    gvs->vd = vd;
+    gvs->zrle = g_new0(VncZrle, 1);
+    gvs->tight = g_new0(VncTight, 1);
+    qemu_mutex_init(&gvs->output_mutex);
+
+    buffer_init(&gvs->tight->tight,    "vnc-group-tight/%p", gvs);
+    buffer_init(&gvs->tight->zlib,     "vnc-group-tight-zlib/%p", gvs);
+    buffer_init(&gvs->tight->gradient, "vnc-group-tight-gradient/%p", gvs);
+#ifdef CONFIG_VNC_JPEG
+    buffer_init(&gvs->tight->jpeg,     "vnc-group-tight-jpeg/%p", gvs);
+#endif
+#ifdef CONFIG_PNG
+    buffer_init(&gvs->tight->png,      "vnc-group-tight-png/%p", gvs);
+#endif
+
+    vnc_dirty_resize(&gvs->dirty, vnc_width(vd), vnc_height(vd));
+    gvs->lossy_rect = g_malloc0(VNC_STAT_ROWS * sizeof(*gvs->lossy_rect));
+    for (i = 0; i < VNC_STAT_ROWS; ++i) {
+        gvs->lossy_rect[i] = g_new0(uint8_t, VNC_STAT_COLS);
+    }
+
+    gvs->vnc_encoding = vs->vnc_encoding;
+    gvs->features = vs->features;
+    gvs->write_pixels = vs->write_pixels;
+    gvs->client_pf = vs->client_pf;
+    gvs->client_format = vs->client_format;
+    gvs->client_be = vs->client_be;
+    gvs->client_width = vs->client_width;
+    gvs->client_height = vs->client_height;
+    gvs->hextile = vs->hextile;
+    gvs->tight->quality = vs->tight->quality;
+    gvs->tight->compression = vs->tight->compression;
+    gvs->link.level = vs->link.level;
+
+    group->vs = gvs;
+    QTAILQ_INSERT_TAIL(&vd->encode_groups, group, next);
+    trace_vnc_encode_group_new(vd, group->id, gvs->vnc_encoding);
+    return group;
+}
+
+static void vnc_encode_group_free(VncEncodeGroup *group)
+{
+    VncState *gvs = group->vs;
+    int i;
+
+    trace_vnc_encode_group_free(group->id);
+    vnc_jobs_join(gvs);
+
+    vnc_zlib_clear(gvs);
+    vnc_tight_clear(gvs);
+    vnc_zrle_clear(gvs);
+    qemu_mutex_destroy(&gvs->output_mutex);
+    vnc_dirty_free(&gvs->dirty);
+
+    for (i = 0; i < VNC_STAT_ROWS; ++i) {
+        g_free(gvs->lossy_rect[i]);
+    }
+    g_free(gvs->lossy_rect);
+    gvs->magic = 0;
+    g_free(gvs->zrle);
+    g_free(gvs->tight);
+    g_free(gvs);
+    g_free(group);
+}
+
+static int vnc_encode_group_update(VncEncodeGroup *group, VncState **members,
+                                   int n_members)
+{
+    VncState *gvs = group->vs;
+    int height = pixman_image_get_height(gvs->vd->server);
+    bool reset = false;
+    VncJob *job;
+    int i, n;
+
+    for (i = 0; i < n_members; i++) {
+        vnc_dirty_merge(&gvs->dirty, &members[i]->dirty);
+        members[i]->has_dirty = 0;
+    }
+
+    job = vnc_job_new(gvs);
+    n = vnc_job_add_dirty(job, gvs, 0, VNC_DIRTY_BPL(gvs), 0, height);
+    if (!n) {
+        vnc_job_push(job);
+        return 0;
+    }
+
+    /*
+     * A client that missed an update of the group has its zlib streams out
+     * of sync with the group's, so the streams of everybody are restarted.
+     */
+    for (i = 0; i < n_members; i++) {
+        VncState *vs = members[i];
+
+        reset |= vs->encode_group != group->id ||
+                 vs->encode_group_seq != group->seq;
+    }
+    group->seq++;
+    group->used_ns = get_clock();
+
+    job->members = g_memdup2(members, n_members * sizeof(*members));
+    job->n_members = n_members;
+    job->reset_streams = reset;
+    for (i = 0; i < n_members; i++) {
+        VncState *vs = members[i];
+
+        vs->encode_group = group->id;
+        vs->encode_group_seq = group->seq;
+        vs->job_update = vs->update;
+        vs->update = VNC_STATE_UPDATE_NONE;
+    }
+    trace_vnc_encode_group_update(group->id, n_members, n, reset);
+    vnc_job_push(job);
+    return n;
+}
+
+/*
+ * Encode the pending updates of clients with the same settings once for
+ * all of them.  The clients left over are updated by vnc_update_client().
+ */
+static int vnc_update_groups(VncDisplay *vd, int has_dirty)
+{
+    g_autofree VncState **ready = NULL;
+    g_autofree VncState **members = NULL;
+    VncEncodeGroup *group, *gn;
+    VncState *vs;
+    int64_t now = get_clock();
+    int n_ready = 0, n_clients = 0;
+    int i, j, rects = 0;
+
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        n_clients++;
+    }
+    ready = g_new(VncState *, n_clients);
+    members = g_new(VncState *, n_clients);
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (vnc_encode_group_ready(vs, has_dirty)) {
+            ready[n_ready++] = vs;
+        }
+    }
+
+    for (i = 0; i < n_ready; i++) {
+        int n_members = 0;
+
+        if (!ready[i]) {
+            continue;
+        }
+        for (j = i; j < n_ready; j++) {
+            if (ready[j] && vnc_encode_group_match(ready[i], ready[j])) {
+                members[n_members++] = ready[j];
+                ready[j] = NULL;
             }
         }
+        if (n_members > 1) {
+            group = vnc_encode_group_get(vd, members[0]);
+            rects += vnc_encode_group_update(group, members, n_members);
+        }
+    }
+
+    QTAILQ_FOREACH_SAFE(group, &vd->encode_groups, next, gn) {
+        if (now - group->used_ns > VNC_ENCODE_GROUP_IDLE_NS) {
+            QTAILQ_REMOVE(&vd->encode_groups, group, next);
+            vnc_encode_group_free(group);
+        }
     }
+    return rects;
+}
 
-    vs->job_update = vs->update;
-    vs->update = VNC_STATE_UPDATE_NONE;
-    vnc_job_push(job);
-    vs->has_dirty = 0;
-    return n;
+static void vnc_free_groups(VncDisplay *vd)
+{
+    VncEncodeGroup *group;
+
+    while ((group = QTAILQ_FIRST(&vd->encode_groups))) {
+        QTAILQ_REMOVE(&vd->encode_groups, group, next);
+        vnc_encode_group_free(group);
+    }
 }
 
 /* audio */
@@ -1325,6 +1713,7 @@ void vnc_disconnect_finish(VncState *vs)
     vnc_zlib_clear(vs);
     vnc_tight_clear(vs);
     vnc_zrle_clear(vs);
+    vnc_dirty_free(&vs->dirty);
 
 #ifdef CONFIG_VNC_SASL
     vnc_sasl_client_cleanup(vs);
@@ -1460,6 +1849,7 @@ static size_t vnc_client_write_plain(VncState *vs)
     }
     offset = vs->output.offset;
     buffer_advance(&vs->output, ret);
+    vnc_link_written(vs, ret);
     if (offset >= vs->throttle_output_offset &&
         vs->output.offset < vs->throttle_output_offset) {
         trace_vnc_client_unthrottle_incremental(vs, vs->ioc, vs->output.offset);
@@ -2074,13 +2464,14 @@ static void ext_key_event(VncState *vs, int down,
 static void framebuffer_update_request(VncState *vs, int incremental,
                                        int x, int y, int w, int h)
 {
+    vnc_link_request(vs);
     if (incremental) {
         if (vs->update != VNC_STATE_UPDATE_FORCE) {
             vs->update = VNC_STATE_UPDATE_INCREMENTAL;
         }
     } else {
         vs->update = VNC_STATE_UPDATE_FORCE;
-        vnc_set_area_dirty(vs->dirty, vs->vd, x, y, w, h);
+        vnc_set_area_dirty(&vs->dirty, vs->vd, x, y, w, h);
         if (vnc_has_feature(vs, VNC_FEATURE_RESIZE_EXT)) {
             vnc_desktop_resize_ext(vs, 0);
         }
@@ -2126,10 +2517,111 @@ static void send_xvp_message(VncState *vs, int code)
     vnc_flush(vs);
 }
 
+/* Payload of the fences we send, to recognize the answers */
+enum {
+    VNC_FENCE_PROBE,
+    VNC_FENCE_PING,
+};
+
+static void vnc_write_fence(VncState *vs, uint32_t flags,
+                            uint8_t len, const uint8_t *payload)
+{
+    vnc_write_u8(vs, VNC_MSG_SERVER_FENCE);
+    vnc_write_u8(vs, 0); /* pad */
+    vnc_write_u16(vs, 0); /* pad */
+    vnc_write_u32(vs, flags);
+    vnc_write_u8(vs, len);
+    vnc_write(vs, payload, len);
+}
+
+static void send_fence(VncState *vs, uint32_t flags,
+                       uint8_t len, const uint8_t *payload)
+{
+    vnc_lock_output(vs);
+    vnc_write_fence(vs, flags, len, payload);
+    vnc_unlock_output(vs);
+    vnc_flush(vs);
+}
+
+/*
+ * Follows each update while continuous updates are on: the answer tells
+ * that the client has processed the update, which paces the next ones.
+ */
+void vnc_fence_ping_locked(VncState *vs)
+{
+    uint8_t type = VNC_FENCE_PING;
+    int i;
+
+    if (!vnc_has_feature(vs, VNC_FEATURE_FENCE) ||
+        vs->fences_pending == VNC_FENCE_MAX_PENDING) {
+        return;
+    }
+
+    i = (vs->fence_head + vs->fences_pending) % VNC_FENCE_MAX_PENDING;
+    vs->fence_ns[i] = get_clock();
+    vs->fences_pending++;
+    vnc_write_fence(vs, VNC_FENCE_REQUEST | VNC_FENCE_BLOCK_BEFORE,
+                    sizeof(type), &type);
+}
+
+static void vnc_client_fence(VncState *vs, uint32_t flags,
+                             uint8_t len, uint8_t *payload)
+{
+    trace_vnc_msg_client_fence(vs, vs->ioc, flags, len);
+
+    if (flags & VNC_FENCE_REQUEST) {
+        /*
+         * Messages are handled in order, so only the updates the encoders
+         * are still working on could be overtaken by the answer.
+         */
+        if (flags & VNC_FENCE_BLOCK_BEFORE) {
+            vnc_jobs_join(vs);
+        }
+        flags &= VNC_FENCE_BLOCK_BEFORE | VNC_FENCE_BLOCK_AFTER |
+                 VNC_FENCE_SYNC_NEXT;
+        send_fence(vs, flags, len, payload);
+        return;
+    }
+
+    if (len == 1 && payload[0] == VNC_FENCE_PING && vs->fences_pending) {
+        vnc_link_rtt(vs, get_clock() - vs->fence_ns[vs->fence_head]);
+        vs->fence_head = (vs->fence_head + 1) % VNC_FENCE_MAX_PENDING;
+        vs->fences_pending--;
+    }
+}
+
+static void send_end_continuous_updates(VncState *vs)
+{
+    vnc_lock_output(vs);
+    vnc_write_u8(vs, VNC_MSG_SERVER_END_CONTINUOUS_UPDATES);
+    vnc_unlock_output(vs);
+    vnc_flush(vs);
+}
+
+static void enable_continuous_updates(VncState *vs, bool enable,
+                                      int x, int y, int w, int h)
+{
+    trace_vnc_msg_client_continuous_updates(vs, vs->ioc, enable, x, y, w, h);
+
+    if (enable) {
+        vs->continuous = true;
+        vs->continuous_area = (VncRect) { x, y, w, h };
+        return;
+    }
+
+    vs->continuous = false;
+    /* The end marker comes after the last continuous update */
+    vnc_jobs_join(vs);
+    send_end_continuous_updates(vs);
+}
+
 static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
 {
     int i;
     unsigned int enc = 0;
+    bool had_fence = vnc_has_feature(vs, VNC_FEATURE_FENCE);
+    bool had_continuous = vnc_has_feature(vs,
+                                          VNC_FEATURE_CONTINUOUS_UPDATES);
 
     vs->features = 0;
     vs->vnc_encoding = 0;
@@ -2148,6 +2640,9 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
         case VNC_ENCODING_RAW:
             vs->vnc_encoding = enc;
             break;
+        case VNC_ENCODING_COPYRECT:
+            vnc_set_feature(vs, VNC_FEATURE_COPYRECT);
+            break;
         case VNC_ENCODING_HEXTILE:
             vnc_set_feature(vs, VNC_FEATURE_HEXTILE);
             vs->vnc_encoding = enc;
@@ -2217,6 +2712,22 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
                 send_xvp_message(vs, VNC_XVP_CODE_INIT);
             }
             break;
+        case VNC_ENCODING_FENCE:
+            if (!had_fence) {
+                uint8_t type = VNC_FENCE_PROBE;
+
+                /* Tells the client that we support fences */
+                send_fence(vs, VNC_FENCE_REQUEST, sizeof(type), &type);
+            }
+            vnc_set_feature(vs, VNC_FEATURE_FENCE);
+            break;
+        case VNC_ENCODING_CONTINUOUS_UPDATES:
+            if (!had_continuous) {
+                /* Tells the client that we support continuous updates */
+                send_end_continuous_updates(vs);
+            }
+            vnc_set_feature(vs, VNC_FEATURE_CONTINUOUS_UPDATES);
+            break;
         case VNC_ENCODING_CLIPBOARD_EXT:
             vnc_set_feature(vs, VNC_FEATURE_CLIPBOARD_EXT);
             vnc_server_cut_text_caps(vs);
@@ -2466,6 +2977,44 @@ static int protocol_client_msg(VncState *vs, uint8_t *data, size_t len)
         }
         vnc_client_cut_text(vs, read_u32(data, 4), data + 8);
         break;
+    case VNC_MSG_CLIENT_ENABLE_CONTINUOUS_UPDATES:
+        if (!vnc_has_feature(vs, VNC_FEATURE_CONTINUOUS_UPDATES)) {
+            error_report("vnc: continuous updates message while disabled");
+            vnc_client_error(vs);
+            break;
+        }
+        if (len == 1) {
+            return 10;
+        }
+        enable_continuous_updates(vs, read_u8(data, 1),
+                                  read_u16(data, 2), read_u16(data, 4),
+                                  read_u16(data, 6), read_u16(data, 8));
+        break;
+    case VNC_MSG_CLIENT_FENCE:
+        if (!vnc_has_feature(vs, VNC_FEATURE_FENCE)) {
+            error_report("vnc: fence message while disabled");
+            vnc_client_error(vs);
+            break;
+        }
+        if (len == 1) {
+            return 9;
+        }
+        if (len == 9) {
+            uint8_t plen = read_u8(data, 8);
+
+            if (plen > VNC_FENCE_MAX_PAYLOAD) {
+                error_report("vnc: fence msg payload has %u bytes"
+                             " which exceeds the limit of %d.",
+                             plen, VNC_FENCE_MAX_PAYLOAD);
+                vnc_client_error(vs);
+                break;
+            }
+            if (plen > 0) {
+                return 9 + plen;
+            }
+        }
+        vnc_client_fence(vs, read_u32(data, 4), read_u8(data, 8), data + 9);
+        break;
     case VNC_MSG_CLIENT_XVP:
         if (!vnc_has_feature(vs, VNC_FEATURE_XVP)) {
             error_report("vnc: xvp client message while disabled");
@@ -2947,11 +3496,9 @@ static int protocol_version(VncState *vs, uint8_t *version, size_t len)
     return 0;
 }
 
-static VncRectStat *vnc_stat_rect(VncDisplay *vd, int x, int y)
+static int vnc_stat_index(VncDisplay *vd, int x, int y)
 {
-    struct VncSurface *vs = &vd->guest;
-
-    return &vs->stats[y / VNC_STAT_RECT][x / VNC_STAT_RECT];
+    return (y / VNC_STAT_RECT) * vd->guest.stat_cols + x / VNC_STAT_RECT;
 }
 
 void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
@@ -2993,10 +3540,10 @@ static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
         }
 
         vs->lossy_rect[sty][stx] = 0;
-        for (j = 0; j < VNC_STAT_RECT; ++j) {
-            bitmap_set(vs->dirty[y + j],
-                       x / VNC_DIRTY_PIXELS_PER_BIT,
-                       VNC_STAT_RECT / VNC_DIRTY_PIXELS_PER_BIT);
+        for (j = 0; j < VNC_STAT_RECT && y + j < vs->dirty.height; ++j) {
+            vnc_dirty_set(&vs->dirty, y + j,
+                          x / VNC_DIRTY_PIXELS_PER_BIT,
+                          VNC_STAT_RECT / VNC_DIRTY_PIXELS_PER_BIT);
         }
         has_dirty++;
     }
@@ -3004,97 +3551,439 @@ static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
     return has_dirty;
 }
 
-static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
+static void vnc_update_stat_sums(struct VncSurface *s)
 {
-    int width = MIN(pixman_image_get_width(vd->guest.fb),
-                    pixman_image_get_width(vd->server));
-    int height = MIN(pixman_image_get_height(vd->guest.fb),
-                     pixman_image_get_height(vd->server));
-    int x, y;
-    struct timeval res;
+    int cols = s->stat_cols + 1;
+    int i, j;
+
+    for (j = 0; j < s->stat_rows; j++) {
+        uint64_t row = 0;
+
+        for (i = 0; i < s->stat_cols; i++) {
+            row += s->stats[j * s->stat_cols + i].freq_mhz;
+            s->stat_sums[(j + 1) * cols + i + 1] =
+                s->stat_sums[j * cols + i + 1] + row;
+        }
+    }
+}
+
+/*
+ * Every VNC_REFRESH_STATS_NS, refresh the frequency of the tiles updated
+ * lately.  Those idle for VNC_REFRESH_LOSSY_NS drop to zero and have their
+ * lossy content sent again.
+ */
+static int vnc_update_stats(VncDisplay *vd, int64_t now)
+{
+    struct VncSurface *s = &vd->guest;
+    int tiles = s->stat_rows * s->stat_cols;
+    bool changed = false;
     int has_dirty = 0;
+    int i;
+
+    s->stat_refresh++;
+    if (now - s->last_freq_check < VNC_REFRESH_STATS_NS) {
+        return 0;
+    }
+    s->last_freq_check = now;
+
+    for (i = find_first_bit(s->stat_active, tiles); i < tiles;
+         i = find_next_bit(s->stat_active, tiles, i + 1)) {
+        VncRectStat *rect = &s->stats[i];
+        uint32_t freq = 0;
+
+        if (now - rect->last_ns > VNC_REFRESH_LOSSY_NS) {
+            clear_bit(i, s->stat_active);
+            rect->updates = 0;
+            has_dirty += vnc_refresh_lossy_rect(vd,
+                                                (i % s->stat_cols) *
+                                                VNC_STAT_RECT,
+                                                (i / s->stat_cols) *
+                                                VNC_STAT_RECT);
+        } else if (rect->updates >= VNC_STAT_MIN_UPDATES) {
+            /* a tile that stopped updating slows down until it expires */
+            freq = NANOSECONDS_PER_SECOND * 1000 /
+                   MAX(MAX(rect->interval_ns, now - rect->last_ns), SCALE_MS);
+        }
+        if (rect->freq_mhz != freq) {
+            rect->freq_mhz = freq;
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        vnc_update_stat_sums(s);
+    }
+    return has_dirty;
+}
+
+/* Average update frequency of the tiles from (x, y) to (x + w, y + h) */
+double vnc_update_freq(VncState *vs, int x, int y, int w, int h)
+{
+    struct VncSurface *s = &vs->vd->guest;
+    int cols = s->stat_cols + 1;
+    int x0 = x / VNC_STAT_RECT;
+    int y0 = y / VNC_STAT_RECT;
+    int x1 = MIN((x + w) / VNC_STAT_RECT, s->stat_cols - 1) + 1;
+    int y1 = MIN((y + h) / VNC_STAT_RECT, s->stat_rows - 1) + 1;
+    uint64_t total;
+
+    if (x0 >= x1 || y0 >= y1) {
+        return 0;
+    }
+
+    total = s->stat_sums[y1 * cols + x1] - s->stat_sums[y0 * cols + x1] -
+            s->stat_sums[y1 * cols + x0] + s->stat_sums[y0 * cols + x0];
+    return total / 1000. / ((x1 - x0) * (y1 - y0));
+}
+
+static void vnc_rect_updated(VncDisplay *vd, int x, int y, int64_t now)
+{
+    struct VncSurface *s = &vd->guest;
+    int i = vnc_stat_index(vd, x, y);
+    VncRectStat *rect = &s->stats[i];
+
+    if (rect->refresh == s->stat_refresh) {
+        return;
+    }
+    rect->refresh = s->stat_refresh;
+
+    if (rect->updates == 1) {
+        rect->interval_ns = now - rect->last_ns;
+    } else if (rect->updates) {
+        rect->interval_ns += (now - rect->last_ns - rect->interval_ns) /
+                             VNC_STAT_DECAY;
+    }
+    rect->updates = MIN(rect->updates + 1, VNC_STAT_MIN_UPDATES);
+    rect->last_ns = now;
+    set_bit(i, s->stat_active);
+}
+
+/*
+ * Scroll and move detection
+ *
+ * Before the dirty parts of the guest surface are copied to the server
+ * surface, look for a region of the guest surface that shows the content of
+ * the server surface shifted horizontally or vertically.  Each line (and
+ * column) of the dirty bounding box is hashed on both surfaces, the shift
+ * that most distinct lines vote for is picked and the longest run of lines
+ * matching with that shift becomes the moved region.  Clients that support
+ * CopyRect get the move and only need the exposed strip encoded.
+ *
+ * Hashing the box is only worth it for a move, so two cheap checks come
+ * first: a move dirties most of its bounding box, and most lines of a
+ * moved region differ from the server surface at the same position.
+ */
+#define VNC_COPYRECT_MIN_LINES  32
+#define VNC_COPYRECT_MIN_AREA   (256 * 64)
+#define VNC_COPYRECT_HASH_MUL   0x100000001b3ULL
+#define VNC_COPYRECT_SAMPLES    8
 
-    for (y = 0; y < height; y += VNC_STAT_RECT) {
-        for (x = 0; x < width; x += VNC_STAT_RECT) {
-            VncRectStat *rect = vnc_stat_rect(vd, x, y);
+static void vnc_copyrect_hash(uint8_t *row0, int stride, int x, int y,
+                              int w, int h, uint64_t *rows, uint64_t *cols)
+{
+    int i, j;
 
-            rect->updated = false;
+    memset(cols, 0, w * sizeof(*cols));
+    for (j = 0; j < h; j++) {
+        uint32_t *p = (uint32_t *)(row0 + (y + j) * stride) + x;
+        uint64_t hash = 0;
+
+        for (i = 0; i < w; i++) {
+            hash = (hash ^ p[i]) * VNC_COPYRECT_HASH_MUL;
+            cols[i] = (cols[i] ^ p[i]) * VNC_COPYRECT_HASH_MUL;
         }
+        rows[j] = hash;
     }
+}
 
-    qemu_timersub(tv, &VNC_REFRESH_STATS, &res);
+/*
+ * Find the shift that maps most lines of @old to lines of @new, and the
+ * longest run of lines of @new that match @old with that shift.  Returns
+ * the length of the run, its first line in @new goes in @start.
+ */
+static int vnc_copyrect_find_shift(GHashTable *lines, const uint64_t *old,
+                                   const uint64_t *new, int n,
+                                   int *shift, int *start)
+{
+    g_autofree int *votes = g_new0(int, 2 * n);
+    int i, best = 0, run = 0, len = 0;
 
-    if (timercmp(&vd->guest.last_freq_check, &res, >)) {
-        return has_dirty;
+    for (i = 0; i < n; i++) {
+        /* Lines that repeat, e.g. blank ones, do not tell the shift */
+        if (g_hash_table_contains(lines, &old[i])) {
+            g_hash_table_insert(lines, (gpointer)&old[i], GINT_TO_POINTER(-1));
+        } else {
+            g_hash_table_insert(lines, (gpointer)&old[i], GINT_TO_POINTER(i));
+        }
     }
-    vd->guest.last_freq_check = *tv;
 
-    for (y = 0; y < height; y += VNC_STAT_RECT) {
-        for (x = 0; x < width; x += VNC_STAT_RECT) {
-            VncRectStat *rect= vnc_stat_rect(vd, x, y);
-            int count = ARRAY_SIZE(rect->times);
-            struct timeval min, max;
+    for (i = 0; i < n; i++) {
+        gpointer value;
+        int j;
 
-            if (!timerisset(&rect->times[count - 1])) {
-                continue ;
-            }
+        if (new[i] == old[i] ||
+            !g_hash_table_lookup_extended(lines, &new[i], NULL, &value)) {
+            continue;
+        }
+        j = GPOINTER_TO_INT(value);
+        if (j >= 0 && ++votes[i - j + n] > votes[best]) {
+            best = i - j + n;
+        }
+    }
+    /* Empty, but with its buckets, for the next refresh */
+    g_hash_table_remove_all(lines);
+    if (!votes[best]) {
+        return 0;
+    }
+    *shift = best - n;
 
-            max = rect->times[(rect->idx + count - 1) % count];
-            qemu_timersub(tv, &max, &res);
+    for (i = MAX(*shift, 0); i < MIN(n, n + *shift); i++) {
+        if (new[i] != old[i - *shift]) {
+            run = 0;
+            continue;
+        }
+        if (++run > len) {
+            len = run;
+            *start = i - run + 1;
+        }
+    }
+    return len;
+}
 
-            if (timercmp(&res, &VNC_REFRESH_LOSSY, >)) {
-                rect->freq = 0;
-                has_dirty += vnc_refresh_lossy_rect(vd, x, y);
-                memset(rect->times, 0, sizeof (rect->times));
-                continue ;
-            }
+/*
+ * A CopyRect works on the client framebuffer, so the parts of the source
+ * the client has not received yet are stale at the destination too.
+ */
+static void vnc_copyrect_move_dirty(VncState *vs, const VncCopyRect *copy)
+{
+    int longs = VNC_DIRTY_BPL(vs) / BITS_PER_LONG;
+    int dx = copy->dst.x - copy->src_x;
+    int x0 = copy->dst.x / VNC_DIRTY_PIXELS_PER_BIT;
+    int x1 = DIV_ROUND_UP(copy->dst.x + copy->dst.w, VNC_DIRTY_PIXELS_PER_BIT);
+    g_autofree unsigned long *moved = g_new0(unsigned long,
+                                             copy->dst.h * longs);
+    int i, j;
 
-            min = rect->times[rect->idx];
-            max = rect->times[(rect->idx + count - 1) % count];
-            qemu_timersub(&max, &min, &res);
+    for (j = 0; j < copy->dst.h; j++) {
+        unsigned long *src = vnc_dirty_row(&vs->dirty, copy->src_y + j);
 
-            rect->freq = res.tv_sec + res.tv_usec / 1000000.;
-            rect->freq /= count;
-            rect->freq = 1. / rect->freq;
+        for (i = x0; i < x1; i++) {
+            int px0 = MAX(i * VNC_DIRTY_PIXELS_PER_BIT, copy->dst.x) - dx;
+            int px1 = MIN((i + 1) * VNC_DIRTY_PIXELS_PER_BIT,
+                          copy->dst.x + copy->dst.w) - dx;
+            int last = (px1 - 1) / VNC_DIRTY_PIXELS_PER_BIT;
+
+            if (find_next_bit(src, last + 1,
+                              px0 / VNC_DIRTY_PIXELS_PER_BIT) <= last) {
+                set_bit(i, moved + j * longs);
+            }
         }
     }
-    return has_dirty;
+
+    for (j = 0; j < copy->dst.h; j++) {
+        vnc_dirty_or_row(&vs->dirty, copy->dst.y + j, moved + j * longs);
+    }
 }
 
-double vnc_update_freq(VncState *vs, int x, int y, int w, int h)
+static bool vnc_copyrect_lossy(VncState *vs, const VncCopyRect *copy)
 {
     int i, j;
-    double total = 0;
-    int num = 0;
 
-    x =  QEMU_ALIGN_DOWN(x, VNC_STAT_RECT);
-    y =  QEMU_ALIGN_DOWN(y, VNC_STAT_RECT);
+    for (j = copy->src_y / VNC_STAT_RECT;
+         j <= (copy->src_y + copy->dst.h - 1) / VNC_STAT_RECT; j++) {
+        for (i = copy->src_x / VNC_STAT_RECT;
+             i <= (copy->src_x + copy->dst.w - 1) / VNC_STAT_RECT; i++) {
+            if (vs->lossy_rect[j][i]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Only a client with no update in flight can take a CopyRect: an update
+ * encoded after the server surface moved would change the source of the
+ * copy before the client executes it.
+ */
+static bool vnc_copyrect_ready(VncState *vs)
+{
+    return vnc_has_feature(vs, VNC_FEATURE_COPYRECT) && !vs->disconnecting &&
+           !vs->copy_pending && vs->job_update == VNC_STATE_UPDATE_NONE;
+}
+
+static int vnc_refresh_copyrect(VncDisplay *vd, int width, int height,
+                                uint8_t *guest_row0, int guest_stride,
+                                uint8_t *server_row0, int server_stride)
+{
+    g_autofree uint64_t *old_rows = NULL, *new_rows = NULL;
+    g_autofree uint64_t *old_cols = NULL, *new_cols = NULL;
+    int bits = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+    unsigned long bpl = VNC_DIRTY_BPL(&vd->guest);
+    int x0 = bits, x1 = 0, y0 = -1, y1 = 0, y, w, h;
+    int dx = 0, dy = 0, vstart = 0, hstart = 0, vlen, hlen;
+    int64_t dirty = 0;
+    int i, differ = 0;
+    VncCopyRect copy;
+    VncState *vs;
+    bool ready = false;
+
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        ready |= vnc_copyrect_ready(vs);
+    }
+    if (!ready) {
+        return 0;
+    }
 
-    for (j = y; j <= y + h; j += VNC_STAT_RECT) {
-        for (i = x; i <= x + w; i += VNC_STAT_RECT) {
-            total += vnc_stat_rect(vs->vd, i, j)->freq;
-            num++;
+    /* Bounding box of the dirty area */
+    for (y = 0; y < height; y++) {
+        unsigned long *row;
+        unsigned long offset, first;
+
+        offset = vnc_dirty_find_next(&vd->guest.dirty, height * bpl, y * bpl);
+        if (offset == height * bpl) {
+            break;
+        }
+        y = offset / bpl;
+        row = vnc_dirty_row(&vd->guest.dirty, y);
+        first = find_next_bit(row, bits, offset % bpl);
+        if (first == bits) {
+            continue;
         }
+        if (y0 < 0) {
+            y0 = y;
+        }
+        y1 = y + 1;
+        x0 = MIN(x0, (int)first);
+        x1 = MAX(x1, (int)find_last_bit(row, bits) + 1);
+        dirty += bitmap_count_one(row, bits);
+    }
+    if (y0 < 0) {
+        return 0;
+    }
+
+    /* Scattered small updates, e.g. a clock and a cursor, span a big box */
+    if (dirty * 2 < (int64_t)(x1 - x0) * (y1 - y0)) {
+        return 0;
+    }
+    x0 *= VNC_DIRTY_PIXELS_PER_BIT;
+    x1 = MIN(x1 * VNC_DIRTY_PIXELS_PER_BIT, width);
+    w = x1 - x0;
+    h = y1 - y0;
+    if (w < VNC_COPYRECT_MIN_LINES || h < VNC_COPYRECT_MIN_LINES ||
+        w * h < VNC_COPYRECT_MIN_AREA) {
+        return 0;
     }
 
-    if (num) {
-        return total / num;
+    for (i = 0; i < VNC_COPYRECT_SAMPLES; i++) {
+        y = y0 + (2 * i + 1) * h / (2 * VNC_COPYRECT_SAMPLES);
+        differ += memcmp(guest_row0 + y * guest_stride +
+                         x0 * VNC_SERVER_FB_BYTES,
+                         server_row0 + y * server_stride +
+                         x0 * VNC_SERVER_FB_BYTES,
+                         w * VNC_SERVER_FB_BYTES) != 0;
+    }
+    if (differ * 2 < VNC_COPYRECT_SAMPLES) {
+        return 0;
+    }
+
+    old_rows = g_new(uint64_t, h);
+    new_rows = g_new(uint64_t, h);
+    old_cols = g_new(uint64_t, w);
+    new_cols = g_new(uint64_t, w);
+    vnc_copyrect_hash(server_row0, server_stride, x0, y0, w, h,
+                      old_rows, old_cols);
+    vnc_copyrect_hash(guest_row0, guest_stride, x0, y0, w, h,
+                      new_rows, new_cols);
+
+    vlen = vnc_copyrect_find_shift(vd->copyrect_lines, old_rows, new_rows, h,
+                                   &dy, &vstart);
+    hlen = vnc_copyrect_find_shift(vd->copyrect_lines, old_cols, new_cols, w,
+                                   &dx, &hstart);
+    if ((int64_t)vlen * w >= (int64_t)hlen * h) {
+        if (vlen < VNC_COPYRECT_MIN_LINES) {
+            return 0;
+        }
+        copy.dst = (VncRect) { x0, y0 + vstart, w, vlen };
+        copy.src_x = x0;
+        copy.src_y = y0 + vstart - dy;
     } else {
+        if (hlen < VNC_COPYRECT_MIN_LINES) {
+            return 0;
+        }
+        copy.dst = (VncRect) { x0 + hstart, y0, hlen, h };
+        copy.src_x = x0 + hstart - dx;
+        copy.src_y = y0;
+    }
+    if (copy.dst.w * copy.dst.h < VNC_COPYRECT_MIN_AREA) {
         return 0;
     }
+
+    /* Hashes may collide, the pixels decide */
+    for (y = 0; y < copy.dst.h; y++) {
+        uint8_t *guest_ptr = guest_row0 + (copy.dst.y + y) * guest_stride +
+                             copy.dst.x * VNC_SERVER_FB_BYTES;
+        uint8_t *server_ptr = server_row0 + (copy.src_y + y) * server_stride +
+                              copy.src_x * VNC_SERVER_FB_BYTES;
+
+        if (memcmp(guest_ptr, server_ptr,
+                   copy.dst.w * VNC_SERVER_FB_BYTES) != 0) {
+            return 0;
+        }
+    }
+
+    trace_vnc_copyrect_detect(vd, copy.src_x, copy.src_y, copy.dst.x,
+                              copy.dst.y, copy.dst.w, copy.dst.h);
+
+    /*
+     * Bring the server surface up to date, so that the dirty map walk only
+     * finds the exposed strip and whatever else changed.
+     */
+    for (y = 0; y < copy.dst.h; y++) {
+        memcpy(server_row0 + (copy.dst.y + y) * server_stride +
+               copy.dst.x * VNC_SERVER_FB_BYTES,
+               guest_row0 + (copy.dst.y + y) * guest_stride +
+               copy.dst.x * VNC_SERVER_FB_BYTES,
+               copy.dst.w * VNC_SERVER_FB_BYTES);
+    }
+
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (!vnc_copyrect_ready(vs)) {
+            vnc_set_area_dirty(&vs->dirty, vd, copy.dst.x, copy.dst.y,
+                               copy.dst.w, copy.dst.h);
+            continue;
+        }
+        vnc_copyrect_move_dirty(vs, &copy);
+        if (vnc_copyrect_lossy(vs, &copy)) {
+            vnc_sent_lossy_rect(vs, copy.dst.x, copy.dst.y,
+                                copy.dst.w - 1, copy.dst.h - 1);
+        }
+        vs->copy = copy;
+        vs->copy_pending = true;
+    }
+    return 1;
 }
 
-static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
+/*
+ * Pass the blocks of line @y that the refresh found changed on to the
+ * update statistics and the clients; bit 0 of @changed is block @x.
+ */
+static void vnc_refresh_changed(VncDisplay *vd, int y, int x,
+                                const unsigned long *changed, int n,
+                                int64_t now)
 {
-    VncRectStat *rect;
+    VncState *vs;
+    int i;
 
-    rect = vnc_stat_rect(vd, x, y);
-    if (rect->updated) {
-        return;
+    if (!vd->non_adaptive) {
+        for (i = find_first_bit(changed, n); i < n;
+             i = find_next_bit(changed, n, i + 1)) {
+            vnc_rect_updated(vd, (x + i) * VNC_DIRTY_PIXELS_PER_BIT, y, now);
+        }
+    }
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        vnc_dirty_set_bits(&vs->dirty, y, x, changed, n);
     }
-    rect->times[rect->idx] = *tv;
-    rect->idx = (rect->idx + 1) % ARRAY_SIZE(rect->times);
-    rect->updated = true;
 }
 
 static int vnc_refresh_server_surface(VncDisplay *vd)
@@ -3103,24 +3992,23 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                     pixman_image_get_width(vd->server));
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
+    int bits = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
     int cmp_bytes, server_stride, line_bytes, guest_ll, guest_stride, y = 0;
     uint8_t *guest_row0 = NULL, *server_row0;
-    VncState *vs;
     int has_dirty = 0;
     pixman_image_t *tmpbuf = NULL;
     unsigned long offset;
     int x;
-    uint8_t *guest_ptr, *server_ptr;
 
-    struct timeval tv = { 0, 0 };
+    int64_t now = 0;
 
     if (!vd->non_adaptive) {
-        gettimeofday(&tv, NULL);
-        has_dirty = vnc_update_stats(vd, &tv);
+        now = get_clock();
+        has_dirty = vnc_update_stats(vd, now);
     }
 
-    offset = find_next_bit((unsigned long *) &vd->guest.dirty,
-                           height * VNC_DIRTY_BPL(&vd->guest), 0);
+    offset = vnc_dirty_find_next(&vd->guest.dirty,
+                                 height * VNC_DIRTY_BPL(&vd->guest), 0);
     if (offset == height * VNC_DIRTY_BPL(&vd->guest)) {
         /* no dirty bits in guest surface */
         return has_dirty;
@@ -3146,51 +4034,65 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         guest_stride = pixman_image_get_stride(vd->guest.fb);
         guest_ll = pixman_image_get_width(vd->guest.fb)
                    * DIV_ROUND_UP(guest_bpp, 8);
+        has_dirty += vnc_refresh_copyrect(vd, width, height,
+                                          guest_row0, guest_stride,
+                                          server_row0, server_stride);
     }
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
+        unsigned long *row;
+        uint8_t *server_line;
+
         y = offset / VNC_DIRTY_BPL(&vd->guest);
         x = offset % VNC_DIRTY_BPL(&vd->guest);
+        row = vnc_dirty_row(&vd->guest.dirty, y);
+        server_line = server_row0 + y * server_stride;
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
-
-        if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
-            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
-            guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
-        } else {
-            guest_ptr = guest_row0 + y * guest_stride;
-        }
-        guest_ptr += x * cmp_bytes;
+        /*
+         * Compare and copy whole runs of dirty blocks at once.  A guest
+         * surface in another format is converted run by run, right before
+         * the comparison, instead of a full line at a time.
+         */
+        while (x < bits) {
+            DECLARE_BITMAP(changed, VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT);
+            int x2 = find_next_zero_bit(row, bits, x);
+            int start = x * cmp_bytes;
+            int end = MIN(x2 * cmp_bytes, line_bytes);
+            uint8_t *guest_ptr;
+            size_t n;
+
+            bitmap_clear(row, x, x2 - x);
+            if (start < end) {
+                if (tmpbuf) {
+                    int px = MIN(x2 * VNC_DIRTY_PIXELS_PER_BIT, width) -
+                             x * VNC_DIRTY_PIXELS_PER_BIT;
+
+                    if (px > 0) {
+                        qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, px,
+                                                 x * VNC_DIRTY_PIXELS_PER_BIT,
+                                                 y);
+                    }
+                    guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
+                } else {
+                    guest_ptr = guest_row0 + y * guest_stride + start;
+                }
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
-            if ((x + 1) * cmp_bytes > line_bytes) {
-                _cmp_bytes = line_bytes - x * cmp_bytes;
-            }
-            assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
-                continue;
-            }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
-            if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
-            }
-            QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+                bitmap_zero(changed, x2 - x);
+                n = buffer_diff_copy(server_line + start, guest_ptr,
+                                     end - start, cmp_bytes, changed);
+                if (n) {
+                    vnc_refresh_changed(vd, y, x, changed, x2 - x, now);
+                    has_dirty += n;
+                }
             }
-            has_dirty++;
+            x = find_next_bit(row, bits, x2);
         }
 
         y++;
-        offset = find_next_bit((unsigned long *) &vd->guest.dirty,
-                               height * VNC_DIRTY_BPL(&vd->guest),
-                               y * VNC_DIRTY_BPL(&vd->guest));
+        offset = vnc_dirty_find_next(&vd->guest.dirty,
+                                     height * VNC_DIRTY_BPL(&vd->guest),
+                                     y * VNC_DIRTY_BPL(&vd->guest));
         if (offset == height * VNC_DIRTY_BPL(&vd->guest)) {
             /* no more dirty bits */
             break;
@@ -3205,6 +4107,7 @@ static void vnc_refresh(DisplayChangeListener *dcl)
     VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
     VncState *vs, *vn;
     int has_dirty, rects = 0;
+    int64_t paced_ns = 0;
 
     if (QTAILQ_EMPTY(&vd->clients)) {
         update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_MAX);
@@ -3221,6 +4124,18 @@ static void vnc_refresh(DisplayChangeListener *dcl)
     has_dirty = vnc_refresh_server_surface(vd);
     vnc_unlock_display(vd);
 
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        int64_t left = vs->update == VNC_STATE_UPDATE_INCREMENTAL ?
+                       vnc_link_pace_left(vs) : 0;
+
+        if (left && (!paced_ns || left < paced_ns)) {
+            paced_ns = left;
+        }
+    }
+
+    if (vd->shared_encoding) {
+        rects += vnc_update_groups(vd, has_dirty);
+    }
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         rects += vnc_update_client(vs, has_dirty);
         /* vs might be free()ed here */
@@ -3231,6 +4146,10 @@ static void vnc_refresh(DisplayChangeListener *dcl)
         if (vd->dcl.update_interval < VNC_REFRESH_INTERVAL_BASE) {
             vd->dcl.update_interval = VNC_REFRESH_INTERVAL_BASE;
         }
+    } else if (paced_ns) {
+        /* Not idle: come back when the paced client may send again */
+        vd->dcl.update_interval = MAX(DIV_ROUND_UP(paced_ns, SCALE_MS),
+                                      VNC_REFRESH_INTERVAL_BASE);
     } else {
         vd->dcl.update_interval += VNC_REFRESH_INTERVAL_INC;
         if (vd->dcl.update_interval > VNC_REFRESH_INTERVAL_MAX) {
@@ -3289,6 +4208,7 @@ static void vnc_connect(VncDisplay *vd, QIOChannelSocket *sioc,
     VNC_DEBUG("Client sioc=%p ws=%d auth=%d subauth=%d\n",
               sioc, websocket, vs->auth, vs->subauth);
 
+    vnc_dirty_resize(&vs->dirty, vnc_width(vd), vnc_height(vd));
     vs->lossy_rect = g_malloc0(VNC_STAT_ROWS * sizeof (*vs->lossy_rect));
     for (i = 0; i < VNC_STAT_ROWS; ++i) {
         vs->lossy_rect[i] = g_new0(uint8_t, VNC_STAT_COLS);
@@ -3399,7 +4319,9 @@ void vnc_display_init(const char *id, Error **errp)
     QTAILQ_INSERT_TAIL(&vnc_displays, vd, next);
 
     QTAILQ_INIT(&vd->clients);
+    QTAILQ_INIT(&vd->encode_groups);
     vd->expires = TIME_MAX;
+    vd->copyrect_lines = g_hash_table_new(g_int64_hash, g_int64_equal);
 
     if (keyboard_layout) {
         trace_vnc_key_map_init(keyboard_layout);
@@ -3417,7 +4339,7 @@ void vnc_display_init(const char *id, Error **errp)
     vd->connections_limit = 32;
 
     qemu_mutex_init(&vd->mutex);
-    vnc_start_worker_thread();
+    vnc_start_worker_threads(1);
 
     vd->dcl.ops = &dcl_ops;
     register_displaychangelistener(&vd->dcl);
@@ -3431,6 +4353,7 @@ static void vnc_display_close(VncDisplay *vd)
         return;
     }
     vd->is_unix = false;
+    vnc_free_groups(vd);
 
     if (vd->listener) {
         qio_net_listener_disconnect(vd->listener);
@@ -3595,6 +4518,15 @@ static QemuOptsList qemu_vnc_opts = {
         },{
             .name = "power-control",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "encoders",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "shared-encoding",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "parallel-tight",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -4026,6 +4958,7 @@ void vnc_display_open(const char *id, Error **errp)
     const char *saslauthz;
     int lock_key_sync = 1;
     int key_delay_ms;
+    int encoders;
     const char *audiodev;
     const char *passwordSecret;
 
@@ -4147,6 +5080,16 @@ void vnc_display_open(const char *id, Error **errp)
     }
 
     vd->power_control = qemu_opt_get_bool(opts, "power-control", false);
+    vd->shared_encoding = qemu_opt_get_bool(opts, "shared-encoding", false);
+    vd->parallel_tight = qemu_opt_get_bool(opts, "parallel-tight", false);
+
+    encoders = qemu_opt_get_number(opts, "encoders", 1);
+    if (encoders < 1 || encoders > VNC_MAX_ENCODERS) {
+        error_setg(errp, "vnc 'encoders' must be between 1 and %d",
+                   VNC_MAX_ENCODERS);
+        goto fail;
+    }
+    vnc_start_worker_threads(encoders);
 
     if (tlsauthz) {
         vd->tlsauthzid = g_strdup(tlsauthz);
@@ -79,17 +79,16 @@ typedef void VncSendHextileTile(VncState *vs,
  * by one bit in the dirty bitmap, should be a power of 2 */
 #define VNC_DIRTY_PIXELS_PER_BIT 16
 
-/* VNC_MAX_WIDTH must be a multiple of VNC_DIRTY_PIXELS_PER_BIT. */
-
-#define VNC_MAX_WIDTH ROUND_UP(2560, VNC_DIRTY_PIXELS_PER_BIT)
-#define VNC_MAX_HEIGHT 2048
-
-/* VNC_DIRTY_BITS is the number of bits in the dirty bitmap. */
-#define VNC_DIRTY_BITS (VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT)
+/*
+ * Largest surface served, VNC_MAX_WIDTH must be a multiple of
+ * VNC_DIRTY_PIXELS_PER_BIT.  The dirty maps are sized to the actual
+ * surface, so these only bound the fixed-size lossy maps.
+ */
+#define VNC_MAX_WIDTH ROUND_UP(5120, VNC_DIRTY_PIXELS_PER_BIT)
+#define VNC_MAX_HEIGHT 5120
 
-/* VNC_DIRTY_BPL (BPL = bits per line) might be greater than
- * VNC_DIRTY_BITS due to alignment */
-#define VNC_DIRTY_BPL(x) (sizeof((x)->dirty) / VNC_MAX_HEIGHT * BITS_PER_BYTE)
+/* VNC_DIRTY_BPL (BPL = bits per line) is a multiple of BITS_PER_LONG */
+#define VNC_DIRTY_BPL(x) ((x)->dirty.bpl)
 
 #define VNC_STAT_RECT  64
 #define VNC_STAT_COLS (VNC_MAX_WIDTH / VNC_STAT_RECT)
@@ -97,7 +96,14 @@ typedef void VncSendHextileTile(VncState *vs,
 
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
+/* Upper bound for the size of the encoder thread pool */
+#define VNC_MAX_ENCODERS 64
+
+/* Continuous updates sent ahead of the client's fence acknowledgements */
+#define VNC_FENCE_MAX_PENDING 2
+
 typedef struct VncDisplay VncDisplay;
+typedef struct VncEncodeGroup VncEncodeGroup;
 
 #include "vnc-auth-vencrypt.h"
 #ifdef CONFIG_VNC_SASL
@@ -105,24 +111,51 @@ typedef struct VncDisplay VncDisplay;
 #endif
 #include "vnc-ws.h"
 
+/*
+ * Dirty map of the server surface, one bit per VNC_DIRTY_PIXELS_PER_BIT
+ * pixels.  @summary has one bit per word of @bits and is set for the words
+ * that may be non-zero, so that scans of a mostly clean 4K map only read
+ * a few cache lines.
+ */
+typedef struct VncDirtyMap {
+    unsigned long *bits;
+    unsigned long *summary;
+    int bpl;
+    int height;
+} VncDirtyMap;
+
+/*
+ * Update statistics of a VNC_STAT_RECT square tile.  The interval between
+ * updates is averaged with exponential decay; @freq_mhz is derived from it
+ * every VNC_REFRESH_STATS_NS and only changes for tiles that are updated
+ * or just went idle.
+ */
 struct VncRectStat
 {
-    /* time of last 10 updates, to find update frequency */
-    struct timeval times[10];
-    int idx;
-
-    double freq;        /* Update frequency (in Hz) */
-    bool updated;       /* Already updated during this refresh */
+    int64_t last_ns;        /* time of the last update */
+    int64_t interval_ns;    /* decayed average time between updates */
+    uint32_t refresh;       /* last refresh that updated the tile */
+    uint32_t freq_mhz;      /* update frequency, in mHz */
+    uint8_t updates;        /* saturates at VNC_STAT_MIN_UPDATES */
 };
 
 typedef struct VncRectStat VncRectStat;
 
 struct VncSurface
 {
-    struct timeval last_freq_check;
-    DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT],
-                   VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT);
-    VncRectStat stats[VNC_STAT_ROWS][VNC_STAT_COLS];
+    int64_t last_freq_check;
+    uint32_t stat_refresh;  /* number of refreshes with statistics */
+    VncDirtyMap dirty;
+    VncRectStat *stats;  /* stat_rows x stat_cols grid */
+    unsigned long *stat_active; /* tiles with a recent update */
+    /*
+     * Summed-area table of @stats.freq_mhz, (stat_rows + 1) x
+     * (stat_cols + 1) with a zero first row and column, for
+     * vnc_update_freq().
+     */
+    uint64_t *stat_sums;
+    int stat_rows;
+    int stat_cols;
     pixman_image_t *fb;
     pixman_format_code_t format;
 };
@@ -158,6 +191,7 @@ struct VncDisplay
     int ledstate;
     QKbdState *kbd;
     QemuMutex mutex;
+    int encoders; /* encoder threads sharing the display lock */
 
     int cursor_msize;
     uint8_t *cursor_mask;
@@ -178,6 +212,11 @@ struct VncDisplay
     bool lossy;
     bool non_adaptive;
     bool power_control;
+    bool shared_encoding;
+    bool parallel_tight;
+    GHashTable *copyrect_lines; /* scratch table of the scroll detection */
+    QTAILQ_HEAD(, VncEncodeGroup) encode_groups;
+    uint64_t encode_group_id;
     QCryptoTLSCreds *tlscreds;
     QAuthZ *tlsauthz;
     char *tlsauthzid;
@@ -191,6 +230,8 @@ struct VncDisplay
 typedef struct VncTight {
     int type;
     uint8_t quality;
+    uint8_t link_quality; /* quality in use, lowered on congested links */
+    uint8_t reset_streams; /* stream reset bits for the next control byte */
     uint8_t compression;
     uint8_t pixel24;
     Buffer tight;
@@ -240,6 +281,13 @@ struct VncRect
     int h;
 };
 
+/* A CopyRect update: move @dst from (@src_x, @src_y) on the client */
+typedef struct VncCopyRect {
+    VncRect dst;
+    int src_x;
+    int src_y;
+} VncCopyRect;
+
 struct VncRectEntry
 {
     struct VncRect rect;
@@ -249,6 +297,14 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running; /* taken by an encoder thread */
+    int64_t queued_ns;
+    bool has_copy; /* @copy is sent before the rectangles */
+    VncCopyRect copy;
+    /* Clients of a shared encoding group that receive the update */
+    VncState **members;
+    int n_members;
+    bool reset_streams; /* the clients' zlib streams are out of sync */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -260,8 +316,49 @@ typedef enum {
     VNC_STATE_UPDATE_FORCE,
 } VncStateUpdate;
 
+/*
+ * Estimate of a client link from how fast its output buffer drains.  Only
+ * the main thread updates it, the encoders read @level.
+ */
+typedef struct VncLink {
+    int64_t sample_ns;      /* start of the current throughput sample */
+    size_t sample_bytes;
+    uint64_t throughput;    /* smoothed drain rate, in bytes per second */
+    int64_t update_ns;      /* when the last update was queued for output */
+    size_t update_bytes;    /* size of the last update */
+    int64_t drained_ns;     /* when the last update left the output buffer,
+                               -1 once sampled */
+    int64_t rtt_ns;         /* smoothed time from update to next request */
+    int64_t check_ns;       /* last run of the controller */
+    int64_t interval_ns;    /* minimum time between incremental updates */
+    int stable;             /* uncongested checks in a row */
+    int level;              /* congestion level, 0 while the link keeps up */
+} VncLink;
+
+typedef struct VncEncodeStats {
+    uint64_t frames;
+    uint64_t rects;
+    uint64_t bytes;
+    uint64_t encode_ns;      /* time spent encoding the updates */
+    uint64_t encode_ns_max;
+    uint64_t latency_ns;     /* time from queuing an update to its data */
+    uint64_t latency_ns_max;
+} VncEncodeStats;
+
 #define VNC_MAGIC ((uint64_t)0x05b3f069b3d204bb)
 
+/*
+ * Clients with the same encoding settings share one encoder: an update is
+ * encoded once, in the state of @vs, and copied to each client.
+ */
+struct VncEncodeGroup {
+    uint64_t id;
+    uint64_t seq;       /* number of updates encoded by the group */
+    VncState *vs;
+    int64_t used_ns;
+    QTAILQ_ENTRY(VncEncodeGroup) next;
+};
+
 struct VncState
 {
     uint64_t magic;
@@ -270,7 +367,7 @@ struct VncState
     guint ioc_tag;
     gboolean disconnecting;
 
-    DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
+    VncDirtyMap dirty;
     uint8_t **lossy_rect; /* Not an Array to avoid costly memcpy in
                            * vnc-jobs-async.c */
 
@@ -278,6 +375,15 @@ struct VncState
     VncStateUpdate update; /* Most recent pending request from client */
     VncStateUpdate job_update; /* Currently processed by job thread */
     int has_dirty;
+    bool copy_pending; /* @copy goes out with the next update */
+    VncCopyRect copy;
+    /* ContinuousUpdates: updates in @continuous_area need no request */
+    bool continuous;
+    VncRect continuous_area;
+    /* Send times of the pacing fences the client has not answered yet */
+    int64_t fence_ns[VNC_FENCE_MAX_PENDING];
+    int fence_head;
+    int fences_pending;
     uint32_t features;
     int absolute;
     int last_x;
@@ -336,6 +442,14 @@ struct VncState
     QemuMutex output_mutex;
     QEMUBH *bh;
     Buffer jobs_buffer;
+    VncEncodeStats encode_stats; /* protected by output_mutex */
+    VncLink link;
+    /*
+     * Encoder that fed the client's zlib streams last: 0 for its own,
+     * otherwise the id and update count of a shared encoding group.
+     */
+    uint64_t encode_group;
+    uint64_t encode_group_seq;
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -419,6 +533,8 @@ enum {
 #define VNC_ENCODING_LED_STATE            0XFFFFFEFB /* -261 */
 #define VNC_ENCODING_DESKTOP_RESIZE_EXT   0XFFFFFECC /* -308 */
 #define VNC_ENCODING_XVP                  0XFFFFFECB /* -309 */
+#define VNC_ENCODING_FENCE                0XFFFFFEC8 /* -312 */
+#define VNC_ENCODING_CONTINUOUS_UPDATES   0XFFFFFEC7 /* -313 */
 #define VNC_ENCODING_ALPHA_CURSOR         0XFFFFFEC6 /* -314 */
 #define VNC_ENCODING_WMVi                 0x574D5669
 #define VNC_ENCODING_CLIPBOARD_EXT        0xc0a1e5ce
@@ -465,6 +581,9 @@ enum VncFeatures {
     VNC_FEATURE_XVP,
     VNC_FEATURE_CLIPBOARD_EXT,
     VNC_FEATURE_AUDIO,
+    VNC_FEATURE_COPYRECT,
+    VNC_FEATURE_FENCE,
+    VNC_FEATURE_CONTINUOUS_UPDATES,
 };
 
 
@@ -476,6 +595,8 @@ enum VncFeatures {
 #define VNC_MSG_CLIENT_POINTER_EVENT              5
 #define VNC_MSG_CLIENT_CUT_TEXT                   6
 #define VNC_MSG_CLIENT_VMWARE_0                   127
+#define VNC_MSG_CLIENT_ENABLE_CONTINUOUS_UPDATES  150
+#define VNC_MSG_CLIENT_FENCE                      248
 #define VNC_MSG_CLIENT_CALL_CONTROL               249
 #define VNC_MSG_CLIENT_XVP                        250
 #define VNC_MSG_CLIENT_SET_DESKTOP_SIZE           251
@@ -490,6 +611,8 @@ enum VncFeatures {
 #define VNC_MSG_SERVER_BELL                       2
 #define VNC_MSG_SERVER_CUT_TEXT                   3
 #define VNC_MSG_SERVER_VMWARE_0                   127
+#define VNC_MSG_SERVER_END_CONTINUOUS_UPDATES     150
+#define VNC_MSG_SERVER_FENCE                      248
 #define VNC_MSG_SERVER_CALL_CONTROL               249
 #define VNC_MSG_SERVER_XVP                        250
 #define VNC_MSG_SERVER_TIGHT                      252
@@ -527,6 +650,13 @@ enum VncFeatures {
 #define VNC_XVP_ACTION_REBOOT 3
 #define VNC_XVP_ACTION_RESET 4
 
+/* fence flags */
+#define VNC_FENCE_BLOCK_BEFORE (1 << 0)
+#define VNC_FENCE_BLOCK_AFTER  (1 << 1)
+#define VNC_FENCE_SYNC_NEXT    (1 << 2)
+#define VNC_FENCE_REQUEST      (1U << 31)
+#define VNC_FENCE_MAX_PAYLOAD  64
+
 /* extended clipboard flags  */
 #define VNC_CLIPBOARD_TEXT     (1 << 0)
 #define VNC_CLIPBOARD_RTF      (1 << 1)
@@ -571,6 +701,8 @@ uint32_t read_u32(uint8_t *data, size_t offset);
 /* Protocol stage functions */
 void vnc_client_error(VncState *vs);
 size_t vnc_client_io_error(VncState *vs, ssize_t ret, Error *err);
+void vnc_link_written(VncState *vs, size_t bytes);
+void vnc_fence_ping_locked(VncState *vs);
 
 void start_client_init(VncState *vs);
 void start_auth_vnc(VncState *vs);
@@ -603,6 +735,23 @@ void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v);
 double vnc_update_freq(VncState *vs, int x, int y, int w, int h);
 void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h);
 
+/* vnc-dirty.c */
+void vnc_dirty_resize(VncDirtyMap *map, int width, int height);
+void vnc_dirty_free(VncDirtyMap *map);
+void vnc_dirty_clear_all(VncDirtyMap *map);
+void vnc_dirty_set(VncDirtyMap *map, int y, int x, int n);
+void vnc_dirty_set_bits(VncDirtyMap *map, int y, int x,
+                        const unsigned long *src, int n);
+void vnc_dirty_or_row(VncDirtyMap *map, int y, const unsigned long *src);
+void vnc_dirty_merge(VncDirtyMap *dst, VncDirtyMap *src);
+unsigned long vnc_dirty_find_next(VncDirtyMap *map, unsigned long size,
+                                  unsigned long offset);
+
+static inline unsigned long *vnc_dirty_row(VncDirtyMap *map, int y)
+{
+    return map->bits + (size_t)y * (map->bpl / BITS_PER_LONG);
+}
+
 /* Encodings */
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 
@@ -620,6 +769,9 @@ void vnc_zlib_clear(VncState *vs);
 int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_tight_png_send_framebuffer_update(VncState *vs, int x, int y,
                                           int w, int h);
+void vnc_tight_reset_streams(VncState *vs);
+void vnc_tight_slice_start(VncState *vs, VncTight *orig);
+void vnc_tight_slice_end(VncState *vs);
 void vnc_tight_clear(VncState *vs);
 
 int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
@@ -0,0 +1,73 @@
+/*
+ * Compare and copy buffers block by block
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/bitops.h"
+#include "host/cpuinfo.h"
+
+typedef size_t (*bdc_accel_fn)(void *, const void *, size_t, size_t,
+                               unsigned long *);
+
+/* Handle a block of @len bytes, the @i-th of the buffer */
+static inline size_t buffer_diff_copy_block(void *dst, const void *src,
+                                            size_t len, size_t i,
+                                            unsigned long *changed)
+{
+    if (memcmp(dst, src, len) == 0) {
+        return 0;
+    }
+    memcpy(dst, src, len);
+    set_bit(i, changed);
+    return 1;
+}
+
+static size_t buffer_diff_copy_int(void *dst, const void *src, size_t len,
+                                   size_t block, unsigned long *changed)
+{
+    size_t i, n = 0;
+
+    for (i = 0; len; i++) {
+        size_t l = MIN(block, len);
+
+        n += buffer_diff_copy_block(dst, src, l, i, changed);
+        dst += l;
+        src += l;
+        len -= l;
+    }
+    return n;
+}
+
+#include "host/bufferdiff.c.inc"
+
+static bdc_accel_fn buffer_diff_copy_accel;
+static unsigned accel_index;
+
+size_t buffer_diff_copy(void *dst, const void *src, size_t len,
+                        size_t block, unsigned long *changed)
+{
+    assert(block);
+    if (block % 16) {
+        /* The vector versions only handle whole 16-byte chunks */
+        return buffer_diff_copy_int(dst, src, len, block, changed);
+    }
+    return buffer_diff_copy_accel(dst, src, len, block, changed);
+}
+
+bool test_buffer_diff_copy_next_accel(void)
+{
+    if (accel_index != 0) {
+        buffer_diff_copy_accel = accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    buffer_diff_copy_accel = accel_table[accel_index];
+}